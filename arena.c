@@ -0,0 +1,99 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the arena allocator that backs the knowledge base.
+ *
+ * An arena hands out memory by bumping a pointer through large chunks that
+ * are obtained from malloc(), so allocating a node or a string costs a few
+ * instructions and no per-allocation header. Memory is never freed
+ * individually: arena_reset() releases every chunk at once. Chunks double in
+ * size up to ARENA_MAX_CHUNK, so even a very large arena only has a handful of
+ * chunks to free.
+ */
+
+#include "chat1002.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Allocate memory from an arena.
+ *
+ * Input:
+ *   arena - the arena
+ *   size  - the number of bytes to allocate
+ *   align - the required alignment (a power of two)
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the memory, which is valid until arena_reset()
+ */
+void *arena_alloc(Arena *arena, size_t size, size_t align) {
+  ArenaChunk *chunk = arena->head;
+  size_t offset = 0;
+
+  if (chunk != NULL) {
+    uintptr_t next = (uintptr_t)(chunk->data + chunk->used);
+    offset = chunk->used + (-next & (align - 1));
+  }
+  if (chunk == NULL || offset + size > chunk->size) {
+    /* start a new chunk, twice the size of the last one */
+    size_t chunk_size = chunk == NULL ? ARENA_MIN_CHUNK : chunk->size * 2;
+    if (chunk_size > ARENA_MAX_CHUNK) {
+      chunk_size = ARENA_MAX_CHUNK;
+    }
+    if (chunk_size < size + align) {
+      chunk_size = size + align;
+    }
+    chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->reserved += chunk_size;
+    offset = -(uintptr_t)chunk->data & (align - 1);
+  }
+
+  chunk->used = offset + size;
+  arena->used += size;
+  return chunk->data + offset;
+}
+
+/*
+ * Copy a string into an arena, adding a terminating null.
+ *
+ * Input:
+ *   arena - the arena
+ *   str   - the string (need not be null-terminated)
+ *   len   - the number of characters to copy
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the copy
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1, 1);
+  if (copy != NULL) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+/*
+ * Free all of the memory allocated from an arena.
+ *
+ * Input:
+ *   arena - the arena
+ */
+void arena_reset(Arena *arena) {
+  ArenaChunk *chunk;
+  while (arena->head != NULL) {
+    chunk = arena->head;
+    arena->head = chunk->next;
+    free(chunk);
+  }
+  arena->reserved = 0;
+  arena->used = 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements batch mode, which answers a file of questions without
+ * chatting.
+ *
+ * The questions are read one per line, BATCH_BLOCK lines at a time. The lines
+ * of a block are shared out between a pool of worker threads, each of which
+ * answers lines with chatbot_answer() until none are left; then the answers
+ * are written out in the order of the questions, and the next block is read.
+ * The knowledge base is only read during the batch, so the workers need no
+ * locks. A question the chatbot can't answer gets "I don't know..." as its
+ * answer (nobody is asked for the answer), and is copied to the unknown file
+ * if there is one, so that it can be taught later.
+ *
+ * When the batch is done, the number of questions and the rate at which they
+ * were answered are printed on stderr.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* the number of lines read, answered and written at a time */
+#define BATCH_BLOCK 4096
+
+/* the result of a line that was too long to answer */
+#define BATCH_TOO_LONG 1
+
+/* Type definition for the state shared by batch mode's threads */
+typedef struct batch {
+  session_t *session;             /* the session the questions are asked in */
+  char (*lines)[MAX_INPUT];       /* the questions in the current block */
+  char (*answers)[MAX_RESPONSE];  /* the answers to them */
+  int *results;                   /* KB_OK, KB_NOTFOUND, ... for each line */
+  size_t count;                   /* the number of lines in the block */
+  atomic_size_t next;             /* the next line to be answered */
+  int busy;                       /* the workers still answering the block */
+  unsigned round;                 /* the number of blocks started */
+  int quit;                       /* set to 1 to stop the workers */
+  pthread_mutex_t lock;           /* protects busy, round and quit */
+  pthread_cond_t start;           /* signalled when a block is ready */
+  pthread_cond_t finished;        /* signalled when a block is answered */
+} Batch;
+
+/*
+ * Helper function to answer one line of a batch. Questions are answered from
+ * the knowledge base; the intents that would change it (or end the chat) are
+ * refused.
+ *
+ * Input:
+ *   batch - the batch
+ *   i     - the index of the line in the current block
+ */
+
+static void answer_line(Batch *batch, size_t i) {
+  char input[MAX_INPUT];
+  char *inv[MAX_INPUT];
+  char *response = batch->answers[i];
+
+  if (batch->results[i] == BATCH_TOO_LONG) {
+    snprintf(response, MAX_RESPONSE, "Too many characters. Try again.");
+    return;
+  }
+
+  memcpy(input, batch->lines[i], MAX_INPUT);
+  int inc = split_words(input, inv);
+  const Intent *intent = inc < 1 ? NULL : intent_find(inv[0]);
+  if (inc < 1) {
+    response[0] = '\0';
+    batch->results[i] = KB_INVALID;
+  } else if (intent_question(batch->session->kb, inv[0]) >= 0) {
+    batch->results[i] = chatbot_answer(batch->session, inc, inv, response,
+                                       MAX_RESPONSE);
+  } else {
+    if (intent != NULL) {
+      snprintf(response, MAX_RESPONSE, "I can't %s in batch mode.", inv[0]);
+    } else {
+      snprintf(response, MAX_RESPONSE, "I don't understand \"%s\".", inv[0]);
+    }
+    batch->results[i] = KB_INVALID;
+  }
+}
+
+/*
+ * Helper function run by each worker thread: wait for a block, answer lines
+ * from it until there are none left, and report back.
+ *
+ * Input:
+ *   arg - the batch
+ */
+
+static void *batch_worker(void *arg) {
+  Batch *batch = arg;
+  unsigned seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    while (batch->round == seen && !batch->quit) {
+      pthread_cond_wait(&batch->start, &batch->lock);
+    }
+    if (batch->quit) {
+      pthread_mutex_unlock(&batch->lock);
+      return NULL;
+    }
+    seen = batch->round;
+    pthread_mutex_unlock(&batch->lock);
+
+    size_t i;
+    while ((i = atomic_fetch_add_explicit(&batch->next, 1,
+                                          memory_order_relaxed)) <
+           batch->count) {
+      answer_line(batch, i);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->busy == 0) {
+      pthread_cond_signal(&batch->finished);
+    }
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+/*
+ * Helper function to read the next block of questions.
+ *
+ * Input:
+ *   batch - the batch
+ *   in    - the file of questions
+ *
+ * Returns:
+ *   the number of lines read (0 at the end of the file)
+ */
+
+static size_t read_block(Batch *batch, FILE *in) {
+  size_t count = 0;
+  while (count < BATCH_BLOCK &&
+         fgets(batch->lines[count], MAX_INPUT, in) != NULL) {
+    char *line = batch->lines[count];
+    char *nl = strchr(line, '\n');
+    batch->results[count] = KB_OK;
+    if (nl != NULL) {
+      *nl = '\0';
+    } else if (!feof(in)) {
+      /* too long: skip the rest of the line */
+      int c;
+      while ((c = fgetc(in)) != '\n' && c != EOF)
+        ;
+      batch->results[count] = BATCH_TOO_LONG;
+    }
+    count++;
+  }
+  return count;
+}
+
+/*
+ * Helper function to get the time in seconds, for measuring throughput.
+ */
+
+static double batch_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Run batch mode.
+ *
+ * Input:
+ *   options - the files to use and the number of threads
+ *
+ * Returns:
+ *   the exit status for the program (0 if every question was answered or
+ *   found unknown, 1 if a file could not be opened or written)
+ */
+int batch_main(const BatchOptions *options) {
+  Batch batch;
+  int threads = options->threads;
+  FILE *in = stdin, *out = stdout, *unknown = NULL;
+  int status = 0;
+
+  if (threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads <= 0) {
+      threads = 1;
+    }
+  }
+
+  if (strcmp(options->input, "-") != 0 &&
+      (in = fopen(options->input, "r")) == NULL) {
+    fprintf(stderr, "batch: can't read %s\n", options->input);
+    return 1;
+  }
+  if (options->output != NULL && (out = fopen(options->output, "w")) == NULL) {
+    fprintf(stderr, "batch: can't write to %s\n", options->output);
+    return 1;
+  }
+  if (options->unknown != NULL &&
+      (unknown = fopen(options->unknown, "w")) == NULL) {
+    fprintf(stderr, "batch: can't write to %s\n", options->unknown);
+    return 1;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.session = session_create(knowledge_default(), NULL, NULL);
+  batch.lines = malloc(BATCH_BLOCK * sizeof(*batch.lines));
+  batch.answers = malloc(BATCH_BLOCK * sizeof(*batch.answers));
+  batch.results = malloc(BATCH_BLOCK * sizeof(*batch.results));
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  if (batch.session == NULL || batch.lines == NULL || batch.answers == NULL ||
+      batch.results == NULL || workers == NULL) {
+    fprintf(stderr, "batch: Memory allocation error.\n");
+    return 1;
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.start, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+  for (int t = 0; t < threads; t++) {
+    pthread_create(&workers[t], NULL, batch_worker, &batch);
+  }
+
+  size_t total = 0, answered = 0, missed = 0;
+  double started = batch_clock();
+  size_t count;
+  while ((count = read_block(&batch, in)) > 0) {
+    /* hand the block to the workers and wait for them to answer it */
+    pthread_mutex_lock(&batch.lock);
+    batch.count = count;
+    atomic_store(&batch.next, 0);
+    batch.busy = threads;
+    batch.round++;
+    pthread_cond_broadcast(&batch.start);
+    while (batch.busy > 0) {
+      pthread_cond_wait(&batch.finished, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    /* write the answers in the order of the questions */
+    for (size_t i = 0; i < count; i++) {
+      fputs(batch.answers[i], out);
+      fputc('\n', out);
+      if (batch.results[i] == KB_OK) {
+        answered++;
+      } else if (batch.results[i] == KB_NOTFOUND) {
+        missed++;
+        if (unknown != NULL) {
+          fputs(batch.lines[i], unknown);
+          fputc('\n', unknown);
+        }
+      }
+    }
+    total += count;
+  }
+  double elapsed = batch_clock() - started;
+
+  pthread_mutex_lock(&batch.lock);
+  batch.quit = 1;
+  pthread_cond_broadcast(&batch.start);
+  pthread_mutex_unlock(&batch.lock);
+  for (int t = 0; t < threads; t++) {
+    pthread_join(workers[t], NULL);
+  }
+
+  if (fflush(out) != 0 || ferror(out) ||
+      (unknown != NULL && (fflush(unknown) != 0 || ferror(unknown)))) {
+    fprintf(stderr, "batch: error writing the answers\n");
+    status = 1;
+  }
+  fprintf(stderr,
+          "batch: %zu lines (%zu answered, %zu unknown) in %.3f s, "
+          "%.0f questions/s on %d threads\n",
+          total, answered, missed, elapsed,
+          elapsed > 0 ? total / elapsed : 0.0, threads);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  if (unknown != NULL) {
+    fclose(unknown);
+  }
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.start);
+  pthread_cond_destroy(&batch.finished);
+  session_destroy(batch.session);
+  free(workers);
+  free(batch.lines);
+  free(batch.answers);
+  free(batch.results);
+  return status;
+}
@@ -0,0 +1,687 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the knowledge base benchmarks, and the generator of
+ * the synthetic knowledge files they run on.
+ *
+ * The generator writes a file like Sample.ini with the same number of lines
+ * in each of the who, what and where sections. Entities and responses are
+ * random strings whose lengths are spread evenly over the ranges in the
+ * options, and the given fraction of the lines repeat an entity from earlier
+ * in their section (so the later response overrides it when loaded). The
+ * same options and seed always produce the same file. The generator can
+ * also write a transcript of a conversation about the file, for replay.c.
+ *
+ * The benchmarks generate such a file for each size asked for, then time
+ * loading it, looking up entities that are there (hits) and that are not
+ * (misses), teaching new entities (inserts), teaching existing ones again
+ * (overwrites), saving, and resetting. Each size runs in a process of its own
+ * so that its peak memory use is its own. The results are printed on stdout,
+ * one line of JSON per operation and size, e.g.
+ *
+ *   {"op":"get_hit","entries":1000,"ops":1000000,"ns_per_op":41.3,
+ *    "allocs_per_op":0.000,"process_peak_rss_kb":3120}
+ *
+ * (on one line), so that runs from different commits can be compared by a
+ * script. For load, save and reset, an operation is one entry of the
+ * knowledge base. allocs_per_op counts calls to malloc(), calloc(), realloc()
+ * and the aligned allocators; it is -1 where they can't be counted (other C
+ * libraries than glibc, and builds with a sanitizer, which has its own).
+ * process_peak_rss_kb is the peak memory use of the process for the size so
+ * far, not of the operation: it only grows from one operation to the next.
+ *
+ * The benchmarks replace the C library's allocator to count allocations, so
+ * they are built in only with -DCHATBOT_BENCH:
+ *
+ *   gcc -O2 -pthread -DCHATBOT_BENCH -o chatbot main.c
+ *
+ * The generator is always built in.
+ */
+
+#include "chat1002.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/* the sections written by the generator */
+static const char *const bench_sections[] = {"who", "what", "where"};
+
+/* the seed of the generator */
+#define BENCH_SEED 0x2545F4914F6CDD1DULL
+
+/* the number of lookups, and of inserts and overwrites, timed per size */
+#define BENCH_LOOKUPS 1000000
+#define BENCH_PUTS 100000
+
+/* the number of different entities the lookups cycle through, and of
+ * responses the inserts and overwrites do */
+#define BENCH_KEYS 65536
+#define BENCH_RESPONSES 256
+
+/* the characters entities and responses are made of */
+static const char bench_alphabet[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+
+/* the percentages of the questions in a generated transcript that are about
+ * entities in the file, and that are about new entities (and so are followed
+ * by the answer to teach); the rest are not questions */
+#define BENCH_TRANSCRIPT_HITS 80
+#define BENCH_TRANSCRIPT_TEACH 15
+
+/* Type definition for an entity the benchmarks look up or teach */
+typedef struct bench_key {
+  int section;             /* the index of its section in bench_sections */
+  char entity[MAX_ENTITY]; /* the entity */
+} BenchKey;
+
+#if defined(CHATBOT_BENCH) && defined(__GLIBC__) &&                           \
+    !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define BENCH_COUNT_ALLOCS 1
+
+/* 1 while allocations are being counted, and how many there have been */
+static atomic_int bench_counting;
+static atomic_long bench_allocs;
+
+/* glibc's own allocator, which the functions below hand on to */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+/*
+ * Helper function to count an allocation, if allocations are being counted.
+ */
+
+static void bench_count() {
+  if (atomic_load_explicit(&bench_counting, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  }
+}
+
+/*
+ * The C library's allocation functions, replaced so that the benchmarks can
+ * count allocations (glibc lets a program replace them, as long as all of
+ * them are). They behave exactly as glibc's own.
+ */
+void *malloc(size_t size) {
+  bench_count();
+  return __libc_malloc(size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+void *calloc(size_t count, size_t size) {
+  bench_count();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_count();
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+  if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+    return EINVAL;
+  }
+  bench_count();
+  void *p = __libc_memalign(align, size);
+  if (p == NULL) {
+    return ENOMEM;
+  }
+  *ptr = p;
+  return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  bench_count();
+  return __libc_memalign(align, size);
+}
+
+void *memalign(size_t align, size_t size) {
+  bench_count();
+  return __libc_memalign(align, size);
+}
+
+void *valloc(size_t size) {
+  bench_count();
+  return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) {
+  bench_count();
+  return __libc_pvalloc(size);
+}
+#endif
+
+/*
+ * Helper function to mix a number into a random-looking one (splitmix64), so
+ * that every string can be made again from its number alone.
+ */
+
+static uint64_t bench_mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/*
+ * Helper function to make a random string.
+ *
+ * Input:
+ *   seed - the number the string is made from
+ *   min  - the shortest the string may be
+ *   max  - the longest the string may be
+ *   buf  - a buffer for the string, with room for max + 1 characters
+ *
+ * Returns:
+ *   the length of the string
+ */
+
+static size_t bench_string(uint64_t seed, int min, int max, char *buf) {
+  uint64_t r = bench_mix(seed);
+  size_t len = min + r % (max - min + 1);
+  for (size_t i = 0; i < len; i++) {
+    if (i % 8 == 0) {
+      r = bench_mix(r);
+    }
+    unsigned char byte = r >> (i % 8 * 8);
+    buf[i] = bench_alphabet[byte % (sizeof(bench_alphabet) - 1)];
+    // Single spaces only, none at the end, and a first word longer than
+    // "the", so that a question about the entity finds it
+    if (buf[i] == ' ' && (i < 4 || i == len - 1 || buf[i - 1] == ' ')) {
+      buf[i] = 'x';
+    }
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ * Helper function to make the k-th distinct entity of a section.
+ *
+ * Input:
+ *   options - the lengths of entities
+ *   section - the index of the section in bench_sections
+ *   k       - the number of the entity; those from the number of distinct
+ *             entities in the section on are never in the file
+ *   buf     - a buffer with room for MAX_ENTITY characters
+ */
+
+static void bench_entity(const BenchOptions *options, int section, uint64_t k,
+                         char *buf) {
+  bench_string(BENCH_SEED ^ ((uint64_t)section << 56) ^ (k << 1),
+               options->key_min, options->key_max, buf);
+}
+
+/*
+ * Helper function to write a generated knowledge file.
+ *
+ * Input:
+ *   options  - the shape of the file
+ *   f        - the file
+ *   distinct - receives the number of distinct entities in each section
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the file could not be written
+ */
+
+static int bench_generate(const BenchOptions *options, FILE *f,
+                          uint64_t distinct[3]) {
+  char entity[MAX_ENTITY];
+  char response[MAX_RESPONSE];
+  uint64_t r = BENCH_SEED;
+
+  for (int s = 0; s < 3; s++) {
+    fprintf(f, "[%s]\n", bench_sections[s]);
+    distinct[s] = 0;
+    for (long i = 0; i < options->entities; i++) {
+      r = bench_mix(r);
+      uint64_t k = distinct[s];
+      if (k > 0 && (r >> 11) * 0x1.0p-53 < options->duplicates) {
+        k = bench_mix(r) % distinct[s]; // repeat an earlier entity
+      } else {
+        distinct[s]++;
+      }
+      bench_entity(options, s, k, entity);
+      bench_string(r, options->value_min, options->value_max, response);
+      fprintf(f, "%s=%s\n", entity, response);
+    }
+    fprintf(f, "\n");
+  }
+  return fflush(f) == 0 && !ferror(f) ? KB_OK : KB_IOERROR;
+}
+
+/*
+ * Helper function to write a transcript of a conversation about a generated
+ * knowledge file, as a user would type it, for replay.c. There are three
+ * lines per line of the file: mostly questions it answers, some about new
+ * entities followed by the answer to teach, and some that are not questions.
+ *
+ * Input:
+ *   options  - the shape of the knowledge file
+ *   distinct - the number of distinct entities in each section of the file
+ *   f        - the file to write the transcript to
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the file could not be written
+ */
+
+static int bench_transcript(const BenchOptions *options,
+                            const uint64_t distinct[3], FILE *f) {
+  char entity[MAX_ENTITY];
+  char response[MAX_RESPONSE];
+  uint64_t taught[3] = {0, 0, 0};
+  uint64_t r = ~BENCH_SEED;
+
+  for (long i = 0; i < options->entities * 3; i++) {
+    r = bench_mix(r);
+    int s = (r >> 8) % 3;
+    int kind = r % 100;
+    if (kind < BENCH_TRANSCRIPT_HITS) {
+      bench_entity(options, s, (r >> 16) % distinct[s], entity);
+      fprintf(f, "%s is %s\n", bench_sections[s], entity);
+    } else if (kind < BENCH_TRANSCRIPT_HITS + BENCH_TRANSCRIPT_TEACH) {
+      bench_entity(options, s, distinct[s] + taught[s]++, entity);
+      bench_string(r, options->value_min, options->value_max, response);
+      fprintf(f, "%s is %s\n%s\n", bench_sections[s], entity, response);
+    } else {
+      fprintf(f, "hello %s\n", bench_sections[s]);
+    }
+  }
+  return fflush(f) == 0 && !ferror(f) ? KB_OK : KB_IOERROR;
+}
+
+#ifdef CHATBOT_BENCH
+/*
+ * Helper function to get the time in nanoseconds.
+ */
+
+static uint64_t bench_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * Helper function to get the peak memory use of the process.
+ *
+ * Returns:
+ *   the peak resident set size in kilobytes, or -1 if it is not known
+ */
+
+static long bench_peak_rss() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+#endif
+  return -1;
+}
+
+/*
+ * Helper function to start timing an operation.
+ *
+ * Returns:
+ *   the time
+ */
+
+static uint64_t bench_start() {
+#ifdef BENCH_COUNT_ALLOCS
+  atomic_store(&bench_allocs, 0);
+  atomic_store(&bench_counting, 1);
+#endif
+  return bench_clock();
+}
+
+/*
+ * Helper function to finish timing an operation and print the result.
+ *
+ * Input:
+ *   op      - the name of the operation
+ *   entries - the number of entries in the knowledge base
+ *   ops     - the number of operations timed
+ *   started - the time from bench_start()
+ */
+
+static void bench_report(const char *op, long entries, long ops,
+                         uint64_t started) {
+  uint64_t elapsed = bench_clock() - started;
+  double allocs = -1;
+#ifdef BENCH_COUNT_ALLOCS
+  atomic_store(&bench_counting, 0);
+  allocs = (double)atomic_load(&bench_allocs) / (ops > 0 ? ops : 1);
+#endif
+  printf("{\"op\":\"%s\",\"entries\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f,"
+         "\"allocs_per_op\":%.3f,\"process_peak_rss_kb\":%ld}\n",
+         op, entries, ops, (double)elapsed / (ops > 0 ? ops : 1), allocs,
+         bench_peak_rss());
+  fflush(stdout);
+}
+
+/*
+ * Helper function to time the operations on a knowledge base, once it has
+ * been generated.
+ *
+ * Input:
+ *   options   - the shape of the knowledge base
+ *   kb        - an empty knowledge base
+ *   f         - the generated file
+ *   distinct  - the number of distinct entities in each section of the file
+ *   keys      - room for BENCH_PUTS entities
+ *   responses - BENCH_RESPONSES responses to teach
+ *
+ * Returns:
+ *   0, if the benchmarks ran
+ *   1, if there was an error (which has been reported)
+ */
+
+static int bench_run(const BenchOptions *options, kb_t *kb, FILE *f,
+                     const uint64_t distinct[3], BenchKey *keys,
+                     char (*responses)[MAX_RESPONSE]) {
+  char response[MAX_RESPONSE];
+  long entries = options->entities * 3;
+  uint64_t r = BENCH_SEED;
+
+  // Load the file as -k would (the knowledge base then points into it)
+  rewind(f);
+  uint64_t started = bench_start();
+  int loaded = kb_read(kb, f);
+  bench_report("load", entries, entries, started);
+  if (loaded < 0) {
+    fprintf(stderr, "bench: Memory allocation error.\n");
+    return 1;
+  }
+
+  // Look up random entities that are there, then ones that are not; the
+  // entities are made before the clock starts, so only lookups are timed
+  for (int hit = 1; hit >= 0; hit--) {
+    for (int i = 0; i < BENCH_KEYS; i++) {
+      r = bench_mix(r);
+      int s = r % 3;
+      uint64_t k = (r >> 8) % distinct[s];
+      keys[i].section = s;
+      bench_entity(options, s, hit ? k : distinct[s] + k, keys[i].entity);
+    }
+    long found = 0;
+    started = bench_start();
+    for (long i = 0; i < BENCH_LOOKUPS; i++) {
+      const BenchKey *key = &keys[i % BENCH_KEYS];
+      found += kb_get(kb, bench_sections[key->section], key->entity,
+                      response, MAX_RESPONSE) == KB_OK;
+    }
+    bench_report(hit ? "get_hit" : "get_miss", entries, BENCH_LOOKUPS,
+                 started);
+    if (found != (hit ? BENCH_LOOKUPS : 0)) {
+      fprintf(stderr, "bench: %ld of %d lookups found an answer\n", found,
+              BENCH_LOOKUPS);
+    }
+  }
+
+  // Teach new entities (never looked up above), then existing ones again
+  for (int insert = 1; insert >= 0; insert--) {
+    for (long i = 0; i < BENCH_PUTS; i++) {
+      r = bench_mix(r);
+      int s = r % 3;
+      keys[i].section = s;
+      bench_entity(options, s,
+                   insert ? distinct[s] + BENCH_KEYS + i
+                          : (r >> 8) % distinct[s],
+                   keys[i].entity);
+    }
+    started = bench_start();
+    for (long i = 0; i < BENCH_PUTS; i++) {
+      if (kb_put(kb, bench_sections[keys[i].section], keys[i].entity,
+                 responses[i % BENCH_RESPONSES]) != KB_OK) {
+        fprintf(stderr, "bench: Memory allocation error.\n");
+        return 1;
+      }
+    }
+    bench_report(insert ? "put_insert" : "put_overwrite", entries, BENCH_PUTS,
+                 started);
+  }
+  entries += BENCH_PUTS;
+
+  // Save everything (not over the generated file, which is still mapped),
+  // then forget it
+  FILE *saved = tmpfile();
+  if (saved == NULL) {
+    fprintf(stderr, "bench: can't write a temporary file\n");
+    return 1;
+  }
+  started = bench_start();
+  int result = kb_write(kb, saved);
+  bench_report("save", entries, entries, started);
+  fclose(saved);
+  if (result != KB_OK) {
+    fprintf(stderr, "bench: can't write a temporary file\n");
+    return 1;
+  }
+
+  started = bench_start();
+  kb_reset(kb);
+  bench_report("reset", entries, entries, started);
+  return 0;
+}
+
+/*
+ * Helper function to run the benchmarks for one size of knowledge base.
+ *
+ * Input:
+ *   options - the shape of the knowledge base
+ *
+ * Returns:
+ *   0, if the benchmarks ran
+ *   1, if there was an error (which has been reported)
+ */
+
+static int bench_size(const BenchOptions *options) {
+  uint64_t distinct[3];
+  BenchKey *keys = malloc(BENCH_PUTS * sizeof(BenchKey));
+  char (*responses)[MAX_RESPONSE] = malloc(BENCH_RESPONSES * MAX_RESPONSE);
+  kb_t *kb = kb_create();
+  FILE *f = tmpfile();
+  int status = 1;
+
+  if (keys == NULL || responses == NULL || kb == NULL) {
+    fprintf(stderr, "bench: Memory allocation error.\n");
+  } else if (f == NULL || bench_generate(options, f, distinct) != KB_OK) {
+    fprintf(stderr, "bench: can't write a temporary file\n");
+  } else {
+    for (int i = 0; i < BENCH_RESPONSES; i++) {
+      bench_string(bench_mix(BENCH_SEED + i), options->value_min,
+                   options->value_max, responses[i]);
+    }
+    status = bench_run(options, kb, f, distinct, keys, responses);
+  }
+
+  if (f != NULL) {
+    fclose(f);
+  }
+  if (kb != NULL) {
+    kb_destroy(kb);
+  }
+  free(keys);
+  free(responses);
+  return status;
+}
+#endif
+
+/*
+ * Helper function to parse a range of lengths, e.g. "8-24" or "16".
+ *
+ * Input:
+ *   text  - the range
+ *   limit - the longest length allowed
+ *   min   - receives the shortest length
+ *   max   - receives the longest length
+ *
+ * Returns:
+ *   0, if the range is valid
+ *   1, if it is not
+ */
+
+static int bench_range(const char *text, int limit, int *min, int *max) {
+  char *end;
+  *min = (int)strtol(text, &end, 10);
+  *max = *end == '-' ? (int)strtol(end + 1, &end, 10) : *min;
+  return *end != '\0' || *min < 1 || *max < *min || *max > limit;
+}
+
+/*
+ * Helper function to check the options shared by the generator and the
+ * benchmarks, filling in the defaults.
+ *
+ * Input:
+ *   options - the options
+ *   checked - receives the options with the defaults filled in
+ *
+ * Returns:
+ *   0, if the options are valid
+ *   1, if they are not (which has been reported)
+ */
+
+static int bench_check(const BenchOptions *options, BenchOptions *checked) {
+  *checked = *options;
+  if (bench_range(options->keys ? options->keys : "8-24", MAX_ENTITY - 1,
+                  &checked->key_min, &checked->key_max) != 0) {
+    fprintf(stderr, "bench: entity lengths must be from 1 to %d\n",
+            MAX_ENTITY - 1);
+    return 1;
+  }
+  if (bench_range(options->values ? options->values : "16-128",
+                  MAX_RESPONSE - 1, &checked->value_min,
+                  &checked->value_max) != 0) {
+    fprintf(stderr, "bench: response lengths must be from 1 to %d\n",
+            MAX_RESPONSE - 1);
+    return 1;
+  }
+  if (checked->duplicates < 0 || checked->duplicates >= 1) {
+    fprintf(stderr, "bench: the duplicate ratio must be from 0 to under 1\n");
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Write a generated knowledge file, and a transcript of questions about it if
+ * options->transcript is set.
+ *
+ * Input:
+ *   options - the files and the shape of the knowledge file
+ *
+ * Returns:
+ *   the exit status for the program (0 if the file was written)
+ */
+int bench_generate_main(const BenchOptions *options) {
+  BenchOptions checked;
+  uint64_t distinct[3];
+  if (bench_check(options, &checked) != 0) {
+    return 1;
+  }
+  if (checked.entities <= 0) {
+    fprintf(stderr, "bench: there must be at least one entity per section\n");
+    return 1;
+  }
+
+  SaveFile file;
+  int result = savefile_open(&file, checked.output);
+  if (result == KB_OK) {
+    result = bench_generate(&checked, file.f, distinct);
+    if (result == KB_OK) {
+      result = savefile_commit(&file);
+    } else {
+      savefile_abort(&file);
+    }
+  }
+  if (result != KB_OK) {
+    fprintf(stderr, "bench: can't write %s\n", checked.output);
+    return 1;
+  }
+
+  if (checked.transcript != NULL) {
+    result = savefile_open(&file, checked.transcript);
+    if (result == KB_OK) {
+      result = bench_transcript(&checked, distinct, file.f);
+      if (result == KB_OK) {
+        result = savefile_commit(&file);
+      } else {
+        savefile_abort(&file);
+      }
+    }
+    if (result != KB_OK) {
+      fprintf(stderr, "bench: can't write %s\n", checked.transcript);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Run the benchmarks for each of a list of sizes.
+ *
+ * Input:
+ *   options - the sizes (the number of entries in each section, separated by
+ *             commas, e.g. "1000,1e6") and the shape of the entries
+ *
+ * Returns:
+ *   the exit status for the program (0 if every benchmark ran, 1 if not, or
+ *   if the chatbot was built without them)
+ */
+int bench_main(const BenchOptions *options) {
+#ifndef CHATBOT_BENCH
+  (void)options;
+  return 1;
+#else
+  BenchOptions checked;
+  if (bench_check(options, &checked) != 0) {
+    return 1;
+  }
+
+  int status = 0;
+  const char *p = options->sizes;
+  while (*p != '\0' && status == 0) {
+    char *end;
+    checked.entities = (long)strtod(p, &end);
+    if (end == p || (*end != ',' && *end != '\0') || checked.entities <= 0) {
+      fprintf(stderr, "bench: bad size in %s\n", options->sizes);
+      return 1;
+    }
+    p = *end == ',' ? end + 1 : end;
+
+#ifndef _WIN32
+    pid_t child = fork();
+    if (child == 0) {
+      _exit(bench_size(&checked));
+    }
+    int wstatus;
+    if (child < 0 || waitpid(child, &wstatus, 0) != child ||
+        !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+      status = 1;
+    }
+#else
+    status = bench_size(&checked);
+#endif
+  }
+  return status;
+#endif
+}
@@ -8,6 +8,10 @@
 #ifndef _CHAT1002_H
 #define _CHAT1002_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /* the maximum number of characters we expect in a line of input (including the
@@ -26,48 +30,796 @@
  * terminating null) */
 #define MAX_RESPONSE 256
 
+/* a character upper-cased as toupper() does in the "C" locale, which the
+ * chatbot never leaves, for comparing and hashing without ctype calls or
+ * branches */
+#define FOLD_CHAR(c)                                                           \
+  ((c) - ((unsigned)((unsigned char)(c) - 'a') < 26u) * ('a' - 'A'))
+
 /* return codes for knowledge_get() and knowledge_put() */
 #define KB_OK 0
 #define KB_NOTFOUND -1
 #define KB_INVALID -2
 #define KB_NOMEM -3
+#define KB_IOERROR -4
+
+/* the initial number of slots in a section's hash index (a power of two) */
+#define KB_INITIAL_SLOTS 16
+
+/* the hash index of a section grows once it is more than this percent full */
+#define KB_MAX_LOAD 70
+
+/* the size of the first chunk of an arena, and the largest size to which
+ * later chunks grow */
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (16 * 1024 * 1024)
 
-/*Type definition for Nodes*/
+/* Type definition for a chunk of memory owned by an arena */
+typedef struct arena_chunk {
+  struct arena_chunk *next; /* the previously allocated chunk */
+  size_t size;              /* the number of bytes in data */
+  size_t used;              /* the number of bytes of data handed out */
+  char data[];
+} ArenaChunk;
+
+/* Type definition for an arena allocator (see arena.c) */
+typedef struct arena {
+  ArenaChunk *head; /* the chunk currently being allocated from */
+  size_t reserved;  /* the total size of all chunks */
+  size_t used;      /* the total number of bytes handed out */
+} Arena;
+
+/*
+ * Type definition for Nodes. The strings are packed into the knowledge base's
+ * arena or point straight into a loaded file, so a node only stores where
+ * they are and how long they are.
+ */
 typedef struct node {
-  char entity[MAX_ENTITY];
-  char response[MAX_RESPONSE];
+  const char *entity;       /* the entity (not null-terminated) */
+  const char *response;     /* the response (not null-terminated), or NULL if
+                               the entity has been removed (see kb_reload()) */
+  uint32_t entity_len;      /* the length of the entity */
+  uint16_t response_len;    /* the length of the response (< MAX_RESPONSE) */
+  uint8_t flags;            /* KB_NODE_OWNED, KB_NODE_SPILLED,
+                               KB_NODE_PACKED */
+  atomic_uchar referenced;  /* 1 if looked up since the last eviction sweep */
+  uint64_t hash;            /* hash of the case-folded entity */
   struct node *next;
 } Node;
 
+/* the response of a node was malloc()ed and counts against the memory budget
+ * (see kb_set_budget()) */
+#define KB_NODE_OWNED 1
+
+/* the response of a node has been moved to the spill file (see spill.c) */
+#define KB_NODE_SPILLED 2
+
+/* the node is a view of an entry of a pack (see section_walk()), whose
+ * response is only valid until the function it was passed to returns */
+#define KB_NODE_PACKED 4
+
+/*
+ * Type definition for a file loaded by knowledge_read(). Its contents are
+ * mapped (or, if the file cannot be mapped, read into a buffer) and kept until
+ * knowledge_reset(), because nodes point into them.
+ */
+typedef struct kb_source {
+  char *data;             /* the contents of the file */
+  size_t size;            /* the number of bytes in data */
+  int mapped;             /* 1 if data is mapped, 0 if it was malloc()ed,
+                             2 if it was moved to the spill file */
+  uint64_t device;        /* the device and inode of a mapped file */
+  uint64_t inode;
+  char *path;             /* the name of the file, if kb_reload() is to
+                             compare it with the next version, or NULL */
+  int compared;           /* 1 if kb_reload() only compared it with the
+                             version before, so no node points into it */
+  struct kb_source *next; /* the previously loaded file */
+} KBSource;
+
+/* the first bytes of a compiled knowledge base (see snapshot.c) */
+#define KB_SNAPSHOT_MAGIC "CHATKB\r\n"
+
+/* the version of the compiled knowledge base format written by compile */
+#define KB_SNAPSHOT_VERSION 1
+
+/* Type definition for the header at the start of a compiled knowledge base */
+typedef struct kb_snapshot_header {
+  char magic[8];            /* KB_SNAPSHOT_MAGIC */
+  uint32_t version;         /* KB_SNAPSHOT_VERSION */
+  uint32_t byte_order;      /* 0x01020304, as stored by the writing machine */
+  uint64_t file_size;       /* the size of the whole file */
+  uint64_t sections_offset; /* where the table of KBSnapshotSections is */
+  uint64_t section_count;   /* the number of entries in that table */
+  uint64_t checksum;        /* checksum of everything after the header */
+} KBSnapshotHeader;
+
+/* Type definition for a section in a compiled knowledge base. Its entries
+ * are stored in the order in which they were added, and its slots
+ * are a linear-probing hash index over them (0 is empty, i is entry i - 1).
+ */
+typedef struct kb_snapshot_section {
+  char name[MAX_INTENT];   /* the question word */
+  uint64_t entries_offset; /* where the array of KBSnapshotEntrys is */
+  uint64_t entry_count;    /* the number of entries */
+  uint64_t slots_offset;   /* where the array of uint32_t slots is */
+  uint64_t slot_count;     /* the number of slots (a power of two) */
+} KBSnapshotSection;
+
+/* Type definition for an entity and its response in a compiled knowledge
+ * base. The offsets of the strings are from the start of the file. */
+typedef struct kb_snapshot_entry {
+  uint64_t hash;            /* hash of the case-folded entity */
+  uint64_t entity_offset;   /* where the entity is */
+  uint64_t response_offset; /* where the response is */
+  uint32_t entity_len;      /* the length of the entity */
+  uint32_t response_len;    /* the length of the response */
+} KBSnapshotEntry;
+
+/* the first bytes of a knowledge base journal (see journal.c) */
+#define KB_JOURNAL_MAGIC "CHATJNL\n"
+
+/* the version of the journal format */
+#define KB_JOURNAL_VERSION 1
+
+/* the kinds of record in a journal */
+#define KB_JOURNAL_PUT 1
+#define KB_JOURNAL_RESET 2
+
+/* a journal is compacted into its snapshot once it is this many bytes long */
+#define KB_JOURNAL_COMPACT_BYTES (64 * 1024 * 1024)
+
+/* the memory the answers learned by a knowledge base kept in a disk store
+ * may take before they are written to the store as a run (see store.c) */
+#define KB_STORE_MEMTABLE_BYTES (64 * 1024 * 1024)
+
+/* Type definition for the header at the start of a journal */
+typedef struct kb_journal_header {
+  char magic[8];       /* KB_JOURNAL_MAGIC */
+  uint32_t version;    /* KB_JOURNAL_VERSION */
+  uint32_t byte_order; /* 0x01020304, as stored by the writing machine */
+} KBJournalHeader;
+
+/* Type definition for the header of a record in a journal. The intent,
+ * entity and response follow it, without terminating nulls. */
+typedef struct kb_journal_record {
+  uint64_t checksum;     /* checksum of the rest of the record */
+  uint8_t type;          /* KB_JOURNAL_PUT or KB_JOURNAL_RESET */
+  uint8_t intent_len;    /* the length of the intent */
+  uint16_t entity_len;   /* the length of the entity */
+  uint16_t response_len; /* the length of the response */
+  uint16_t reserved;     /* 0 */
+} KBJournalRecord;
+
+/* Type definition for an open journal (see journal.c) */
+typedef struct kb_journal KBJournal;
+
+/* Type definition for the fuzzy index of a section (see fuzzy.c) */
+typedef struct kb_fuzzy KBFuzzy;
+
+/* Type definition for the radix tree of a section (see radix.c) */
+typedef struct kb_radix KBRadix;
+
+/* Type definition for the search index of a knowledge base (see search.c) */
+typedef struct kb_search KBSearch;
+
+/* Type definition for a point-in-time view of a knowledge base (see
+ * kb_view()) */
+typedef struct kb_view KBView;
+
+/* Type definition for a table of intents (see intent.c) */
+typedef struct intent_table IntentTable;
+
+/* Type definition for a save running in the background (see saver.c) */
+typedef struct kb_saver KBSaver;
+
+/* Type definition for the file responses are moved to when a knowledge base
+ * is over its memory budget (see spill.c) */
+typedef struct kb_spill KBSpill;
+
+/* Type definition for the disk store a knowledge base may be kept in, and
+ * for the list of its runs (see store.c) */
+typedef struct kb_store KBStore;
+typedef struct kb_store_runs KBStoreRuns;
+
+/* Type definition for the packed entries of a section, and for the table of
+ * symbols their responses are compressed with (see pack.c) */
+typedef struct kb_pack KBPack;
+typedef struct kb_pack_table KBPackTable;
+
+/* Type definition for an entry to be packed (see pack_create()) */
+typedef struct kb_pack_item {
+  const char *entity;   /* the entity (not null-terminated) */
+  const char *response; /* the response (not null-terminated) */
+  size_t entity_len;    /* the length of the entity */
+  size_t response_len;  /* the length of the response */
+} KBPackItem;
+
+/* Type definition for the state of a streaming checksum (see snapshot.c) */
+typedef struct checksum {
+  uint64_t lanes[4];          /* four independent accumulators */
+  unsigned char pending[32];  /* bytes not yet folded into the lanes */
+  size_t pending_len;         /* the number of bytes in pending */
+  uint64_t total;             /* the number of bytes seen */
+} Checksum;
+
+/*
+ * Type definition for the hash index of a section. Lookups read it without
+ * locking, so its slots are atomic, and it is never resized in place: a
+ * larger index is built and replaces it (see knowledge.c).
+ */
+typedef struct kb_index {
+  size_t capacity;       /* the number of slots (a power of two) */
+  Node *_Atomic slots[]; /* the indexed nodes; NULL for an empty slot */
+} KBIndex;
+
+/* Type definition for the base of a section: the same section of a compiled
+ * knowledge base, used where it is mapped */
+typedef struct kb_base {
+  const char *data;                /* the compiled knowledge base */
+  const KBSnapshotEntry *entries;  /* the base's entries */
+  const uint32_t *slots;           /* the base's hash index */
+  size_t count;                    /* the number of base entries */
+  size_t capacity;                 /* the number of base slots */
+} KBBase;
+
+/*
+ * Type definition for a section of the knowledge base (one per question
+ * word). The nodes are kept in a list in the order in which they were added,
+ * which is the order kb_compile() saves them in, and are indexed by an
+ * open-addressing (linear probing) hash table keyed on the case-folded entity.
+ * A node is never changed once it is indexed: overwriting a response indexes
+ * a new node in its place, and the old one stays on the list (and is looked
+ * up in the index when the list is walked) until the list is rebuilt.
+ *
+ * A section may also have a base, or a pack (see kb_pack()). Nodes added for
+ * entities that are already in the base or pack shadow them; they are indexed
+ * but not put on the list, since they are saved in their entity's place.
+ */
+typedef struct section {
+  Node *head;                 /* the first node added to the section */
+  Node *tail;                 /* the last node added to the section */
+  KBIndex *_Atomic index;     /* the hash index; NULL until a node is added */
+  size_t count;               /* the number of nodes in the index */
+  size_t shadowed;            /* the number of nodes shadowing base or pack
+                                 entities */
+  size_t replaced;            /* the number of list nodes since replaced */
+  size_t removed;             /* the number of indexed nodes that mark
+                                 removed entities */
+  const KBBase *_Atomic base; /* the section's base, or NULL */
+  const KBPack *_Atomic pack; /* the section's packed entries, or NULL */
+  char *unpacked;             /* the pack's entities, one after another, or
+                                 NULL until the fuzzy index, radix tree or
+                                 search index need them */
+  KBFuzzy *fuzzy;             /* the entities by trigram, or NULL until a
+                                 miss needs them (see kb_suggest()) */
+  KBRadix *radix;             /* the entities in order, or NULL until they
+                                 are listed or saved (see kb_list()) */
+} Section;
+
+/* the most question words a knowledge base may have, and so sections in it
+ * (see intent.c) */
+#define KB_MAX_SECTIONS 64
+
+/*
+ * Type definition for a knowledge base (see knowledge.c). Each knowledge base
+ * has its own sections, memory and lock, so any number of them can be used
+ * at once, from any number of threads; the knowledge_*() functions use the
+ * default one returned by knowledge_default().
+ */
+typedef struct kb {
+  /* the answers to each question word, by its section number */
+  Section sections[KB_MAX_SECTIONS];
+  Arena arena;          /* holds every node and string added */
+  KBSource *sources;    /* the files loaded, which the nodes point into */
+  KBJournal *journal;   /* records every change, or NULL (see journal.c) */
+  KBSearch *search;     /* the answers by the words of their responses, or
+                           NULL until searched (see kb_search()) */
+  KBSaver *saver;       /* the last save started in the background, or NULL
+                           (see saver.c) */
+  KBSpill *spill;       /* where responses over the budget go, or NULL until
+                           one does (see spill.c) */
+  char *spill_dir;      /* the directory of the spill file, or NULL */
+  size_t budget;        /* the most memory responses may use, or 0 */
+  size_t resident;      /* the bytes of KB_NODE_OWNED responses */
+  size_t borrowed;      /* the bytes of the files loaded that the sections
+                           point into, for the memtable's size */
+  int clock_section;    /* where the eviction sweep goes on from */
+  size_t clock_slot;
+  KBStore *store;       /* the disk store it is kept in, or NULL (see
+                           store.c) */
+  /* its own question words, beyond WHO, WHAT and WHERE, or NULL until one is
+   * added (see intent.c) */
+  IntentTable *_Atomic questions;
+  pthread_mutex_t lock; /* held to change or save; lookups don't take it */
+} kb_t;
+
+/*
+ * Type definition for a conversation with the chatbot (see chatbot.c). A
+ * session says which knowledge base the chatbot answers from and where it
+ * asks the user for answers it doesn't know. Sessions may share a knowledge
+ * base, or each have one of their own.
+ */
+typedef struct session {
+  kb_t *kb;    /* the knowledge base used by the session */
+  int owns_kb; /* 1 if the knowledge base is the session's alone */
+  FILE *in;    /* the stream answers are read from (NULL = stdin) */
+  FILE *out;   /* the stream prompts are written to (NULL = stdout) */
+} session_t;
+
+/* Type definition for the function that carries out an intent (see
+ * chatbot.c) */
+typedef int (*IntentHandler)(session_t *session, int inc, char *inv[],
+                             char *response, int n);
+
+/* Type definition for an intent: a word the chatbot understands at the start
+ * of a line (see intent.c) */
+typedef struct intent {
+  char name[MAX_INTENT];  /* the word */
+  size_t len;             /* the length of the word */
+  uint64_t hash;          /* hash of the case-folded word */
+  IntentHandler handler;  /* carries the intent out */
+  int metric;             /* the intent counted by the metrics */
+  int section;            /* the section of a question word, or -1 */
+} Intent;
+
+/* Type definition for the hash index statistics of a section. The probe
+ * lengths are worked out from the layout of the index, so lookups do not
+ * have to count anything (and can run in parallel). */
+typedef struct kb_stats {
+  size_t entries;        /* the number of entities in the section */
+  size_t capacity;       /* the number of slots in the hash index */
+  double load_factor;    /* entries / capacity */
+  double avg_probe;      /* the mean slots visited to find an indexed node */
+  double avg_miss_probe; /* the mean slots visited to miss, over all slots */
+  size_t max_probe;      /* the longest probe sequence in the index */
+} KBStats;
+
+/* Type definition for the changes kb_reload() made */
+typedef struct kb_delta {
+  size_t added;   /* the number of entities that were not known */
+  size_t changed; /* the number of entities whose responses changed */
+  size_t removed; /* the number of entities no longer in the file */
+} KBDelta;
+
+/* the states of a save in the background (see saver_status()) */
+#define KB_SAVE_RUNNING 0 /* the file is being written */
+#define KB_SAVE_DONE 1    /* the file has been written, or failed to be */
+
+/* Type definition for the state of a save in the background */
+typedef struct kb_save_status {
+  int state;                 /* KB_SAVE_RUNNING or KB_SAVE_DONE */
+  int result;                /* once done, KB_OK or the error */
+  char path[MAX_RESPONSE];   /* the file (truncated if it is long) */
+  uint64_t elapsed_ns;       /* the time taken so far, or in all */
+  uint64_t bytes;            /* once done, the bytes written */
+} KBSaveStatus;
+
+/* the most entries in a block of a pack (see kb_pack()) */
+#define KB_PACK_MAX_BLOCK 256
+
+/* Type definition for the memory used by the responses of a knowledge base
+ * (see kb_memory()) */
+typedef struct kb_memory {
+  size_t budget;     /* the most they may use, or 0 for no limit */
+  size_t resident;   /* the bytes they use in memory, against the budget */
+  uint64_t spilled;  /* the bytes moved to the spill file */
+} KBMemory;
+
+/* Type definition for the size of a disk store (see kb_store_stats()) */
+typedef struct kb_store_stats {
+  size_t runs;       /* the number of runs */
+  uint64_t entries;  /* the entries in them, counting out-of-date ones */
+  uint64_t bytes;    /* the size of their files */
+} KBStoreStats;
+
+/* Type definition for the size of packed entries (see pack_stats() and
+ * kb_pack_stats()) */
+typedef struct kb_pack_stats {
+  uint64_t entries;      /* the number of entries */
+  uint64_t entity_bytes; /* the bytes of their entities */
+  uint64_t raw_bytes;    /* the bytes of their entities and responses */
+  uint64_t bytes;        /* the memory the packs take */
+} KBPackStats;
+
+/* Type definition for an answer found by kb_search() */
+typedef struct kb_search_hit {
+  int section;                 /* the section number of the question word */
+  char intent[MAX_INTENT];     /* the question word */
+  char entity[MAX_ENTITY];     /* the entity */
+  char response[MAX_RESPONSE]; /* the response */
+  double score;                /* how well the response matched the query */
+} KBSearchHit;
+
+/* Type definition for the options of batch mode (see batch.c) */
+typedef struct batch_options {
+  const char *input;   /* the file of questions, one per line ("-" = stdin) */
+  const char *output;  /* the file to write the answers to (NULL = stdout) */
+  const char *unknown; /* the file to copy unanswered questions to, or NULL */
+  int threads;         /* the number of worker threads (0 = one per CPU) */
+} BatchOptions;
+
+/* the intents counted by the runtime metrics (see metrics.c) */
+#define METRIC_INTENT_EXIT 0
+#define METRIC_INTENT_LOAD 1
+#define METRIC_INTENT_QUESTION 2
+#define METRIC_INTENT_RESET 3
+#define METRIC_INTENT_SAVE 4
+#define METRIC_INTENT_COMPILE 5
+#define METRIC_INTENT_STATS 6
+#define METRIC_INTENT_LIST 7
+#define METRIC_INTENT_SEARCH 8
+#define METRIC_INTENT_STATUS 9
+#define METRIC_INTENT_OTHER 10
+#define METRICS_INTENTS 11
+
+/* the counters kept by the runtime metrics */
+#define METRIC_HITS 0               /* questions answered */
+#define METRIC_MISSES 1             /* questions not answered */
+#define METRIC_TAUGHT 2             /* answers learned from users */
+#define METRIC_LOADED 3             /* entities read from files */
+#define METRIC_LOAD_NS 4            /* nanoseconds spent reading files */
+#define METRIC_SAVED_BYTES 5        /* bytes saved by kb_write() */
+#define METRIC_SAVE_NS 6            /* nanoseconds spent in kb_write() */
+#define METRIC_PROMPT_NS 7          /* nanoseconds spent waiting for the user */
+#define METRIC_SUGGESTED 8          /* questions answered with a suggestion */
+#define METRIC_EVICTED 9            /* responses moved to the spill file */
+#define METRIC_SPILL_READS 10       /* questions answered from the spill file */
+#define METRIC_STORE_FLUSHES 11     /* runs written to the disk store */
+#define METRIC_STORE_COMPACTIONS 12 /* merges of the disk store's runs */
+#define METRIC_RUN_PROBES 13        /* runs looked in for an entity */
+#define METRIC_BLOOM_SKIPS 14       /* runs passed over by their bloom filter */
+#define METRIC_COUNTERS 15
+
+/* the number of latency buckets kept for each intent (see metrics.c) */
+#define METRICS_BUCKETS 28
+
+/* Type definition for the runtime metrics, added up over every thread */
+typedef struct metrics {
+  uint64_t counters[METRIC_COUNTERS];   /* METRIC_HITS, ... */
+  uint64_t requests[METRICS_INTENTS];   /* the lines of each intent */
+  uint64_t latency_ns[METRICS_INTENTS]; /* the time taken by them */
+  /* the number of lines of each intent in each latency bucket */
+  uint64_t buckets[METRICS_INTENTS][METRICS_BUCKETS];
+} Metrics;
+
+/* the number of spans each thread keeps for the trace, the oldest being
+ * overwritten first (see trace.c) */
+#define TRACE_RING_SIZE 65536
+
+/*
+ * TRACE_SPAN(name) traces the rest of the block it is in, as a span with the
+ * given name, when the chatbot is built with -DCHATBOT_TRACE; otherwise it
+ * compiles to nothing. There may be one in each block.
+ */
+#ifdef CHATBOT_TRACE
+/* Type definition for a span being traced */
+typedef struct trace_span {
+  const char *name; /* the name of the span, a string constant */
+  uint64_t start;   /* when it started, in nanoseconds */
+} TraceSpan;
+#define TRACE_SPAN(name)                                                       \
+  TraceSpan trace_span_ __attribute__((cleanup(trace_end))) = trace_begin(name)
+#else
+#define TRACE_SPAN(name)                                                       \
+  do {                                                                         \
+  } while (0)
+#endif
+
+/* latencies below this many nanoseconds are counted exactly in a latency
+ * histogram; above it, with LATENCY_SUB_BUCKETS buckets per power of two */
+#define LATENCY_LINEAR 256
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (LATENCY_LINEAR + 56 * LATENCY_SUB_BUCKETS)
+
+/* Type definition for the options of the knowledge base stress test (see
+ * stress.c) */
+typedef struct stress_options {
+  double seconds; /* how long to run with and without writers */
+  int readers;    /* the number of threads looking up answers (0 = per CPU) */
+  int writers;    /* the number of threads teaching answers */
+} StressOptions;
+
+/* Type definition for the options of server mode and the load generator
+ * (see server.c) */
+typedef struct server_options {
+  const char *address;   /* "unix:path", "host:port" or "port" */
+  int connections;       /* the most to serve, or the number to open */
+  int requests;          /* the number of questions to ask per connection */
+  const char *questions; /* the file of questions to ask, or NULL */
+} ServerOptions;
+
+/* Type definition for the options of the benchmarks and the knowledge file
+ * generator (see bench.c) */
+typedef struct bench_options {
+  const char *sizes;  /* the entities per section to benchmark, "1e3,1e6" */
+  const char *output; /* the file to generate */
+  const char *transcript; /* a transcript to generate for it, or NULL */
+  long entities;      /* the number of lines per section to generate */
+  const char *keys;   /* the range of entity lengths, e.g. "8-24" */
+  const char *values; /* the range of response lengths, e.g. "16-128" */
+  double duplicates;  /* the fraction of lines that repeat an entity */
+  int key_min, key_max;     /* the range of entity lengths, parsed */
+  int value_min, value_max; /* the range of response lengths, parsed */
+} BenchOptions;
+
+/* Type definition for a file being replaced (see savefile.c) */
+typedef struct save_file {
+  FILE *f;          /* the file to write to */
+  const char *path; /* the name of the file being replaced */
+  char *temp;       /* the name of the temporary file, or NULL */
+} SaveFile;
+
+/* functions defined in arena.c */
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_reset(Arena *arena);
+
+/* functions defined in epoch.c */
+int epoch_enter();
+void epoch_leave();
+void epoch_retire(void (*fn)(void *ptr), void *ptr);
+void epoch_synchronize();
+
+/* functions defined in bench.c */
+int bench_main(const BenchOptions *options);
+int bench_generate_main(const BenchOptions *options);
+
+/* functions defined in intent.c */
+const Intent *intent_find(const char *word);
+int intent_question(kb_t *kb, const char *word);
+int intent_add_question(kb_t *kb, const char *word, size_t len);
+void intent_reset(kb_t *kb);
+int intent_sections(kb_t *kb);
+const char *intent_section_name(kb_t *kb, int section);
+
+/* functions defined in metrics.c */
+uint64_t metrics_clock();
+void metrics_add(int counter, uint64_t n);
+uint64_t metrics_local(int counter);
+int metrics_bucket(uint64_t ns);
+void metrics_intent(int intent, uint64_t ns);
+void metrics_read(Metrics *total);
+const char *metrics_intent_name(int intent);
+int metrics_find_intent(const char *name);
+uint64_t metrics_percentile(const Metrics *metrics, int intent,
+                            double fraction);
+int metrics_write(FILE *f);
+int metrics_dump_start(const char *path, int seconds);
+void metrics_dump_stop();
+
+/* functions defined in trace.c */
+#ifdef CHATBOT_TRACE
+TraceSpan trace_begin(const char *name);
+void trace_end(TraceSpan *span);
+#endif
+int trace_write(FILE *f);
+int trace_export(const char *path);
+
+/* functions defined in replay.c */
+int replay_main(const char *filename);
+
+/* functions defined in savefile.c */
+int savefile_open(SaveFile *file, const char *path);
+int savefile_commit(SaveFile *file);
+void savefile_abort(SaveFile *file);
+
+/* functions defined in journal.c */
+int journal_open(kb_t *kb, const char *path, int sync_ms);
+void journal_close(kb_t *kb);
+uint64_t journal_append(KBJournal *journal, int type, const char *intent,
+                        const char *entity, size_t entity_len,
+                        const char *response, size_t response_len);
+int journal_commit(KBJournal *journal, uint64_t seq);
+void journal_request_compact(KBJournal *journal);
+int journal_truncate(KBJournal *journal);
+
+/* functions defined in snapshot.c */
+void checksum_init(Checksum *sum);
+void checksum_update(Checksum *sum, const void *data, size_t len);
+uint64_t checksum_final(Checksum *sum);
+const KBSnapshotHeader *snapshot_layout(const char *data, size_t size);
+const KBSnapshotHeader *snapshot_validate(const char *data, size_t size);
+int snapshot_write(FILE *f, kb_t *kb);
+
+/* functions defined in fuzzy.c */
+KBFuzzy *fuzzy_create();
+void fuzzy_destroy(KBFuzzy *fuzzy);
+int fuzzy_add(KBFuzzy *fuzzy, const char *entity, size_t len);
+int fuzzy_find(KBFuzzy *fuzzy, const char *query, size_t len,
+               const char **match, size_t *n);
+
+/* functions defined in radix.c */
+KBRadix *radix_create();
+void radix_destroy(KBRadix *radix);
+int radix_insert(KBRadix *radix, const char *entity, size_t len);
+int radix_remove(KBRadix *radix, const char *entity, size_t len);
+size_t radix_list(const KBRadix *radix, const char *prefix, size_t len,
+                  size_t skip, size_t limit,
+                  void (*fn)(const char *entity, size_t len, void *arg),
+                  void *arg);
+
+/* functions defined in search.c */
+KBSearch *search_create();
+void search_destroy(KBSearch *search);
+int search_add(KBSearch *search, int section, const char *entity,
+               size_t entity_len, uint64_t hash, const char *response,
+               size_t response_len);
+void search_remove(KBSearch *search, int section, const char *entity,
+                   size_t entity_len, uint64_t hash);
+void search_move(KBSearch *search, int section, const char *entity,
+                 size_t entity_len, uint64_t hash, const char *response);
+int search_find(KBSearch *search, const char *query, size_t len,
+                KBSearchHit *hits, int max, size_t *matches);
+
+/* functions defined in watch.c */
+int watch_file(kb_t *kb, const char *path, KBDelta *delta);
+int watch_active();
+void watch_forget(kb_t *kb);
+void watch_stop();
+
+/* functions defined in saver.c */
+int saver_start(kb_t *kb, const char *path);
+int saver_status(kb_t *kb, KBSaveStatus *status);
+void saver_wait(kb_t *kb);
+
+/* functions defined in spill.c */
+KBSpill *spill_create(const char *dir);
+const char *spill_append(KBSpill *spill, const char *data, size_t len,
+                         size_t align);
+uint64_t spill_size(const KBSpill *spill);
+void spill_destroy(void *arg);
+
+/* functions defined in store.c */
+int store_open(kb_t *kb, const char *dir);
+void store_close(kb_t *kb);
+int store_get(KBStore *store, int section, const char *folded, size_t len,
+              uint64_t hash, char *response, int n);
+int store_flush(KBStore *store, kb_t *kb, size_t bytes);
+void store_reset(KBStore *store);
+const KBStoreRuns *store_runs(KBStore *store);
+void store_walk(const KBStoreRuns *runs, int section,
+                void (*fn)(const char *entity, size_t entity_len,
+                           const char *response, size_t response_len,
+                           void *arg),
+                void *arg);
+uint64_t store_entries(const KBStoreRuns *runs, int section);
+void store_stats(KBStore *store, KBStoreStats *stats);
+
+/* functions defined in pack.c */
+KBPackTable *pack_train(const KBPackItem *items, size_t count);
+KBPack *pack_create(const KBPackTable *table, KBPackItem *items, size_t count,
+                    size_t block);
+int pack_find(const KBPack *pack, const char *folded, size_t len,
+              char *response, int n);
+void pack_walk(const KBPack *pack,
+               void (*fn)(const char *entity, size_t entity_len,
+                          const char *response, size_t response_len,
+                          void *arg),
+               void *arg);
+void pack_entities(const KBPack *pack, char *buffer);
+void pack_stats(const KBPack *pack, KBPackStats *stats);
+void pack_destroy(void *arg);
+
+/* functions defined in batch.c */
+int batch_main(const BatchOptions *options);
+
+/* functions defined in stress.c */
+int stress_main(const StressOptions *options);
+int latency_bucket(uint64_t ns);
+uint64_t latency_bucket_ns(int bucket);
+uint64_t latency_percentile(const long *histogram, long total,
+                            double fraction);
+
+/* functions defined in server.c */
+int server_main(const ServerOptions *options);
+int loadgen_main(const ServerOptions *options);
+
 /* functions defined in main.c */
+int split_words(char *input, char *inv[]);
+const char *join_words(int inc, char *inv[], int first);
 int compare_token(const char *token1, const char *token2);
-void prompt_user(char *buf, int n, const char *format, ...);
+int prompt_user(char *buf, int n, const char *format, ...);
+int session_prompt(session_t *session, char *buf, int n, const char *format,
+                   ...);
 
 /* functions defined in chatbot.c */
 const char *chatbot_botname();
 const char *chatbot_username();
+session_t *session_create(kb_t *kb, FILE *in, FILE *out);
+void session_destroy(session_t *session);
 int chatbot_main(int inc, char *inv[], char *response, int n);
+int chatbot_session_main(session_t *session, int inc, char *inv[],
+                         char *response, int n);
 int chatbot_is_exit(const char *intent);
-int chatbot_do_exit(int inc, char *inv[], char *response, int n);
+int chatbot_do_exit(session_t *session, int inc, char *inv[], char *response,
+                    int n);
 int chatbot_is_load(const char *intent);
-int chatbot_do_load(int inc, char *inv[], char *response, int n);
+int chatbot_do_load(session_t *session, int inc, char *inv[], char *response,
+                    int n);
 int chatbot_is_question(const char *intent);
-int chatbot_do_question(int inc, char *inv[], char *response, int n);
+int chatbot_do_question(session_t *session, int inc, char *inv[],
+                        char *response, int n);
+int chatbot_answer(session_t *session, int inc, char *inv[], char *response,
+                   int n);
 int chatbot_is_reset(const char *intent);
-int chatbot_do_reset(int inc, char *inv[], char *response, int n);
+int chatbot_do_reset(session_t *session, int inc, char *inv[], char *response,
+                     int n);
 int chatbot_is_save(const char *intent);
-int chatbot_do_save(int inc, char *inv[], char *response, int n);
+int chatbot_do_save(session_t *session, int inc, char *inv[], char *response,
+                    int n);
+int chatbot_is_compile(const char *intent);
+int chatbot_do_compile(session_t *session, int inc, char *inv[],
+                       char *response, int n);
+int chatbot_is_stats(const char *intent);
+int chatbot_do_stats(session_t *session, int inc, char *inv[], char *response,
+                     int n);
+int chatbot_is_list(const char *intent);
+int chatbot_do_list(session_t *session, int inc, char *inv[], char *response,
+                    int n);
+int chatbot_is_search(const char *intent);
+int chatbot_do_search(session_t *session, int inc, char *inv[], char *response,
+                      int n);
+int chatbot_is_status(const char *intent);
+int chatbot_do_status(session_t *session, int inc, char *inv[], char *response,
+                      int n);
 
 /* functions defined in knowledge.c */
+kb_t *kb_create();
+void kb_destroy(kb_t *kb);
+void kb_close(kb_t *kb);
+int kb_get(kb_t *kb, const char *intent, const char *entity, char *response,
+           int n);
+int kb_put(kb_t *kb, const char *intent, const char *entity,
+           const char *response);
+void kb_reset(kb_t *kb);
+int kb_read(kb_t *kb, FILE *f);
+int kb_read_mapped(kb_t *kb, FILE *f);
+int kb_reload(kb_t *kb, const char *path, KBDelta *delta);
+int kb_write(kb_t *kb, FILE *f);
+KBView *kb_view(kb_t *kb);
+int kb_view_write(const KBView *view, FILE *f, uint64_t *written);
+void kb_view_close(KBView *view);
+int kb_detach(kb_t *kb, const char *filename);
+int kb_compile(kb_t *kb, FILE *f);
+int kb_stats(kb_t *kb, const char *intent, KBStats *stats);
+int kb_suggest(kb_t *kb, const char *intent, const char *entity,
+               char *suggestion, int n);
+int kb_list(kb_t *kb, const char *intent, const char *prefix, size_t skip,
+            size_t limit, void (*fn)(const char *entity, size_t len, void *arg),
+            void *arg, size_t *total);
+int kb_search(kb_t *kb, const char *query, KBSearchHit *hits, int max,
+              size_t *matches);
+int kb_set_budget(kb_t *kb, size_t budget, const char *dir);
+void kb_memory(kb_t *kb, KBMemory *memory);
+int kb_store_stats(kb_t *kb, KBStoreStats *stats);
+int kb_pack(kb_t *kb, size_t block);
+int kb_pack_stats(kb_t *kb, KBPackStats *stats);
+kb_t *knowledge_default();
 int knowledge_get(const char *intent, const char *entity, char *response,
                   int n);
 int knowledge_put(const char *intent, const char *entity, const char *response);
 void knowledge_reset();
 int knowledge_read(FILE *f);
-void knowledge_write(FILE *f);
-void push_to_list(Node *head, Node *new_node);
-Node *create_node(const char *entity, const char *response);
-void write_section_to_file(FILE *f, char *entity, char *response, char *buffer,
-                           const char *delimiter, const char *end);
+int knowledge_reload(const char *path, KBDelta *delta);
+int knowledge_write(FILE *f);
+int knowledge_detach(const char *filename);
+int knowledge_compile(FILE *f);
+int knowledge_stats(const char *intent, KBStats *stats);
+int knowledge_suggest(const char *intent, const char *entity,
+                      char *suggestion, int n);
+int knowledge_list(const char *intent, const char *prefix, size_t skip,
+                   size_t limit,
+                   void (*fn)(const char *entity, size_t len, void *arg),
+                   void *arg, size_t *total);
+int knowledge_search(const char *query, KBSearchHit *hits, int max,
+                     size_t *matches);
+Section *find_section(kb_t *kb, const char *intent);
+void section_walk(Section *section, void (*fn)(const Node *node, void *arg),
+                  void *arg);
+void push_to_list(Section *section, Node *new_node);
+Node *create_node(kb_t *kb, const char *entity, size_t entity_len,
+                  uint64_t hash, const char *response, size_t response_len,
+                  int copy);
 
 #endif
\ No newline at end of file
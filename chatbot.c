@@ -2,14 +2,18 @@
  * INF1002 (C Language) Group Project.
  *
  * This file implements the behaviour of the chatbot. The main entry point to
- * this module is the chatbot_main() function, which identifies the intent
- * using the chatbot_is_*() functions then invokes the matching chatbot_do_*()
+ * this module is the chatbot_main() function, which looks the intent up in the
+ * registry of intents (see intent.c) then invokes the matching chatbot_do_*()
  * function to carry out the intent.
  *
- * chatbot_main() and chatbot_do_*() have the same method signature, which
- * works as described here.
+ * chatbot_main() holds the conversation on the terminal, using the default
+ * knowledge base. chatbot_session_main() does the same for any session (see
+ * session_create()), so that one program can hold many conversations at once.
+ * chatbot_session_main() and chatbot_do_*() have the same method signature,
+ * which works as described here.
  *
  * Input parameters:
+ *   session  - the conversation
  *   inc      - the number of words in the question
  *   inv      - an array of pointers to each word in the question
  *   response - a buffer to receive the response
@@ -42,8 +46,32 @@
 
 #include "chat1002.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+/* the number of entities listed at once, unless the user asks for more */
+#define LIST_PAGE 10
+
+/* the most entities that may be asked for at once, and the last page */
+#define LIST_MAX_LIMIT 1000
+#define LIST_MAX_PAGE 1000000
+
+/* the most answers a search names */
+#define SEARCH_HITS 5
+
+/* Type definition for the entities gathered for a response by
+ * list_entities() */
+typedef struct list_page {
+  char text[MAX_RESPONSE]; /* the entities, separated by ", " */
+  size_t used;             /* the length of the text */
+  size_t room;             /* the most text the response has room for */
+  size_t shown;            /* the number of entities in the text */
+  int full;                /* 1 once an entity did not fit */
+} ListPage;
+
+/* the conversation on the terminal, held by chatbot_main() */
+static session_t chatbot_terminal;
+
 /*
  * Get the name of the chatbot.
  *
@@ -59,7 +87,53 @@ const char *chatbot_botname() { return "Zeus"; }
 const char *chatbot_username() { return "Prometheus"; }
 
 /*
- * Get a response to user input.
+ * Start a conversation.
+ *
+ * Input:
+ *   kb  - the knowledge base to use, which may be shared with other sessions;
+ *         if NULL, the session gets an empty knowledge base of its own
+ *   in  - the stream to read the user's answers from (NULL for stdin)
+ *   out - the stream to write questions to the user to (NULL for stdout)
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the session, to be freed with session_destroy()
+ */
+session_t *session_create(kb_t *kb, FILE *in, FILE *out) {
+  session_t *session = calloc(1, sizeof(session_t));
+  if (session == NULL) {
+    return NULL;
+  }
+  if (kb == NULL) {
+    kb = kb_create();
+    if (kb == NULL) {
+      free(session);
+      return NULL;
+    }
+    session->owns_kb = 1;
+  }
+  session->kb = kb;
+  session->in = in;
+  session->out = out;
+  return session;
+}
+
+/*
+ * End a conversation, freeing the session and its knowledge base if it has
+ * one of its own. The streams are not closed.
+ *
+ * Input:
+ *   session - the session
+ */
+void session_destroy(session_t *session) {
+  if (session->owns_kb) {
+    kb_destroy(session->kb);
+  }
+  free(session);
+}
+
+/*
+ * Get a response to user input on the terminal.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -69,6 +143,26 @@ const char *chatbot_username() { return "Prometheus"; }
  *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
  */
 int chatbot_main(int inc, char *inv[], char *response, int n) {
+  if (chatbot_terminal.kb == NULL) {
+    chatbot_terminal.kb = knowledge_default();
+    chatbot_terminal.owns_kb = 1;
+  }
+  return chatbot_session_main(&chatbot_terminal, inc, inv, response, n);
+}
+
+/*
+ * Get a response to user input in a session.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
+ */
+int chatbot_session_main(session_t *session, int inc, char *inv[],
+                         char *response, int n) {
+  TRACE_SPAN("chatbot_main");
 
   /* check for empty input */
   if (inc < 1) {
@@ -76,21 +170,29 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
     return 0;
   }
 
-  /* look for an intent and invoke the corresponding do_* function */
-  if (chatbot_is_exit(inv[0]))
-    return chatbot_do_exit(inc, inv, response, n);
-  else if (chatbot_is_load(inv[0]))
-    return chatbot_do_load(inc, inv, response, n);
-  else if (chatbot_is_question(inv[0]))
-    return chatbot_do_question(inc, inv, response, n);
-  else if (chatbot_is_reset(inv[0]))
-    return chatbot_do_reset(inc, inv, response, n);
-  else if (chatbot_is_save(inv[0]))
-    return chatbot_do_save(inc, inv, response, n);
-  else {
+  /* time the intent, leaving out any time spent waiting for the user */
+  uint64_t started = metrics_clock();
+  uint64_t waited = metrics_local(METRIC_PROMPT_NS);
+  int intent, done;
+
+  /* look up the intent and invoke the corresponding do_* function; a word
+   * that is not built in may be a question word of the knowledge base */
+  const Intent *found = intent_find(inv[0]);
+  if (found != NULL) {
+    intent = found->metric;
+    done = found->handler(session, inc, inv, response, n);
+  } else if (intent_question(session->kb, inv[0]) >= 0) {
+    intent = METRIC_INTENT_QUESTION;
+    done = chatbot_do_question(session, inc, inv, response, n);
+  } else {
+    intent = METRIC_INTENT_OTHER;
     snprintf(response, n, "I don't understand \"%s\".", inv[0]);
-    return 0;
+    done = 0;
   }
+
+  waited = metrics_local(METRIC_PROMPT_NS) - waited;
+  metrics_intent(intent, metrics_clock() - started - waited);
+  return done;
 }
 
 /*
@@ -105,21 +207,26 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
  */
 int chatbot_is_exit(const char *intent) {
 
-  return compare_token(intent, "exit") == 0 ||
-         compare_token(intent, "quit") == 0;
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_exit;
 }
 
 /*
- * Perform the EXIT intent.
+ * Perform the EXIT intent. The knowledge base is erased, unless it is shared
+ * with other sessions.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
  *
  * Returns:
- *   0 (the chatbot always continues chatting after a question)
+ *   1 (the chatbot always stops chatting after EXIT)
  */
-int chatbot_do_exit(int inc, char *inv[], char *response, int n) {
-  knowledge_reset();
+int chatbot_do_exit(session_t *session, int inc, char *inv[], char *response,
+                    int n) {
+  TRACE_SPAN("chatbot_do_exit");
+  if (session->owns_kb) {
+    kb_close(session->kb);
+  }
   snprintf(response, n, "Goodbye!");
   return 1;
 }
@@ -135,7 +242,8 @@ int chatbot_do_exit(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_load(const char *intent) {
-  return compare_token(intent, "load") == 0;
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_load;
 }
 
 /*
@@ -147,7 +255,9 @@ int chatbot_is_load(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after loading knowledge)
  */
-int chatbot_do_load(int inc, char *inv[], char *response, int n) {
+int chatbot_do_load(session_t *session, int inc, char *inv[], char *response,
+                    int n) {
+  TRACE_SPAN("chatbot_do_load");
   int entity_count;
   if (inc > 1) {
     int filePosition = 1;
@@ -155,35 +265,46 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
         compare_token(inv[1], "as") == 0) {
       filePosition = 2;
     }
-    char fileStr[MAX_INPUT];
-    for (int i = 0; i < MAX_INPUT; i++) {
-      fileStr[i] = '\0';
-    }
-    for (int i = filePosition; i < inc; i++) {
-      if (i > filePosition) {
-        strcat(fileStr, " ");
+    const char *fileStr = join_words(inc, inv, filePosition);
+    if (watch_active()) {
+      // In watch mode, the file is watched too, and loading it again applies
+      // only what has changed
+      KBDelta delta;
+      entity_count = watch_file(session->kb, fileStr, &delta);
+      if (entity_count >= 0) {
+        snprintf(response, n,
+                 "I have %s %s into my system: %zu added, %zu changed, "
+                 "%zu removed. I will watch it for changes.",
+                 inv[0], fileStr, delta.added, delta.changed, delta.removed);
+        return 0;
+      }
+      if (entity_count == KB_NOTFOUND) {
+        snprintf(response, n, "Can't open file. Please enter a correct file.");
+        return 0;
+      }
+    } else {
+      FILE *f;
+      f = fopen(fileStr, "r");
+      if (f == NULL) {
+        snprintf(response, n, "Can't open file. Please enter a correct file.");
+        return 0;
       }
-      strcat(fileStr, inv[i]);
-    }
-    FILE *f;
-    f = fopen(fileStr, "r");
-    if (f == NULL) {
-      snprintf(response, n, "Can't open file. Please enter a correct file.");
-      return 0;
-    }
 
-    entity_count = knowledge_read(f);
-    if(entity_count>0){
+      entity_count = kb_read(session->kb, f);
+      fclose(f);
+    }
+    if(entity_count>=0){
       snprintf(response, n,
              "I have read %d entities. I have %s %s into my system.",
              entity_count, inv[0], fileStr);
-    fclose(f);
-    return 0;
+    }
+    else if(entity_count==KB_INVALID){
+      snprintf(response, n, "%s is damaged or from another version.", fileStr);
     }
     else{
       snprintf(response, n, "Memory allocation error.");
     }
-    
+    return 0;
   } else {
     snprintf(response, n, "Please enter a file name after the load command!");
     return 0;
@@ -197,96 +318,271 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is "what", "where", or "who"
+ *  1, if the intent is a question word: "what", "where", "who", or the name
+ *     of a section of a knowledge file that has been loaded into the
+ *     default knowledge base
  *  0, otherwise
  */
 int chatbot_is_question(const char *intent) {
-  return compare_token(intent, "what") == 0 ||
-         compare_token(intent, "where") == 0 ||
-         compare_token(intent, "who") == 0;
+  return intent_question(knowledge_default(), intent) >= 0;
 }
 
 /*
- * Answer a question.
+ * Helper function to find the entity of a question.
  *
  * inv[0] contains the the question word.
  * inv[1] may contain "is" or "are"; if so, it is skipped.
+ * The next word may be "the"; if so, it is skipped too (but kept in the form
+ * of the entity used to ask the user for an answer).
  * The remainder of the words form the entity.
  *
- * See the comment at the top of the file for a description of how this
- * function is used.
+ * The words are joined in place (see join_words()), so the entity is a part
+ * of the input rather than a copy of it.
+ *
+ * Input:
+ *   inc       - the number of words in the question
+ *   inv       - an array of pointers to each word in the question, from
+ *               split_words()
+ *   entityStr - receives the entity
+ *   returnStr - receives the entity as it should be repeated back to the user
  *
  * Returns:
- *   0 (the chatbot always continues chatting after a question)
+ *   1, if the question has an entity
+ *   0, otherwise
  */
-int chatbot_do_question(int inc, char *inv[], char *response, int n) {
+static int question_entity(int inc, char *inv[], const char **entityStr,
+                           const char **returnStr) {
 
   int entityPosition = 1;
   if (inc <= 1) {
-    snprintf(response, n, "Please enter an entity.");
     return 0;
   }
-  if (inv[1]) {
-    if (compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0) {
-      entityPosition = 2;
-    }
+  if (compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0) {
+    entityPosition = 2;
   }
 
-  char entityStr[MAX_INPUT];
-  char returnStr[MAX_INPUT];
-  for (int i = 0; i < MAX_INPUT; i++) {
-    entityStr[i] = '\0';
-    returnStr[i] = '\0';
+  int thePosition = 0;
+  if (entityPosition + 1 < inc &&
+      compare_token(inv[entityPosition], "the") == 0) {
+    thePosition = entityPosition;
+    entityPosition++;
   }
 
+  if (inc <= entityPosition) {
+    return 0;
+  }
 
-  if (inv[entityPosition + 1] && inv[entityPosition]) {
-    if (compare_token(inv[entityPosition], "the") == 0) {
-      entityPosition++;
-    }
+  *returnStr = join_words(inc, inv, thePosition > 0 ? thePosition
+                                                    : entityPosition);
+  *entityStr = inv[entityPosition];
+  return 1;
+}
+
+/*
+ * Helper function to add an entity to a page of a listing, as kb_list()
+ * passes it on. Once one does not fit, the rest are left off too.
+ *
+ * Input:
+ *   entity - the entity
+ *   len    - the length of the entity
+ *   arg    - the ListPage
+ */
+
+static void list_entity(const char *entity, size_t len, void *arg) {
+  ListPage *page = arg;
+  size_t separator = page->shown > 0 ? 2 : 0;
+  if (page->full || page->used + separator + len > page->room) {
+    page->full = 1;
+    return;
   }
+  memcpy(page->text + page->used, ", ", separator);
+  memcpy(page->text + page->used + separator, entity, len);
+  page->used += separator + len;
+  page->text[page->used] = '\0';
+  page->shown++;
+}
 
-  if (inc <= entityPosition) {
-    snprintf(response, n, "Please enter an entity.");
+/*
+ * Helper function to list a page of the entities of a question word that
+ * start with a prefix, e.g. "what ICT10*: ICT1002, ICT1003 (1-2 of 2)."
+ *
+ * Input:
+ *   session  - the session
+ *   intent   - the question word
+ *   prefix   - the prefix ("" for every entity)
+ *   limit    - the number of entities on a page
+ *   page     - the page, from 1
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ */
+
+static void list_entities(session_t *session, const char *intent,
+                          const char *prefix, size_t limit, size_t page,
+                          char *response, int n) {
+  char subject[MAX_INTENT + MAX_ENTITY + 2];
+  snprintf(subject, sizeof(subject), "%s%s%s%s", intent,
+           prefix[0] == '\0' ? "" : " ", prefix, prefix[0] == '\0' ? "" : "*");
+
+  ListPage list;
+  size_t reserved = strlen(subject) + 64;
+  list.used = list.shown = 0;
+  list.full = 0;
+  list.text[0] = '\0';
+  list.room = (size_t)n > reserved ? (size_t)n - reserved : 0;
+
+  size_t skip = (page - 1) * limit;
+  size_t total = 0;
+  int result = kb_list(session->kb, intent, prefix, skip, limit, list_entity,
+                       &list, &total);
+  if (result == KB_NOMEM) {
+    snprintf(response, n, "Memory allocation error.");
+  } else if (result == KB_INVALID) {
+    snprintf(response, n, "I can't list the answers I keep on disk.");
+  } else if (total == 0) {
+    snprintf(response, n, "I don't know anything for %s.", subject);
+  } else if (list.shown == 0) {
+    snprintf(response, n, "I only know %zu for %s.", total, subject);
+  } else {
+    snprintf(response, n, "%s: %s (%zu-%zu of %zu).", subject, list.text,
+             skip + 1, skip + list.shown, total);
+  }
+}
+
+/*
+ * Helper function to tell whether the entity of a question is a prefix, e.g.
+ * "ICT10*".
+ *
+ * Input:
+ *   entity - the entity
+ *   prefix - a buffer of MAX_ENTITY characters to receive the prefix
+ *
+ * Returns:
+ *   1, if the entity is a prefix (which is copied to the buffer)
+ *   0, otherwise
+ */
+
+static int question_prefix(const char *entity, char *prefix) {
+  size_t len = strlen(entity);
+  if (len < 2 || len > MAX_ENTITY || entity[len - 1] != '*') {
     return 0;
   }
+  memcpy(prefix, entity, len - 1);
+  prefix[len - 1] = '\0';
+  return 1;
+}
 
+/*
+ * Answer a question from the knowledge base, without asking the user
+ * anything. This only reads the session, so several threads may answer
+ * questions in the same session at once (e.g. in batch mode).
+ *
+ * See the comment at the top of the file for a description of the
+ * parameters.
+ *
+ * Returns:
+ *   KB_OK, if the answer was written to the response buffer (or, for an
+ *          entity ending in '*', the entities that start with it)
+ *   KB_NOTFOUND, if the answer is not known ("I don't know..." is written)
+ *   KB_INVALID, if the question has no entity ("Please enter..." is written)
+ */
+int chatbot_answer(session_t *session, int inc, char *inv[], char *response,
+                   int n) {
 
-  for (int i = entityPosition; i < inc; i++) {
-    if (i > entityPosition) {
-      strcat(entityStr, " ");
-    }
-    strcat(entityStr, inv[i]);
+  const char *entityStr, *returnStr;
+  if (!question_entity(inc, inv, &entityStr, &returnStr)) {
+    snprintf(response, n, "Please enter an entity.");
+    return KB_INVALID;
+  }
+  char prefix[MAX_ENTITY];
+  if (kb_get(session->kb, inv[0], entityStr, response, n) == KB_OK) {
+    metrics_add(METRIC_HITS, 1);
+    return KB_OK;
+  }
+  if (question_prefix(entityStr, prefix)) {
+    list_entities(session, inv[0], prefix, LIST_PAGE, 1, response, n);
+    return KB_OK;
   }
+  metrics_add(METRIC_MISSES, 1);
+  snprintf(response, n, "I don't know. %s is %s?", inv[0], returnStr);
+  return KB_NOTFOUND;
+}
 
-  if (compare_token(inv[entityPosition], "the") == 0) {
-       for (int i = entityPosition-1; i < inc; i++) {
-          if (i > entityPosition-1) {
-            strcat(returnStr, " ");
-          }
-          strcat(returnStr, inv[i]);
-        }
-    
-  }else{
-    strcpy(returnStr,entityStr);
+/*
+ * Answer a question. If the answer is not known, offer the answer for the
+ * nearest known entity (see kb_suggest()), in case the user made a typo;
+ * otherwise (always, for a knowledge base kept in a disk store), or if the
+ * user says that is not what they meant, ask the user for the answer and add
+ * it to the knowledge base. A question about an
+ * unknown entity ending in '*', e.g. "what is ICT10*", lists the entities
+ * that start with it instead, as LIST does.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after a question)
+ */
+int chatbot_do_question(session_t *session, int inc, char *inv[],
+                        char *response, int n) {
+  TRACE_SPAN("chatbot_do_question");
+
+  const char *entityStr, *returnStr;
+  if (!question_entity(inc, inv, &entityStr, &returnStr)) {
+    snprintf(response, n, "Please enter an entity.");
+    return 0;
   }
-  
 
-  if (knowledge_get(inv[0], entityStr, response, n) == 0) {
-    knowledge_get(inv[0], entityStr, response, n);
+  char prefix[MAX_ENTITY];
+  if (kb_get(session->kb, inv[0], entityStr, response, n) == KB_OK) {
+    metrics_add(METRIC_HITS, 1);
+  } else if (question_prefix(entityStr, prefix)) {
+    list_entities(session, inv[0], prefix, LIST_PAGE, 1, response, n);
   } else {
+    metrics_add(METRIC_MISSES, 1);
     char answer[MAX_INPUT];
-    prompt_user(answer, n, "I don't know. %s is %s?", inv[0], returnStr);
-    if (answer[0] == '\0') {
-      do {
-        prompt_user(answer, n, "Please enter something.");
-      } while (answer[0] == '\0');
+    char suggestion[MAX_ENTITY];
+    if (kb_suggest(session->kb, inv[0], entityStr, suggestion,
+                   MAX_ENTITY) == KB_OK) {
+      int answered = session_prompt(session, answer, sizeof(answer),
+                                    "Did you mean %s is %s? (yes/no)", inv[0],
+                                    suggestion);
+      if (!answered) {
+        snprintf(response, n, "Goodbye!");
+        return 0;
+      }
+      if ((compare_token(answer, "yes") == 0 ||
+           compare_token(answer, "y") == 0) &&
+          kb_get(session->kb, inv[0], suggestion, response, n) == KB_OK) {
+        metrics_add(METRIC_SUGGESTED, 1);
+        return 0;
+      }
+    }
+    int answered = session_prompt(session, answer, sizeof(answer),
+                                  "I don't know. %s is %s?", inv[0], returnStr);
+    while (answered && answer[0] == '\0') {
+      answered = session_prompt(session, answer, sizeof(answer),
+                                "Please enter something.");
+    }
+    if (!answered) {
+      /* the user has gone; there is nothing to learn */
+      snprintf(response, n, "Goodbye!");
+      return 0;
     }
-    int success=knowledge_put(inv[0], entityStr, answer);
-    if(success==-3){
+    int success=kb_put(session->kb, inv[0], entityStr, answer);
+    if(success==KB_NOMEM){
       snprintf(response, n, "Memory allocation error.");
     }
-    else if(success==0){
+    else if(success==KB_INVALID){
+      snprintf(response, n, "I can't learn answers to '%s' questions.",
+               inv[0]);
+    }
+    else if(success==KB_IOERROR){
+      /* the answer is known until exit, but may be lost then */
+      metrics_add(METRIC_TAUGHT, 1);
+      snprintf(response, n, "I learned that, but could not save it.");
+    }
+    else if(success==KB_OK){
+      metrics_add(METRIC_TAUGHT, 1);
       snprintf(response, n, "Thank you.");
     }
   }
@@ -304,7 +600,8 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
  *  0, otherwise
  */
 int chatbot_is_reset(const char *intent) {
-  return compare_token(intent, "reset") == 0;
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_reset;
 }
 
 /*
@@ -316,8 +613,10 @@ int chatbot_is_reset(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after beign reset)
  */
-int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
-  knowledge_reset();
+int chatbot_do_reset(session_t *session, int inc, char *inv[], char *response,
+                     int n) {
+  TRACE_SPAN("chatbot_do_reset");
+  kb_reset(session->kb);
   snprintf(response, n, "Chatbot Reset.");
   return 0;
 }
@@ -329,15 +628,18 @@ int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is "what", "where", or "who"
+ *  1, if the intent is "save"
  *  0, otherwise
  */
 int chatbot_is_save(const char *intent) {
-  return compare_token(intent, "save") == 0;
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_save;
 }
 
 /*
- * Save the chatbot's knowledge to a file.
+ * Save the chatbot's knowledge to a file, in the background (see saver.c):
+ * the chatbot answers as soon as the file has been created and what it knows
+ * now has been set aside to be written, and STATUS tells when it is done.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -345,36 +647,534 @@ int chatbot_is_save(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after saving knowledge)
  */
-int chatbot_do_save(int inc, char *inv[], char *response, int n) {
+int chatbot_do_save(session_t *session, int inc, char *inv[], char *response,
+                    int n) {
+  TRACE_SPAN("chatbot_do_save");
   if (inc > 1) {
     int filePosition = 1;
     if (compare_token(inv[1], "to") == 0 || compare_token(inv[1], "as") == 0) {
       filePosition = 2;
     }
-    char fileStr[MAX_INPUT];
-    for (int i = 0; i < MAX_INPUT; i++) {
-      fileStr[i] = '\0';
+    const char *fileStr = join_words(inc, inv, filePosition);
+
+#ifdef _WIN32
+    /* the file may be one we loaded, whose contents we still point into */
+    if (kb_detach(session->kb, fileStr) != KB_OK) {
+      snprintf(response, n, "Memory allocation error.");
+      return 0;
     }
+#endif
 
-    for (int i = filePosition; i < inc; i++) {
-      if (i > filePosition) {
-        strcat(fileStr, " ");
-      }
-      strcat(fileStr, inv[i]);
+    /* the file is replaced only once the new one is complete */
+    int result = saver_start(session->kb, fileStr);
+    if (result == KB_NOMEM) {
+      snprintf(response, n, "Memory allocation error.");
+    } else if (result == KB_INVALID) {
+      snprintf(response, n,
+               "I am still saving my knowledge. Ask me for my status.");
+    } else if (result != KB_OK) {
+      snprintf(response, n, "I can't write to that file.");
+    } else {
+      snprintf(response, n,
+               "I am saving my knowledge to %s. Ask me for my status to see "
+               "when it is done.",
+               fileStr);
     }
+    return 0;
+  } else {
+    snprintf(response, n, "Please enter a file name after the save command!");
+    return 0;
+  }
+}
+/*
+ * Determine whether an intent is COMPILE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "compile"
+ *  0, otherwise
+ */
+int chatbot_is_compile(const char *intent) {
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_compile;
+}
 
-    FILE *f; 
-    f = fopen(fileStr, "w");
-    if (f == NULL) {
+/*
+ * Save the chatbot's knowledge to a file in the compiled (binary) format,
+ * which can be loaded again without being parsed.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after compiling knowledge)
+ */
+int chatbot_do_compile(session_t *session, int inc, char *inv[],
+                       char *response, int n) {
+  TRACE_SPAN("chatbot_do_compile");
+  if (inc > 1) {
+    int filePosition = 1;
+    if (compare_token(inv[1], "to") == 0 || compare_token(inv[1], "as") == 0) {
+      filePosition = 2;
+    }
+    const char *fileStr = join_words(inc, inv, filePosition);
+
+#ifdef _WIN32
+    /* the file may be one we loaded, whose contents we still point into */
+    if (kb_detach(session->kb, fileStr) != KB_OK) {
+      snprintf(response, n, "Memory allocation error.");
+      return 0;
+    }
+#endif
+
+    /* the file is replaced only once the new one is complete */
+    SaveFile file;
+    int result = savefile_open(&file, fileStr);
+    if (result == KB_IOERROR) {
       snprintf(response, n, "I can't write to that file.");
       return 0;
     }
-    knowledge_write(f);
-    fclose(f);
-    snprintf(response, n, "My knowledge has been saved to %s.", fileStr);
+    if (result == KB_OK) {
+      result = kb_compile(session->kb, file.f);
+      if (result == KB_OK) {
+        result = savefile_commit(&file);
+      } else {
+        savefile_abort(&file);
+      }
+    }
+    if (result == KB_NOMEM) {
+      snprintf(response, n, "Memory allocation error.");
+    } else if (result == KB_INVALID) {
+      snprintf(response, n,
+               "My knowledge is kept on disk already compiled. Save it "
+               "instead.");
+    } else if (result != KB_OK) {
+      snprintf(response, n, "I couldn't finish writing %s.", fileStr);
+    } else {
+      snprintf(response, n, "My knowledge has been compiled to %s.", fileStr);
+    }
     return 0;
   } else {
-    snprintf(response, n, "Please enter a file name after the save command!");
+    snprintf(response, n,
+             "Please enter a file name after the compile command!");
     return 0;
   }
-}
\ No newline at end of file
+}
+
+/*
+ * Determine whether an intent is STATS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "stats"
+ *  0, otherwise
+ */
+int chatbot_is_stats(const char *intent) {
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_stats;
+}
+
+/*
+ * Helper function to write a number of nanoseconds in the most readable unit.
+ *
+ * Input:
+ *   ns  - the number of nanoseconds (UINT64_MAX for "a very long time")
+ *   buf - a buffer for the result
+ *   n   - the size of the buffer
+ *
+ * Returns:
+ *   buf
+ */
+
+static const char *format_ns(uint64_t ns, char *buf, int n) {
+  if (ns == UINT64_MAX) {
+    snprintf(buf, n, "over %.0f s",
+             ((uint64_t)256 << (METRICS_BUCKETS - 2)) * 1e-9);
+  } else if (ns < 10000) {
+    snprintf(buf, n, "%llu ns", (unsigned long long)ns);
+  } else if (ns < 10000000) {
+    snprintf(buf, n, "%.1f us", ns / 1e3);
+  } else if (ns < 10000000000ULL) {
+    snprintf(buf, n, "%.1f ms", ns / 1e6);
+  } else {
+    snprintf(buf, n, "%.1f s", ns / 1e9);
+  }
+  return buf;
+}
+
+/*
+ * Helper function to format a number of bytes for the user, e.g. "1.5 MB".
+ *
+ * Input:
+ *   bytes - the number of bytes
+ *   buf   - a buffer to receive the text
+ *   n     - the size of the buffer
+ *
+ * Returns:
+ *   buf
+ */
+
+static const char *format_bytes(uint64_t bytes, char *buf, int n) {
+  if (bytes < 10000) {
+    snprintf(buf, n, "%llu bytes", (unsigned long long)bytes);
+  } else if (bytes < 10000000) {
+    snprintf(buf, n, "%.1f KB", bytes / 1024.0);
+  } else if (bytes < 10000000000ULL) {
+    snprintf(buf, n, "%.1f MB", bytes / 1048576.0);
+  } else {
+    snprintf(buf, n, "%.1f GB", bytes / 1073741824.0);
+  }
+  return buf;
+}
+
+/*
+ * Helper function to report how much memory the responses of the knowledge
+ * base take, against its budget (see kb_set_budget()), and how many answers
+ * came from memory rather than the spill file.
+ *
+ * Input:
+ *   session  - the session
+ *   metrics  - the runtime metrics
+ *   response - a buffer to receive the report
+ *   n        - the size of the buffer
+ */
+
+static void report_memory(session_t *session, const Metrics *metrics,
+                          char *response, int n) {
+  KBMemory memory;
+  char budget[32], resident[32], spilled[32];
+  kb_memory(session->kb, &memory);
+  uint64_t hits = metrics->counters[METRIC_HITS];
+  uint64_t spill_reads = metrics->counters[METRIC_SPILL_READS];
+  double in_memory = hits == 0 || spill_reads > hits
+                         ? 100
+                         : 100.0 * (hits - spill_reads) / hits;
+  snprintf(response, n,
+           "My answers take %s of memory (budget %s); %s have been moved to "
+           "disk in %llu evictions, and %.1f%% of my answers came from "
+           "memory.",
+           format_bytes(memory.resident, resident, 32),
+           memory.budget == 0 ? "unlimited"
+                              : format_bytes(memory.budget, budget, 32),
+           format_bytes(memory.spilled, spilled, 32),
+           (unsigned long long)metrics->counters[METRIC_EVICTED], in_memory);
+}
+
+/*
+ * Helper function to report the size of the disk store the knowledge base is
+ * kept in (see store.c), and how many runs lookups have had to read.
+ *
+ * Input:
+ *   session  - the session
+ *   metrics  - the runtime metrics
+ *   response - a buffer to receive the report
+ *   n        - the size of the buffer
+ */
+
+static void report_store(session_t *session, const Metrics *metrics,
+                         char *response, int n) {
+  KBStoreStats stats;
+  char bytes[32];
+  if (kb_store_stats(session->kb, &stats) != KB_OK) {
+    snprintf(response, n, "My knowledge is kept in memory.");
+    return;
+  }
+  snprintf(response, n,
+           "My knowledge on disk is %zu runs of %llu entries in %s, written "
+           "%llu times and merged %llu times; questions have read %llu runs "
+           "and skipped %llu.",
+           stats.runs, (unsigned long long)stats.entries,
+           format_bytes(stats.bytes, bytes, 32),
+           (unsigned long long)metrics->counters[METRIC_STORE_FLUSHES],
+           (unsigned long long)metrics->counters[METRIC_STORE_COMPACTIONS],
+           (unsigned long long)metrics->counters[METRIC_RUN_PROBES],
+           (unsigned long long)metrics->counters[METRIC_BLOOM_SKIPS]);
+}
+
+/*
+ * Helper function to report how much memory the packed knowledge base takes
+ * (see kb_pack()), against what its entries took before they were packed.
+ *
+ * Input:
+ *   session  - the session
+ *   response - a buffer to receive the report
+ *   n        - the size of the buffer
+ */
+
+static void report_pack(session_t *session, char *response, int n) {
+  KBPackStats stats;
+  char bytes[32], raw[32];
+  if (kb_pack_stats(session->kb, &stats) != KB_OK) {
+    snprintf(response, n, "My knowledge is not packed.");
+    return;
+  }
+  snprintf(response, n,
+           "My packed knowledge is %llu entries in %s, from %s of entities "
+           "and responses (a compression ratio of %.1f).",
+           (unsigned long long)stats.entries,
+           format_bytes(stats.bytes, bytes, 32),
+           format_bytes(stats.raw_bytes, raw, 32),
+           stats.bytes == 0 ? 1.0 : (double)stats.raw_bytes / stats.bytes);
+}
+
+/*
+ * Report the chatbot's runtime metrics (see metrics.c): how many questions it
+ * has answered and how quickly, and how much it has loaded and saved. With an
+ * intent after STATS (e.g. "stats save"), report on that intent instead, with
+ * "stats memory", on the memory taken by the answers, with "stats store", on
+ * the disk store, and with "stats pack", on the packed knowledge base.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_stats(session_t *session, int inc, char *inv[], char *response,
+                     int n) {
+  TRACE_SPAN("chatbot_do_stats");
+  Metrics metrics;
+  char p50[32], p99[32], p999[32], load[32], save[32];
+  metrics_read(&metrics);
+
+  if (inc > 1 && compare_token(inv[1], "memory") == 0) {
+    report_memory(session, &metrics, response, n);
+    return 0;
+  } else if (inc > 1 && compare_token(inv[1], "store") == 0) {
+    report_store(session, &metrics, response, n);
+    return 0;
+  } else if (inc > 1 && compare_token(inv[1], "pack") == 0) {
+    report_pack(session, response, n);
+    return 0;
+  } else if (inc > 1) {
+    int intent = metrics_find_intent(inv[1]);
+    if (intent < 0 && intent_question(session->kb, inv[1]) >= 0) {
+      intent = METRIC_INTENT_QUESTION;
+    }
+    if (intent < 0) {
+      snprintf(response, n, "I don't keep statistics for \"%s\".", inv[1]);
+      return 0;
+    }
+    snprintf(response, n, "%s: %llu requests, p50 %s, p99 %s, p99.9 %s.",
+             metrics_intent_name(intent),
+             (unsigned long long)metrics.requests[intent],
+             format_ns(metrics_percentile(&metrics, intent, 0.5), p50, 32),
+             format_ns(metrics_percentile(&metrics, intent, 0.99), p99, 32),
+             format_ns(metrics_percentile(&metrics, intent, 0.999), p999, 32));
+    return 0;
+  }
+
+  int q = METRIC_INTENT_QUESTION;
+  snprintf(response, n,
+           "I have answered %llu of %llu questions (p50 %s, p99 %s) and "
+           "learned %llu answers. I have loaded %llu entities in %s and saved "
+           "%llu bytes in %s.",
+           (unsigned long long)metrics.counters[METRIC_HITS],
+           (unsigned long long)(metrics.counters[METRIC_HITS] +
+                                metrics.counters[METRIC_MISSES]),
+           format_ns(metrics_percentile(&metrics, q, 0.5), p50, 32),
+           format_ns(metrics_percentile(&metrics, q, 0.99), p99, 32),
+           (unsigned long long)metrics.counters[METRIC_TAUGHT],
+           (unsigned long long)metrics.counters[METRIC_LOADED],
+           format_ns(metrics.counters[METRIC_LOAD_NS], load, 32),
+           (unsigned long long)metrics.counters[METRIC_SAVED_BYTES],
+           format_ns(metrics.counters[METRIC_SAVE_NS], save, 32));
+  return 0;
+}
+
+/*
+ * Determine whether an intent is STATUS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "status"
+ *  0, otherwise
+ */
+int chatbot_is_status(const char *intent) {
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_status;
+}
+
+/*
+ * Report on the last save started by SAVE, which runs in the background.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting its status)
+ */
+int chatbot_do_status(session_t *session, int inc, char *inv[],
+                      char *response, int n) {
+  TRACE_SPAN("chatbot_do_status");
+  KBSaveStatus status;
+  char elapsed[32];
+  if (saver_status(session->kb, &status) != KB_OK) {
+    snprintf(response, n, "I haven't saved my knowledge yet.");
+    return 0;
+  }
+
+  format_ns(status.elapsed_ns, elapsed, 32);
+  if (status.state == KB_SAVE_RUNNING) {
+    snprintf(response, n, "I have been saving my knowledge to %s for %s.",
+             status.path, elapsed);
+  } else if (status.result == KB_OK) {
+    snprintf(response, n,
+             "My knowledge has been saved to %s (%llu bytes in %s).",
+             status.path, (unsigned long long)status.bytes, elapsed);
+  } else if (status.result == KB_NOMEM) {
+    snprintf(response, n, "I couldn't save my knowledge to %s: memory "
+             "allocation error.", status.path);
+  } else {
+    snprintf(response, n, "I couldn't save my knowledge to %s: I can't write "
+             "to that file.", status.path);
+  }
+  return 0;
+}
+
+/*
+ * Determine whether an intent is LIST.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "list"
+ *  0, otherwise
+ */
+int chatbot_is_list(const char *intent) {
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_list;
+}
+
+/*
+ * List the entities the chatbot knows for a question word, in order, a page
+ * at a time: "list <question word> [prefix] [limit] [page]", e.g.
+ * "list what ICT10 5 2" for the sixth to tenth entities starting with
+ * "ICT10". A number is taken as the limit (10 by default), then the page (1
+ * by default); to list entities starting with a number, end it with '*'.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after listing)
+ */
+int chatbot_do_list(session_t *session, int inc, char *inv[], char *response,
+                    int n) {
+  TRACE_SPAN("chatbot_do_list");
+  if (inc < 2 || intent_question(session->kb, inv[1]) < 0) {
+    snprintf(response, n, "Please enter a question word after list.");
+    return 0;
+  }
+
+  const char *prefix = "";
+  size_t numbers[2] = {LIST_PAGE, 1};
+  size_t maximum[2] = {LIST_MAX_LIMIT, LIST_MAX_PAGE};
+  int given = 0;
+  for (int i = 2; i < inc; i++) {
+    size_t len = strlen(inv[i]);
+    if (len > 0 && len < 10 && strspn(inv[i], "0123456789") == len &&
+        given < 2) {
+      size_t number = strtoul(inv[i], NULL, 10);
+      if (number == 0 || number > maximum[given]) {
+        snprintf(response, n, "Please enter a %s from 1 to %zu.",
+                 given == 0 ? "limit" : "page", maximum[given]);
+        return 0;
+      }
+      numbers[given++] = number;
+    } else {
+      if (len > 0 && inv[i][len - 1] == '*') {
+        inv[i][len - 1] = '\0';
+      }
+      prefix = inv[i];
+    }
+  }
+
+  list_entities(session, inv[1], prefix, numbers[0], numbers[1], response, n);
+  return 0;
+}
+
+/*
+ * Determine whether an intent is SEARCH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "search"
+ *  0, otherwise
+ */
+int chatbot_is_search(const char *intent) {
+  const Intent *found = intent_find(intent);
+  return found != NULL && found->handler == chatbot_do_search;
+}
+
+/*
+ * Find answers by the words of their responses: "search <words>", e.g.
+ * "search teaches Python". The best answer is given in full, followed by the
+ * questions of the next best, as room allows, e.g.
+ * "who Alan: Teaches Python. Also: who Bob, what ICT1002 (3 found)."
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after searching)
+ */
+int chatbot_do_search(session_t *session, int inc, char *inv[], char *response,
+                      int n) {
+  TRACE_SPAN("chatbot_do_search");
+  if (inc < 2) {
+    snprintf(response, n, "Please enter some words after search.");
+    return 0;
+  }
+
+  const char *query = join_words(inc, inv, 1);
+  KBSearchHit hits[SEARCH_HITS];
+  size_t matches = 0;
+  int found = kb_search(session->kb, query, hits, SEARCH_HITS, &matches);
+  if (found == KB_NOMEM) {
+    snprintf(response, n, "Memory allocation error.");
+    return 0;
+  }
+  if (found == KB_INVALID) {
+    snprintf(response, n, "I can't search the answers I keep on disk.");
+    return 0;
+  }
+  if (found == 0) {
+    snprintf(response, n, "I don't know anything about \"%s\".", query);
+    return 0;
+  }
+
+  // Leave room for the count at the end, cutting the best answer short if
+  // need be
+  char count[32];
+  int count_len = snprintf(count, sizeof(count), " (%zu found).", matches);
+  int room = n > count_len ? n - count_len : 1;
+  int used = snprintf(response, room, "%s %s: %s", hits[0].intent,
+                      hits[0].entity, hits[0].response);
+  if (used >= room) {
+    used = room - 1;
+  }
+  int ended = used > 0 && strchr(".!?", response[used - 1]) != NULL;
+  for (int h = 1; h < found; h++) {
+    char more[MAX_INTENT + MAX_ENTITY + 16];
+    int len = snprintf(more, sizeof(more), "%s %s %s",
+                       h > 1 ? "," : ended ? " Also:" : ". Also:",
+                       hits[h].intent, hits[h].entity);
+    if (used + len >= room) {
+      break;
+    }
+    memcpy(response + used, more, len + 1);
+    used += len;
+  }
+  snprintf(response + used, n - used, "%s", count);
+  return 0;
+}
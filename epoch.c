@@ -0,0 +1,246 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements epoch-based reclamation, which lets threads look up
+ * answers in a knowledge base without taking any locks while other threads
+ * change it.
+ *
+ * A reader brackets each lookup with epoch_enter() and epoch_leave(), and in
+ * between announces the epoch in which it entered. A writer never frees
+ * memory that a reader might be using: it first unlinks the memory, so that
+ * no reader entering from then on can find it, and then passes it to
+ * epoch_retire(), which notes the epoch and moves the epoch on. The memory is
+ * freed once every reader is either outside or entered in a later epoch.
+ * Readers never wait for anything; a writer only waits for readers if it
+ * calls epoch_synchronize() (or if there is no memory to note what it
+ * retired).
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Type definition for the announcement of a thread that looks things up */
+typedef struct epoch_reader {
+  _Atomic uint64_t epoch;    /* the epoch entered in, or 0 if outside */
+  atomic_int in_use;         /* 1 while a thread owns the record */
+  struct epoch_reader *next; /* the next record in epoch_readers */
+} EpochReader;
+
+/* Type definition for memory waiting to be freed */
+typedef struct epoch_retired {
+  void (*fn)(void *ptr);       /* the function to free it with */
+  void *ptr;                   /* the memory */
+  uint64_t epoch;              /* the epoch in which it was retired */
+  struct epoch_retired *next;  /* the memory retired next after it */
+} EpochRetired;
+
+/* the current epoch (0 means "outside", so it starts at 1) */
+static _Atomic uint64_t epoch_current = 1;
+
+/* every reader record made so far; records are reused, but never freed */
+static EpochReader *_Atomic epoch_readers;
+
+/* the memory waiting to be freed, oldest first (so in order of epoch), and
+ * the lock protecting the list */
+static EpochRetired *epoch_retired;
+static EpochRetired **epoch_retired_tail = &epoch_retired;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the current thread's record, and how many times it has entered */
+static _Thread_local EpochReader *epoch_self;
+static _Thread_local int epoch_depth;
+
+/* the key whose destructor gives up a thread's record when it ends */
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Helper function (the destructor of epoch_key) to give up the record of a
+ * thread that has ended, so that another thread can use it.
+ *
+ * Input:
+ *   arg - the record
+ */
+
+static void epoch_release(void *arg) {
+  EpochReader *reader = arg;
+  atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+  atomic_store_explicit(&reader->in_use, 0, memory_order_release);
+}
+
+/*
+ * Helper function to create epoch_key, once.
+ */
+
+static void epoch_make_key() { pthread_key_create(&epoch_key, epoch_release); }
+
+/*
+ * Helper function to find a record for the current thread: one given up by a
+ * thread that has ended, or else a new one.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the record
+ */
+
+static EpochReader *epoch_register() {
+  pthread_once(&epoch_key_once, epoch_make_key);
+
+  EpochReader *reader;
+  for (reader = atomic_load(&epoch_readers); reader != NULL;
+       reader = reader->next) {
+    int unused = 0;
+    if (atomic_load_explicit(&reader->in_use, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_strong(&reader->in_use, &unused, 1)) {
+      break;
+    }
+  }
+
+  if (reader == NULL) {
+    reader = calloc(1, sizeof(EpochReader));
+    if (reader == NULL) {
+      return NULL;
+    }
+    atomic_init(&reader->in_use, 1);
+    EpochReader *head = atomic_load(&epoch_readers);
+    do {
+      reader->next = head;
+    } while (!atomic_compare_exchange_weak(&epoch_readers, &head, reader));
+  }
+  pthread_setspecific(epoch_key, reader);
+  return reader;
+}
+
+/*
+ * Enter a read-side critical section. Memory found by following pointers
+ * published by writers stays valid until the matching epoch_leave(). Entries
+ * may be nested.
+ *
+ * Returns:
+ *   0, if successful
+ *   -1, if there was a memory allocation failure (the thread has not entered)
+ */
+int epoch_enter() {
+  if (epoch_depth > 0) {
+    epoch_depth++;
+    return 0;
+  }
+  if (epoch_self == NULL && (epoch_self = epoch_register()) == NULL) {
+    return -1;
+  }
+
+  // Announce the epoch before reading anything; the fence pairs with the one
+  // in epoch_oldest(), so a writer either sees the announcement or this
+  // thread sees what the writer unlinked
+  uint64_t epoch = atomic_load_explicit(&epoch_current, memory_order_acquire);
+  atomic_store_explicit(&epoch_self->epoch, epoch, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  epoch_depth = 1;
+  return 0;
+}
+
+/*
+ * Leave a read-side critical section entered with epoch_enter().
+ */
+void epoch_leave() {
+  if (--epoch_depth == 0) {
+    atomic_store_explicit(&epoch_self->epoch, 0, memory_order_release);
+  }
+}
+
+/*
+ * Helper function to find the oldest epoch any reader is in.
+ *
+ * Returns:
+ *   the oldest epoch, or UINT64_MAX if no reader is inside
+ */
+
+static uint64_t epoch_oldest() {
+  uint64_t oldest = UINT64_MAX;
+  atomic_thread_fence(memory_order_seq_cst);
+  for (EpochReader *reader = atomic_load(&epoch_readers); reader != NULL;
+       reader = reader->next) {
+    uint64_t epoch =
+        atomic_load_explicit(&reader->epoch, memory_order_acquire);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  return oldest;
+}
+
+/*
+ * Helper function to free the retired memory that no reader can be using.
+ * The list is in order of epoch, so only the memory freed is looked at, and
+ * retiring stays cheap however much is waiting for a long-running reader
+ * (e.g. a save in the background).
+ */
+
+static void epoch_reclaim() {
+  EpochRetired *done = NULL;
+
+  pthread_mutex_lock(&epoch_lock);
+  uint64_t oldest = epoch_oldest();
+  if (epoch_retired != NULL && epoch_retired->epoch < oldest) {
+    done = epoch_retired;
+    EpochRetired *last = done;
+    while (last->next != NULL && last->next->epoch < oldest) {
+      last = last->next;
+    }
+    epoch_retired = last->next;
+    last->next = NULL;
+    if (epoch_retired == NULL) {
+      epoch_retired_tail = &epoch_retired;
+    }
+  }
+  pthread_mutex_unlock(&epoch_lock);
+
+  while (done != NULL) {
+    EpochRetired *item = done;
+    done = item->next;
+    item->fn(item->ptr);
+    free(item);
+  }
+}
+
+/*
+ * Free memory once no reader can be using it. The memory must already be
+ * unreachable for readers that enter from now on.
+ *
+ * Input:
+ *   fn  - the function to free the memory with
+ *   ptr - the memory
+ */
+void epoch_retire(void (*fn)(void *ptr), void *ptr) {
+  EpochRetired *item = malloc(sizeof(EpochRetired));
+  if (item == NULL) {
+    epoch_synchronize();
+    fn(ptr);
+    return;
+  }
+  item->fn = fn;
+  item->ptr = ptr;
+
+  pthread_mutex_lock(&epoch_lock);
+  item->epoch = atomic_fetch_add(&epoch_current, 1);
+  item->next = NULL;
+  *epoch_retired_tail = item;
+  epoch_retired_tail = &item->next;
+  pthread_mutex_unlock(&epoch_lock);
+
+  epoch_reclaim();
+}
+
+/*
+ * Wait until every reader that might have seen memory unlinked before the call
+ * has left its critical section. This must not be called from inside one.
+ */
+void epoch_synchronize() {
+  uint64_t epoch = atomic_fetch_add(&epoch_current, 1);
+  while (epoch_oldest() <= epoch) {
+    sched_yield();
+  }
+}
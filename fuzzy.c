@@ -0,0 +1,376 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements approximate matching of entities, so that the chatbot
+ * can ask "did you mean ICT1002?" when the user asks about "ICT10002",
+ * instead of learning a second answer for the typo.
+ *
+ * Each section of a knowledge base can have a fuzzy index: a list of its
+ * entities, and an inverted index from each character trigram (three
+ * case-folded characters, with the entity padded by two nulls at each end) to
+ * the entities that contain it. An entity of length L has L + 2 trigrams, and
+ * one edit changes at most three of them, so an entity within k edits of the
+ * query shares at least two trigrams with any 3k + 2 of the query's trigrams.
+ * fuzzy_find() therefore reads only the postings of the query's 3k + 2 rarest
+ * trigrams, which stay short even with millions of entities, and checks each
+ * entity found in two of them with a bounded bit-parallel edit distance
+ * (Myers' algorithm; entities are shorter than 64 characters, so one word
+ * holds a column).
+ *
+ * A fuzzy index is built the first time it is needed (see kb_suggest() in
+ * knowledge.c), kept up to date as entities are added, and dropped when its
+ * entities might move. It is only used with the knowledge base's lock held,
+ * so it takes no locks of its own.
+ */
+
+#include "chat1002.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the shortest entity that is matched approximately; shorter ones are too
+ * close to everything */
+#define FUZZY_MIN_LEN 4
+
+/* entities at least this long may be two edits away, shorter ones one */
+#define FUZZY_TWO_EDITS 8
+
+/* the most entities a fuzzy index can hold: a posting keeps an entity's
+ * number above its length, which takes the low FUZZY_LEN_BITS bits */
+#define FUZZY_LEN_BITS 6
+#define FUZZY_MAX_ENTITIES ((size_t)1 << (32 - FUZZY_LEN_BITS))
+
+/* Type definition for the postings of a trigram */
+typedef struct fuzzy_gram {
+  uint32_t gram;      /* the trigram plus one; 0 for an empty slot */
+  uint32_t count;     /* the number of entities with the trigram */
+  uint32_t capacity;  /* the room in 'postings' */
+  uint32_t *postings; /* the entities with the trigram, in the order added,
+                         each as its number and length */
+} FuzzyGram;
+
+/* Type definition for a fuzzy index */
+struct kb_fuzzy {
+  const char **entities; /* the entities, by number */
+  size_t count;          /* the number of entities */
+  size_t capacity;       /* the room in 'entities' */
+  FuzzyGram *grams;      /* the trigrams, by hash (open addressing) */
+  size_t gram_count;     /* the number of trigrams */
+  size_t gram_capacity;  /* the number of slots (a power of two) */
+};
+
+/*
+ * Helper function to get the trigrams of a string, case-folded and padded
+ * with two nulls at each end.
+ *
+ * Input:
+ *   s     - the string (need not be null-terminated)
+ *   len   - the length of the string, less than MAX_ENTITY
+ *   grams - an array to receive the len + 2 trigrams
+ */
+
+static void fuzzy_trigrams(const char *s, size_t len, uint32_t *grams) {
+  unsigned char padded[MAX_ENTITY + 4];
+  padded[0] = padded[1] = 0;
+  for (size_t i = 0; i < len; i++) {
+    padded[i + 2] = (unsigned char)FOLD_CHAR(s[i]);
+  }
+  padded[len + 2] = padded[len + 3] = 0;
+  for (size_t i = 0; i < len + 2; i++) {
+    grams[i] = (uint32_t)padded[i] << 16 | (uint32_t)padded[i + 1] << 8 |
+               padded[i + 2];
+  }
+}
+
+/*
+ * Helper function to find a trigram's slot.
+ *
+ * Input:
+ *   fuzzy - the fuzzy index
+ *   gram  - the trigram
+ *
+ * Returns:
+ *   the slot holding the trigram, or the empty slot where it would go
+ */
+
+static FuzzyGram *fuzzy_slot(KBFuzzy *fuzzy, uint32_t gram) {
+  size_t mask = fuzzy->gram_capacity - 1;
+  size_t i = (size_t)(((gram + 1) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  while (fuzzy->grams[i].gram != 0 && fuzzy->grams[i].gram != gram + 1) {
+    i = (i + 1) & mask;
+  }
+  return &fuzzy->grams[i];
+}
+
+/*
+ * Helper function to double the number of trigram slots.
+ *
+ * Input:
+ *   fuzzy - the fuzzy index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int fuzzy_grow(KBFuzzy *fuzzy) {
+  FuzzyGram *old = fuzzy->grams;
+  size_t old_capacity = fuzzy->gram_capacity;
+  size_t capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+  FuzzyGram *grams = calloc(capacity, sizeof(FuzzyGram));
+  if (grams == NULL) {
+    return KB_NOMEM;
+  }
+
+  fuzzy->grams = grams;
+  fuzzy->gram_capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].gram != 0) {
+      *fuzzy_slot(fuzzy, old[i].gram - 1) = old[i];
+    }
+  }
+  free(old);
+  return KB_OK;
+}
+
+/*
+ * Helper function to work out the edit distance between the query and an
+ * entity, with Myers' bit-parallel algorithm, giving up once it must exceed a
+ * bound.
+ *
+ * Input:
+ *   peq  - for each character, the bits of the positions in the query where
+ *          it appears
+ *   m    - the length of the query, from 1 to 63
+ *   text - the entity
+ *   n    - the length of the entity
+ *   max  - the bound
+ *
+ * Returns:
+ *   the edit distance, or max + 1 if it is greater than max
+ */
+
+static int fuzzy_distance(const uint64_t *peq, size_t m, const char *text,
+                          size_t n, int max) {
+  uint64_t pv = ~(uint64_t)0, mv = 0, last = (uint64_t)1 << (m - 1);
+  int score = (int)m;
+  for (size_t j = 0; j < n; j++) {
+    uint64_t eq = peq[(unsigned char)FOLD_CHAR(text[j])];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    if (ph & last) {
+      score++;
+    } else if (mh & last) {
+      score--;
+    }
+    // The top row of the table counts up, so a one enters from the top
+    ph = (ph << 1) | 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    if (score - (int)(n - j - 1) > max) {
+      return max + 1; // the rest of the entity can't bring it back in reach
+    }
+  }
+  return score;
+}
+
+/*
+ * Create an empty fuzzy index.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the fuzzy index, to be freed with fuzzy_destroy()
+ */
+KBFuzzy *fuzzy_create() {
+  KBFuzzy *fuzzy = calloc(1, sizeof(KBFuzzy));
+  if (fuzzy == NULL) {
+    return NULL;
+  }
+  if (fuzzy_grow(fuzzy) != KB_OK) {
+    free(fuzzy);
+    return NULL;
+  }
+  return fuzzy;
+}
+
+/*
+ * Free a fuzzy index. The entities themselves belong to the knowledge base.
+ *
+ * Input:
+ *   fuzzy - the fuzzy index, or NULL
+ */
+void fuzzy_destroy(KBFuzzy *fuzzy) {
+  if (fuzzy == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < fuzzy->gram_capacity; i++) {
+    free(fuzzy->grams[i].postings);
+  }
+  free(fuzzy->grams);
+  free(fuzzy->entities);
+  free(fuzzy);
+}
+
+/*
+ * Add an entity to a fuzzy index. The entity is not copied, so it must stay
+ * where it is for as long as the index is used.
+ *
+ * Input:
+ *   fuzzy  - the fuzzy index
+ *   entity - the entity (need not be null-terminated)
+ *   len    - the length of the entity, less than MAX_ENTITY
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure, or the index is full
+ *             (the index may then be missing some of the entity's trigrams,
+ *             and should be dropped)
+ */
+int fuzzy_add(KBFuzzy *fuzzy, const char *entity, size_t len) {
+  if (fuzzy->count == fuzzy->capacity) {
+    size_t capacity = fuzzy->capacity == 0 ? 256 : fuzzy->capacity * 2;
+    const char **entities = realloc(fuzzy->entities,
+                                    capacity * sizeof(const char *));
+    if (entities == NULL || fuzzy->count == FUZZY_MAX_ENTITIES) {
+      fuzzy->entities = entities != NULL ? entities : fuzzy->entities;
+      return KB_NOMEM;
+    }
+    fuzzy->entities = entities;
+    fuzzy->capacity = capacity;
+  }
+  uint32_t id = (uint32_t)fuzzy->count++;
+  uint32_t posting = id << FUZZY_LEN_BITS | (uint32_t)len;
+  fuzzy->entities[id] = entity;
+
+  uint32_t grams[MAX_ENTITY + 2];
+  fuzzy_trigrams(entity, len, grams);
+  for (size_t i = 0; i < len + 2; i++) {
+    if (2 * (fuzzy->gram_count + 1) > fuzzy->gram_capacity &&
+        fuzzy_grow(fuzzy) != KB_OK) {
+      return KB_NOMEM;
+    }
+    FuzzyGram *slot = fuzzy_slot(fuzzy, grams[i]);
+    if (slot->gram == 0) {
+      slot->gram = grams[i] + 1;
+      fuzzy->gram_count++;
+    } else if (slot->postings[slot->count - 1] == posting) {
+      continue; // the trigram is in the entity more than once
+    }
+    if (slot->count == slot->capacity) {
+      uint32_t capacity = slot->capacity == 0 ? 4 : slot->capacity * 2;
+      uint32_t *postings = realloc(slot->postings,
+                                   capacity * sizeof(uint32_t));
+      if (postings == NULL) {
+        return KB_NOMEM;
+      }
+      slot->postings = postings;
+      slot->capacity = capacity;
+    }
+    slot->postings[slot->count++] = posting;
+  }
+  return KB_OK;
+}
+
+/*
+ * Find the entity nearest to a query: the one fewest edits (insertions,
+ * deletions and substitutions, ignoring case) away, and the earliest added of
+ * those. Queries shorter than eight characters may be one edit away, longer
+ * ones two; queries shorter than four characters are not matched.
+ *
+ * The postings of the rarest trigrams are merged (they are in the order the
+ * entities were added), counting the trigrams each entity shares with the
+ * query, and only entities that share enough of them, and are near enough in
+ * length, have their edit distance worked out.
+ *
+ * Input:
+ *   fuzzy  - the fuzzy index
+ *   query  - the query (need not be null-terminated)
+ *   len    - the length of the query
+ *   match  - receives the nearest entity (not null-terminated)
+ *   n      - receives the length of the nearest entity
+ *
+ * Returns:
+ *   the edit distance to the nearest entity, or -1 if none is near enough
+ */
+int fuzzy_find(KBFuzzy *fuzzy, const char *query, size_t len,
+               const char **match, size_t *n) {
+  if (len < FUZZY_MIN_LEN || len >= MAX_ENTITY) {
+    return -1;
+  }
+  int max = len < FUZZY_TWO_EDITS ? 1 : 2;
+
+  // Sort the trigrams' postings, rarest first
+  uint32_t grams[MAX_ENTITY + 2];
+  const FuzzyGram *lists[MAX_ENTITY + 2];
+  size_t gram_count = len + 2;
+  fuzzy_trigrams(query, len, grams);
+  for (size_t i = 0; i < gram_count; i++) {
+    const FuzzyGram *list = fuzzy_slot(fuzzy, grams[i]);
+    size_t j = i;
+    while (j > 0 && lists[j - 1]->count > list->count) {
+      lists[j] = lists[j - 1];
+      j--;
+    }
+    lists[j] = list;
+  }
+
+  // Any 3 * max + 1 trigrams include one that a near entity shares, so any
+  // 3 * max + 2 include two: reading one more list than is needed to find
+  // every near entity rules out most of the entities found, which share only
+  // one trigram with the query. (A query has at least 3 * max + 2 trigrams.)
+  size_t picked = 3 * max + 2;
+  size_t need = 2;
+  const uint32_t *next[MAX_ENTITY + 2], *end[MAX_ENTITY + 2];
+  for (size_t i = 0; i < picked; i++) {
+    next[i] = lists[i]->postings;
+    end[i] = lists[i]->postings + lists[i]->count;
+  }
+
+  uint64_t peq[256];
+  memset(peq, 0, sizeof(peq));
+  for (size_t i = 0; i < len; i++) {
+    peq[(unsigned char)FOLD_CHAR(query[i])] |= (uint64_t)1 << i;
+  }
+
+  int best = max + 1;
+  uint32_t best_posting = 0;
+  for (;;) {
+    uint32_t lowest = UINT32_MAX;
+    for (size_t i = 0; i < picked; i++) {
+      if (next[i] < end[i] && *next[i] < lowest) {
+        lowest = *next[i];
+      }
+    }
+    if (lowest == UINT32_MAX) {
+      break;
+    }
+    size_t shared = 0;
+    for (size_t i = 0; i < picked; i++) {
+      if (next[i] < end[i] && *next[i] == lowest) {
+        next[i]++;
+        shared++;
+      }
+    }
+
+    size_t entity_len = lowest & ((1u << FUZZY_LEN_BITS) - 1);
+    if (shared < need || entity_len + max < len || len + max < entity_len) {
+      continue;
+    }
+    int distance = fuzzy_distance(peq, len,
+                                  fuzzy->entities[lowest >> FUZZY_LEN_BITS],
+                                  entity_len, best - 1 < max ? best - 1 : max);
+    if (distance < best) {
+      best = distance;
+      best_posting = lowest;
+    }
+  }
+
+  if (best > max) {
+    return -1;
+  }
+  *match = fuzzy->entities[best_posting >> FUZZY_LEN_BITS];
+  *n = best_posting & ((1u << FUZZY_LEN_BITS) - 1);
+  return best;
+}
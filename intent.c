@@ -0,0 +1,382 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the registry of intents: the words the chatbot
+ * understands at the start of a line, each with the chatbot_do_*() function
+ * that carries it out (see chatbot.c).
+ *
+ * The commands (EXIT, LOAD, RESET, ...) are built in, as are the question
+ * words WHO, WHAT and WHERE, which every knowledge base has. Any other word
+ * can be made a question word of one knowledge base by intent_add_question(),
+ * which kb_read() does for the header of every [section] it finds, so a
+ * knowledge file can have as many sections as it likes. Each question word
+ * has a section number, which picks its section of the knowledge base (see
+ * find_section() in knowledge.c). A knowledge base's own question words are
+ * no one else's, and are forgotten when it is reset.
+ *
+ * Words are found by their case-folded hash in an open-addressing table, so
+ * finding an intent costs the same however many there are. The built-in
+ * table never changes once it is made. A knowledge base's table is only ever
+ * added to, with its lock held, and one is complete before it is put in the
+ * table, so lookups take no locks, even while a file being loaded in another
+ * thread is adding question words; a reset replaces the table, and the old
+ * one is freed once no lookup can still be reading it (see epoch.c).
+ */
+
+#include "chat1002.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the most intents there may be: the commands and every question word */
+#define INTENT_MAX (KB_MAX_SECTIONS + 16)
+
+/* the number of slots in the table of intents (a power of two, at least
+ * twice INTENT_MAX, so that probes stay short) */
+#define INTENT_SLOTS 256
+
+/* the built-in intents, added in this order; question words are numbered
+ * from 0 in the order they are added, so WHO, WHAT and WHERE come first */
+static const struct {
+  const char *name;
+  IntentHandler handler;
+  int metric;
+} intent_builtins[] = {
+    {"exit", chatbot_do_exit, METRIC_INTENT_EXIT},
+    {"quit", chatbot_do_exit, METRIC_INTENT_EXIT},
+    {"load", chatbot_do_load, METRIC_INTENT_LOAD},
+    {"who", chatbot_do_question, METRIC_INTENT_QUESTION},
+    {"what", chatbot_do_question, METRIC_INTENT_QUESTION},
+    {"where", chatbot_do_question, METRIC_INTENT_QUESTION},
+    {"reset", chatbot_do_reset, METRIC_INTENT_RESET},
+    {"save", chatbot_do_save, METRIC_INTENT_SAVE},
+    {"compile", chatbot_do_compile, METRIC_INTENT_COMPILE},
+    {"stats", chatbot_do_stats, METRIC_INTENT_STATS},
+    {"list", chatbot_do_list, METRIC_INTENT_LIST},
+    {"search", chatbot_do_search, METRIC_INTENT_SEARCH},
+    {"status", chatbot_do_status, METRIC_INTENT_STATUS},
+};
+
+/* Type definition for a table of intents */
+struct intent_table {
+  Intent list[INTENT_MAX];                   /* every intent added so far */
+  int count;                                 /* the number of them */
+  const Intent *_Atomic slots[INTENT_SLOTS]; /* the intents, by hash */
+  /* the question words, by section number */
+  const Intent *_Atomic questions[KB_MAX_SECTIONS];
+  atomic_int section_count;                  /* the number of them */
+};
+
+/* the built-in intents, made once */
+static IntentTable intent_builtin;
+static pthread_once_t intent_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Helper function to hash a word case-insensitively, as knowledge.c hashes
+ * entities.
+ *
+ * Input:
+ *   word - the word (need not be null-terminated)
+ *   len  - the length of the word
+ *
+ * Returns:
+ *   the hash of the word
+ */
+
+static uint64_t intent_hash(const char *word, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)FOLD_CHAR(word[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ * Helper function to find a word in a table of intents.
+ *
+ * Input:
+ *   table - the table
+ *   word  - the word (need not be null-terminated)
+ *   len   - the length of the word
+ *   hash  - the hash of the word
+ *
+ * Returns:
+ *   the index of the intent's slot, or of the empty slot where it would go
+ */
+
+static size_t intent_slot(const IntentTable *table, const char *word,
+                          size_t len, uint64_t hash) {
+  size_t mask = INTENT_SLOTS - 1;
+  size_t i = (size_t)hash & mask;
+  const Intent *intent;
+  while ((intent = atomic_load_explicit(&table->slots[i],
+                                        memory_order_acquire)) != NULL) {
+    if (intent->hash == hash && intent->len == len) {
+      size_t k = 0;
+      while (k < len && FOLD_CHAR(intent->name[k]) == FOLD_CHAR(word[k])) {
+        k++;
+      }
+      if (k == len) {
+        break;
+      }
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/*
+ * Helper function to find a word in a table of intents.
+ *
+ * Input:
+ *   table - the table
+ *   word  - the word (need not be null-terminated)
+ *   len   - the length of the word, less than MAX_INTENT
+ *
+ * Returns:
+ *   NULL, if the word is not in the table
+ *   A pointer to the intent
+ */
+
+static const Intent *intent_lookup(const IntentTable *table, const char *word,
+                                   size_t len) {
+  return atomic_load_explicit(
+      &table->slots[intent_slot(table, word, len, intent_hash(word, len))],
+      memory_order_acquire);
+}
+
+/*
+ * Helper function to add an intent to a table. Only one thread may add to a
+ * table at once.
+ *
+ * Input:
+ *   table   - the table
+ *   word    - the word (need not be null-terminated)
+ *   len     - the length of the word, less than MAX_INTENT
+ *   handler - the function that carries the intent out
+ *   metric  - the intent it is counted as by the metrics
+ *
+ * Returns:
+ *   NULL, if there is no room for another intent (or question word)
+ *   A pointer to the intent (the one already added, if the word was)
+ */
+
+static const Intent *intent_insert(IntentTable *table, const char *word,
+                                   size_t len, IntentHandler handler,
+                                   int metric) {
+  uint64_t hash = intent_hash(word, len);
+  size_t i = intent_slot(table, word, len, hash);
+  const Intent *found = atomic_load_explicit(&table->slots[i],
+                                             memory_order_relaxed);
+  if (found != NULL) {
+    return found;
+  }
+
+  int question = handler == chatbot_do_question;
+  int section = atomic_load_explicit(&table->section_count,
+                                     memory_order_relaxed);
+  if (table->count == INTENT_MAX ||
+      (question && section == KB_MAX_SECTIONS)) {
+    return NULL;
+  }
+
+  Intent *intent = &table->list[table->count++];
+  memcpy(intent->name, word, len);
+  intent->name[len] = '\0';
+  intent->len = len;
+  intent->hash = hash;
+  intent->handler = handler;
+  intent->metric = metric;
+  intent->section = question ? section : -1;
+
+  // Publish the intent only once it is complete
+  if (question) {
+    atomic_store_explicit(&table->questions[section], intent,
+                          memory_order_release);
+    atomic_store_explicit(&table->section_count, section + 1,
+                          memory_order_release);
+  }
+  atomic_store_explicit(&table->slots[i], intent, memory_order_release);
+  return intent;
+}
+
+/*
+ * Helper function to add the built-in intents, once.
+ */
+
+static void intent_init() {
+  for (size_t b = 0; b < sizeof(intent_builtins) / sizeof(intent_builtins[0]);
+       b++) {
+    intent_insert(&intent_builtin, intent_builtins[b].name,
+                  strlen(intent_builtins[b].name), intent_builtins[b].handler,
+                  intent_builtins[b].metric);
+  }
+}
+
+/*
+ * Find the built-in intent of a word: a command, or WHO, WHAT or WHERE. The
+ * question words of a knowledge base's own are found by intent_question().
+ *
+ * Input:
+ *   word - the word (in any case)
+ *
+ * Returns:
+ *   NULL, if the word is not a built-in intent
+ *   A pointer to the intent
+ */
+const Intent *intent_find(const char *word) {
+  pthread_once(&intent_once, intent_init);
+  size_t len = strnlen(word, MAX_INTENT);
+  if (len >= MAX_INTENT) {
+    return NULL;
+  }
+  return intent_lookup(&intent_builtin, word, len);
+}
+
+/*
+ * Find the section of a question word of a knowledge base: WHO, WHAT, WHERE,
+ * or one of its own (see intent_add_question()). No lock need be held.
+ *
+ * Input:
+ *   kb   - the knowledge base
+ *   word - the word (in any case)
+ *
+ * Returns:
+ *   the section number, or -1 if the word is not a question word of the
+ *   knowledge base
+ */
+int intent_question(kb_t *kb, const char *word) {
+  const Intent *found = intent_find(word);
+  if (found != NULL) {
+    return found->section;
+  }
+  size_t len = strnlen(word, MAX_INTENT);
+  if (len >= MAX_INTENT || epoch_enter() != 0) {
+    return -1;
+  }
+  int section = -1;
+  const IntentTable *table =
+      atomic_load_explicit(&kb->questions, memory_order_acquire);
+  if (table != NULL && (found = intent_lookup(table, word, len)) != NULL) {
+    section = found->section;
+  }
+  epoch_leave();
+  return section;
+}
+
+/*
+ * Make a word a question word of a knowledge base, e.g. for a [section] of a
+ * knowledge file. A question word must be one the user could ask with: a
+ * single word, which split_words() would not strip punctuation from. The
+ * knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb   - the knowledge base
+ *   word - the word (need not be null-terminated)
+ *   len  - the length of the word
+ *
+ * Returns:
+ *   the section number of the question word, or -1 if the word is a command,
+ *   cannot be asked with, the knowledge base already has KB_MAX_SECTIONS
+ *   question words, or there is memory allocation error
+ */
+int intent_add_question(kb_t *kb, const char *word, size_t len) {
+  pthread_once(&intent_once, intent_init);
+  if (len == 0 || len >= MAX_INTENT || ispunct((unsigned char)word[len - 1])) {
+    return -1;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (strchr(" ?\t\r\n", word[i]) != NULL) {
+      return -1;
+    }
+  }
+
+  const Intent *intent = intent_lookup(&intent_builtin, word, len);
+  if (intent != NULL) {
+    return intent->section;
+  }
+
+  // The knowledge base's own question words are numbered on from the
+  // built-in ones
+  IntentTable *table =
+      atomic_load_explicit(&kb->questions, memory_order_relaxed);
+  if (table == NULL) {
+    table = calloc(1, sizeof(IntentTable));
+    if (table == NULL) {
+      return -1;
+    }
+    int builtin = atomic_load_explicit(&intent_builtin.section_count,
+                                       memory_order_relaxed);
+    for (int s = 0; s < builtin; s++) {
+      atomic_init(&table->questions[s], intent_builtin.questions[s]);
+    }
+    atomic_init(&table->section_count, builtin);
+    atomic_store_explicit(&kb->questions, table, memory_order_release);
+  }
+  intent = intent_insert(table, word, len, chatbot_do_question,
+                         METRIC_INTENT_QUESTION);
+  return intent == NULL ? -1 : intent->section;
+}
+
+/*
+ * Forget the question words of a knowledge base's own, e.g. because it has
+ * been reset, so that only WHO, WHAT and WHERE are left. Their table is freed
+ * once no lookup can still be reading it. The knowledge base's lock must be
+ * held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void intent_reset(kb_t *kb) {
+  IntentTable *table =
+      atomic_exchange_explicit(&kb->questions, NULL, memory_order_acq_rel);
+  if (table != NULL) {
+    epoch_retire(free, table);
+  }
+}
+
+/*
+ * Get the number of question words of a knowledge base, and so of its
+ * sections. Section numbers run from 0 to one less than this. The knowledge
+ * base's lock must be held, or the caller must be in an epoch (see
+ * epoch.c), for the result to stay true.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *
+ * Returns:
+ *   the number of question words
+ */
+int intent_sections(kb_t *kb) {
+  pthread_once(&intent_once, intent_init);
+  const IntentTable *table =
+      atomic_load_explicit(&kb->questions, memory_order_acquire);
+  return atomic_load_explicit(
+      table == NULL ? &intent_builtin.section_count : &table->section_count,
+      memory_order_acquire);
+}
+
+/*
+ * Get the question word of a section of a knowledge base. The knowledge
+ * base's lock must be held, or the caller must be in an epoch (see
+ * epoch.c), while the word is used.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the section number, less than intent_sections()
+ *
+ * Returns:
+ *   the question word, as it was first added
+ */
+const char *intent_section_name(kb_t *kb, int section) {
+  const IntentTable *table =
+      atomic_load_explicit(&kb->questions, memory_order_acquire);
+  if (table == NULL) {
+    table = &intent_builtin;
+  }
+  return atomic_load_explicit(&table->questions[section],
+                              memory_order_acquire)->name;
+}
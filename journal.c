@@ -0,0 +1,606 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the knowledge base journal, which makes every answer
+ * the chatbot learns durable as soon as it is learned, without saving the
+ * whole knowledge base.
+ *
+ * A journal is a file of records appended one per change: KB_JOURNAL_PUT for
+ * each answer taught, KB_JOURNAL_RESET for each reset. Beside it is the
+ * journal's snapshot, "<journal>.kb", a compiled knowledge base (see
+ * snapshot.c). journal_open() loads the snapshot, replays the records on top
+ * of it, and from then on kb_put() and kb_reset() append a record for every
+ * change. A record that was only partly written when the program stopped
+ * fails its checksum and is cut off, along with anything after it.
+ *
+ * Appending costs one write() of a few dozen bytes. Making it durable costs
+ * an fdatasync(), which is shared by every thread waiting for one at the same
+ * time (group commit) or, if sync_ms is positive, done by a background thread
+ * every sync_ms milliseconds instead, so that a crash loses at most that much.
+ * A negative sync_ms leaves it to the operating system.
+ *
+ * The background thread also compacts the journal: once it has grown past
+ * KB_JOURNAL_COMPACT_BYTES, or a file has been loaded (which is not recorded
+ * in the journal), the knowledge base is compiled over the snapshot and the
+ * journal is emptied. Teaching waits while this is done; lookups don't.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int journal_open(kb_t *kb, const char *path, int sync_ms) {
+  return KB_IOERROR;
+}
+
+void journal_close(kb_t *kb) {}
+
+uint64_t journal_append(KBJournal *journal, int type, const char *intent,
+                        const char *entity, size_t entity_len,
+                        const char *response, size_t response_len) {
+  return 0;
+}
+
+int journal_commit(KBJournal *journal, uint64_t seq) { return KB_IOERROR; }
+
+void journal_request_compact(KBJournal *journal) {}
+
+int journal_truncate(KBJournal *journal) { return KB_IOERROR; }
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the largest record that can be appended */
+#define JOURNAL_MAX_RECORD                                                     \
+  (sizeof(KBJournalRecord) + MAX_INTENT + MAX_ENTITY + MAX_RESPONSE)
+
+/* Type definition for an open journal */
+struct kb_journal {
+  kb_t *kb;                /* the knowledge base being recorded */
+  char *path;              /* the name of the journal */
+  char *snapshot;          /* the name of its snapshot */
+  int fd;                  /* the journal, open for appending */
+  int sync_ms;             /* see the comment at the top of the file */
+  uint64_t size;           /* the length of the journal */
+  uint64_t written;        /* the number of records appended */
+  uint64_t synced;         /* the number of those known to be durable */
+  int syncing;             /* 1 while a thread is in fdatasync() */
+  int error;               /* KB_OK, or KB_IOERROR once the journal could
+                              not be made durable; it is never cleared, since
+                              the kernel may have dropped what it failed to
+                              write */
+  int compact;             /* 1 if the journal should be compacted */
+  int stop;                /* 1 to stop the background thread */
+  pthread_mutex_t lock;    /* protects all of the above after opening */
+  pthread_cond_t changed;  /* signalled when synced, compact or stop change */
+  pthread_t thread;        /* the background thread */
+};
+
+/*
+ * Helper function to write all of a buffer to a file descriptor.
+ *
+ * Returns:
+ *   0, if successful
+ *   -1, if there was an error
+ */
+
+static int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Helper function to compute the checksum of a record.
+ *
+ * Input:
+ *   record  - the record's header (aligned, e.g. copied out of the journal)
+ *   strings - the record's strings, which follow the header in the journal
+ *
+ * Returns:
+ *   the checksum of everything after the checksum field
+ */
+
+static uint64_t record_checksum(const KBJournalRecord *record,
+                                const char *strings) {
+  Checksum sum;
+  checksum_init(&sum);
+  checksum_update(&sum, &record->type,
+                  sizeof(KBJournalRecord) - sizeof(record->checksum));
+  checksum_update(&sum, strings,
+                  record->intent_len + record->entity_len +
+                      record->response_len);
+  return checksum_final(&sum);
+}
+
+/*
+ * Helper function to replay the records of a journal into its knowledge base.
+ *
+ * Input:
+ *   data - the contents of the journal
+ *   size - the length of the journal
+ *   end  - receives the length of the part of the journal that is intact
+ *
+ * Returns:
+ *   the number of records replayed, or KB_NOMEM
+ */
+
+static int replay(kb_t *kb, const char *data, size_t size, size_t *end) {
+  int count = 0;
+  size_t offset = sizeof(KBJournalHeader);
+
+  while (size - offset >= sizeof(KBJournalRecord)) {
+    KBJournalRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    const char *p = data + offset + sizeof(record);
+    size_t len = sizeof(record) + record.intent_len + record.entity_len +
+                 record.response_len;
+    if (len > size - offset || record.intent_len >= MAX_INTENT ||
+        record.entity_len >= MAX_ENTITY ||
+        record.response_len >= MAX_RESPONSE ||
+        record_checksum(&record, p) != record.checksum) {
+      break; // a torn or damaged record: nothing after it can be trusted
+    }
+
+    char intent[MAX_INTENT], entity[MAX_ENTITY], response[MAX_RESPONSE];
+    memcpy(intent, p, record.intent_len);
+    intent[record.intent_len] = '\0';
+    p += record.intent_len;
+    memcpy(entity, p, record.entity_len);
+    entity[record.entity_len] = '\0';
+    p += record.entity_len;
+    memcpy(response, p, record.response_len);
+    response[record.response_len] = '\0';
+
+    // An answer may be to a question word that a file loaded in the last run
+    // made one, and which no file has made one in this run (yet)
+    if (record.type == KB_JOURNAL_RESET) {
+      kb_reset(kb);
+    } else if (record.type == KB_JOURNAL_PUT) {
+      pthread_mutex_lock(&kb->lock);
+      int section = intent_add_question(kb, intent, record.intent_len);
+      pthread_mutex_unlock(&kb->lock);
+      if (section >= 0 && kb_put(kb, intent, entity, response) == KB_NOMEM) {
+        return KB_NOMEM;
+      }
+    }
+    offset += len;
+    count++;
+  }
+  *end = offset;
+  return count;
+}
+
+/*
+ * Helper function to empty a journal, once its records are durable elsewhere
+ * (in its snapshot, or a disk store's run), so they all count as synced. If
+ * the emptied journal can't be made durable, the journal is marked as
+ * failed. The journal's lock must be held.
+ *
+ * Input:
+ *   journal - the journal
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the journal could not be emptied, or made durable
+ */
+
+static int empty_journal(KBJournal *journal) {
+  int result = KB_OK;
+  if (ftruncate(journal->fd, sizeof(KBJournalHeader)) != 0) {
+    result = KB_IOERROR;
+  } else {
+    journal->size = sizeof(KBJournalHeader);
+    if (fdatasync(journal->fd) != 0) {
+      journal->error = KB_IOERROR;
+      result = KB_IOERROR;
+    }
+  }
+  journal->synced = journal->written;
+  pthread_cond_broadcast(&journal->changed);
+  return result;
+}
+
+/*
+ * Helper function to compile the knowledge base over the journal's snapshot
+ * and empty the journal. The knowledge base's lock is held throughout, so no
+ * change is lost between the two.
+ *
+ * Input:
+ *   journal - the journal
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM or KB_IOERROR, if the snapshot could not be written (the journal
+ *   is then left as it was)
+ *   KB_IOERROR, if the journal could not be emptied (the snapshot holds
+ *   its records, so none is lost, but the journal is marked as failed if it
+ *   could not be made durable)
+ */
+
+static int compact(KBJournal *journal) {
+  kb_t *kb = journal->kb;
+  SaveFile file;
+  int result = savefile_open(&file, journal->snapshot);
+  if (result != KB_OK) {
+    return result;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  result = snapshot_write(file.f, kb);
+  if (result == KB_OK) {
+    result = savefile_commit(&file);
+  } else {
+    savefile_abort(&file);
+  }
+  if (result == KB_OK) {
+    pthread_mutex_lock(&journal->lock);
+    result = empty_journal(journal);
+    pthread_mutex_unlock(&journal->lock);
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Helper function to make every record appended so far durable. If
+ * fdatasync() fails, the records are not counted as synced, and the journal
+ * is marked as failed.
+ *
+ * Input:
+ *   journal - the journal (whose lock is held, and is released meanwhile)
+ */
+
+static void sync_records(KBJournal *journal) {
+  uint64_t target = journal->written;
+  journal->syncing = 1;
+  pthread_mutex_unlock(&journal->lock);
+  int synced = fdatasync(journal->fd) == 0;
+  pthread_mutex_lock(&journal->lock);
+  journal->syncing = 0;
+  if (!synced) {
+    if (journal->error == KB_OK) {
+      fprintf(stderr, "journal: can't sync %s\n", journal->path);
+    }
+    journal->error = KB_IOERROR;
+  } else if (target > journal->synced) {
+    journal->synced = target;
+  }
+  pthread_cond_broadcast(&journal->changed);
+}
+
+/*
+ * Helper function run by the journal's background thread: make the records
+ * durable every sync_ms milliseconds (if sync_ms is positive), and compact
+ * the journal when asked to.
+ *
+ * Input:
+ *   arg - the journal
+ */
+
+static void *journal_thread(void *arg) {
+  KBJournal *journal = arg;
+
+  // A compaction asked for is done even if the journal is being closed
+  pthread_mutex_lock(&journal->lock);
+  for (;;) {
+    if (journal->compact) {
+      journal->compact = 0;
+      pthread_mutex_unlock(&journal->lock);
+      if (compact(journal) != KB_OK) {
+        fprintf(stderr, "journal: can't compact %s into %s\n", journal->path,
+                journal->snapshot);
+      }
+      pthread_mutex_lock(&journal->lock);
+      continue;
+    }
+    if (journal->stop) {
+      break;
+    }
+    if (journal->sync_ms > 0 && journal->written > journal->synced &&
+        !journal->syncing && journal->error == KB_OK) {
+      sync_records(journal);
+    }
+
+    if (journal->sync_ms > 0) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += journal->sync_ms / 1000;
+      until.tv_nsec += (long)(journal->sync_ms % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&journal->changed, &journal->lock, &until);
+    } else {
+      pthread_cond_wait(&journal->changed, &journal->lock);
+    }
+  }
+  pthread_mutex_unlock(&journal->lock);
+  return NULL;
+}
+
+/*
+ * Start recording the changes to a knowledge base in a journal. The journal's
+ * snapshot (if there is one) is loaded and the journal replayed first, so
+ * this is best done while the knowledge base is still empty.
+ *
+ * Input:
+ *   kb      - the knowledge base (which must not already have a journal)
+ *   path    - the name of the journal, which is created if need be
+ *   sync_ms - how to make records durable (see the top of the file)
+ *
+ * Returns:
+ *   the number of records replayed, if successful
+ *   KB_INVALID, if the file is not a journal, or is from another version
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the journal or its snapshot could not be read or written
+ */
+int journal_open(kb_t *kb, const char *path, int sync_ms) {
+  KBJournal *journal = calloc(1, sizeof(KBJournal));
+  if (journal == NULL) {
+    return KB_NOMEM;
+  }
+  journal->kb = kb;
+  journal->sync_ms = sync_ms;
+  journal->path = strdup(path);
+  journal->snapshot = malloc(strlen(path) + 4);
+  if (journal->path == NULL || journal->snapshot == NULL) {
+    free(journal->path);
+    free(journal->snapshot);
+    free(journal);
+    return KB_NOMEM;
+  }
+  sprintf(journal->snapshot, "%s.kb", path);
+
+  // Load the snapshot, then replay the journal on top of it
+  int result = KB_OK;
+  FILE *f = fopen(journal->snapshot, "rb");
+  if (f != NULL) {
+    int loaded = kb_read_mapped(kb, f); // only ever replaced, not rewritten
+    fclose(f);
+    result = loaded == -1 ? KB_NOMEM : loaded < 0 ? KB_INVALID : KB_OK;
+  }
+
+  journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  struct stat st;
+  char *data = NULL;
+  if (result == KB_OK &&
+      (journal->fd < 0 || fstat(journal->fd, &st) != 0)) {
+    result = KB_IOERROR;
+  } else if (result == KB_OK && st.st_size > 0) {
+    data = malloc(st.st_size);
+    if (data == NULL) {
+      result = KB_NOMEM;
+    } else if (pread(journal->fd, data, st.st_size, 0) != st.st_size) {
+      result = KB_IOERROR;
+    }
+  }
+
+  KBJournalHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KB_JOURNAL_MAGIC, 8);
+  header.version = KB_JOURNAL_VERSION;
+  header.byte_order = 0x01020304;
+  size_t end = 0;
+  int replayed = 0;
+  if (result == KB_OK && st.st_size == 0) {
+    if (write_all(journal->fd, &header, sizeof(header)) != 0) {
+      result = KB_IOERROR;
+    }
+    end = sizeof(header);
+  } else if (result == KB_OK) {
+    if ((size_t)st.st_size < sizeof(header) ||
+        memcmp(data, &header, sizeof(header)) != 0) {
+      result = KB_INVALID;
+    } else {
+      replayed = replay(kb, data, st.st_size, &end);
+      if (replayed < 0) {
+        result = replayed;
+      } else if (end < (size_t)st.st_size &&
+                 ftruncate(journal->fd, end) != 0) {
+        result = KB_IOERROR;
+      }
+    }
+  }
+  free(data);
+  if (result == KB_OK && fdatasync(journal->fd) != 0) {
+    result = KB_IOERROR;
+  }
+  if (result != KB_OK) {
+    if (journal->fd >= 0) {
+      close(journal->fd);
+    }
+    free(journal->path);
+    free(journal->snapshot);
+    free(journal);
+    return result;
+  }
+
+  journal->size = end;
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->changed, NULL);
+  pthread_create(&journal->thread, NULL, journal_thread, journal);
+  pthread_mutex_lock(&kb->lock);
+  kb->journal = journal;
+  pthread_mutex_unlock(&kb->lock);
+  return replayed;
+}
+
+/*
+ * Stop recording the changes to a knowledge base, making sure everything
+ * recorded so far is durable. Nothing else may be using the knowledge base.
+ *
+ * Input:
+ *   kb - the knowledge base (which need not have a journal)
+ */
+void journal_close(kb_t *kb) {
+  KBJournal *journal = kb->journal;
+  if (journal == NULL) {
+    return;
+  }
+  kb->journal = NULL;
+
+  pthread_mutex_lock(&journal->lock);
+  journal->stop = 1;
+  pthread_cond_broadcast(&journal->changed);
+  pthread_mutex_unlock(&journal->lock);
+  pthread_join(journal->thread, NULL);
+
+  fdatasync(journal->fd);
+  close(journal->fd);
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->changed);
+  free(journal->path);
+  free(journal->snapshot);
+  free(journal);
+}
+
+/*
+ * Append a record to a journal. The knowledge base's lock must be held, so
+ * that the records are in the order in which the changes were made.
+ *
+ * Input:
+ *   journal      - the journal
+ *   type         - KB_JOURNAL_PUT or KB_JOURNAL_RESET
+ *   intent       - the question word (KB_JOURNAL_PUT only)
+ *   entity       - the entity (need not be null-terminated)
+ *   entity_len   - the length of the entity, at most MAX_ENTITY - 1
+ *   response     - the response (need not be null-terminated)
+ *   response_len - the length of the response, at most MAX_RESPONSE - 1
+ *
+ * Returns:
+ *   the sequence number of the record, to pass to journal_commit()
+ *   0, if the record could not be written
+ */
+uint64_t journal_append(KBJournal *journal, int type, const char *intent,
+                        const char *entity, size_t entity_len,
+                        const char *response, size_t response_len) {
+  char buffer[JOURNAL_MAX_RECORD];
+  KBJournalRecord record;
+  size_t intent_len = strnlen(intent, MAX_INTENT - 1);
+
+  memset(&record, 0, sizeof(record));
+  record.type = type;
+  record.intent_len = intent_len;
+  record.entity_len = entity_len;
+  record.response_len = response_len;
+  memcpy(buffer, &record, sizeof(record));
+  char *p = buffer + sizeof(record);
+  memcpy(p, intent, intent_len);
+  memcpy(p + intent_len, entity, entity_len);
+  memcpy(p + intent_len + entity_len, response, response_len);
+  record.checksum = record_checksum(&record, p);
+  memcpy(buffer, &record.checksum, sizeof(record.checksum));
+  size_t len = sizeof(record) + intent_len + entity_len + response_len;
+
+  pthread_mutex_lock(&journal->lock);
+  uint64_t seq = 0;
+  if (write_all(journal->fd, buffer, len) == 0) {
+    journal->size += len;
+    seq = ++journal->written;
+    if (journal->size > KB_JOURNAL_COMPACT_BYTES && !journal->compact) {
+      journal->compact = 1;
+      pthread_cond_broadcast(&journal->changed);
+    }
+  } else if (ftruncate(journal->fd, journal->size) != 0) {
+    // The partial record will fail its checksum, so replay will stop there
+    fprintf(stderr, "journal: can't repair %s\n", journal->path);
+  }
+  pthread_mutex_unlock(&journal->lock);
+  return seq;
+}
+
+/*
+ * Wait until a record appended to a journal is durable, as far as the
+ * journal's sync_ms asks. Threads that commit at the same time share one
+ * fdatasync().
+ *
+ * Input:
+ *   journal - the journal
+ *   seq     - the record's sequence number, from journal_append()
+ *
+ * Returns:
+ *   KB_OK, if the record is durable (or does not need to be yet)
+ *   KB_IOERROR, if the record was not written, or the journal has failed to
+ *   be made durable (see sync_records())
+ */
+int journal_commit(KBJournal *journal, uint64_t seq) {
+  if (seq == 0) {
+    return KB_IOERROR;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->sync_ms == 0 && journal->synced < seq &&
+         journal->error == KB_OK) {
+    if (journal->syncing) {
+      pthread_cond_wait(&journal->changed, &journal->lock);
+    } else {
+      sync_records(journal);
+    }
+  }
+  int result = journal->synced < seq ? journal->error : KB_OK;
+  pthread_mutex_unlock(&journal->lock);
+  return result;
+}
+
+/*
+ * Ask for a journal to be compacted soon, e.g. because a file has been
+ * loaded into its knowledge base, which the journal does not record.
+ *
+ * Input:
+ *   journal - the journal
+ */
+void journal_request_compact(KBJournal *journal) {
+  pthread_mutex_lock(&journal->lock);
+  journal->compact = 1;
+  pthread_cond_broadcast(&journal->changed);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+/*
+ * Empty a journal and remove its snapshot, once everything they hold is
+ * durable elsewhere, e.g. once the knowledge base has been written to its
+ * disk store as a run (see store.c) and emptied. The knowledge base's lock
+ * must be held, so that no change is recorded meanwhile. If the emptied
+ * journal can't be made durable, the journal is marked as failed, so later
+ * commits fail too.
+ *
+ * Input:
+ *   journal - the journal
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the journal could not be emptied, or made durable
+ */
+int journal_truncate(KBJournal *journal) {
+  pthread_mutex_lock(&journal->lock);
+  unlink(journal->snapshot);
+  int result = empty_journal(journal);
+  pthread_mutex_unlock(&journal->lock);
+  if (result != KB_OK) {
+    fprintf(stderr, "journal: can't empty %s\n", journal->path);
+  }
+  return result;
+}
+
+#endif
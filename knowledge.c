@@ -6,342 +6,4050 @@
  * knowledge_get() retrieves the response to a question.
  * knowledge_put() inserts a new response to a question.
  * knowledge_read() reads the knowledge base from a file.
+ * knowledge_reload() applies the changes to a file it has read.
  * knowledge_reset() erases all of the knowledge.
  * knowledge_write() saves the knowledge base in a file.
+ * knowledge_compile() saves the knowledge base in a file in compiled form.
+ * knowledge_search() finds answers by the words of their responses.
+ *
+ * A knowledge base may also be kept in a disk store (see store.c), in which
+ * case its sections only hold what has been learned since the store was last
+ * written to, and lookups they can't answer go on to the store.
+ *
+ * A knowledge base that is mostly read may be packed (see kb_pack()): each
+ * section's entries are compressed into a pack (see pack.c), and its nodes,
+ * and the files they pointed into, are let go.
+ *
+ * Each of these works on the default knowledge base. The kb_*() functions do
+ * the same to a knowledge base created by kb_create(), so a program can keep
+ * as many knowledge bases as it likes, and any of them can be called from any
+ * thread.
+ *
+ * Lookups take no locks. The functions that change or save a knowledge base
+ * hold its lock, and never change anything a lookup might be reading: nodes
+ * and indexes are replaced rather than modified, and what they replace is
+ * retired (see epoch.c) and freed once no lookup can still be using it.
  *
  * You may add helper functions as necessary.
  */
 
 #include "chat1002.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* the size of the buffer kb_write() gathers lines in, and its alignment */
+#define KB_WRITE_BUFFER (1024 * 1024)
+#define KB_WRITE_ALIGN 4096
+
+/* Type definition for the state of kb_write() */
+typedef struct kb_writer {
+  FILE *f;          /* the file being written */
+  char *buffer;     /* KB_WRITE_BUFFER bytes of lines not yet written */
+  size_t used;      /* the number of bytes in the buffer */
+  uint64_t written; /* the number of bytes written out */
+  int result;       /* KB_OK, or KB_IOERROR once a write has failed */
+  Section *section; /* the section being written */
+} KBWriter;
+
+/* Type definition for an entity case-folded for looking it up (see
+ * make_key()) */
+typedef struct kb_key {
+  char folded[MAX_ENTITY]; /* the upper-cased entity (not null-terminated) */
+  size_t len;              /* the length of the entity */
+  uint64_t hash;           /* the hash of the folded entity */
+} KBKey;
+
+/* Type definition for the state of building a fuzzy index (see
+ * kb_suggest()) */
+typedef struct kb_fuzzy_build {
+  KBFuzzy *fuzzy; /* the fuzzy index being built */
+  int result;     /* KB_OK, or KB_NOMEM once an entity could not be added */
+} KBFuzzyBuild;
+
+/* Type definition for the state of building a radix tree (see
+ * section_radix()) */
+typedef struct kb_radix_build {
+  KBRadix *radix; /* the radix tree being built */
+  int result;     /* KB_OK, or KB_NOMEM once an entity could not be added */
+} KBRadixBuild;
+
+/* the kinds of line next_line() reads */
+#define KB_LINE_END 0
+#define KB_LINE_ENTRY 1
+#define KB_LINE_HEADER 2
+
+/* Type definition for an entry of a knowledge file (see next_line()) */
+typedef struct kb_line {
+  const char *entity;   /* the entity (not null-terminated) */
+  size_t entity_len;    /* its length, cut to MAX_ENTITY - 1 */
+  const char *response; /* the response (not null-terminated) */
+  size_t response_len;  /* its length, cut to MAX_RESPONSE - 1 */
+} KBLine;
+
+/* Type definition for an entry kb_reload() may have to change */
+typedef struct kb_change {
+  Section *section; /* the entry's section */
+  KBLine line;      /* the entry */
+  uint64_t hash;    /* the hash of the folded entity, mixed with the section */
+} KBChange;
+
+/* Type definition for a list of changes, indexed by has_change() once
+ * index_changes() has been called */
+typedef struct kb_changes {
+  KBChange *items;   /* the changes */
+  size_t count;      /* the number of them */
+  size_t capacity;   /* the room in 'items' */
+  uint32_t *slots;   /* the changes, plus 1, by hash; 0 for an empty slot */
+  size_t slot_count; /* the number of slots */
+} KBChanges;
+
+/* Type definition for a section of a view of a knowledge base */
+typedef struct kb_view_section {
+  char name[MAX_INTENT]; /* the section's question word */
+  KBIndex *index;        /* a copy of the section's hash index, or NULL */
+  const KBBase *base;    /* the section's base, or NULL */
+  const KBPack *pack;    /* the section's pack, or NULL */
+  int has_nodes;         /* 1 if the section had any nodes */
+} KBViewSection;
+
+/* Type definition for a point-in-time view of a knowledge base (see
+ * kb_view()) */
+struct kb_view {
+  int section_count;                       /* the number of sections */
+  KBViewSection sections[KB_MAX_SECTIONS]; /* the sections */
+  const KBStoreRuns *runs;                 /* the disk store's runs, or NULL */
+};
+
+/* Type definition for the state of writing the entries of a disk store's
+ * runs (see write_runs()) */
+typedef struct kb_run_writer {
+  KBWriter *writer;   /* the writer */
+  KBIndex *index;     /* the hash index of the section the entries are in */
+  const KBBase *base; /* the section's base */
+} KBRunWriter;
 
-/*Additional declaration of global variables for head pointers*/
-Node *who_ptr;
-Node *what_ptr;
-Node *where_ptr;
+/* Type definition for an entity to be written by kb_view_write(), with its
+ * first characters folded, so that most comparisons look no further */
+typedef struct kb_view_entry {
+  uint64_t prefix;       /* the first 8 folded characters, padded with 0 */
+  const char *entity;    /* the entity */
+  const char *response;  /* the response */
+  uint32_t entity_len;   /* the length of the entity */
+  uint32_t response_len; /* the length of the response */
+} KBViewEntry;
+
+/* Type definition for the state of writing the entries of a view's pack,
+ * merged with the entries of its hash index (see write_view_section()) */
+typedef struct kb_view_merge {
+  KBWriter *writer;      /* the writer */
+  KBIndex *index;        /* the view's copy of the section's hash index */
+  KBViewEntry *entries;  /* the entries of the hash index, sorted */
+  size_t count;          /* the number of them */
+  size_t next;           /* the next of them to write */
+} KBViewMerge;
+
+/* Type definition for the state of walking the entries of a section's pack
+ * (see section_walk()) */
+typedef struct kb_pack_walk {
+  Section *section;                        /* the section */
+  void (*fn)(const Node *node, void *arg); /* the function walking it */
+  void *arg;                               /* an argument to pass on to fn */
+  const char *entities;                    /* the next of the section's
+                                              unpacked entities, or NULL */
+} KBPackWalk;
+
+/* Type definition for the state of gathering the entries of a knowledge
+ * base to be packed (see kb_pack()) */
+typedef struct kb_pack_gather {
+  KBPackItem *items; /* the entries */
+  size_t count;      /* the number of them */
+  size_t capacity;   /* the room in 'items' */
+  Arena *strings;    /* holds copies of the strings of packed entries */
+  int result;        /* KB_OK, or KB_NOMEM once an entry could not be added */
+} KBPackGather;
+
+/* Type definition for the state of building a search index (see
+ * kb_search()) */
+typedef struct kb_search_build {
+  KBSearch *search; /* the search index being built */
+  int section;      /* the section number of the section being walked */
+  int result;       /* KB_OK, or KB_NOMEM once an answer could not be added */
+} KBSearchBuild;
+
+/*The default knowledge base, used by the knowledge_*() functions*/
+static kb_t knowledge_base = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Helper function to case-fold an entity once, for looking it up: its
+ * characters are upper-cased as compare_token() does, and the folded entity is
+ * hashed (64-bit FNV-1a), so that entities that compare equal with
+ * compare_token() always have the same hash.
+ *
+ * Input:
+ *   key    - a structure to receive the folded entity
+ *   entity - the entity (need not be null-terminated)
+ *   len    - the length of the entity, less than MAX_ENTITY
+ */
+
+static void make_key(KBKey *key, const char *entity, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    key->folded[i] = FOLD_CHAR(entity[i]);
+    hash ^= (unsigned char)key->folded[i];
+    hash *= 1099511628211ULL;
+  }
+  key->len = len;
+  key->hash = hash;
+}
 
 /*
- * Helper function to push a new node to the end of the chosen linked list
- * Would also help to check if a node with the same entity is in the current
- * linked list. If so, it would update the response.
+ * Helper function to check whether a node's entity is the same as a folded
+ * entity, ignoring case as compare_token() does. The lengths are compared
+ * first; then the node's entity is folded and compared 32 or 16 characters
+ * at a time where the CPU allows.
  *
  * Input:
- *   head    - the head node of the chosen linked list
- *   new_node    - the new_node that we want to push onto our linked list
+ *   node - the node
+ *   key  - the folded entity
  *
+ * Returns:
+ *   1, if the entities are the same
+ *   0, otherwise
  */
 
-void push_to_list(Node *head, Node *new_node) {
-  Node *curr_ptr = head;
-  while (curr_ptr != NULL) {
-    if (compare_token(new_node->entity, curr_ptr->entity) == 0) {
-      strcpy(curr_ptr->response, new_node->response);
+static int entity_equals(const Node *node, const KBKey *key) {
+  size_t len = key->len;
+  if (node->entity_len != len) {
+    return 0;
+  }
+  const char *entity = node->entity;
+  const char *folded = key->folded;
+  size_t i = 0;
+#ifdef __AVX2__
+  {
+    // 'a' to 'z' are positive, so a signed range check finds them
+    const __m256i after = _mm256_set1_epi8('a' - 1);
+    const __m256i before = _mm256_set1_epi8('z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8('a' - 'A');
+    for (; i + 32 <= len; i += 32) {
+      __m256i chunk = _mm256_loadu_si256((const __m256i *)(entity + i));
+      __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, after),
+                                       _mm256_cmpgt_epi8(before, chunk));
+      chunk = _mm256_sub_epi8(chunk, _mm256_and_si256(lower, case_bit));
+      __m256i other = _mm256_loadu_si256((const __m256i *)(folded + i));
+      if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, other)) !=
+          0xffffffffu) {
+        return 0;
+      }
     }
-    if (curr_ptr->next == NULL) {
-      curr_ptr->next = new_node;
-      break;
+  }
+#endif
+#ifdef __SSE2__
+  {
+    const __m128i after = _mm_set1_epi8('a' - 1);
+    const __m128i before = _mm_set1_epi8('z' + 1);
+    const __m128i case_bit = _mm_set1_epi8('a' - 'A');
+    for (; i + 16 <= len; i += 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *)(entity + i));
+      __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(chunk, after),
+                                    _mm_cmpgt_epi8(before, chunk));
+      chunk = _mm_sub_epi8(chunk, _mm_and_si128(lower, case_bit));
+      __m128i other = _mm_loadu_si128((const __m128i *)(folded + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, other)) != 0xffff) {
+        return 0;
+      }
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if (FOLD_CHAR(entity[i]) != folded[i]) {
+      return 0;
     }
-    curr_ptr = curr_ptr->next;
   }
+  return 1;
 }
 
 /*
- * Helper function to write the entity and response for an intent into a file
+ * Helper function to find the section for a question word (see intent.c).
  *
  * Input:
- *   f    - file pointer
- *   entity    - entity string
- *   response  - response string
- *   buffer    - string to be written to the line in file
- *   delimiter    - the string containing the "=" delimiter
- *   end    - the string containing the end of a line "\n\0"
+ *   kb     - the knowledge base
+ *   intent - the question word
  *
+ * Returns:
+ *   NULL, if the intent is not a valid question word
+ *   A pointer to the section
  */
 
-void write_section_to_file(FILE *f, char *entity, char *response, char *buffer,
-                           const char *delimiter, const char *end) {
-  memcpy(buffer, entity, strlen(entity));
-  memcpy(buffer + strlen(entity), delimiter, strlen(delimiter));
-  memcpy(buffer + strlen(entity) + strlen(delimiter), response,
-         strlen(response));
-  memcpy(buffer + strlen(entity) + strlen(delimiter) + strlen(response), end,
-         strlen(end));
-  fprintf(f, buffer);
-  memset(buffer, 0, strlen(buffer));
+Section *find_section(kb_t *kb, const char *intent) {
+  int section = intent_question(kb, intent);
+  return section < 0 ? NULL : &kb->sections[section];
 }
 
 /*
- * Helper function to help create a new_node
+ * Helper function to find the section for a word, making the word a question
+ * word if it is not one already (e.g. for a section header in a file).
  *
  * Input:
- *   entity    - the question word
- *   response    - the entity
+ *   kb   - the knowledge base
+ *   word - the word (need not be null-terminated)
+ *   len  - the length of the word
  *
  * Returns:
- *   NULL, if there is memory allocation error
- *   A pointer to the new node
+ *   NULL, if the word cannot be a question word (see intent_add_question())
+ *   A pointer to the section
  */
 
-Node *create_node(const char *entity, const char *response) {
+static Section *add_section(kb_t *kb, const char *word, size_t len) {
+  int section = intent_add_question(kb, word, len);
+  return section < 0 ? NULL : &kb->sections[section];
+}
 
-  Node *new_node = malloc(sizeof(Node));
+/*
+ * Helper function to read a slot of a hash index. The node is fully
+ * initialised before it is stored in the slot, so once it is read it can be
+ * used without locking.
+ *
+ * Input:
+ *   index - the hash index
+ *   i     - the index of the slot
+ *
+ * Returns:
+ *   the node in the slot, or NULL if the slot is empty
+ */
 
-  if (new_node == NULL) {
-    return NULL;
-  } else {
-    snprintf(new_node->entity, MAX_ENTITY, "%s", entity);
-    snprintf(new_node->response, MAX_RESPONSE, "%s", response);
-    new_node->next = NULL;
-    return new_node;
+static Node *load_slot(KBIndex *index, size_t i) {
+  return atomic_load_explicit(&index->slots[i], memory_order_acquire);
+}
+
+/*
+ * Helper function to find the slot of an entity in a hash index. The probe
+ * sequence stops at the node with the same entity, or at the first empty slot
+ * if the entity is not in the index.
+ *
+ * Input:
+ *   index - the hash index
+ *   key   - the entity
+ *
+ * Returns:
+ *   the index of the slot
+ */
+
+static size_t find_slot(KBIndex *index, const KBKey *key) {
+  size_t mask = index->capacity - 1;
+  size_t i = (size_t)key->hash & mask;
+  Node *node;
+
+  while ((node = load_slot(index, i)) != NULL) {
+    if (node->hash == key->hash && entity_equals(node, key)) {
+      break;
+    }
+    i = (i + 1) & mask;
   }
+  return i;
 }
 
-// Reading of ini files
+/*
+ * Helper function to find the slot of an entity already in the knowledge
+ * base (e.g. one from the base, or on a section's list) in a hash index.
+ *
+ * Input:
+ *   index  - the hash index
+ *   entity - the entity (need not be null-terminated)
+ *   len    - the length of the entity, less than MAX_ENTITY
+ *
+ * Returns:
+ *   the index of the slot
+ */
+
+static size_t find_entity_slot(KBIndex *index, const char *entity,
+                               size_t len) {
+  KBKey key;
+  make_key(&key, entity, len);
+  return find_slot(index, &key);
+}
 
 /*
- * Get the response to a question.
+ * Helper function to find an entity in the base of a section.
  *
  * Input:
- *   intent   - the question word
- *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
+ *   base - the base, or NULL
+ *   key  - the entity
  *
  * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is
- * copied to the response buffer) KB_NOTFOUND, if no response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
+ *   NULL, if there is no base or the entity is not in it
+ *   A pointer to the base entry
  */
-int knowledge_get(const char *intent, const char *entity, char *response,
-                  int n) {
-  int res = KB_INVALID;
 
-  Node *temp_ptr = NULL;
-  if (compare_token(intent, "who") == 0) {
-    temp_ptr = who_ptr;
-  } else if (compare_token(intent, "what") == 0) {
-    temp_ptr = what_ptr;
-  } else if (compare_token(intent, "where") == 0) {
-    temp_ptr = where_ptr;
+static const KBSnapshotEntry *find_base(const KBBase *base,
+                                        const KBKey *key) {
+  if (base == NULL || base->count == 0) {
+    return NULL;
   }
-  while (temp_ptr != NULL) {
-    if (compare_token(temp_ptr->entity, entity) == 0) {
-      snprintf(response, n, "%s", temp_ptr->response);
-      res = KB_OK;
 
-      break;
+  size_t mask = base->capacity - 1;
+  for (size_t i = (size_t)key->hash & mask; base->slots[i] != 0;
+       i = (i + 1) & mask) {
+    const KBSnapshotEntry *entry = &base->entries[base->slots[i] - 1];
+    Node view;
+    view.entity = base->data + entry->entity_offset;
+    view.entity_len = entry->entity_len;
+    if (entry->hash == key->hash && entity_equals(&view, key)) {
+      return entry;
     }
-    if (temp_ptr->next == NULL) {
-      res = KB_NOTFOUND;
-    }
-    temp_ptr = temp_ptr->next;
   }
-  return res;
+  return NULL;
 }
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
+ * Helper function to replace the hash index of a section with one twice the
+ * size (or create it, if the section is empty). Lookups may still be using
+ * the old index, so it is retired rather than freed.
  *
  * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ *   section - the section
  *
  * Returns:
- *   KB_FOUND, if successful
+ *   KB_OK, if successful
  *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
  */
-int knowledge_put(const char *intent, const char *entity,
-                  const char *response) {
-  /*This function will be called each time there is a new entity/response pair
-  that is unknown, which we will then create a node containing the
-  entity/response in the appropriate linked list*/
-  int returns = KB_INVALID;
-
-  // Create a new temporary Node to store the data
-  Node *temp = create_node(entity, response);
 
-  if (temp == NULL) {
-    returns = KB_NOMEM;
+static int grow_index(Section *section) {
+  KBIndex *old = section->index;
+  size_t capacity = old == NULL ? KB_INITIAL_SLOTS : old->capacity * 2;
+  KBIndex *index =
+      calloc(1, sizeof(KBIndex) + capacity * sizeof(index->slots[0]));
+  if (index == NULL) {
+    return KB_NOMEM;
   }
+  index->capacity = capacity;
 
-  // Checks if the intent is "who
-  if (compare_token(intent, "who") == 0) {
-    if (who_ptr == NULL) {
-      who_ptr = temp;
-    } else {
-      push_to_list(who_ptr, temp);
+  for (size_t j = 0; old != NULL && j < old->capacity; j++) {
+    Node *node = load_slot(old, j);
+    if (node == NULL) {
+      continue;
     }
-    returns = KB_OK;
-  }
-  // Checks if the intent is "what"
-  else if (compare_token(intent, "what") == 0) {
-    if (what_ptr == NULL) {
-      what_ptr = temp;
-    } else {
-      push_to_list(what_ptr, temp);
+    size_t i = (size_t)node->hash & (capacity - 1);
+    while (atomic_load_explicit(&index->slots[i], memory_order_relaxed) !=
+           NULL) {
+      i = (i + 1) & (capacity - 1);
     }
-    returns = KB_OK;
+    atomic_store_explicit(&index->slots[i], node, memory_order_relaxed);
   }
-  // Checks if the intent is "where"
-  else if (compare_token(intent, "where") == 0) {
-    if (where_ptr == NULL) {
-      where_ptr = temp;
-    } else {
-      push_to_list(where_ptr, temp);
-    }
-    returns = KB_OK;
-  } else {
-    returns = KB_INVALID;
+  atomic_store_explicit(&section->index, index, memory_order_release);
+  if (old != NULL) {
+    epoch_retire(free, old);
   }
-  return returns;
+  return KB_OK;
 }
 
 /*
- * Read a knowledge base from a file.
+ * Helper function to make sure there is room in the hash index of a section
+ * for one more node, keeping it below its maximum load.
  *
  * Input:
- *   f - the file
+ *   section - the section
  *
- * Returns: the number of entity/response pairs successful read from the file
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
  */
-int knowledge_read(FILE *f) {
 
-  int s_pairs = 0;
-  char buffer[MAX_ENTITY + MAX_RESPONSE + 2];
-  char *start=NULL, *end=NULL, *intent = NULL, *token=NULL;
-  Node *temp_ptr = NULL;
-  const char delimiter[2] = "=";
-  int entity_count = 0;
+static int make_room(Section *section) {
+  KBIndex *index = section->index;
+  size_t capacity = index == NULL ? 0 : index->capacity;
+  if ((section->count + 1) * 100 > capacity * KB_MAX_LOAD) {
+    return grow_index(section);
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to append a new node to the end of a section's list in
+ * constant time, using the section's tail pointer. Duplicate entities are
+ * handled by knowledge_put() before the node is pushed.
+ *
+ * Input:
+ *   section  - the section
+ *   new_node - the new_node that we want to push onto the section's list
+ *
+ */
+
+void push_to_list(Section *section, Node *new_node) {
+  if (section->tail == NULL) {
+    section->head = new_node;
+  } else {
+    section->tail->next = new_node;
+  }
+  section->tail = new_node;
+}
+
+/*
+ * Helper function to pass an entry of a section's pack on to the function
+ * walking the section (through pack_walk()), as a node, unless a node
+ * shadows it. The node's entity is one of the section's unpacked entities,
+ * if it has them.
+ *
+ * Input:
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   arg          - the KBPackWalk
+ */
 
-  char *entity, *response;
-  memset(buffer, 0, strlen(buffer));
-  while (fgets(buffer, MAX_ENTITY + MAX_RESPONSE + 2, f) != NULL) {
-    start = strstr(buffer, "[");
-    if (start != NULL) {
-      start += strlen("[");
-      end = strstr(buffer, "]");
-      if (end != NULL) {
-        intent = (char *)malloc(sizeof(start));
-        memcpy(intent, start, strlen(start) - strlen(end));
-        intent[end - start] = '\0';
+static void walk_packed(const char *entity, size_t entity_len,
+                        const char *response, size_t response_len,
+                        void *arg) {
+  KBPackWalk *walk = arg;
+  Section *section = walk->section;
+  if (walk->entities != NULL) {
+    entity = walk->entities;
+    walk->entities += entity_len;
+  }
+  KBKey key;
+  make_key(&key, entity, entity_len);
+  if (section->shadowed > 0) {
+    KBIndex *index = section->index;
+    Node *node = load_slot(index, find_slot(index, &key));
+    if (node != NULL) {
+      if (node->response != NULL) {
+        walk->fn(node, walk->arg);
       }
+      return;
     }
-    else if (strstr(buffer, delimiter) && intent != NULL) {
-      if (compare_token(intent, "what") == 0 ||
-          compare_token(intent, "where") == 0 ||
-          compare_token(intent, "who") == 0) 
-      {
-        //only saves
-        token = strtok(buffer, delimiter);
-        entity = token;
-        token = strtok(NULL, delimiter);
-        response = token;
-        if (response) {
-          for (int i = 0; i < strlen(response); i++) {
-            if (response[i] == '\n') {
-              response[i] = '\0';
-            }
-          }
-        }
-        int success=knowledge_put(intent, entity, response);
-        if(success==-3){
-          return -1;
-        }
-        else if(success==0){
-          entity_count++;
+  }
+  Node view;
+  view.entity = entity;
+  view.entity_len = entity_len;
+  view.response = response;
+  view.response_len = response_len;
+  view.flags = KB_NODE_PACKED;
+  view.hash = key.hash;
+  view.next = NULL;
+  walk->fn(&view, walk->arg);
+}
+
+/*
+ * Call a function for every entity in a section, in the order in which they
+ * were added: the base or pack entities first (or the nodes shadowing them),
+ * then the nodes on the list (or the nodes that replaced them). Removed
+ * entities are skipped. The knowledge base's lock must be held.
+ *
+ * A pack's entries are passed as nodes flagged KB_NODE_PACKED, whose
+ * response is only valid until fn returns; so is the entity, unless the
+ * section's entities have been unpacked (see unpack_section()).
+ *
+ * Input:
+ *   section - the section
+ *   fn      - the function, which is passed each node and 'arg'
+ *   arg     - an argument to pass on to fn
+ */
+void section_walk(Section *section, void (*fn)(const Node *node, void *arg),
+                  void *arg) {
+  const KBBase *base = section->base;
+  KBIndex *index = section->index;
+
+  for (size_t e = 0; base != NULL && e < base->count; e++) {
+    const KBSnapshotEntry *entry = &base->entries[e];
+    Node view;
+    view.entity = base->data + entry->entity_offset;
+    view.entity_len = entry->entity_len;
+    view.response = base->data + entry->response_offset;
+    view.response_len = entry->response_len;
+    view.flags = 0;
+    view.hash = entry->hash;
+    view.next = NULL;
+
+    if (section->shadowed > 0) {
+      Node *node = load_slot(
+          index, find_entity_slot(index, view.entity, view.entity_len));
+      if (node != NULL) {
+        if (node->response != NULL) {
+          fn(node, arg);
         }
-        
-      }
-      else 
-      {
-        free(intent);
         continue;
       }
     }
+    fn(&view, arg);
+  }
+
+  const KBPack *pack = section->pack;
+  if (pack != NULL) {
+    KBPackWalk walk = {section, fn, arg, section->unpacked};
+    pack_walk(pack, walk_packed, &walk);
+  }
+
+  for (Node *node = section->head; node != NULL; node = node->next) {
+    const Node *current = node;
+    if (section->replaced > 0) {
+      current = load_slot(
+          index, find_entity_slot(index, node->entity, node->entity_len));
+    }
+    if (current->response != NULL) {
+      fn(current, arg);
+    }
+  }
+}
+
+/*
+ * Helper function to drop the fuzzy index and radix tree of a section, e.g.
+ * because its entities are about to move. Each is built again when it is
+ * next needed.
+ *
+ * Input:
+ *   section - the section
+ */
+
+static void drop_side_indexes(Section *section) {
+  fuzzy_destroy(section->fuzzy);
+  section->fuzzy = NULL;
+  radix_destroy(section->radix);
+  section->radix = NULL;
+}
+
+/*
+ * Helper function to add a new entity to the fuzzy index and radix tree of a
+ * section, if it has them. Both are dropped if either cannot be kept up to
+ * date.
+ *
+ * Input:
+ *   section - the section
+ *   node    - the entity's node
+ */
+
+static void add_to_side_indexes(Section *section, const Node *node) {
+  if ((section->fuzzy != NULL &&
+       fuzzy_add(section->fuzzy, node->entity, node->entity_len) != KB_OK) ||
+      (section->radix != NULL &&
+       radix_insert(section->radix, node->entity, node->entity_len) !=
+           KB_OK)) {
+    drop_side_indexes(section);
   }
-  return entity_count;
 }
 
 /*
- * Reset the knowledge base, removing all know entitities from all intents.
+ * Helper function to find the current node of an entity already in a
+ * section (e.g. one from its radix tree). The knowledge base's lock must be
+ * held.
+ *
+ * Input:
+ *   section - the section
+ *   entity  - the entity (need not be null-terminated)
+ *   len     - the length of the entity, less than MAX_ENTITY
+ *   view    - a node to fill in, if the entity is in the base or pack
+ *   buffer  - a buffer of MAX_RESPONSE characters to receive the response,
+ *             if the entity is in the pack
+ *
+ * Returns:
+ *   NULL, if the entity is not in the section (or has been removed)
+ *   A pointer to the node (which may be 'view')
  */
-void knowledge_reset() {
-  // Creating the temp pointer to traverse linked list
-  Node *current_ptr;
-  // Freeing the memory for the who linked list
-  while (what_ptr != NULL) {
-    current_ptr = what_ptr;
-    what_ptr = what_ptr->next;
-    free(current_ptr);
+
+static const Node *section_node(Section *section, const char *entity,
+                                size_t len, Node *view, char *buffer) {
+  KBKey key;
+  make_key(&key, entity, len);
+  KBIndex *index = section->index;
+  if (index != NULL) {
+    Node *node = load_slot(index, find_slot(index, &key));
+    if (node != NULL) {
+      return node->response != NULL ? node : NULL;
+    }
+  }
+
+  const KBBase *base = section->base;
+  const KBSnapshotEntry *entry = find_base(base, &key);
+  view->flags = 0;
+  view->hash = key.hash;
+  view->next = NULL;
+  if (entry != NULL) {
+    view->entity = base->data + entry->entity_offset;
+    view->entity_len = entry->entity_len;
+    view->response = base->data + entry->response_offset;
+    view->response_len = entry->response_len;
+    return view;
   }
-  // freeing the memory allocated for the "where" linked list
-  while (where_ptr != NULL) {
-    current_ptr = where_ptr;
-    where_ptr = where_ptr->next;
-    free(current_ptr);
+
+  int found = pack_find(section->pack, key.folded, len, buffer, MAX_RESPONSE);
+  if (found < 0) {
+    return NULL;
+  }
+  view->entity = entity;
+  view->entity_len = len;
+  view->response = buffer;
+  view->response_len = found;
+  view->flags = KB_NODE_PACKED;
+  return view;
+}
+
+/*
+ * Helper function to write out the entities of a section's pack, if it has
+ * one, for the indexes that point at them (the fuzzy index, radix tree and
+ * search index), which is done the first time one of them is built. They
+ * are kept until the section is reset. The knowledge base's lock must be
+ * held.
+ *
+ * Input:
+ *   section - the section
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int unpack_section(Section *section) {
+  const KBPack *pack = section->pack;
+  if (pack == NULL || section->unpacked != NULL) {
+    return KB_OK;
   }
-  // freeing the memory allocated for the "who" linked list
-  while (who_ptr != NULL) {
-    current_ptr = who_ptr;
-    who_ptr = who_ptr->next;
-    free(current_ptr);
+  KBPackStats stats;
+  pack_stats(pack, &stats);
+  section->unpacked = malloc(stats.entity_bytes + 1);
+  if (section->unpacked == NULL) {
+    return KB_NOMEM;
   }
+  pack_entities(pack, section->unpacked);
+  return KB_OK;
+}
+
+/*
+ * Helper function to add an entity to the radix tree being built by
+ * section_radix(), through section_walk().
+ *
+ * Input:
+ *   node - the node
+ *   arg  - the KBRadixBuild
+ */
 
-  what_ptr = NULL;
-  where_ptr = NULL;
-  who_ptr = NULL;
+static void add_radix(const Node *node, void *arg) {
+  KBRadixBuild *build = arg;
+  if (build->result == KB_OK) {
+    build->result = radix_insert(build->radix, node->entity,
+                                 node->entity_len);
+  }
 }
 
 /*
- * Write the knowledge base to a file.
+ * Helper function to get the radix tree of a section, building it if the
+ * section does not have one yet. The knowledge base's lock must be held.
  *
  * Input:
- *   f - the file
+ *   section - the section
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the radix tree
  */
-void knowledge_write(FILE *f) { 
-  char buffer[MAX_ENTITY + MAX_RESPONSE + 2];
-  Node *temp_ptr = NULL;
-  const char delimiter[2] = "=";
-  const char end[3] = "\n\0";
-  char *entity, *response;
-  memset(buffer, 0, sizeof(buffer));
-  if (who_ptr != NULL) {
-    fprintf(f, "[who]\n");
-    temp_ptr = who_ptr;
-    while (temp_ptr != NULL) {
-      entity = temp_ptr->entity;
-      response = temp_ptr->response;
-      write_section_to_file(f, entity, response, buffer, delimiter, end);
-      temp_ptr = temp_ptr->next;
+
+static const KBRadix *section_radix(Section *section) {
+  if (section->radix == NULL) {
+    KBRadixBuild build = {radix_create(), KB_NOMEM};
+    if (build.radix != NULL && unpack_section(section) == KB_OK) {
+      build.result = KB_OK;
+      section_walk(section, add_radix, &build);
     }
-    fprintf(f, "\n");
+    if (build.result != KB_OK) {
+      radix_destroy(build.radix);
+      return NULL;
+    }
+    section->radix = build.radix;
+  }
+  return section->radix;
+}
+
+/*
+ * Helper function to empty a section. The nodes themselves belong to the
+ * knowledge base's arena; the hash index and base are retired, since lookups
+ * may still be using them. The pack, if any, is kept (see replace_pack()), but
+ * its unpacked entities go with the indexes that pointed at them.
+ *
+ * Input:
+ *   section - the section
+ */
+
+static void reset_section(Section *section) {
+  KBIndex *index = atomic_exchange(&section->index, NULL);
+  const KBBase *base = atomic_exchange(&section->base, NULL);
+  if (index != NULL) {
+    epoch_retire(free, index);
+  }
+  if (base != NULL) {
+    epoch_retire(free, (void *)base);
+  }
+  drop_side_indexes(section);
+  free(section->unpacked);
+  section->unpacked = NULL;
+  section->head = section->tail = NULL;
+  section->count = section->shadowed = section->replaced = 0;
+  section->removed = 0;
+}
+
+/*
+ * Helper function to replace the pack of a section, or drop it. The old pack
+ * is retired, since lookups may still be using it. The section should be
+ * reset (see reset_section()) once nothing points into the old pack.
+ *
+ * Input:
+ *   section - the section
+ *   pack    - the new pack, or NULL
+ */
+
+static void replace_pack(Section *section, const KBPack *pack) {
+  const KBPack *old = atomic_exchange(&section->pack, pack);
+  if (old != NULL) {
+    epoch_retire(pack_destroy, (void *)old);
+  }
+}
+
+/*
+ * Helper function to help create a new_node. The node is allocated from
+ * the knowledge base's arena; its strings are either copied into the arena as
+ * well, or referenced where they are (e.g. in a file mapped by kb_read()).
+ *
+ * Input:
+ *   kb           - the knowledge base
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   hash         - the hash of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   copy         - 1 to copy the entity into the arena, 0 to point at it
+ *                  (the response is never copied)
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the new node
+ */
+
+Node *create_node(kb_t *kb, const char *entity, size_t entity_len,
+                  uint64_t hash, const char *response, size_t response_len,
+                  int copy) {
+
+  Node *new_node = arena_alloc(&kb->arena, sizeof(Node), sizeof(void *));
+  if (new_node == NULL) {
+    return NULL;
   }
-  if (what_ptr != NULL) {
-    fprintf(f, "[what]\n");
-    temp_ptr = what_ptr;
-    while (temp_ptr != NULL) {
-      entity = temp_ptr->entity;
-      response = temp_ptr->response;
-      write_section_to_file(f, entity, response, buffer, delimiter, end);
-      temp_ptr = temp_ptr->next;
+  if (copy) {
+    entity = arena_strndup(&kb->arena, entity, entity_len);
+    if (entity == NULL) {
+      return NULL;
     }
-    fprintf(f, "\n");
   }
-  if (where_ptr != NULL) {
-    fprintf(f, "[where]\n");
-    temp_ptr = where_ptr;
-    while (temp_ptr != NULL) {
-      entity = temp_ptr->entity;
-      response = temp_ptr->response;
-      write_section_to_file(f, entity, response, buffer, delimiter, end);
-      temp_ptr = temp_ptr->next;
+  new_node->entity = entity;
+  new_node->response = response;
+  new_node->entity_len = entity_len;
+  new_node->response_len = response_len;
+  new_node->flags = 0;
+  atomic_init(&new_node->referenced, 0);
+  new_node->hash = hash;
+  new_node->next = NULL;
+  return new_node;
+}
+
+// Reading of ini files
+
+/*
+ * Helper function to look up the response to an entity in a section. The
+ * caller must have entered a read-side critical section (see epoch.c).
+ *
+ * Input:
+ *   section  - the section
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found (and copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ */
+
+static int get_from_section(Section *section, const char *entity,
+                            char *response, int n) {
+  // Entities are shorter than MAX_ENTITY, so a longer one is not known
+  size_t len = strnlen(entity, MAX_ENTITY);
+  if (len >= MAX_ENTITY) {
+    return KB_NOTFOUND;
+  }
+  KBKey key;
+  make_key(&key, entity, len);
+
+  // The base is read before the index: materialise_base() indexes the base's
+  // entities before it drops the base, so one of the two has each of them
+  const KBBase *base = atomic_load_explicit(&section->base,
+                                            memory_order_acquire);
+  KBIndex *index = atomic_load_explicit(&section->index, memory_order_acquire);
+  if (index != NULL) {
+    Node *node = load_slot(index, find_slot(index, &key));
+    if (node != NULL && node->response == NULL) {
+      return KB_NOTFOUND; // removed, even if it is in the base
+    }
+    if (node != NULL) {
+      // Mark it for the eviction sweep, only if it needs to be, so hot
+      // entries are not written to by every lookup
+      if ((node->flags & KB_NODE_OWNED) &&
+          !atomic_load_explicit(&node->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&node->referenced, 1, memory_order_relaxed);
+      } else if (node->flags & KB_NODE_SPILLED) {
+        metrics_add(METRIC_SPILL_READS, 1);
+      }
+      snprintf(response, n, "%.*s", (int)node->response_len, node->response);
+      return KB_OK;
     }
-    fprintf(f, "\n");
   }
-}
\ No newline at end of file
+
+  // The pack is read after the index: kb_pack() replaces the pack before it
+  // drops the index, so one of the two has each entity
+  const KBSnapshotEntry *entry = find_base(base, &key);
+  if (entry == NULL) {
+    const KBPack *pack = atomic_load_explicit(&section->pack,
+                                              memory_order_acquire);
+    return pack_find(pack, key.folded, len, response, n) < 0 ? KB_NOTFOUND
+                                                              : KB_OK;
+  }
+  snprintf(response, n, "%.*s", (int)entry->response_len,
+           base->data + entry->response_offset);
+  return KB_OK;
+}
+
+/*
+ * Helper function to look up the response to an entity in the disk store a
+ * knowledge base is kept in, once its section has not found it. The caller
+ * must have entered a read-side critical section (see epoch.c).
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   section  - the section
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found (and copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ */
+
+static int get_from_store(kb_t *kb, Section *section, const char *entity,
+                          char *response, int n) {
+  size_t len = strnlen(entity, MAX_ENTITY);
+  if (len >= MAX_ENTITY) {
+    return KB_NOTFOUND;
+  }
+  KBKey key;
+  make_key(&key, entity, len);
+  return store_get(kb->store, (int)(section - kb->sections), key.folded, len,
+                   key.hash, response, n);
+}
+
+/*
+ * Get the response to a question. This takes no locks and never waits, even
+ * while other threads are changing the knowledge base.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is
+ * copied to the response buffer) KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_get(kb_t *kb, const char *intent, const char *entity, char *response,
+           int n) {
+  TRACE_SPAN("kb_get");
+  Section *section = find_section(kb, intent);
+  if (section == NULL) {
+    return KB_INVALID;
+  }
+
+  if (epoch_enter() != 0) {
+    return KB_NOMEM;
+  }
+  int result = get_from_section(section, entity, response, n);
+  if (result == KB_NOTFOUND && kb->store != NULL) {
+    result = get_from_store(kb, section, entity, response, n);
+  }
+  epoch_leave();
+  return result;
+}
+
+/*
+ * Helper function to drop the search index of a knowledge base, e.g. because
+ * the responses it points to are about to move. It is built again when it is
+ * next needed.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void drop_search(kb_t *kb) {
+  search_destroy(kb->search);
+  kb->search = NULL;
+}
+
+/*
+ * Helper function to add a node to the knowledge base's search index, if it
+ * has one, in place of the entity's earlier response. The index is dropped if
+ * it cannot be kept up to date, and built again when it is next needed.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the node's section
+ *   node    - the node
+ */
+
+static void add_to_search(kb_t *kb, Section *section, const Node *node) {
+  if (kb->search != NULL &&
+      search_add(kb->search, (int)(section - kb->sections), node->entity,
+                 node->entity_len, node->hash, node->response,
+                 node->response_len) != KB_OK) {
+    drop_search(kb);
+  }
+}
+
+/*
+ * Helper function to make a node's response its own, counting it against the
+ * knowledge base's budget, before the node is indexed. A new response counts
+ * as looked up, so it is not the first to be moved to the spill file.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   node  - the node
+ *   owned - 1 if the response was malloc()ed for the node, 0 if not
+ */
+
+static void own_response(kb_t *kb, Node *node, int owned) {
+  if (owned) {
+    node->flags = KB_NODE_OWNED;
+    atomic_store_explicit(&node->referenced, 1, memory_order_relaxed);
+    kb->resident += node->response_len + 1;
+  }
+}
+
+/*
+ * Helper function to give up the response of a node that is no longer
+ * indexed, if it is the node's own (see kb_set_budget()). It is freed once no
+ * lookup can still be reading it. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb   - the knowledge base
+ *   node - the node
+ */
+
+static void release_response(kb_t *kb, const Node *node) {
+  if (node->flags & KB_NODE_OWNED) {
+    kb->resident -= node->response_len + 1;
+    epoch_retire(free, (void *)node->response);
+  }
+}
+
+/*
+ * Helper function to get the spill file of a knowledge base, creating it if
+ * there is none. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *
+ * Returns:
+ *   NULL, if the file could not be created
+ *   A pointer to the spill file
+ */
+
+static KBSpill *get_spill(kb_t *kb) {
+  if (kb->spill == NULL) {
+    kb->spill = spill_create(kb->spill_dir);
+  }
+  return kb->spill;
+}
+
+/*
+ * Helper function to move the response of the node in a slot of a section's
+ * index to the spill file, by indexing a node that points to it there in its
+ * place. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the section
+ *   i       - the index of the slot, whose node's response is its own
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the response could not be written to the spill file
+ */
+
+static int evict_slot(kb_t *kb, Section *section, size_t i) {
+  KBIndex *index = section->index;
+  Node *node = load_slot(index, i);
+  KBSpill *spill = get_spill(kb);
+  const char *stored =
+      spill == NULL
+          ? NULL
+          : spill_append(spill, node->response, node->response_len, 1);
+  if (stored == NULL) {
+    return KB_IOERROR;
+  }
+  Node *temp = create_node(kb, node->entity, node->entity_len, node->hash,
+                           stored, node->response_len, 0);
+  if (temp == NULL) {
+    return KB_NOMEM;
+  }
+  temp->flags = KB_NODE_SPILLED;
+  atomic_store_explicit(&index->slots[i], temp, memory_order_release);
+  section->replaced++;
+  if (kb->search != NULL) {
+    search_move(kb->search, (int)(section - kb->sections), temp->entity,
+                temp->entity_len, temp->hash, stored);
+  }
+  release_response(kb, node);
+  metrics_add(METRIC_EVICTED, 1);
+  return KB_OK;
+}
+
+/*
+ * Helper function to move responses to the spill file until those left in
+ * memory fit the knowledge base's budget. The hand of a clock sweeps the
+ * slots of the sections' indexes: a response looked up since the hand last
+ * passed is spared (and its mark cleared), and any other is moved, so the
+ * responses moved are ones that have not been looked up for a while. The
+ * knowledge base's lock must be held. It does nothing if the responses are
+ * within the budget, or there is none.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void evict_responses(kb_t *kb) {
+  if (kb->budget == 0 || kb->resident <= kb->budget) {
+    return;
+  }
+  TRACE_SPAN("evict_responses");
+  // Twice round the clock clears every mark, so it is enough to find one
+  size_t total = 0;
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    KBIndex *index = kb->sections[s].index;
+    total += index == NULL ? 0 : index->capacity;
+  }
+
+  for (size_t swept = 0; kb->resident > kb->budget && swept < 2 * total;
+       swept++) {
+    Section *section = &kb->sections[kb->clock_section];
+    KBIndex *index = section->index;
+    if (index == NULL || kb->clock_slot >= index->capacity) {
+      kb->clock_section = (kb->clock_section + 1) % KB_MAX_SECTIONS;
+      kb->clock_slot = 0;
+      continue;
+    }
+    Node *node = load_slot(index, kb->clock_slot);
+    if (node != NULL && (node->flags & KB_NODE_OWNED)) {
+      if (atomic_load_explicit(&node->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&node->referenced, 0, memory_order_relaxed);
+      } else if (evict_slot(kb, section, kb->clock_slot) != KB_OK) {
+        return; // over budget until the spill file can take more
+      }
+    }
+    kb->clock_slot++;
+  }
+}
+
+/*
+ * Helper function to insert an entity and its response into a section,
+ * overwriting the response if the entity is already in the section. The
+ * knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb           - the knowledge base
+ *   section      - the section
+ *   entity       - the entity (need not be null-terminated)
+ *   entity_len   - the length of the entity, at most MAX_ENTITY - 1
+ *   response     - the response (need not be null-terminated)
+ *   response_len - the length of the response, at most MAX_RESPONSE - 1
+ *   copy         - 1 to copy the strings into the arena, 0 to point at them
+ *                  (they must then live until the next reset)
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int put_to_section(kb_t *kb, Section *section, const char *entity,
+                          size_t entity_len, const char *response,
+                          size_t response_len, int copy) {
+  KBKey key;
+  make_key(&key, entity, entity_len);
+
+  // Only a new entity takes a slot, so only then is the index kept below its
+  // maximum load, counting the node to be added (which may move it)
+  KBIndex *index = section->index;
+  size_t i = 0;
+  Node *old = NULL;
+  if (index != NULL) {
+    i = find_slot(index, &key);
+    old = load_slot(index, i);
+  }
+  if (old == NULL) {
+    if (make_room(section) != KB_OK) {
+      return KB_NOMEM;
+    }
+    index = section->index;
+    i = find_slot(index, &key);
+  }
+
+  // Under a budget, a copy is the node's own, so it can be moved to the
+  // spill file and freed
+  int owned = copy && kb->budget > 0;
+  if (owned) {
+    char *own = malloc(response_len + 1);
+    if (own == NULL) {
+      return KB_NOMEM;
+    }
+    memcpy(own, response, response_len);
+    own[response_len] = '\0';
+    response = own;
+  } else if (copy) {
+    response = arena_strndup(&kb->arena, response, response_len);
+    if (response == NULL) {
+      return KB_NOMEM;
+    }
+  }
+
+  // Overwrite the response if the entity is already known, by indexing a new
+  // node in place of the old one, which lookups may be reading. The old node
+  // stays where it is until the next reset.
+  if (!copy) {
+    kb->borrowed += (old == NULL ? entity_len : 0) + response_len;
+  }
+  if (old != NULL) {
+    Node *temp = create_node(kb, old->entity, old->entity_len, key.hash,
+                             response, response_len, 0);
+    if (temp == NULL) {
+      if (owned) {
+        free((char *)response);
+      }
+      return KB_NOMEM;
+    }
+    own_response(kb, temp, owned);
+    atomic_store_explicit(&index->slots[i], temp, memory_order_release);
+    section->replaced++;
+    if (old->response == NULL) {
+      // The entity was removed; it is back
+      section->removed--;
+      add_to_side_indexes(section, temp);
+    }
+    add_to_search(kb, section, temp);
+    release_response(kb, old);
+    evict_responses(kb);
+    return KB_OK;
+  }
+
+  // Create a new Node to store the data
+  Node *temp = create_node(kb, entity, entity_len, key.hash, response,
+                           response_len, copy);
+  if (temp == NULL) {
+    if (owned) {
+      free((char *)response);
+    }
+    return KB_NOMEM;
+  }
+  own_response(kb, temp, owned);
+  atomic_store_explicit(&index->slots[i], temp, memory_order_release);
+  section->count++;
+  if (find_base(section->base, &key) != NULL ||
+      pack_find(section->pack, key.folded, key.len, NULL, 0) >= 0) {
+    section->shadowed++;
+  } else {
+    push_to_list(section, temp);
+    add_to_side_indexes(section, temp);
+  }
+  add_to_search(kb, section, temp);
+  evict_responses(kb);
+  return KB_OK;
+}
+
+/*
+ * Helper function to free an arena that has been retired (see kb_reset()).
+ *
+ * Input:
+ *   arg - the arena, which was allocated with malloc()
+ */
+
+static void free_arena(void *arg) {
+  arena_reset(arg);
+  free(arg);
+}
+
+/*
+ * Helper function to free the responses collected by release_responses()
+ * (called through epoch_retire(), once no lookup can be reading them).
+ *
+ * Input:
+ *   arg - the responses, ending with NULL, in an array allocated with malloc()
+ */
+
+static void free_responses(void *arg) {
+  char **responses = arg;
+  for (size_t r = 0; responses[r] != NULL; r++) {
+    free(responses[r]);
+  }
+  free(responses);
+}
+
+/*
+ * Helper function to give up the responses of the indexed nodes that are
+ * their own, as the knowledge base is emptied (see clear_memtable()). They are
+ * freed once no lookup can still be reading them. The knowledge base's lock
+ * must be held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void release_responses(kb_t *kb) {
+  size_t count = 0;
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    KBIndex *index = kb->sections[s].index;
+    for (size_t i = 0; index != NULL && i < index->capacity; i++) {
+      Node *node = load_slot(index, i);
+      count += node != NULL && (node->flags & KB_NODE_OWNED);
+    }
+  }
+
+  // Without room to list them, wait until they can be freed at once
+  char **responses = NULL;
+  if (count > 0) {
+    responses = malloc((count + 1) * sizeof(char *));
+    if (responses == NULL) {
+      epoch_synchronize();
+    }
+  }
+  size_t r = 0;
+  for (int s = 0; s < KB_MAX_SECTIONS && count > 0; s++) {
+    KBIndex *index = kb->sections[s].index;
+    for (size_t i = 0; index != NULL && i < index->capacity; i++) {
+      Node *node = load_slot(index, i);
+      if (node == NULL || !(node->flags & KB_NODE_OWNED)) {
+        continue;
+      } else if (responses != NULL) {
+        responses[r++] = (char *)node->response;
+      } else {
+        free((char *)node->response);
+      }
+    }
+  }
+  if (responses != NULL) {
+    responses[r] = NULL;
+    epoch_retire(free_responses, responses);
+  }
+  kb->resident = 0;
+  kb->clock_section = 0;
+  kb->clock_slot = 0;
+}
+
+/*
+ * Helper function to empty the sections of a knowledge base, along with the
+ * arena their nodes are in. The files loaded and the spill file are kept,
+ * e.g. because the sections have only been written to the disk store (see
+ * flush_memtable()), and a file is still being read. The memory is freed once
+ * no lookup can still be reading it. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void clear_memtable(kb_t *kb) {
+  release_responses(kb);
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    reset_section(&kb->sections[s]);
+  }
+  drop_search(kb);
+  kb->borrowed = 0;
+
+  Arena *arena = malloc(sizeof(Arena));
+  if (arena != NULL) {
+    *arena = kb->arena;
+    memset(&kb->arena, 0, sizeof(Arena));
+    epoch_retire(free_arena, arena);
+  } else {
+    epoch_synchronize();
+    arena_reset(&kb->arena);
+  }
+}
+
+/*
+ * Helper function to write the sections of a knowledge base kept in a disk
+ * store to the store as a run, once they have grown to
+ * KB_STORE_MEMTABLE_BYTES (see store_flush()), then empty them, and the
+ * journal that recorded them. Entries that point into a loaded file count
+ * as the bytes they point to, so that a file larger than memory is written
+ * out a run at a time as it is read, not left mapped whole. The knowledge
+ * base's lock must be held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void flush_memtable(kb_t *kb) {
+  if (kb->store == NULL ||
+      store_flush(kb->store, kb,
+                  kb->arena.used + kb->resident + kb->borrowed) != 1) {
+    return;
+  }
+  clear_memtable(kb);
+  if (kb->journal != NULL) {
+    journal_truncate(kb->journal);
+  }
+}
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base.
+ *
+ * Input:
+ *   kb        - the knowledge base
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_FOUND, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_IOERROR, if the answer was learned but could not be journalled
+ */
+int kb_put(kb_t *kb, const char *intent, const char *entity,
+           const char *response) {
+  TRACE_SPAN("kb_put");
+  /*This function will be called each time there is a new entity/response pair
+  that is unknown, which we will then create a node containing the
+  entity/response in the appropriate section*/
+  Section *section = find_section(kb, intent);
+  if (section == NULL) {
+    return KB_INVALID;
+  }
+
+  // Entities are stored truncated, so they are indexed (and journalled)
+  // truncated too
+  size_t entity_len = strnlen(entity, MAX_ENTITY - 1);
+  size_t response_len = strnlen(response, MAX_RESPONSE - 1);
+  uint64_t seq = 0;
+  pthread_mutex_lock(&kb->lock);
+  KBJournal *journal = kb->journal;
+  int result = put_to_section(kb, section, entity, entity_len, response,
+                              response_len, 1);
+  if (result == KB_OK && journal != NULL) {
+    seq = journal_append(journal, KB_JOURNAL_PUT, intent, entity, entity_len,
+                         response, response_len);
+  }
+  if (result == KB_OK) {
+    flush_memtable(kb);
+  }
+  pthread_mutex_unlock(&kb->lock);
+
+  // Wait for the record to be durable without holding up other writers
+  if (result == KB_OK && journal != NULL) {
+    result = journal_commit(journal, seq);
+  }
+  return result;
+}
+
+/*
+ * Helper function to get the whole contents of a file in memory. Regular
+ * files are mapped read-only, if asked; anything else (e.g. a pipe) is read
+ * into a buffer. The contents stay valid until release_source().
+ *
+ * Input:
+ *   f   - the file
+ *   map - 1 to map a regular file, 0 to read it into a buffer (e.g. because
+ *         it may be changed in place while it is loaded)
+ *
+ * Returns:
+ *   NULL, if the file could not be read or there is memory allocation error
+ *   A pointer to the source, which is not yet linked into a knowledge base
+ */
+
+static KBSource *open_source(FILE *f, int map) {
+  KBSource *source = calloc(1, sizeof(KBSource));
+  if (source == NULL) {
+    return NULL;
+  }
+
+#ifndef _WIN32
+  struct stat st;
+  if (map && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0 && ftell(f) == 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      source->data = data;
+      source->size = st.st_size;
+      source->mapped = 1;
+      source->device = st.st_dev;
+      source->inode = st.st_ino;
+      return source;
+    }
+  }
+#endif
+
+  // A regular file is read into a buffer of its size, so it is not copied
+  // as the buffer grows
+  size_t capacity = 0, got;
+#ifndef _WIN32
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    capacity = st.st_size + 1;
+    source->data = malloc(capacity);
+    if (source->data == NULL) {
+      free(source);
+      return NULL;
+    }
+  }
+#endif
+  do {
+    if (source->size == capacity) {
+      capacity = capacity == 0 ? 64 * 1024 : capacity * 2;
+      char *data = realloc(source->data, capacity);
+      if (data == NULL) {
+        free(source->data);
+        free(source);
+        return NULL;
+      }
+      source->data = data;
+    }
+    got = fread(source->data + source->size, 1, capacity - source->size, f);
+    source->size += got;
+  } while (got > 0);
+  return source;
+}
+
+/*
+ * Helper function to unmap or free the contents of a source (called through
+ * epoch_retire(), once no lookup can be reading them).
+ *
+ * Input:
+ *   arg - the source
+ */
+
+static void release_source(void *arg) {
+  KBSource *source = arg;
+  free(source->path);
+  if (source->mapped == 2) {
+    free(source); // the spill file is released by kb_reset()
+    return;
+  }
+#ifndef _WIN32
+  if (source->mapped) {
+    munmap(source->data, source->size);
+    free(source);
+    return;
+  }
+#endif
+  free(source->data);
+  free(source);
+}
+
+/*
+ * Helper function to find the end of a line, and the first "=" on it, in one
+ * pass. With SSE2 the line is searched 16 bytes at a time.
+ *
+ * Input:
+ *   p   - the start of the line
+ *   end - the end of the buffer
+ *   eq  - receives a pointer to the first "=" on the line, or NULL if none
+ *
+ * Returns:
+ *   a pointer to the "\n" ending the line, or 'end' if it is the last line
+ */
+
+static const char *scan_line(const char *p, const char *end, const char **eq) {
+  *eq = NULL;
+#ifdef __SSE2__
+  const __m128i newlines = _mm_set1_epi8('\n');
+  const __m128i equals = _mm_set1_epi8('=');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    unsigned nl_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+    if (*eq == NULL) {
+      unsigned eq_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, equals));
+      if (nl_mask != 0) {
+        eq_mask &= (nl_mask & -nl_mask) - 1; // only those before the newline
+      }
+      if (eq_mask != 0) {
+        *eq = p + __builtin_ctz(eq_mask);
+      }
+    }
+    if (nl_mask != 0) {
+      return p + __builtin_ctz(nl_mask);
+    }
+    p += 16;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '\n') {
+      return p;
+    }
+    if (*p == '=' && *eq == NULL) {
+      *eq = p;
+    }
+  }
+  return end;
+}
+
+/*
+ * Helper function to load a compiled knowledge base. If the knowledge base is
+ * empty, the sections of the file become the bases of the sections, so
+ * nothing is parsed or allocated per entry; otherwise the entries are added
+ * to the knowledge base (pointing into the file) as knowledge_put() would.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   source - the contents of the file
+ *
+ * Returns: the number of entity/response pairs in the file, or KB_INVALID if
+ *   the file is damaged or from an incompatible version, or KB_NOMEM
+ */
+
+static int read_snapshot(kb_t *kb, KBSource *source) {
+  TRACE_SPAN("read_snapshot");
+  const KBSnapshotHeader *header = snapshot_validate(source->data,
+                                                     source->size);
+  if (header == NULL) {
+    return KB_INVALID;
+  }
+
+  const KBSnapshotSection *table =
+      (const KBSnapshotSection *)(source->data + header->sections_offset);
+  int empty = 1;
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    if (kb->sections[s].count > 0 || kb->sections[s].base != NULL ||
+        kb->sections[s].pack != NULL) {
+      empty = 0;
+    }
+  }
+  int entity_count = 0;
+
+  for (uint64_t t = 0; t < header->section_count; t++) {
+    Section *section = add_section(kb, table[t].name,
+                                   strlen(table[t].name));
+    if (section == NULL) {
+      continue;
+    }
+    const KBSnapshotEntry *entries =
+        (const KBSnapshotEntry *)(source->data + table[t].entries_offset);
+
+    if (empty && section->base == NULL) {
+      KBBase *base = malloc(sizeof(KBBase));
+      if (base == NULL) {
+        return KB_NOMEM;
+      }
+      base->data = source->data;
+      base->entries = entries;
+      base->slots = (const uint32_t *)(source->data + table[t].slots_offset);
+      base->count = table[t].entry_count;
+      base->capacity = table[t].slot_count;
+      atomic_store_explicit(&section->base, base, memory_order_release);
+      drop_side_indexes(section);
+      drop_search(kb);
+      kb->borrowed += table[t].entry_count * sizeof(KBSnapshotEntry) +
+                      table[t].slot_count * sizeof(uint32_t);
+    } else {
+      for (uint64_t e = 0; e < table[t].entry_count; e++) {
+        if (put_to_section(kb, section,
+                           source->data + entries[e].entity_offset,
+                           entries[e].entity_len,
+                           source->data + entries[e].response_offset,
+                           entries[e].response_len, 0) == KB_NOMEM) {
+          return KB_NOMEM;
+        }
+      }
+    }
+    entity_count += table[t].entry_count;
+  }
+  return entity_count;
+}
+
+/*
+ * Helper function to read the next line of a knowledge file that means
+ * anything: a section header, or an entry in a section the chatbot can ask
+ * about. Entities and responses are cut to the longest the knowledge base
+ * stores.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   pos     - the start of the line to read from, which is moved past the
+ *             lines read
+ *   end     - the end of the file's contents
+ *   section - the section of the lines so far (NULL if they are skipped),
+ *             which a header changes
+ *   line    - receives the entry
+ *
+ * Returns:
+ *   KB_LINE_ENTRY, if an entry was read
+ *   KB_LINE_HEADER, if a section header was read
+ *   KB_LINE_END, at the end of the contents
+ */
+
+static int next_line(kb_t *kb, const char **pos, const char *end,
+                     Section **section, KBLine *line) {
+  const char *start, *eol, *eq;
+  for (start = *pos; start < end; start = eol + 1) {
+    eol = scan_line(start, end, &eq);
+    const char *last = eol;
+    if (last > start && last[-1] == '\r') {
+      last--;
+    }
+
+    if (start[0] == '[') {
+      // A section header; remember the section for the following lines
+      const char *close = memchr(start, ']', last - start);
+      *section = NULL;
+      if (close != NULL) {
+        *section = add_section(kb, start + 1, close - start - 1);
+      }
+      *pos = eol + 1;
+      return KB_LINE_HEADER;
+    } else if (eq != NULL && eq > start && *section != NULL) {
+      line->entity = start;
+      line->entity_len = eq - start;
+      line->response = eq + 1;
+      line->response_len = last - (eq + 1);
+      if (line->entity_len > MAX_ENTITY - 1) {
+        line->entity_len = MAX_ENTITY - 1;
+      }
+      if (line->response_len > MAX_RESPONSE - 1) {
+        line->response_len = MAX_RESPONSE - 1;
+      }
+      *pos = eol + 1;
+      return KB_LINE_ENTRY;
+    }
+  }
+  *pos = end;
+  return KB_LINE_END;
+}
+
+/*
+ * Helper function to add the entries of a loaded file to the knowledge base.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   source - the contents of the file
+ *
+ * Returns: as kb_read()
+ */
+
+static int read_source(kb_t *kb, KBSource *source) {
+  TRACE_SPAN("read_source");
+
+  int entity_count = 0;
+  Section *section = NULL;
+
+  if (source->size >= 8 && memcmp(source->data, KB_SNAPSHOT_MAGIC, 8) == 0) {
+    entity_count = read_snapshot(kb, source);
+    return entity_count == KB_NOMEM ? -1 : entity_count;
+  }
+
+  const char *pos = source->data, *end = source->data + source->size;
+  KBLine line;
+  int kind;
+  while ((kind = next_line(kb, &pos, end, &section, &line)) != KB_LINE_END) {
+    if (kind == KB_LINE_ENTRY) {
+      if (put_to_section(kb, section, line.entity, line.entity_len,
+                         line.response, line.response_len, 0) == KB_NOMEM) {
+        return -1;
+      }
+      flush_memtable(kb);
+      entity_count++;
+    }
+  }
+  return entity_count;
+}
+
+/*
+ * Helper function to move the contents of a source that were read into a
+ * buffer to the spill file, if the knowledge base has a budget or is kept in
+ * a disk store, so that the responses that point into them don't take
+ * memory (and a store can load a file larger than memory). They stay where
+ * they are if they can't be moved. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   source - the source, before any node points into it
+ */
+
+static void spill_source(kb_t *kb, KBSource *source) {
+  if ((kb->budget == 0 && kb->store == NULL) || source->mapped ||
+      source->size == 0) {
+    return;
+  }
+  KBSpill *spill = get_spill(kb);
+  const char *data =
+      spill == NULL
+          ? NULL
+          : spill_append(spill, source->data, source->size, sizeof(uint64_t));
+  if (data != NULL) {
+    free(source->data);
+    source->data = (char *)data;
+    source->mapped = 2;
+  }
+}
+
+/*
+ * Helper function to read a knowledge base from a file, mapped or read into
+ * memory (see kb_read() and kb_read_mapped()).
+ *
+ * Input:
+ *   kb  - the knowledge base
+ *   f   - the file
+ *   map - 1 to map the file, if it is a regular file, 0 to read it
+ *
+ * Returns: as kb_read()
+ */
+
+static int load_file(kb_t *kb, FILE *f, int map) {
+  uint64_t started = metrics_clock();
+  KBSource *source = open_source(f, map);
+  if (source == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  spill_source(kb, source);
+  source->next = kb->sources;
+  kb->sources = source;
+  int entity_count = read_source(kb, source);
+  if (entity_count > 0) {
+    flush_memtable(kb); // e.g. a large compiled file
+  }
+  if (entity_count > 0 && kb->journal != NULL) {
+    journal_request_compact(kb->journal); // loads are not journalled
+  }
+  pthread_mutex_unlock(&kb->lock);
+
+  if (entity_count > 0) {
+    metrics_add(METRIC_LOADED, entity_count);
+  }
+  metrics_add(METRIC_LOAD_NS, metrics_clock() - started);
+  return entity_count;
+}
+
+/*
+ * Read a knowledge base from a file.
+ *
+ * The file is read into memory whole and scanned in a single pass. The nodes
+ * point straight into that copy of the file's bytes, which is kept until
+ * kb_reset(); a response only gets its own copy once it is overwritten by
+ * kb_put(). The file itself may be changed or removed as soon as this
+ * returns. Lines are either a "[section]" header or an "entity=response"
+ * pair. The header of each section makes its name a question word of the
+ * knowledge base, if it is not one already (see intent_add_question());
+ * entries in sections whose names cannot be are skipped.
+ *
+ * Files written by kb_compile() are recognised by their magic number and
+ * used as they are (see read_snapshot()).
+ *
+ * Input:
+ *   kb - the knowledge base
+ *   f  - the file
+ *
+ * Returns: the number of entity/response pairs successful read from the file,
+ *   KB_INVALID if the file is a damaged compiled knowledge base, or -1 if
+ *   there was a memory allocation failure
+ */
+int kb_read(kb_t *kb, FILE *f) {
+  TRACE_SPAN("kb_read");
+  return load_file(kb, f, 0);
+}
+
+/*
+ * Read a knowledge base from a file that will not change while it is loaded,
+ * as kb_read() does, but map the file rather than read it, so it is not
+ * copied and its pages are shared with the page cache (a pipe is read as
+ * kb_read() would). The nodes point into the mapping until kb_reset(), so
+ * the file must not be truncated or written over in place meanwhile (a
+ * write to it shows through, and a truncation kills the process with
+ * SIGBUS); replacing it with a new file, as kb_write() and a rename do, is
+ * safe. Loading a file only ever replaced that way, e.g. a journal's
+ * snapshot, saves both the time and the memory of a copy.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *   f  - the file
+ *
+ * Returns: as kb_read()
+ */
+int kb_read_mapped(kb_t *kb, FILE *f) {
+  TRACE_SPAN("kb_read_mapped");
+  return load_file(kb, f, 1);
+}
+
+/*
+ * Helper function to remove an entity from a section, by indexing a node
+ * without a response in its place (or, for an entity in the base, in front
+ * of it), which lookups take to mean the entity is not known. The knowledge
+ * base's lock must be held.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the section
+ *   entity  - the entity (need not be null-terminated)
+ *   len     - the length of the entity, less than MAX_ENTITY
+ *
+ * Returns:
+ *   KB_OK, if the entity was removed
+ *   KB_NOTFOUND, if the entity is not in the section
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int remove_from_section(kb_t *kb, Section *section, const char *entity,
+                               size_t len) {
+  KBKey key;
+  make_key(&key, entity, len);
+  if (make_room(section) != KB_OK) {
+    return KB_NOMEM;
+  }
+
+  KBIndex *index = section->index;
+  size_t i = find_slot(index, &key);
+  Node *old = load_slot(index, i);
+  const char *stored;
+  if (old != NULL) {
+    if (old->response == NULL) {
+      return KB_NOTFOUND;
+    }
+    stored = old->entity;
+  } else {
+    const KBSnapshotEntry *entry = find_base(section->base, &key);
+    if (entry == NULL) {
+      return KB_NOTFOUND;
+    }
+    stored = section->base->data + entry->entity_offset;
+  }
+
+  Node *temp = create_node(kb, stored, len, key.hash, NULL, 0, 0);
+  if (temp == NULL) {
+    return KB_NOMEM;
+  }
+  atomic_store_explicit(&index->slots[i], temp, memory_order_release);
+  if (old != NULL) {
+    section->replaced++;
+    release_response(kb, old);
+  } else {
+    section->count++;
+    section->shadowed++;
+  }
+  section->removed++;
+
+  // The fuzzy index cannot forget an entity, so it is built again when it
+  // is next needed
+  if (section->radix != NULL) {
+    radix_remove(section->radix, stored, len);
+  }
+  fuzzy_destroy(section->fuzzy);
+  section->fuzzy = NULL;
+  if (kb->search != NULL) {
+    search_remove(kb->search, (int)(section - kb->sections), stored, len,
+                  key.hash);
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to add an entry to a list of changes.
+ *
+ * Input:
+ *   changes - the list
+ *   section - the entry's section
+ *   line    - the entry
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int add_change(KBChanges *changes, Section *section,
+                      const KBLine *line) {
+  if (changes->count == changes->capacity) {
+    size_t capacity = changes->capacity == 0 ? 64 : changes->capacity * 2;
+    KBChange *items = realloc(changes->items, capacity * sizeof(KBChange));
+    if (items == NULL) {
+      return KB_NOMEM;
+    }
+    changes->items = items;
+    changes->capacity = capacity;
+  }
+  KBKey key;
+  make_key(&key, line->entity, line->entity_len);
+  KBChange *change = &changes->items[changes->count++];
+  change->section = section;
+  change->line = *line;
+  change->hash = key.hash ^ (uint64_t)(uintptr_t)section * 0x9E3779B97F4A7C15u;
+  return KB_OK;
+}
+
+/*
+ * Helper function to index a list of changes by section and entity, so that
+ * has_change() can look entries up in it.
+ *
+ * Input:
+ *   changes - the list
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int index_changes(KBChanges *changes) {
+  size_t slots = 16;
+  while (slots < changes->count * 2) {
+    slots *= 2;
+  }
+  changes->slots = calloc(slots, sizeof(uint32_t));
+  if (changes->slots == NULL) {
+    return KB_NOMEM;
+  }
+  changes->slot_count = slots;
+  for (size_t c = 0; c < changes->count; c++) {
+    size_t i = (size_t)changes->items[c].hash & (slots - 1);
+    while (changes->slots[i] != 0) {
+      i = (i + 1) & (slots - 1);
+    }
+    changes->slots[i] = (uint32_t)c + 1;
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to determine whether a list of changes indexed by
+ * index_changes() has an entry for the same entity (ignoring case) as
+ * another change.
+ *
+ * Input:
+ *   changes - the list
+ *   change  - the other change
+ *
+ * Returns:
+ *   1, if the list has such an entry
+ *   0, otherwise
+ */
+
+static int has_change(const KBChanges *changes, const KBChange *change) {
+  size_t mask = changes->slot_count - 1;
+  for (size_t i = (size_t)change->hash & mask; changes->slots[i] != 0;
+       i = (i + 1) & mask) {
+    const KBChange *other = &changes->items[changes->slots[i] - 1];
+    if (other->hash != change->hash || other->section != change->section ||
+        other->line.entity_len != change->line.entity_len) {
+      continue;
+    }
+    size_t k = 0;
+    while (k < change->line.entity_len &&
+           FOLD_CHAR(other->line.entity[k]) ==
+               FOLD_CHAR(change->line.entity[k])) {
+      k++;
+    }
+    if (k == change->line.entity_len) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Helper function to apply the changes kb_reload() found: remove the entities
+ * that were only in the old version of the file, then add or overwrite the
+ * entries of the new one whose responses are not already known. The entries
+ * are copied, so the new version need only be kept to compare with the next.
+ * The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   added   - the entries of the new version that may have changed
+ *   removed - the entries of the old version that may have gone
+ *   delta   - counts the changes made
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int apply_changes(kb_t *kb, KBChanges *added, const KBChanges *removed,
+                         KBDelta *delta) {
+  if (index_changes(added) != KB_OK) {
+    return KB_NOMEM;
+  }
+  for (size_t c = 0; c < removed->count; c++) {
+    const KBChange *change = &removed->items[c];
+    if (has_change(added, change)) {
+      continue; // moved or changed, not removed
+    }
+    int result = remove_from_section(kb, change->section, change->line.entity,
+                                     change->line.entity_len);
+    if (result == KB_NOMEM) {
+      return KB_NOMEM;
+    }
+    delta->removed += result == KB_OK;
+  }
+
+  for (size_t c = 0; c < added->count; c++) {
+    const KBChange *change = &added->items[c];
+    const KBLine *line = &change->line;
+    Node view;
+    char buffer[MAX_RESPONSE];
+    const Node *node = section_node(change->section, line->entity,
+                                    line->entity_len, &view, buffer);
+    if (node != NULL && node->response_len == line->response_len &&
+        memcmp(node->response, line->response, line->response_len) == 0) {
+      continue;
+    }
+    if (put_to_section(kb, change->section, line->entity, line->entity_len,
+                       line->response, line->response_len, 1) != KB_OK) {
+      return KB_NOMEM;
+    }
+    if (node == NULL) {
+      delta->added++;
+    } else {
+      delta->changed++;
+    }
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to find how many bytes two buffers have in common at the
+ * start, comparing a page at a time while they match.
+ *
+ * Input:
+ *   a   - the one buffer
+ *   b   - the other
+ *   len - the length of the shorter one
+ *
+ * Returns:
+ *   the length of the common prefix
+ */
+
+static size_t common_prefix(const char *a, const char *b, size_t len) {
+  size_t p = 0;
+  while (len - p >= 4096 && memcmp(a + p, b + p, 4096) == 0) {
+    p += 4096;
+  }
+  while (p < len && a[p] == b[p]) {
+    p++;
+  }
+  return p;
+}
+
+/*
+ * Helper function to find how many bytes two buffers have in common at the
+ * end, comparing a page at a time while they match.
+ *
+ * Input:
+ *   a     - the one buffer
+ *   a_len - its length
+ *   b     - the other
+ *   b_len - its length
+ *   max   - the longest suffix to look for
+ *
+ * Returns:
+ *   the length of the common suffix
+ */
+
+static size_t common_suffix(const char *a, size_t a_len, const char *b,
+                            size_t b_len, size_t max) {
+  size_t s = 0;
+  while (max - s >= 4096 &&
+         memcmp(a + a_len - s - 4096, b + b_len - s - 4096, 4096) == 0) {
+    s += 4096;
+  }
+  while (s < max && a[a_len - s - 1] == b[b_len - s - 1]) {
+    s++;
+  }
+  return s;
+}
+
+/*
+ * Helper function to determine whether some lines of a knowledge file have a
+ * section header among them.
+ *
+ * Input:
+ *   p   - the start of the first line
+ *   end - the end of the lines
+ *
+ * Returns:
+ *   1, if one of the lines starts with '['
+ *   0, otherwise
+ */
+
+static int has_header(const char *p, const char *end) {
+  while (p < end) {
+    if (*p == '[') {
+      return 1;
+    }
+    const char *eol = memchr(p, '\n', end - p);
+    p = eol == NULL ? end : eol + 1;
+  }
+  return 0;
+}
+
+/*
+ * Helper function to reload a knowledge file that has changed. Only the lines
+ * between the longest common prefix and suffix of the two versions are
+ * parsed (unless a section header is among them, when the rest of the file
+ * is, since its lines may have moved to another section), so the work is in
+ * proportion to the size of the change, apart from comparing the bytes. An
+ * entity is assumed to be in a file once, as kb_write() saves it. The
+ * knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   old    - the version the knowledge base has
+ *   source - the new version
+ *   delta  - counts the changes made
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int reload_text(kb_t *kb, const KBSource *old, const KBSource *source,
+                       KBDelta *delta) {
+  TRACE_SPAN("reload_text");
+  const char *o = old->data, *w = source->data;
+  size_t o_len = old->size, w_len = source->size;
+  size_t shorter = o_len < w_len ? o_len : w_len;
+
+  // Both changed regions start and end on line boundaries
+  size_t p = common_prefix(o, w, shorter);
+  while (p > 0 && o[p - 1] != '\n') {
+    p--;
+  }
+  size_t s = common_suffix(o, o_len, w, w_len, shorter - p);
+  while (s > 0 && ((o_len - s > p && o[o_len - s - 1] != '\n') ||
+                   (w_len - s > p && w[w_len - s - 1] != '\n'))) {
+    s--;
+  }
+  if (has_header(o + p, o + o_len - s) || has_header(w + p, w + w_len - s)) {
+    s = 0;
+  }
+
+  // The section the regions start in is the same in both versions
+  Section *start = NULL;
+  KBLine line;
+  size_t h = p;
+  while (h > 0 && !(o[h - 1] == '[' && (h == 1 || o[h - 2] == '\n'))) {
+    h--;
+  }
+  if (h > 0) {
+    const char *pos = o + h - 1;
+    next_line(kb, &pos, o + p, &start, &line);
+  }
+
+  KBChanges added = {0}, removed = {0};
+  int result = KB_OK;
+  Section *section = start;
+  const char *pos = w + p, *end = w + w_len - s;
+  int kind;
+  while (result == KB_OK &&
+         (kind = next_line(kb, &pos, end, &section, &line)) != KB_LINE_END) {
+    if (kind == KB_LINE_ENTRY) {
+      result = add_change(&added, section, &line);
+    }
+  }
+  section = start;
+  pos = o + p;
+  end = o + o_len - s;
+  while (result == KB_OK &&
+         (kind = next_line(kb, &pos, end, &section, &line)) != KB_LINE_END) {
+    if (kind == KB_LINE_ENTRY) {
+      result = add_change(&removed, section, &line);
+    }
+  }
+
+  if (result == KB_OK) {
+    result = apply_changes(kb, &added, &removed, delta);
+  }
+  free(added.items);
+  free(added.slots);
+  free(removed.items);
+  free(removed.slots);
+  return result;
+}
+
+/*
+ * Helper function to find a section of a compiled knowledge base by the name
+ * of its question word, and use its entries as a base.
+ *
+ * Input:
+ *   data - the compiled knowledge base, which has been validated
+ *   name - the question word
+ *   base - receives the section's entries
+ *
+ * Returns:
+ *   NULL, if the compiled knowledge base has no such section
+ *   base
+ */
+
+static const KBBase *snapshot_section(const char *data, const char *name,
+                                      KBBase *base) {
+  const KBSnapshotHeader *header = (const KBSnapshotHeader *)data;
+  const KBSnapshotSection *table =
+      (const KBSnapshotSection *)(data + header->sections_offset);
+  for (uint64_t t = 0; t < header->section_count; t++) {
+    if (compare_token(table[t].name, name) == 0) {
+      base->data = data;
+      base->entries =
+          (const KBSnapshotEntry *)(data + table[t].entries_offset);
+      base->slots = (const uint32_t *)(data + table[t].slots_offset);
+      base->count = table[t].entry_count;
+      base->capacity = table[t].slot_count;
+      return base;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Helper function to collect the entries of one compiled knowledge base that
+ * are not in another with the same response, as changes.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   data    - the compiled knowledge base whose entries are collected
+ *   other   - the one to compare it with
+ *   compare - 1 to collect entries whose responses differ, 0 to collect only
+ *             entries the other does not have
+ *   changes - the list to add them to
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int snapshot_changes(kb_t *kb, const char *data, const char *other,
+                            int compare, KBChanges *changes) {
+  const KBSnapshotHeader *header = (const KBSnapshotHeader *)data;
+  const KBSnapshotSection *table =
+      (const KBSnapshotSection *)(data + header->sections_offset);
+  for (uint64_t t = 0; t < header->section_count; t++) {
+    Section *section = add_section(kb, table[t].name, strlen(table[t].name));
+    KBBase mine, theirs;
+    if (section == NULL || snapshot_section(data, table[t].name, &mine) ==
+                               NULL) {
+      continue;
+    }
+    const KBBase *base = snapshot_section(other, table[t].name, &theirs);
+
+    for (size_t e = 0; e < mine.count; e++) {
+      const KBSnapshotEntry *entry = &mine.entries[e];
+      KBLine line;
+      line.entity = data + entry->entity_offset;
+      line.entity_len = entry->entity_len;
+      line.response = data + entry->response_offset;
+      line.response_len = entry->response_len;
+      KBKey key;
+      make_key(&key, line.entity, line.entity_len);
+      const KBSnapshotEntry *found = find_base(base, &key);
+      if (found != NULL &&
+          (!compare ||
+           (found->response_len == entry->response_len &&
+            memcmp(other + found->response_offset, line.response,
+                   line.response_len) == 0))) {
+        continue;
+      }
+      if (add_change(changes, section, &line) != KB_OK) {
+        return KB_NOMEM;
+      }
+    }
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to reload a compiled knowledge base that has changed. Each
+ * entry of either version is looked up in the other's hash index, so the
+ * work is in proportion to the number of entries, but only the entries that
+ * changed are written. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   old    - the version the knowledge base has
+ *   source - the new version
+ *   delta  - counts the changes made
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the new version is damaged or from another version
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int reload_snapshot(kb_t *kb, const KBSource *old,
+                           const KBSource *source, KBDelta *delta) {
+  TRACE_SPAN("reload_snapshot");
+  if (snapshot_validate(source->data, source->size) == NULL) {
+    return KB_INVALID;
+  }
+  KBChanges added = {0}, removed = {0};
+  int result = snapshot_changes(kb, source->data, old->data, 1, &added);
+  if (result == KB_OK) {
+    result = snapshot_changes(kb, old->data, source->data, 0, &removed);
+  }
+  if (result == KB_OK) {
+    result = apply_changes(kb, &added, &removed, delta);
+  }
+  free(added.items);
+  free(added.slots);
+  free(removed.items);
+  free(removed.slots);
+  return result;
+}
+
+/*
+ * Helper function to determine whether a loaded file is a compiled knowledge
+ * base.
+ *
+ * Input:
+ *   source - the contents of the file
+ *
+ * Returns:
+ *   1, if the file starts with KB_SNAPSHOT_MAGIC
+ *   0, otherwise
+ */
+
+static int is_snapshot(const KBSource *source) {
+  return source->size >= 8 &&
+         memcmp(source->data, KB_SNAPSHOT_MAGIC, 8) == 0;
+}
+
+/*
+ * Helper function to check whether a knowledge base has been packed (see
+ * kb_pack()).
+ *
+ * Input:
+ *   kb - the knowledge base
+ *
+ * Returns:
+ *   1, if any of its sections has a pack
+ *   0, otherwise
+ */
+
+static int is_packed(kb_t *kb) {
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    if (kb->sections[s].pack != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Load a knowledge file (or compiled knowledge base), or, if this knowledge
+ * base loaded it with kb_reload() before, apply only what has changed since:
+ * add the entities that are new, overwrite those whose responses changed, and
+ * remove those that are gone, without ever emptying the knowledge base.
+ * Each change is made as one store, so a lookup finds either the old answer
+ * or the new one, and the whole delta is applied under the knowledge base's
+ * lock, so no other change or save sees part of it. Changes are not
+ * journalled, as loads are not; the file holds them.
+ *
+ * The file is read rather than mapped, since it is expected to be changed in
+ * place. The version first loaded is kept until kb_reset(), since nodes point
+ * into it; after that, only the latest version is kept, to compare with the
+ * next.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   path  - the name of the file
+ *   delta - receives the changes made (on the first load, every entry read
+ *           counts as added)
+ *
+ * Returns:
+ *   the number of changes made, if successful
+ *   KB_NOTFOUND, if the file could not be opened
+ *   KB_INVALID, if the file is a damaged compiled knowledge base, or the
+ *   knowledge base is kept in a disk store (see store.c) or packed
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_reload(kb_t *kb, const char *path, KBDelta *delta) {
+  TRACE_SPAN("kb_reload");
+  uint64_t started = metrics_clock();
+  memset(delta, 0, sizeof(KBDelta));
+  if (kb->store != NULL || is_packed(kb)) {
+    return KB_INVALID; // neither has a record of which file is which
+  }
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return KB_NOTFOUND;
+  }
+  KBSource *source = open_source(f, 0);
+  fclose(f);
+  if (source == NULL) {
+    return KB_NOMEM;
+  }
+  source->path = strdup(path);
+  if (source->path == NULL) {
+    release_source(source);
+    return KB_NOMEM;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  KBSource *old = kb->sources;
+  while (old != NULL && (old->path == NULL || strcmp(old->path, path) != 0)) {
+    old = old->next;
+  }
+  source->next = kb->sources;
+  kb->sources = source;
+
+  int result;
+  if (old == NULL || is_snapshot(old) != is_snapshot(source)) {
+    spill_source(kb, source);
+    int entity_count = read_source(kb, source);
+    result = entity_count == -1 ? KB_NOMEM : entity_count;
+    delta->added = entity_count > 0 ? entity_count : 0;
+  } else {
+    source->compared = 1;
+    result = is_snapshot(source) ? reload_snapshot(kb, old, source, delta)
+                                 : reload_text(kb, old, source, delta);
+  }
+
+  // The next version is compared with this one, if it was applied
+  if (result < 0) {
+    free(source->path);
+    source->path = NULL;
+  } else if (old != NULL && old->compared) {
+    KBSource **link = &kb->sources;
+    while (*link != old) {
+      link = &(*link)->next;
+    }
+    *link = old->next;
+    release_source(old);
+  } else if (old != NULL) {
+    free(old->path);
+    old->path = NULL;
+  }
+  size_t changes = delta->added + delta->changed + delta->removed;
+  if (changes > 0 && kb->journal != NULL) {
+    journal_request_compact(kb->journal);
+  }
+  pthread_mutex_unlock(&kb->lock);
+
+  if (delta->added + delta->changed > 0) {
+    metrics_add(METRIC_LOADED, delta->added + delta->changed);
+  }
+  metrics_add(METRIC_LOAD_NS, metrics_clock() - started);
+  return result < 0 ? result : (int)changes;
+}
+
+/*
+ * Helper function to turn the base of a section into ordinary nodes, keeping
+ * the order in which they were added. The nodes still point into the
+ * base's file; kb_detach() copies the strings afterwards. Every entity is
+ * indexed before the base is dropped, so lookups find each of them in one or
+ * the other throughout.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the section
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int materialise_base(kb_t *kb, Section *section) {
+  TRACE_SPAN("materialise_base");
+  const KBBase *base = section->base;
+  Node *added_head = section->head;
+  Node *added_tail = section->tail;
+  section->head = section->tail = NULL;
+
+  for (size_t e = 0; e < base->count; e++) {
+    const KBSnapshotEntry *entry = &base->entries[e];
+    const char *entity = base->data + entry->entity_offset;
+
+    if (make_room(section) != KB_OK) {
+      return KB_NOMEM;
+    }
+    KBIndex *index = section->index;
+    size_t i = find_entity_slot(index, entity, entry->entity_len);
+    Node *node = load_slot(index, i); // the node shadowing this entity
+    if (node == NULL) {
+      node = create_node(kb, entity, entry->entity_len, entry->hash,
+                         base->data + entry->response_offset,
+                         entry->response_len, 0);
+      if (node == NULL) {
+        return KB_NOMEM;
+      }
+      atomic_store_explicit(&index->slots[i], node, memory_order_release);
+      section->count++;
+    }
+    node->next = NULL;
+    push_to_list(section, node);
+  }
+
+  if (added_head != NULL) {
+    push_to_list(section, added_head);
+    section->tail = added_tail;
+  }
+  section->shadowed = 0;
+  atomic_store_explicit(&section->base, NULL, memory_order_release);
+  epoch_retire(free, (void *)base);
+  return KB_OK;
+}
+
+/*
+ * Helper function to make sure the node in a slot of a section's index does
+ * not point into a file, by indexing a copy of it in its place if it does.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   index - the section's hash index
+ *   i     - the index of the slot (which must not be empty)
+ *   lo    - the start of the file's contents
+ *   hi    - the end of the file's contents
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the node now in the slot
+ */
+
+static Node *detach_slot(kb_t *kb, KBIndex *index, size_t i, const char *lo,
+                         const char *hi) {
+  Node *node = load_slot(index, i);
+  const char *entity = node->entity;
+  const char *response = node->response;
+  if (entity >= lo && entity < hi) {
+    entity = arena_strndup(&kb->arena, entity, node->entity_len);
+  }
+  if (response >= lo && response < hi) {
+    response = arena_strndup(&kb->arena, response, node->response_len);
+  }
+  if (entity == NULL || (response == NULL && node->response != NULL)) {
+    return NULL;
+  }
+  if (entity == node->entity && response == node->response) {
+    return node;
+  }
+
+  Node *copy = create_node(kb, entity, node->entity_len, node->hash, response,
+                           node->response_len, 0);
+  if (copy != NULL) {
+    copy->flags = node->flags; // the response, if its own, moves with it
+    atomic_store_explicit(&index->slots[i], copy, memory_order_release);
+  }
+  return copy;
+}
+
+/*
+ * Helper function to make sure no node of a section points into a file. The
+ * list is rebuilt from the nodes now in the index, so none of the nodes on it
+ * has been replaced afterwards.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   section - the section
+ *   lo      - the start of the file's contents
+ *   hi      - the end of the file's contents
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int detach_section(kb_t *kb, Section *section, const char *lo,
+                          const char *hi) {
+  const KBBase *base = section->base;
+  KBIndex *index = section->index;
+
+  // The nodes shadowing base entities, which are not on the list
+  for (size_t e = 0; section->shadowed > 0 && e < base->count; e++) {
+    const KBSnapshotEntry *entry = &base->entries[e];
+    size_t i = find_entity_slot(index, base->data + entry->entity_offset,
+                                entry->entity_len);
+    if (load_slot(index, i) != NULL && detach_slot(kb, index, i, lo, hi) ==
+                                           NULL) {
+      return KB_NOMEM;
+    }
+  }
+
+  Node *prev = NULL;
+  Node *node = section->head;
+  while (node != NULL) {
+    Node *next = node->next;
+    size_t i = find_entity_slot(index, node->entity, node->entity_len);
+    Node *current = detach_slot(kb, index, i, lo, hi);
+    if (current == NULL) {
+      return KB_NOMEM;
+    }
+    current->next = next;
+    if (prev == NULL) {
+      section->head = current;
+    } else {
+      prev->next = current;
+    }
+    prev = current;
+    node = next;
+  }
+  section->tail = prev;
+  section->replaced = 0;
+  return KB_OK;
+}
+
+/*
+ * Copy the strings of every node that points into a loaded file into the
+ * arena, and unmap the file once no lookup can be reading it. This must be
+ * done before the file is overwritten or truncated in place. (Saving over it
+ * through savefile_open() replaces it instead, which the mapping survives.)
+ * Every knowledge base that loaded the file must let go of it.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   filename - the name of the file
+ *
+ * Returns:
+ *   KB_OK, if the file is no longer referenced
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_detach(kb_t *kb, const char *filename) {
+  int result = KB_OK;
+#ifndef _WIN32
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return KB_OK;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  KBSource **link = &kb->sources;
+  while (*link != NULL && result == KB_OK) {
+    KBSource *source = *link;
+    if (!source->mapped || source->device != (uint64_t)st.st_dev ||
+        source->inode != (uint64_t)st.st_ino) {
+      link = &source->next;
+      continue;
+    }
+
+    const char *lo = source->data, *hi = source->data + source->size;
+    drop_search(kb);
+    for (int s = 0; s < KB_MAX_SECTIONS && result == KB_OK; s++) {
+      Section *section = &kb->sections[s];
+      const KBBase *base = section->base;
+      drop_side_indexes(section);
+      if (base != NULL && base->data == source->data) {
+        result = materialise_base(kb, section);
+      }
+      if (result == KB_OK) {
+        result = detach_section(kb, section, lo, hi);
+      }
+    }
+    if (result == KB_OK) {
+      *link = source->next;
+      epoch_retire(release_source, source);
+    }
+  }
+  pthread_mutex_unlock(&kb->lock);
+#endif
+  return result;
+}
+
+/*
+ * Helper function to let go of the files a knowledge base has loaded and its
+ * spill file, e.g. once its sections have been emptied (see
+ * clear_memtable()), so no node points into them. They are released once no
+ * lookup can still be reading them. The knowledge base's lock must be held.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+
+static void release_files(kb_t *kb) {
+  if (kb->spill != NULL) {
+    epoch_retire(spill_destroy, kb->spill);
+    kb->spill = NULL;
+  }
+  while (kb->sources != NULL) {
+    KBSource *source = kb->sources;
+    kb->sources = source->next;
+    epoch_retire(release_source, source);
+  }
+}
+
+/*
+ * Reset the knowledge base, removing all know entitities from all intents,
+ * and every run of the disk store it is kept in, if any. The memory is freed
+ * once no lookup can still be reading it.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void kb_reset(kb_t *kb) {
+  TRACE_SPAN("kb_reset");
+  uint64_t seq = 0;
+  pthread_mutex_lock(&kb->lock);
+  KBJournal *journal = kb->journal;
+  if (journal != NULL) {
+    seq = journal_append(journal, KB_JOURNAL_RESET, "", "", 0, "", 0);
+  }
+  clear_memtable(kb);
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    replace_pack(&kb->sections[s], NULL);
+  }
+  intent_reset(kb);
+  if (kb->store != NULL) {
+    store_reset(kb->store);
+  }
+  release_files(kb);
+  pthread_mutex_unlock(&kb->lock);
+
+  if (journal != NULL) {
+    journal_commit(journal, seq);
+  }
+}
+
+/*
+ * Helper function to write out the lines gathered by kb_write(). They go
+ * straight to the file's descriptor, bypassing its stdio buffer.
+ *
+ * Input:
+ *   writer - the writer
+ */
+
+static void writer_flush(KBWriter *writer) {
+  TRACE_SPAN("writer_flush");
+  const char *p = writer->buffer;
+  size_t len = writer->used;
+  writer->used = 0;
+  writer->written += len;
+#ifdef _WIN32
+  if (writer->result == KB_OK && fwrite(p, 1, len, writer->f) != len) {
+    writer->result = KB_IOERROR;
+  }
+#else
+  while (len > 0 && writer->result == KB_OK) {
+    ssize_t written = write(fileno(writer->f), p, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      writer->result = KB_IOERROR;
+      break;
+    }
+    p += written;
+    len -= written;
+  }
+#endif
+}
+
+/*
+ * Helper function to start gathering lines to write to a file, flushing the
+ * file's own buffer first.
+ *
+ * Input:
+ *   writer - the writer to set up
+ *   f      - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int writer_open(KBWriter *writer, FILE *f) {
+  writer->f = f;
+  writer->used = 0;
+  writer->written = 0;
+  writer->result = fflush(f) == 0 ? KB_OK : KB_IOERROR;
+#ifdef _WIN32
+  writer->buffer = malloc(KB_WRITE_BUFFER);
+#else
+  if (posix_memalign((void **)&writer->buffer, KB_WRITE_ALIGN,
+                     KB_WRITE_BUFFER) != 0) {
+    writer->buffer = NULL;
+  }
+#endif
+  return writer->buffer == NULL ? KB_NOMEM : KB_OK;
+}
+
+/*
+ * Helper function to write out the rest of the lines gathered, free the
+ * writer's buffer, and count the save in the metrics.
+ *
+ * Input:
+ *   writer  - the writer
+ *   result  - KB_OK, or the error that stopped the lines being gathered
+ *   started - when the save started, from metrics_clock()
+ *
+ * Returns:
+ *   KB_OK, if every line was written
+ *   result, or KB_IOERROR, otherwise
+ */
+
+static int writer_close(KBWriter *writer, int result, uint64_t started) {
+  writer_flush(writer);
+  if (result != KB_OK) {
+    writer->result = result;
+  }
+
+  free(writer->buffer);
+  if (writer->result == KB_OK) {
+    metrics_add(METRIC_SAVED_BYTES, writer->written);
+  }
+  metrics_add(METRIC_SAVE_NS, metrics_clock() - started);
+  return writer->result;
+}
+
+/*
+ * Helper function to add bytes to the lines gathered by kb_write(), writing
+ * them out whenever the buffer fills up.
+ *
+ * Input:
+ *   writer - the writer
+ *   data   - the bytes
+ *   len    - the number of bytes, at most KB_WRITE_BUFFER
+ */
+
+static void writer_append(KBWriter *writer, const char *data, size_t len) {
+  if (writer->used + len > KB_WRITE_BUFFER) {
+    writer_flush(writer);
+  }
+  memcpy(writer->buffer + writer->used, data, len);
+  writer->used += len;
+}
+
+/*
+ * Helper function (called by section_walk()) to write a node to a file as
+ * "entity=response".
+ *
+ * Input:
+ *   node - the node
+ *   arg  - the writer
+ */
+
+static void write_node(const Node *node, void *arg) {
+  KBWriter *writer = arg;
+  size_t len = node->entity_len + node->response_len + 2;
+  if (writer->used + len > KB_WRITE_BUFFER) {
+    writer_flush(writer);
+  }
+  char *p = writer->buffer + writer->used;
+  memcpy(p, node->entity, node->entity_len);
+  p += node->entity_len;
+  *p++ = '=';
+  memcpy(p, node->response, node->response_len);
+  p[node->response_len] = '\n';
+  writer->used += len;
+}
+
+/*
+ * Helper function to write the line for an entity, as radix_list() passes it
+ * on.
+ *
+ * Input:
+ *   entity - the entity
+ *   len    - the length of the entity
+ *   arg    - the writer
+ */
+
+static void write_entity(const char *entity, size_t len, void *arg) {
+  KBWriter *writer = arg;
+  Node view;
+  char buffer[MAX_RESPONSE];
+  const Node *node = section_node(writer->section, entity, len, &view, buffer);
+  if (node != NULL) {
+    write_node(node, writer);
+  }
+}
+
+/*
+ * Helper function to write the line for an entry of a disk store's runs, as
+ * store_walk() passes it on, unless the section has the entity (which is
+ * newer, and so written instead).
+ *
+ * Input:
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   arg          - the KBRunWriter
+ */
+
+static void write_run_entry(const char *entity, size_t entity_len,
+                            const char *response, size_t response_len,
+                            void *arg) {
+  KBRunWriter *run_writer = arg;
+  KBKey key;
+  make_key(&key, entity, entity_len);
+  KBIndex *index = run_writer->index;
+  if ((index != NULL && load_slot(index, find_slot(index, &key)) != NULL) ||
+      find_base(run_writer->base, &key) != NULL) {
+    return;
+  }
+  Node node;
+  node.entity = entity;
+  node.entity_len = entity_len;
+  node.response = response;
+  node.response_len = response_len;
+  write_node(&node, run_writer->writer);
+}
+
+/*
+ * Helper function to write the entries of one section of a disk store's runs
+ * that the section itself does not have. They are written in the order the
+ * runs have them, since sorting them would take as much memory as the store.
+ *
+ * Input:
+ *   writer  - the writer
+ *   runs    - the runs, or NULL if there is no store
+ *   s       - the section number
+ *   index   - the section's hash index, or NULL
+ *   base    - the section's base, or NULL
+ */
+
+static void write_runs(KBWriter *writer, const KBStoreRuns *runs, int s,
+                       KBIndex *index, const KBBase *base) {
+  if (runs == NULL) {
+    return;
+  }
+  KBRunWriter run_writer;
+  run_writer.writer = writer;
+  run_writer.index = index;
+  run_writer.base = base;
+  store_walk(runs, s, write_run_entry, &run_writer);
+}
+
+/*
+ * Helper function to write one section of the knowledge base to a file, in
+ * order of the entities' case-folded characters, so that the same knowledge
+ * is always saved the same way, followed by the entries of the disk store's
+ * runs (see write_runs()).
+ *
+ * Input:
+ *   writer  - the writer
+ *   name    - the name of the section, e.g. "who"
+ *   section - the section
+ *   runs    - the disk store's runs, or NULL
+ *   s       - the section number
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int write_section(KBWriter *writer, const char *name, Section *section,
+                         const KBStoreRuns *runs, int s) {
+  const KBBase *base = section->base;
+  if (section->head == NULL && (base == NULL || base->count == 0) &&
+      section->pack == NULL && (runs == NULL || store_entries(runs, s) == 0)) {
+    return KB_OK;
+  }
+  const KBRadix *radix = section_radix(section);
+  if (radix == NULL) {
+    return KB_NOMEM;
+  }
+  char header[MAX_INTENT + 3];
+  int len = snprintf(header, sizeof(header), "[%s]\n", name);
+  writer_append(writer, header, len);
+  writer->section = section;
+  radix_list(radix, "", 0, 0, SIZE_MAX, write_entity, writer);
+  write_runs(writer, runs, s, section->index, base);
+  writer_append(writer, "\n", 1);
+  return KB_OK;
+}
+
+/*
+ * Write the knowledge base to a file, each section in order of its entities
+ * (see write_section()). The lines are gathered in a large buffer and
+ * written out a buffer at a time, so f's own buffer is flushed first, and
+ * nothing should be written to f through stdio afterwards except after
+ * fflush().
+ *
+ * Input:
+ *   kb - the knowledge base
+ *   f  - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written
+ */
+int kb_write(kb_t *kb, FILE *f) {
+  TRACE_SPAN("kb_write");
+  uint64_t started = metrics_clock();
+  KBWriter writer;
+  if (writer_open(&writer, f) != KB_OK) {
+    return KB_NOMEM;
+  }
+
+  int result = KB_OK;
+  pthread_mutex_lock(&kb->lock);
+  const KBStoreRuns *runs = kb->store == NULL ? NULL : store_runs(kb->store);
+  for (int s = 0; s < intent_sections(kb) && result == KB_OK; s++) {
+    result = write_section(&writer, intent_section_name(kb, s),
+                           &kb->sections[s], runs, s);
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return writer_close(&writer, result, started);
+}
+
+/*
+ * Take a point-in-time view of a knowledge base, which kb_view_write() can
+ * save while the knowledge base goes on changing. Nodes are never modified
+ * once they are indexed, so the view is a copy of each section's hash index
+ * (a pointer per slot), taken under the lock. The calling thread enters an
+ * epoch (see epoch.c) before the lock is released, and stays in it until it
+ * calls kb_view_close(), so the nodes, bases, packs and files the view points
+ * to stay valid until then, even if the knowledge base is reset.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the view, to be freed with kb_view_close()
+ */
+KBView *kb_view(kb_t *kb) {
+  TRACE_SPAN("kb_view");
+  KBView *view = calloc(1, sizeof(KBView));
+  if (view == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  if (epoch_enter() != 0) {
+    pthread_mutex_unlock(&kb->lock);
+    free(view);
+    return NULL;
+  }
+  view->section_count = intent_sections(kb);
+  view->runs = kb->store == NULL ? NULL : store_runs(kb->store);
+  for (int s = 0; s < view->section_count; s++) {
+    Section *section = &kb->sections[s];
+    KBViewSection *copy = &view->sections[s];
+    snprintf(copy->name, MAX_INTENT, "%s", intent_section_name(kb, s));
+    KBIndex *index = section->index;
+    copy->base = section->base;
+    copy->pack = section->pack;
+    copy->has_nodes = section->head != NULL;
+    if (index == NULL) {
+      continue;
+    }
+    copy->index =
+        malloc(sizeof(KBIndex) + index->capacity * sizeof(index->slots[0]));
+    if (copy->index == NULL) {
+      pthread_mutex_unlock(&kb->lock);
+      kb_view_close(view);
+      return NULL;
+    }
+    copy->index->capacity = index->capacity;
+    for (size_t i = 0; i < index->capacity; i++) {
+      atomic_store_explicit(&copy->index->slots[i], load_slot(index, i),
+                            memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return view;
+}
+
+/*
+ * Helper function to fill in an entity to be written by kb_view_write().
+ *
+ * Input:
+ *   entry        - the entity to fill in
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ */
+
+static void make_view_entry(KBViewEntry *entry, const char *entity,
+                            size_t entity_len, const char *response,
+                            size_t response_len) {
+  uint64_t prefix = 0;
+  for (size_t k = 0; k < 8; k++) {
+    prefix = prefix << 8 |
+             (k < entity_len ? (unsigned char)FOLD_CHAR(entity[k]) : 0);
+  }
+  entry->prefix = prefix;
+  entry->entity = entity;
+  entry->response = response;
+  entry->entity_len = entity_len;
+  entry->response_len = response_len;
+}
+
+/*
+ * Helper function (called by qsort()) to order entities as the radix tree
+ * does: by their case-folded characters, a prefix before the entities that
+ * extend it.
+ *
+ * Input:
+ *   a - the one entity
+ *   b - the other
+ *
+ * Returns:
+ *   as strcmp()
+ */
+
+static int compare_view_entries(const void *a, const void *b) {
+  const KBViewEntry *x = a, *y = b;
+  if (x->prefix != y->prefix) {
+    return x->prefix < y->prefix ? -1 : 1;
+  }
+  size_t len = x->entity_len < y->entity_len ? x->entity_len : y->entity_len;
+  for (size_t k = 8; k < len; k++) {
+    int cx = (unsigned char)FOLD_CHAR(x->entity[k]);
+    int cy = (unsigned char)FOLD_CHAR(y->entity[k]);
+    if (cx != cy) {
+      return cx - cy;
+    }
+  }
+  return (x->entity_len > y->entity_len) - (x->entity_len < y->entity_len);
+}
+
+/*
+ * Helper function to write the line for an entity to be written by
+ * kb_view_write().
+ *
+ * Input:
+ *   writer - the writer
+ *   entry  - the entity
+ */
+
+static void write_view_entry(KBWriter *writer, const KBViewEntry *entry) {
+  Node node;
+  node.entity = entry->entity;
+  node.entity_len = entry->entity_len;
+  node.response = entry->response;
+  node.response_len = entry->response_len;
+  write_node(&node, writer);
+}
+
+/*
+ * Helper function to write the line for an entry of a view's pack, as
+ * pack_walk() passes it on, after the entities of the view's hash index that
+ * come before it, unless the hash index has the entity (which is newer, and
+ * so written instead). Both are in the same order, so they are merged.
+ *
+ * Input:
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   arg          - the KBViewMerge
+ */
+
+static void write_view_packed(const char *entity, size_t entity_len,
+                              const char *response, size_t response_len,
+                              void *arg) {
+  KBViewMerge *merge = arg;
+  KBViewEntry packed;
+  make_view_entry(&packed, entity, entity_len, response, response_len);
+  while (merge->next < merge->count &&
+         compare_view_entries(&merge->entries[merge->next], &packed) < 0) {
+    write_view_entry(merge->writer, &merge->entries[merge->next++]);
+  }
+  KBKey key;
+  make_key(&key, entity, entity_len);
+  KBIndex *index = merge->index;
+  if (index != NULL && load_slot(index, find_slot(index, &key)) != NULL) {
+    return; // shadowed by a node
+  }
+  write_view_entry(merge->writer, &packed);
+}
+
+/*
+ * Helper function to write one section of a view to a file, in the same
+ * order and form as write_section().
+ *
+ * Input:
+ *   writer  - the writer
+ *   name    - the name of the section, e.g. "who"
+ *   view    - the view
+ *   s       - the section number
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int write_view_section(KBWriter *writer, const char *name,
+                              const KBView *view, int s) {
+  const KBViewSection *section = &view->sections[s];
+  const KBBase *base = section->base;
+  KBIndex *index = section->index;
+  size_t base_count = base == NULL ? 0 : base->count;
+  if (!section->has_nodes && base_count == 0 && section->pack == NULL &&
+      (view->runs == NULL || store_entries(view->runs, s) == 0)) {
+    return KB_OK;
+  }
+  size_t capacity = (index == NULL ? 0 : index->capacity) + base_count;
+  KBViewEntry *entries = malloc((capacity + 1) * sizeof(KBViewEntry));
+  if (entries == NULL) {
+    return KB_NOMEM;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; index != NULL && i < index->capacity; i++) {
+    Node *node = load_slot(index, i);
+    if (node != NULL && node->response != NULL) {
+      make_view_entry(&entries[count++], node->entity, node->entity_len,
+                      node->response, node->response_len);
+    }
+  }
+  for (size_t e = 0; e < base_count; e++) {
+    const KBSnapshotEntry *entry = &base->entries[e];
+    const char *entity = base->data + entry->entity_offset;
+    KBKey key;
+    make_key(&key, entity, entry->entity_len);
+    if (index != NULL && load_slot(index, find_slot(index, &key)) != NULL) {
+      continue; // shadowed by a node
+    }
+    make_view_entry(&entries[count++], entity, entry->entity_len,
+                    base->data + entry->response_offset, entry->response_len);
+  }
+  qsort(entries, count, sizeof(KBViewEntry), compare_view_entries);
+
+  char header[MAX_INTENT + 3];
+  int len = snprintf(header, sizeof(header), "[%s]\n", name);
+  writer_append(writer, header, len);
+  KBViewMerge merge = {writer, index, entries, count, 0};
+  if (section->pack != NULL) {
+    pack_walk(section->pack, write_view_packed, &merge);
+  }
+  for (; merge.next < count; merge.next++) {
+    write_view_entry(writer, &entries[merge.next]);
+  }
+  write_runs(writer, view->runs, s, index, base);
+  writer_append(writer, "\n", 1);
+  free(entries);
+  return KB_OK;
+}
+
+/*
+ * Write a view of a knowledge base to a file, as kb_write() would have
+ * written the knowledge base when the view was taken. It takes no locks, so
+ * the knowledge base can be changed (or even reset) while it runs; the
+ * entities of each section are sorted rather than listed from its radix
+ * tree, which may change.
+ *
+ * Input:
+ *   view    - the view, from kb_view()
+ *   f       - the file (as kb_write())
+ *   written - receives the number of bytes written
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written
+ */
+int kb_view_write(const KBView *view, FILE *f, uint64_t *written) {
+  TRACE_SPAN("kb_view_write");
+  uint64_t started = metrics_clock();
+  KBWriter writer;
+  if (writer_open(&writer, f) != KB_OK) {
+    return KB_NOMEM;
+  }
+
+  int result = KB_OK;
+  for (int s = 0; s < view->section_count && result == KB_OK; s++) {
+    result = write_view_section(&writer, view->sections[s].name, view, s);
+  }
+  result = writer_close(&writer, result, started);
+  *written = writer.written;
+  return result;
+}
+
+/*
+ * Free a view taken by kb_view(), and leave the epoch it entered. It must be
+ * called by the thread that took the view.
+ *
+ * Input:
+ *   view - the view
+ */
+void kb_view_close(KBView *view) {
+  for (int s = 0; s < view->section_count; s++) {
+    free(view->sections[s].index);
+  }
+  free(view);
+  epoch_leave();
+}
+
+/*
+ * Write the knowledge base to a file in the compiled format, which
+ * kb_read() can load without parsing. A knowledge base kept in a disk store
+ * can't be compiled: its runs are compiled already.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *   f  - the file (opened for writing in binary mode)
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the knowledge base is kept in a disk store
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written
+ */
+int kb_compile(kb_t *kb, FILE *f) {
+  pthread_mutex_lock(&kb->lock);
+  int result = kb->store != NULL ? KB_INVALID : snapshot_write(f, kb);
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Helper function to work out the statistics of the hash index of a section.
+ *
+ * Input:
+ *   section - the section
+ *   stats   - a structure to receive the statistics
+ */
+
+static void section_stats(const Section *section, KBStats *stats) {
+  const KBBase *base = section->base;
+  const KBPack *pack = section->pack;
+  KBIndex *index = section->index;
+  memset(stats, 0, sizeof(KBStats));
+  stats->entries = section->count - section->shadowed - section->removed +
+                   (base == NULL ? 0 : base->count);
+  if (pack != NULL) {
+    KBPackStats packed;
+    pack_stats(pack, &packed);
+    stats->entries += packed.entries;
+  }
+  if (index == NULL) {
+    return;
+  }
+  stats->capacity = index->capacity;
+  stats->load_factor = (double)section->count / index->capacity;
+
+  // A hit visits the slots from the node's home slot to the node
+  size_t mask = index->capacity - 1;
+  uint64_t total = 0;
+  for (size_t i = 0; i < index->capacity; i++) {
+    Node *node = load_slot(index, i);
+    if (node != NULL) {
+      size_t length = ((i - (size_t)node->hash) & mask) + 1;
+      total += length;
+      if (length > stats->max_probe) {
+        stats->max_probe = length;
+      }
+    }
+  }
+  if (section->count > 0) {
+    stats->avg_probe = (double)total / section->count;
+  }
+
+  // A miss visits the slots from its home slot to the next empty one, so
+  // walk backwards from an empty slot counting the length of each run
+  size_t empty = 0;
+  while (load_slot(index, empty) != NULL) {
+    empty++;
+  }
+  total = 0;
+  size_t run = 0;
+  for (size_t k = 0; k < index->capacity; k++) {
+    size_t i = (empty - k) & mask;
+    run = load_slot(index, i) == NULL ? 1 : run + 1;
+    total += run;
+  }
+  stats->avg_miss_probe = (double)total / index->capacity;
+}
+
+/*
+ * Get the statistics of the hash index for a question word.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   intent - the question word
+ *   stats  - a structure to receive the statistics
+ *
+ * Returns:
+ *   KB_OK, if the statistics were written to 'stats'
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int kb_stats(kb_t *kb, const char *intent, KBStats *stats) {
+  Section *section = find_section(kb, intent);
+  if (section == NULL) {
+    return KB_INVALID;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  section_stats(section, stats);
+  pthread_mutex_unlock(&kb->lock);
+  return KB_OK;
+}
+
+/*
+ * Helper function to add an entity to the fuzzy index being built by
+ * kb_suggest(), through section_walk().
+ *
+ * Input:
+ *   node - the node
+ *   arg  - the KBFuzzyBuild
+ */
+
+static void add_fuzzy(const Node *node, void *arg) {
+  KBFuzzyBuild *build = arg;
+  if (build->result == KB_OK) {
+    build->result = fuzzy_add(build->fuzzy, node->entity, node->entity_len);
+  }
+}
+
+/*
+ * Suggest the entity nearest to one that is not known: the one with the
+ * fewest edits (see fuzzy_find()) from it. The first suggestion for a
+ * question word builds the fuzzy index of its section, which takes time in
+ * proportion to the number of entities; after that, a suggestion reads only
+ * the entities that share a rare trigram with the one asked about. There
+ * are no suggestions for a knowledge base kept in a disk store, whose runs
+ * have no fuzzy index.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   intent     - the question word
+ *   entity     - the entity that is not known
+ *   suggestion - a buffer to receive the nearest entity
+ *   n          - the maximum number of characters to write to the buffer
+ *
+ * Returns:
+ *   KB_OK, if an entity near enough was found (and copied to the buffer)
+ *   KB_NOTFOUND, if no entity is near enough
+ *   KB_INVALID, if 'intent' is not a recognised question word, or the
+ *   knowledge base is kept in a disk store
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_suggest(kb_t *kb, const char *intent, const char *entity,
+               char *suggestion, int n) {
+  TRACE_SPAN("kb_suggest");
+  Section *section = find_section(kb, intent);
+  if (section == NULL || kb->store != NULL) {
+    return KB_INVALID;
+  }
+
+  int result = KB_OK;
+  pthread_mutex_lock(&kb->lock);
+  if (section->fuzzy == NULL) {
+    KBFuzzyBuild build = {fuzzy_create(), KB_NOMEM};
+    if (build.fuzzy != NULL && unpack_section(section) == KB_OK) {
+      build.result = KB_OK;
+      section_walk(section, add_fuzzy, &build);
+    }
+    if (build.result == KB_OK) {
+      section->fuzzy = build.fuzzy;
+    } else {
+      fuzzy_destroy(build.fuzzy);
+      result = KB_NOMEM;
+    }
+  }
+  if (result == KB_OK) {
+    const char *match;
+    size_t len;
+    if (fuzzy_find(section->fuzzy, entity, strnlen(entity, MAX_ENTITY), &match,
+                   &len) < 0) {
+      result = KB_NOTFOUND;
+    } else {
+      snprintf(suggestion, n, "%.*s", (int)len, match);
+    }
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * List the entities of a question word that start with a prefix (ignoring
+ * case), a page at a time, in order of their case-folded characters. The
+ * first listing (or save) of a question word builds the radix tree of its
+ * section, which takes time in proportion to the number of entities; after
+ * that, a listing takes time in proportion to the prefix and the page. A
+ * knowledge base kept in a disk store can't be listed: its runs are only
+ * indexed by hash, not in order.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   intent - the question word
+ *   prefix - the prefix ("" for every entity)
+ *   skip   - the number of entities to skip, e.g. for the pages before
+ *   limit  - the most entities to list
+ *   fn     - the function, which is passed each entity (not null-terminated),
+ *            its length and 'arg'; it is called with the knowledge base's
+ *            lock held, so it must not use the knowledge base
+ *   arg    - an argument to pass on to fn
+ *   total  - receives the number of entities that start with the prefix
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if 'intent' is not a recognised question word, or the
+ *   knowledge base is kept in a disk store
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_list(kb_t *kb, const char *intent, const char *prefix, size_t skip,
+            size_t limit, void (*fn)(const char *entity, size_t len, void *arg),
+            void *arg, size_t *total) {
+  TRACE_SPAN("kb_list");
+  Section *section = find_section(kb, intent);
+  if (section == NULL || kb->store != NULL) {
+    return KB_INVALID;
+  }
+
+  int result = KB_OK;
+  pthread_mutex_lock(&kb->lock);
+  const KBRadix *radix = section_radix(section);
+  if (radix == NULL) {
+    result = KB_NOMEM;
+  } else {
+    *total = radix_list(radix, prefix, strnlen(prefix, MAX_ENTITY), skip,
+                        limit, fn, arg);
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Helper function to add an answer to the search index being built by
+ * kb_search(), through section_walk(). The search index does not keep the
+ * response of an entry of a pack, which is only there while it is added;
+ * kb_search() looks it up again for a hit.
+ *
+ * Input:
+ *   node - the node
+ *   arg  - the KBSearchBuild
+ */
+
+static void add_search(const Node *node, void *arg) {
+  KBSearchBuild *build = arg;
+  if (build->result == KB_OK) {
+    build->result = search_add(build->search, build->section, node->entity,
+                               node->entity_len, node->hash, node->response,
+                               node->response_len);
+  }
+  if (build->result == KB_OK && (node->flags & KB_NODE_PACKED)) {
+    search_move(build->search, build->section, node->entity, node->entity_len,
+                node->hash, NULL);
+  }
+}
+
+/*
+ * Find the answers whose responses best match some words, of every question
+ * word, best first (see search_find()). The first search builds the search
+ * index from every section in one pass, which takes time in proportion to
+ * the size of the responses; after that, answers are added to it as they are
+ * learned or loaded, and a search reads only the posting lists of its words.
+ * A knowledge base kept in a disk store can't be searched: its runs are not
+ * indexed by word.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   query   - the words to search for
+ *   hits    - receives the answers
+ *   max     - the most answers to give
+ *   matches - receives the number of answers with any of the words
+ *
+ * Returns:
+ *   the number of answers given, KB_INVALID if the knowledge base is kept in
+ *   a disk store, or KB_NOMEM if there was a memory allocation failure
+ */
+int kb_search(kb_t *kb, const char *query, KBSearchHit *hits, int max,
+              size_t *matches) {
+  TRACE_SPAN("kb_search");
+  if (kb->store != NULL) {
+    return KB_INVALID;
+  }
+
+  int result = KB_OK;
+  pthread_mutex_lock(&kb->lock);
+  if (kb->search == NULL) {
+    KBSearchBuild build = {search_create(), 0, KB_NOMEM};
+    if (build.search != NULL) {
+      build.result = KB_OK;
+      int sections = intent_sections(kb);
+      for (; build.section < sections && build.result == KB_OK;
+           build.section++) {
+        Section *section = &kb->sections[build.section];
+        build.result = unpack_section(section);
+        if (build.result == KB_OK) {
+          section_walk(section, add_search, &build);
+        }
+      }
+    }
+    if (build.result == KB_OK) {
+      kb->search = build.search;
+    } else {
+      search_destroy(build.search);
+      result = KB_NOMEM;
+    }
+  }
+  if (result == KB_OK) {
+    result = search_find(kb->search, query, strlen(query), hits, max,
+                         matches);
+  }
+
+  // The responses of packed entries were not kept (see add_search())
+  for (int h = 0; h < result; h++) {
+    Section *section = &kb->sections[hits[h].section];
+    snprintf(hits[h].intent, MAX_INTENT, "%s",
+             intent_section_name(kb, hits[h].section));
+    if (hits[h].response[0] == '\0' && section->pack != NULL) {
+      get_from_section(section, hits[h].entity, hits[h].response,
+                       MAX_RESPONSE);
+    }
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Limit the memory taken by the responses a knowledge base learns (from
+ * users, or from files as they change). Once they take more than the budget,
+ * the ones looked up least recently are moved to a spill file, whose
+ * contents are mapped, so they are still answered without locking and the
+ * kernel reads them back in from disk as they are looked up. Files read
+ * into memory (rather than mapped) are moved there whole. Entities and the
+ * indexes stay in memory. Responses learned before the budget was set are
+ * not counted.
+ *
+ * The budget is not kept while a save runs in the background (see saver.c):
+ * a response moved to the spill file is only freed once no reader can be
+ * using it, and the save's view may be until it is done, so the memory of
+ * the responses moved meanwhile is given back only once the save finishes.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   budget - the most memory, in bytes, the responses may take, or 0 for no
+ *            limit
+ *   dir    - the directory to create the spill file in, or NULL for $TMPDIR
+ *            (or /var/tmp)
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_set_budget(kb_t *kb, size_t budget, const char *dir) {
+  char *spill_dir = NULL;
+  if (dir != NULL && (spill_dir = strdup(dir)) == NULL) {
+    return KB_NOMEM;
+  }
+  pthread_mutex_lock(&kb->lock);
+  free(kb->spill_dir);
+  kb->spill_dir = spill_dir;
+  kb->budget = budget;
+  evict_responses(kb);
+  pthread_mutex_unlock(&kb->lock);
+  return KB_OK;
+}
+
+/*
+ * Find out how much memory the responses of a knowledge base take, against
+ * its budget (see kb_set_budget()).
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   memory - a structure to receive the figures
+ */
+void kb_memory(kb_t *kb, KBMemory *memory) {
+  pthread_mutex_lock(&kb->lock);
+  memory->budget = kb->budget;
+  memory->resident = kb->resident;
+  memory->spilled = spill_size(kb->spill);
+  pthread_mutex_unlock(&kb->lock);
+}
+
+/*
+ * Find out how large the disk store a knowledge base is kept in is.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   stats - a structure to receive the figures
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the knowledge base is not kept in a disk store
+ */
+int kb_store_stats(kb_t *kb, KBStoreStats *stats) {
+  pthread_mutex_lock(&kb->lock);
+  int result = kb->store == NULL ? KB_NOTFOUND : KB_OK;
+  if (kb->store != NULL) {
+    store_stats(kb->store, stats);
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Helper function to add an entry to the ones gathered by kb_pack(), through
+ * section_walk(). The strings of an entry of an earlier pack are copied,
+ * since they are only there while it is added.
+ *
+ * Input:
+ *   node - the node
+ *   arg  - the KBPackGather
+ */
+
+static void gather_entry(const Node *node, void *arg) {
+  KBPackGather *gather = arg;
+  if (gather->result != KB_OK) {
+    return;
+  }
+  if (gather->count == gather->capacity) {
+    size_t capacity = gather->capacity == 0 ? 1024 : gather->capacity * 2;
+    KBPackItem *items = realloc(gather->items, capacity * sizeof(KBPackItem));
+    if (items == NULL) {
+      gather->result = KB_NOMEM;
+      return;
+    }
+    gather->items = items;
+    gather->capacity = capacity;
+  }
+
+  KBPackItem *item = &gather->items[gather->count];
+  item->entity = node->entity;
+  item->entity_len = node->entity_len;
+  item->response = node->response;
+  item->response_len = node->response_len;
+  if (node->flags & KB_NODE_PACKED) {
+    item->entity = arena_strndup(gather->strings, node->entity,
+                                 node->entity_len);
+    item->response = arena_strndup(gather->strings, node->response,
+                                   node->response_len);
+    if (item->entity == NULL || item->response == NULL) {
+      gather->result = KB_NOMEM;
+      return;
+    }
+  }
+  gather->count++;
+}
+
+/*
+ * Pack a knowledge base that is mostly read, to take less memory: the
+ * entries of each section are compressed into a pack (see pack.c), with
+ * responses compressed by a table of symbols trained on them all, and the
+ * nodes, indexes and files they were in are let go. A lookup then finds the
+ * block of the pack the entity would be in by binary search, and
+ * decompresses only its response. Answers learned afterwards are kept as
+ * usual, shadowing the packed ones, until the knowledge base is packed
+ * again. Files being watched (see kb_reload()) can't be packed, since their
+ * next versions are compared with the entries they loaded, and neither can a
+ * knowledge base kept in a disk store, which is compact already.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   block - the number of entries in each block of a pack, from 1 to
+ *           KB_PACK_MAX_BLOCK: fewer make lookups faster, more make the
+ *           entities smaller
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the block size is out of range, the knowledge base is
+ *   kept in a disk store, or it has files being watched
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int kb_pack(kb_t *kb, size_t block) {
+  TRACE_SPAN("kb_pack");
+  if (block == 0 || block > KB_PACK_MAX_BLOCK) {
+    return KB_INVALID;
+  }
+  pthread_mutex_lock(&kb->lock);
+  int result = kb->store != NULL ? KB_INVALID : KB_OK;
+  for (KBSource *source = kb->sources; source != NULL; source = source->next) {
+    if (source->path != NULL) {
+      result = KB_INVALID;
+    }
+  }
+
+  // Gather the entries of every section, so one table is trained on them all
+  Arena strings;
+  memset(&strings, 0, sizeof(Arena));
+  KBPackGather gather = {NULL, 0, 0, &strings, result};
+  size_t starts[KB_MAX_SECTIONS + 1] = {0};
+  int sections = intent_sections(kb);
+  for (int s = 0; s < sections && gather.result == KB_OK; s++) {
+    starts[s] = gather.count;
+    section_walk(&kb->sections[s], gather_entry, &gather);
+  }
+  starts[sections] = gather.count;
+  result = gather.result;
+  KBPackTable *table = NULL;
+  if (result == KB_OK &&
+      (table = pack_train(gather.items, gather.count)) == NULL) {
+    result = KB_NOMEM;
+  }
+
+  const KBPack *packs[KB_MAX_SECTIONS] = {NULL};
+  for (int s = 0; s < sections && result == KB_OK; s++) {
+    size_t count = starts[s + 1] - starts[s];
+    if (count > 0 && (packs[s] = pack_create(table, gather.items + starts[s],
+                                             count, block)) == NULL) {
+      result = KB_NOMEM;
+    }
+  }
+
+  // Each pack is in place before the nodes it replaces are let go
+  for (int s = 0; s < sections; s++) {
+    if (result == KB_OK) {
+      replace_pack(&kb->sections[s], packs[s]);
+    } else {
+      pack_destroy((void *)packs[s]);
+    }
+  }
+  if (result == KB_OK) {
+    clear_memtable(kb);
+    release_files(kb);
+  }
+  pthread_mutex_unlock(&kb->lock);
+  free(table);
+  free(gather.items);
+  arena_reset(&strings);
+  return result;
+}
+
+/*
+ * Find out how large the packs of a knowledge base are (see kb_pack()), and
+ * how large their entries were before they were packed.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   stats - a structure to receive the figures
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the knowledge base is not packed
+ */
+int kb_pack_stats(kb_t *kb, KBPackStats *stats) {
+  memset(stats, 0, sizeof(KBPackStats));
+  pthread_mutex_lock(&kb->lock);
+  int result = is_packed(kb) ? KB_OK : KB_NOTFOUND;
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    const KBPack *pack = kb->sections[s].pack;
+    if (pack != NULL) {
+      KBPackStats packed;
+      pack_stats(pack, &packed);
+      stats->entries += packed.entries;
+      stats->entity_bytes += packed.entity_bytes;
+      stats->raw_bytes += packed.raw_bytes;
+      stats->bytes += packed.bytes;
+    }
+  }
+  pthread_mutex_unlock(&kb->lock);
+  return result;
+}
+
+/*
+ * Create an empty knowledge base.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the knowledge base, to be freed with kb_destroy()
+ */
+kb_t *kb_create() {
+  kb_t *kb = calloc(1, sizeof(kb_t));
+  if (kb == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&kb->lock, NULL) != 0) {
+    free(kb);
+    return NULL;
+  }
+  return kb;
+}
+
+/*
+ * Close a knowledge base: stop watching its files (see watch.c), wait for
+ * any save running in the background (see saver.c), stop journalling it
+ * (making sure everything journalled is durable) and close its disk store,
+ * then empty it without journalling that or touching the store. No other
+ * thread may be using it.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void kb_close(kb_t *kb) {
+  watch_forget(kb);
+  saver_wait(kb);
+  journal_close(kb);
+  store_close(kb);
+  kb_reset(kb);
+}
+
+/*
+ * Free a knowledge base created by kb_create(), and everything in it. No
+ * other thread may be using it.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void kb_destroy(kb_t *kb) {
+  kb_close(kb);
+  pthread_mutex_destroy(&kb->lock);
+  free(kb->spill_dir);
+  free(kb);
+}
+
+/*
+ * Get the default knowledge base, which the knowledge_*() functions use.
+ *
+ * Returns:
+ *   A pointer to the default knowledge base
+ */
+kb_t *knowledge_default() { return &knowledge_base; }
+
+/*
+ * The knowledge_*() functions do the same as the kb_*() functions of the same
+ * name, to the default knowledge base.
+ */
+int knowledge_get(const char *intent, const char *entity, char *response,
+                  int n) {
+  return kb_get(&knowledge_base, intent, entity, response, n);
+}
+
+int knowledge_put(const char *intent, const char *entity,
+                  const char *response) {
+  return kb_put(&knowledge_base, intent, entity, response);
+}
+
+void knowledge_reset() { kb_reset(&knowledge_base); }
+
+int knowledge_read(FILE *f) { return kb_read(&knowledge_base, f); }
+
+int knowledge_reload(const char *path, KBDelta *delta) {
+  return kb_reload(&knowledge_base, path, delta);
+}
+
+int knowledge_write(FILE *f) { return kb_write(&knowledge_base, f); }
+
+int knowledge_detach(const char *filename) {
+  return kb_detach(&knowledge_base, filename);
+}
+
+int knowledge_compile(FILE *f) { return kb_compile(&knowledge_base, f); }
+
+int knowledge_stats(const char *intent, KBStats *stats) {
+  return kb_stats(&knowledge_base, intent, stats);
+}
+
+int knowledge_suggest(const char *intent, const char *entity,
+                      char *suggestion, int n) {
+  return kb_suggest(&knowledge_base, intent, entity, suggestion, n);
+}
+
+int knowledge_list(const char *intent, const char *prefix, size_t skip,
+                   size_t limit,
+                   void (*fn)(const char *entity, size_t len, void *arg),
+                   void *arg, size_t *total) {
+  return kb_list(&knowledge_base, intent, prefix, skip, limit, fn, arg, total);
+}
+
+int knowledge_search(const char *query, KBSearchHit *hits, int max,
+                     size_t *matches) {
+  return kb_search(&knowledge_base, query, hits, max, matches);
+}
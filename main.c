@@ -5,19 +5,172 @@
  *
  * You should not need to modify this file. You may invoke its functions if you
  * like, however.
+ *
+ * The other source files are included below, so the whole chatbot is built
+ * from this one file:
+ *
+ *   gcc -O2 -pthread -o chatbot main.c
+ *
+ * Usage:
+ *
+ *   chatbot [-k|-W|-Z knowledge-file]... [-b questions [-o answers]
+ *           [-u unknown] [-t threads]]
+ *   chatbot [-k|-W|-Z knowledge-file]... -s address [-c max-connections]
+ *   chatbot -g address [-c connections] [-n requests] [-q questions]
+ *   chatbot -r seconds [-t readers] [-w writers]
+ *   chatbot -m sizes [-K key-lengths] [-V value-lengths] [-d duplicates]
+ *   chatbot -G file -e entities [-K key-lengths] [-V value-lengths]
+ *           [-d duplicates] [-T transcript]
+ *   chatbot [-k knowledge-file]... -p transcript
+ *
+ * Chatting, -b, -s and -p may also be given -M metrics-file [-I seconds], to
+ * write the chatbot's runtime metrics (see metrics.c) to the file every so
+ * many seconds (10 by default), in the Prometheus text format.
+ *
+ * Chatting, -b, -s and -p may also be given -x trace-file, to write what the
+ * chatbot spent its time on to the file as a Chrome trace when it exits (see
+ * trace.c), if it was built with -DCHATBOT_TRACE.
+ *
+ * Chatting, -b, -s and -p may also be given -j journal [-f sync-ms], to
+ * remember what the chatbot learns from one run to the next (see journal.c).
+ *
+ * -B budget [-S spill-dir] limits the memory taken by the responses the
+ * chatbot learns, e.g. "-B 512M" (see kb_set_budget() in knowledge.c): the
+ * least recently asked are moved to a file in the directory ($TMPDIR or
+ * /var/tmp by default) and read back from there. Like -k, it applies to the
+ * files named after it.
+ *
+ * -D store-dir keeps the knowledge base in a disk store in the directory (see
+ * store.c), so it may be larger than memory: what the chatbot learns, and the
+ * files named after it, are written to the store a piece at a time, and are
+ * there the next time it is started with the same -D. The store's journal is
+ * "store-dir/wal" unless -j says otherwise. -W can't be used with it.
+ *
+ * -P block-size packs the knowledge base once the files named are loaded (see
+ * kb_pack() in knowledge.c), e.g. "-P 16": the entries are compressed, that
+ * many to a block, for a knowledge base that is mostly read to take a
+ * fraction of the memory. -W and -D can't be used with it.
+ *
+ * Each -k file is loaded before the chatbot starts, and may then be changed.
+ * Each -Z file is too, but is mapped rather than read (see kb_read_mapped()
+ * in knowledge.c), so it must not be changed in place while the chatbot
+ * runs. Each -W file is loaded before the chatbot starts too, and is loaded
+ * again whenever it changes (see watch.c), applying only the entities that
+ * were added, changed or removed; files named by LOAD are then watched as
+ * well. With -b, the chatbot runs in batch mode (see batch.c) instead of
+ * chatting: it answers every question in the file ("-" for standard input)
+ * and exits. With -s, it chats with
+ * everyone who connects to the address (see server.c); -g runs the load
+ * generator against such a server. -r runs the knowledge base stress test
+ * (see stress.c) for that many seconds without writers and as many with.
+ * -m runs the benchmarks (see bench.c) for each of a list of sizes, e.g.
+ * "1e3,1e4,1e5", printing the results as JSON, if it was built with
+ * -DCHATBOT_BENCH; -G writes a knowledge file like theirs with the given
+ * number of entities per section. Entities and responses have random
+ * lengths in the ranges -K and -V (e.g. "8-24" and "16-128", the defaults),
+ * and the fraction -d of lines repeat an entity.
+ * -T also writes a transcript of questions about the file, which -p replays
+ * (see replay.c), printing the latency percentiles of each intent as JSON.
+ *
+ * With -j, every answer learned is recorded in the journal, and the journal
+ * is replayed (after any -k files are loaded) when the chatbot starts again.
+ * By default each answer is on disk before the chatbot replies; with -f, they
+ * are flushed every sync-ms milliseconds instead, or never if it is negative.
  */
 
 #include "chat1002.h"
+#include "arena.c"
 #include "chatbot.c"
+#include "intent.c"
 #include "knowledge.c"
+#include "snapshot.c"
+#include "savefile.c"
+#include "batch.c"
+#include "server.c"
+#include "epoch.c"
+#include "stress.c"
+#include "bench.c"
+#include "replay.c"
+#include "metrics.c"
+#include "trace.c"
+#include "journal.c"
+#include "fuzzy.c"
+#include "radix.c"
+#include "search.c"
+#include "watch.c"
+#include "saver.c"
+#include "spill.c"
+#include "store.c"
+#include "pack.c"
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-/* word delimiters */
-const char *delimiters = " ?\t\n";
+/* word delimiters, as a table so that a character is looked up rather than
+ * searched for */
+static const char delimiters[256] = {
+    [' '] = 1, ['?'] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1};
+
+/*
+ * Print how to run the chatbot, and fail.
+ */
+static int usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-k|-W|-Z knowledge-file]... [-b questions [-o answers] "
+          "[-u unknown] [-t threads]]\n"
+          "       %s [-k|-W|-Z knowledge-file]... -s address "
+          "[-c max-connections]\n"
+          "       %s -g address [-c connections] [-n requests] "
+          "[-q questions]\n"
+          "       %s -r seconds [-t readers] [-w writers]\n"
+          "       %s -m sizes [-K key-lengths] [-V value-lengths] "
+          "[-d duplicates]\n"
+          "       %s -G file -e entities [-K key-lengths] [-V value-lengths] "
+          "[-d duplicates] [-T transcript]\n"
+          "       %s [-k knowledge-file]... -p transcript\n"
+          "  (chatting, -b, -s and -p also take -j journal [-f sync-ms], "
+          "-M metrics-file [-I seconds], -x trace-file\n"
+          "   -B budget [-S spill-dir], -D store-dir and -P block-size)\n",
+          program, program, program, program, program, program, program);
+  return 2;
+}
+
+/*
+ * Helper function to read a number of bytes, with an optional K, M or G
+ * suffix (e.g. "512M").
+ *
+ * Input:
+ *   value - the number
+ *   bytes - receives the number of bytes
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the value is not a number of bytes
+ */
+
+static int parse_bytes(const char *value, size_t *bytes) {
+  char *end;
+  unsigned long long n = strtoull(value, &end, 10);
+  int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  }
+  if (end == value || end[shift != 0] != '\0' || n > SIZE_MAX >> shift) {
+    return KB_INVALID;
+  }
+  *bytes = (size_t)n << shift;
+  return KB_OK;
+}
 
 /*
  * Main loop.
@@ -28,15 +181,252 @@ int main(int argc, char *argv[]) {
   int inc;               /* the number of words in the user input */
   char *inv[MAX_INPUT];  /* pointers to the beginning of each word of input */
   char output[MAX_RESPONSE]; /* the chatbot's output */
-  int len;                   /* length of a word */
   int done = 0;              /* set to 1 to end the main loop */
 
   int isLong = 0;
 
+  BatchOptions batch;        /* the options for batch mode */
+  ServerOptions server;      /* the options for server mode */
+  StressOptions stress;      /* the options for the stress test */
+  BenchOptions bench;        /* the options for the benchmarks */
+  char mode = 0;             /* b, s, g, r, m, G or p if not chatting */
+  const char *transcript = NULL; /* the transcript to replay */
+  const char *journal = NULL; /* the journal, if any */
+  int sync_ms = 0;           /* how often to flush it (0 = every answer) */
+  const char *metrics = NULL; /* the file to write the metrics to, if any */
+  int metrics_seconds = 10;  /* how often to write it */
+  const char *trace = NULL;  /* the file to write the trace to, if any */
+  size_t budget = 0;         /* the memory budget of responses (0 = none) */
+  const char *spill_dir = NULL; /* where to spill them, if not the default */
+  const char *store = NULL;  /* the disk store's directory, if any */
+  size_t pack = 0;           /* the entries in a block of a pack (0 = none) */
+  char store_journal[4096];  /* the store's journal, if -j is not given */
+  int watched = 0;           /* 1 once a file has been named by -W */
+  int status = 0;            /* the exit status */
+  memset(&batch, 0, sizeof(batch));
+  memset(&server, 0, sizeof(server));
+  memset(&stress, 0, sizeof(stress));
+  memset(&bench, 0, sizeof(bench));
+  server.requests = 1000;
+  stress.writers = 1;
+
   /* initialise the chatbot */
   inv[0] = "reset";
   inv[1] = NULL;
-  chatbot_do_reset(1, inv, output, MAX_RESPONSE);
+  chatbot_main(1, inv, output, MAX_RESPONSE);
+
+  /* read the command line, loading knowledge files as they are named */
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2) {
+      return usage(argv[0]);
+    }
+    const char *value = argv[++i];
+    switch (argv[i - 1][1]) {
+    case 'k':
+    case 'Z': {
+      FILE *f = fopen(value, "rb");
+      int entity_count = KB_NOTFOUND;
+      if (f != NULL && argv[i - 1][1] == 'Z') {
+        entity_count = kb_read_mapped(knowledge_default(), f);
+      } else if (f != NULL) {
+        entity_count = knowledge_read(f);
+      }
+      if (f != NULL) {
+        fclose(f);
+      }
+      if (entity_count < 0) {
+        fprintf(stderr, "%s: can't load %s\n", argv[0], value);
+        return 1;
+      }
+      break;
+    }
+    case 'W': {
+      KBDelta delta;
+      watched = 1;
+      if (store != NULL) {
+        return usage(argv[0]);
+      } else if (watch_file(knowledge_default(), value, &delta) < 0) {
+        fprintf(stderr, "%s: can't watch %s\n", argv[0], value);
+        return 1;
+      }
+      break;
+    }
+    case 'b':
+      batch.input = value;
+      mode = 'b';
+      break;
+    case 's':
+    case 'g':
+      server.address = value;
+      mode = argv[i - 1][1];
+      break;
+    case 'c':
+      server.connections = atoi(value);
+      break;
+    case 'n':
+      server.requests = atoi(value);
+      break;
+    case 'q':
+      server.questions = value;
+      break;
+    case 'o':
+      batch.output = value;
+      break;
+    case 'u':
+      batch.unknown = value;
+      break;
+    case 't':
+      batch.threads = atoi(value);
+      stress.readers = atoi(value);
+      break;
+    case 'r':
+      stress.seconds = atof(value);
+      mode = 'r';
+      break;
+    case 'w':
+      stress.writers = atoi(value);
+      break;
+    case 'm':
+      bench.sizes = value;
+      mode = 'm';
+      break;
+    case 'G':
+      bench.output = value;
+      mode = 'G';
+      break;
+    case 'e':
+      bench.entities = atol(value);
+      break;
+    case 'K':
+      bench.keys = value;
+      break;
+    case 'V':
+      bench.values = value;
+      break;
+    case 'd':
+      bench.duplicates = atof(value);
+      break;
+    case 'T':
+      bench.transcript = value;
+      break;
+    case 'p':
+      transcript = value;
+      mode = 'p';
+      break;
+    case 'j':
+      journal = value;
+      break;
+    case 'f':
+      sync_ms = atoi(value);
+      break;
+    case 'M':
+      metrics = value;
+      break;
+    case 'I':
+      metrics_seconds = atoi(value);
+      break;
+    case 'x':
+      trace = value;
+      break;
+    case 'B':
+    case 'S':
+      if (argv[i - 1][1] == 'S') {
+        spill_dir = value;
+      } else if (parse_bytes(value, &budget) != KB_OK) {
+        return usage(argv[0]);
+      }
+      if (kb_set_budget(knowledge_default(), budget, spill_dir) != KB_OK) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+      }
+      break;
+    case 'D':
+      if (store != NULL || watched) {
+        return usage(argv[0]);
+      } else if (store_open(knowledge_default(), value) != KB_OK) {
+        fprintf(stderr, "%s: can't open store %s\n", argv[0], value);
+        return 1;
+      }
+      store = value;
+      break;
+    case 'P':
+      pack = (size_t)atol(value);
+      if (pack == 0 || pack > KB_PACK_MAX_BLOCK) {
+        return usage(argv[0]);
+      }
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (pack != 0 && (store != NULL || watched)) {
+    return usage(argv[0]);
+  } else if (pack != 0 && kb_pack(knowledge_default(), pack) != KB_OK) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  if (store != NULL && journal == NULL) {
+    snprintf(store_journal, sizeof(store_journal), "%s/wal", store);
+    journal = store_journal;
+  }
+  if (journal != NULL &&
+      (mode == 0 || mode == 'b' || mode == 's' || mode == 'p')) {
+    int replayed = journal_open(knowledge_default(), journal, sync_ms);
+    if (replayed < 0) {
+      fprintf(stderr, "%s: can't open journal %s\n", argv[0], journal);
+      return 1;
+    }
+    if (store != NULL) {
+      // Keep the files loaded before the journal was open
+      journal_request_compact(knowledge_default()->journal);
+    }
+  }
+  if (metrics != NULL &&
+      (mode == 0 || mode == 'b' || mode == 's' || mode == 'p') &&
+      metrics_dump_start(metrics, metrics_seconds) != KB_OK) {
+    fprintf(stderr, "%s: can't write metrics every %d seconds\n", argv[0],
+            metrics_seconds);
+    return 1;
+  }
+#ifndef CHATBOT_TRACE
+  if (trace != NULL) {
+    fprintf(stderr, "%s: built without tracing (-DCHATBOT_TRACE)\n", argv[0]);
+    return 1;
+  }
+#endif
+#ifndef CHATBOT_BENCH
+  if (mode == 'm') {
+    fprintf(stderr, "%s: built without benchmarks (-DCHATBOT_BENCH)\n",
+            argv[0]);
+    return 1;
+  }
+#endif
+  if (mode == 'b') {
+    status = batch_main(&batch);
+  } else if (mode == 's') {
+    status = server_main(&server);
+  } else if (mode == 'p') {
+    status = replay_main(transcript);
+  } else if (mode == 'g') {
+    return loadgen_main(&server);
+  } else if (mode == 'r') {
+    return stress_main(&stress);
+  } else if (mode == 'm') {
+    return bench_main(&bench);
+  } else if (mode == 'G') {
+    return bench_generate_main(&bench);
+  }
+  if (mode != 0) {
+    saver_wait(knowledge_default());
+    watch_stop();
+    metrics_dump_stop();
+    if (trace != NULL && trace_export(trace) != KB_OK) {
+      fprintf(stderr, "%s: can't write trace %s\n", argv[0], trace);
+    }
+    journal_close(knowledge_default());
+    store_close(knowledge_default());
+    return status;
+  }
 
   /* print a welcome message */
   printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
@@ -56,21 +446,7 @@ int main(int argc, char *argv[]) {
       }
 
       /* split it into words */
-      inc = 0;
-      inv[inc] = strtok(input, delimiters);
-      while (inv[inc] != NULL) {
-
-        /* remove trailing punctuation */
-        len = strlen(inv[inc]);
-        while (len > 0 && ispunct(inv[inc][len - 1])) {
-          inv[inc][len - 1] = '\0';
-          len--;
-        }
-
-        /* go to the next word */
-        inc++;
-        inv[inc] = strtok(NULL, delimiters);
-      }
+      inc = split_words(input, inv);
     } while (inc < 1);
 
     /* invoke the chatbot */
@@ -81,9 +457,97 @@ int main(int argc, char *argv[]) {
 
   } while (!done);
 
+  saver_wait(knowledge_default());
+  watch_stop();
+  metrics_dump_stop();
+  if (trace != NULL && trace_export(trace) != KB_OK) {
+    fprintf(stderr, "%s: can't write trace %s\n", argv[0], trace);
+  }
   return 0;
 }
 
+/*
+ * Split a line of input into words, in place, in one pass. The words are
+ * separated by the delimiters, and any punctuation at the end of a word is
+ * removed, except a '*' (which asks for the entities that start with the
+ * word, e.g. "what is ICT10*"). Each word is moved up to just after the one
+ * before it, so the words are left one after another, each ended by a single
+ * null; join_words() can then make any run of them one string without
+ * copying. This does not use strtok(), so several threads may split lines at
+ * once.
+ *
+ * Input:
+ *   input - the line, which is modified
+ *   inv   - an array to receive pointers to the beginning of each word; it
+ *           must have room for MAX_INPUT pointers (inv[inc] is set to NULL)
+ *
+ * Returns:
+ *   the number of words
+ */
+int split_words(char *input, char *inv[]) {
+
+  int inc = 0;
+  const char *p = input; /* the next character to read */
+  char *out = input;     /* where the next word goes */
+  while (inc < MAX_INPUT - 1) {
+    while (*p != '\0' && delimiters[(unsigned char)*p]) {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    const char *word = p;
+    while (*p != '\0' && !delimiters[(unsigned char)*p]) {
+      p++;
+    }
+    size_t len = p - word;
+    if (*p != '\0') {
+      p++; /* past the delimiter, which the null may take the place of */
+    }
+
+    /* remove trailing punctuation */
+    while (len > 0 && ispunct((unsigned char)word[len - 1]) &&
+           word[len - 1] != '*') {
+      len--;
+    }
+
+    /* move the word up, and go to the next one */
+    inv[inc++] = out;
+    if (out != word) {
+      memmove(out, word, len);
+    }
+    out += len;
+    *out++ = '\0';
+  }
+  inv[inc] = NULL;
+  return inc;
+}
+
+/*
+ * Join a run of words from split_words() into one string, separated by single
+ * spaces, in place: the null after each word but the last becomes a space.
+ * Afterwards, inv[first + 1] and later point into the joined string rather
+ * than to words of their own.
+ *
+ * Input:
+ *   inc   - the number of words
+ *   inv   - the words, from split_words()
+ *   first - the first word to join
+ *
+ * Returns:
+ *   the joined string, which starts at inv[first] ("" if first >= inc)
+ */
+const char *join_words(int inc, char *inv[], int first) {
+  if (first >= inc) {
+    return "";
+  }
+  for (int i = first + 1; i < inc; i++) {
+    inv[i][-1] = ' ';
+  }
+  return inv[first];
+}
+
 /*
  * Utility function for comparing string case-insensitively.
  *
@@ -98,9 +562,10 @@ int compare_token(const char *token1, const char *token2) {
 
   int i = 0;
   while (token1[i] != '\0' && token2[i] != '\0') {
-    if (toupper(token1[i]) < toupper(token2[i]))
+    int c1 = FOLD_CHAR(token1[i]), c2 = FOLD_CHAR(token2[i]);
+    if (c1 < c2)
       return -1;
-    else if (toupper(token1[i]) > toupper(token2[i]))
+    else if (c1 > c2)
       return 1;
     i++;
   }
@@ -114,38 +579,116 @@ int compare_token(const char *token1, const char *token2) {
 }
 
 /*
- * Prompt the user.
+ * Helper function to prompt the user on a pair of streams, and read the
+ * answer. Prompts to a remote user (e.g. a connection to the server) are
+ * written on a line of their own, starting with the chatbot's name and "?".
  *
  * Input:
+ *   in     - the stream to read the answer from
+ *   out    - the stream to write the prompt to
+ *   remote - 1 if the user is not on the terminal
  *   buf    - a buffer into which to store the answer
  *   n      - the maximum number of characters to write to the buffer
  *   format - format string, as printf
- *   ...    - as printf
+ *   args   - as vprintf
+ *
+ * Returns: as prompt_user()
  */
-void prompt_user(char *buf, int n, const char *format, ...) {
+
+static int prompt_streams(FILE *in, FILE *out, int remote, char *buf, int n,
+                          const char *format, va_list args) {
+  TRACE_SPAN("prompt_user");
 
   /* print the prompt */
-  va_list args;
-  va_start(args, format);
-  printf("%s: ", chatbot_botname());
-  vprintf(format, args);
-  printf(" ");
-  va_end(args);
-  printf("\n%s: ", chatbot_username());
+  if (remote) {
+    fprintf(out, "%s? ", chatbot_botname());
+    vfprintf(out, format, args);
+    fprintf(out, "\n");
+  } else {
+    fprintf(out, "%s: ", chatbot_botname());
+    vfprintf(out, format, args);
+    fprintf(out, " ");
+    fprintf(out, "\n%s: ", chatbot_username());
+  }
+  fflush(out);
 
-  /* get the response from the user */
-  int length = 1;
+  /* get the response from the user, counting the wait so that it is not
+   * mistaken for the chatbot's own time */
+  uint64_t started = metrics_clock();
+  int answered = 1;
   char *nl = NULL;
   while (nl == NULL) {
-    fgets(buf, n, stdin);
+    if (fgets(buf, n, in) == NULL) {
+      buf[0] = '\0';
+      answered = 0;
+      break;
+    }
     nl = strchr(buf, '\n');
     if (nl != NULL) {
       *nl = '\0';
+      if (nl > buf && nl[-1] == '\r') {
+        nl[-1] = '\0';
+      }
+    } else if (feof(in)) {
+      break;
     } else {
-      printf("%s: Too many characters. Try again.\n%s: ", chatbot_botname(),
-             chatbot_username());
-      while (fgetc(stdin) != '\n')
+      fprintf(out, "%s: Too many characters. Try again.\n", chatbot_botname());
+      if (!remote) {
+        fprintf(out, "%s: ", chatbot_username());
+      }
+      fflush(out);
+      int c;
+      while ((c = fgetc(in)) != '\n' && c != EOF)
         ;
     }
   };
-}
\ No newline at end of file
+  metrics_add(METRIC_PROMPT_NS, metrics_clock() - started);
+  return answered;
+}
+
+/*
+ * Prompt the user on the terminal.
+ *
+ * Input:
+ *   buf    - a buffer into which to store the answer
+ *   n      - the maximum number of characters to write to the buffer
+ *   format - format string, as printf
+ *   ...    - as printf
+ *
+ * Returns:
+ *   1, if the answer was stored in buf
+ *   0, if the input ended before an answer was given (buf is made empty)
+ */
+int prompt_user(char *buf, int n, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int answered = prompt_streams(stdin, stdout, 0, buf, n, format, args);
+  va_end(args);
+  return answered;
+}
+
+/*
+ * Prompt the user of a session, on the session's streams (or the terminal,
+ * if it has none).
+ *
+ * Input:
+ *   session - the session
+ *   buf     - a buffer into which to store the answer
+ *   n       - the maximum number of characters to write to the buffer
+ *   format  - format string, as printf
+ *   ...     - as printf
+ *
+ * Returns: as prompt_user()
+ */
+int session_prompt(session_t *session, char *buf, int n, const char *format,
+                   ...) {
+  va_list args;
+  va_start(args, format);
+  int remote = session->in != NULL;
+  int answered =
+      prompt_streams(remote ? session->in : stdin,
+                     remote ? session->out : stdout, remote, buf, n, format,
+                     args);
+  va_end(args);
+  return answered;
+}
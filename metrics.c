@@ -0,0 +1,488 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the chatbot's runtime metrics: how many lines of each
+ * intent it has handled and how long they took, how many questions it could
+ * and couldn't answer, and how much time it has spent loading and saving.
+ *
+ * Each thread counts into a block of its own, so counting is a load and a
+ * store to memory no other thread writes, with no locks or shared cache lines.
+ * metrics_read() adds up every block. Blocks are never freed: when a thread
+ * ends, its block is kept (with its counts) for the next thread to carry on
+ * counting in, so the totals never go backwards.
+ *
+ * The metrics are shown by the STATS intent (see chatbot.c), and can be
+ * written to a file in the Prometheus text format every few seconds (see
+ * metrics_dump_start()), e.g. for node_exporter's textfile collector. The file
+ * is replaced whole each time (see savefile.c), so it is never read half
+ * written.
+ *
+ * Latencies go in METRICS_BUCKETS buckets: the first for up to 256 ns, each
+ * of the next twice as long as the one before, and the last for the rest.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the names of the intents, as metrics_intent() numbers them */
+static const char *const metrics_intent_names[METRICS_INTENTS] = {
+    "exit", "load", "question", "reset", "save", "compile", "stats", "list",
+    "search", "status", "other"};
+
+/* Type definition for the counts of one thread */
+typedef struct metrics_block {
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  _Atomic uint64_t requests[METRICS_INTENTS];
+  _Atomic uint64_t latency_ns[METRICS_INTENTS];
+  _Atomic uint64_t buckets[METRICS_INTENTS][METRICS_BUCKETS];
+  atomic_int in_use;           /* 1 while a thread owns the block */
+  struct metrics_block *next;  /* the next block in metrics_blocks */
+} MetricsBlock;
+
+/* every block made so far */
+static MetricsBlock *_Atomic metrics_blocks;
+
+/* the current thread's block */
+static _Thread_local MetricsBlock *metrics_self;
+
+/* the key whose destructor gives up a thread's block when it ends */
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+/* the state of the thread that writes the metrics to a file */
+static struct {
+  const char *path;     /* the file */
+  int seconds;          /* how often to write it */
+  int running;          /* 1 while the thread runs */
+  int stop;             /* set to 1 to stop the thread */
+  pthread_t thread;     /* the thread */
+  pthread_mutex_t lock; /* protects stop */
+  pthread_cond_t wake;  /* signalled when stop is set */
+} metrics_dump = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                  .wake = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Helper function (the destructor of metrics_key) to give up the block of a
+ * thread that has ended, so that another thread can count in it.
+ *
+ * Input:
+ *   arg - the block
+ */
+
+static void metrics_release(void *arg) {
+  MetricsBlock *block = arg;
+  atomic_store_explicit(&block->in_use, 0, memory_order_release);
+}
+
+/*
+ * Helper function to create metrics_key, once.
+ */
+
+static void metrics_make_key() {
+  pthread_key_create(&metrics_key, metrics_release);
+}
+
+/*
+ * Helper function to find the current thread's block: one given up by a
+ * thread that has ended, or else a new one.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error (nothing is then counted)
+ *   A pointer to the block
+ */
+
+static MetricsBlock *metrics_block() {
+  if (metrics_self != NULL) {
+    return metrics_self;
+  }
+  pthread_once(&metrics_key_once, metrics_make_key);
+
+  MetricsBlock *block;
+  for (block = atomic_load(&metrics_blocks); block != NULL;
+       block = block->next) {
+    int unused = 0;
+    if (atomic_load_explicit(&block->in_use, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_strong(&block->in_use, &unused, 1)) {
+      break;
+    }
+  }
+
+  if (block == NULL) {
+    block = calloc(1, sizeof(MetricsBlock));
+    if (block == NULL) {
+      return NULL;
+    }
+    atomic_init(&block->in_use, 1);
+    MetricsBlock *head = atomic_load(&metrics_blocks);
+    do {
+      block->next = head;
+    } while (!atomic_compare_exchange_weak(&metrics_blocks, &head, block));
+  }
+  pthread_setspecific(metrics_key, block);
+  metrics_self = block;
+  return block;
+}
+
+/*
+ * Helper function to add to a count in the current thread's block. Only the
+ * owning thread writes it, so a plain load and store will do.
+ */
+
+static void metrics_bump(_Atomic uint64_t *count, uint64_t n) {
+  atomic_store_explicit(
+      count, atomic_load_explicit(count, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+/*
+ * Get the time in nanoseconds, for timing things to count.
+ *
+ * Returns:
+ *   the time
+ */
+uint64_t metrics_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * Add to a counter.
+ *
+ * Input:
+ *   counter - the counter, e.g. METRIC_HITS
+ *   n       - the amount to add
+ */
+void metrics_add(int counter, uint64_t n) {
+  MetricsBlock *block = metrics_block();
+  if (block != NULL) {
+    metrics_bump(&block->counters[counter], n);
+  }
+}
+
+/*
+ * Get the amount the current thread has added to a counter, e.g. to leave
+ * out the time it spent waiting for the user (METRIC_PROMPT_NS).
+ *
+ * Input:
+ *   counter - the counter
+ *
+ * Returns:
+ *   the amount (which may include other threads' that ended before it)
+ */
+uint64_t metrics_local(int counter) {
+  MetricsBlock *block = metrics_block();
+  if (block == NULL) {
+    return 0;
+  }
+  return atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+}
+
+/*
+ * Find the latency bucket of a number of nanoseconds.
+ *
+ * Input:
+ *   ns - the latency
+ *
+ * Returns:
+ *   the index of the bucket
+ */
+int metrics_bucket(uint64_t ns) {
+  if (ns <= 256) {
+    return 0;
+  }
+  int bucket = (64 - __builtin_clzll(ns - 1)) - 8;
+  return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/*
+ * Count a line handled by the chatbot.
+ *
+ * Input:
+ *   intent - the intent, e.g. METRIC_INTENT_QUESTION
+ *   ns     - how long it took
+ */
+void metrics_intent(int intent, uint64_t ns) {
+  MetricsBlock *block = metrics_block();
+  if (block != NULL) {
+    metrics_bump(&block->requests[intent], 1);
+    metrics_bump(&block->latency_ns[intent], ns);
+    metrics_bump(&block->buckets[intent][metrics_bucket(ns)], 1);
+  }
+}
+
+/*
+ * Add up the metrics of every thread.
+ *
+ * Input:
+ *   total - a structure to receive the totals
+ */
+void metrics_read(Metrics *total) {
+  memset(total, 0, sizeof(Metrics));
+  for (MetricsBlock *block = atomic_load(&metrics_blocks); block != NULL;
+       block = block->next) {
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+      total->counters[c] +=
+          atomic_load_explicit(&block->counters[c], memory_order_relaxed);
+    }
+    for (int i = 0; i < METRICS_INTENTS; i++) {
+      total->requests[i] +=
+          atomic_load_explicit(&block->requests[i], memory_order_relaxed);
+      total->latency_ns[i] +=
+          atomic_load_explicit(&block->latency_ns[i], memory_order_relaxed);
+      for (int b = 0; b < METRICS_BUCKETS; b++) {
+        total->buckets[i][b] +=
+            atomic_load_explicit(&block->buckets[i][b], memory_order_relaxed);
+      }
+    }
+  }
+}
+
+/*
+ * Find the name of an intent.
+ *
+ * Input:
+ *   intent - the intent, e.g. METRIC_INTENT_QUESTION
+ *
+ * Returns:
+ *   the name, e.g. "question"
+ */
+const char *metrics_intent_name(int intent) {
+  return metrics_intent_names[intent];
+}
+
+/*
+ * Find the intent with a name.
+ *
+ * Input:
+ *   name - the name, e.g. "question" (in any case)
+ *
+ * Returns:
+ *   the intent, or -1 if there is none by that name
+ */
+int metrics_find_intent(const char *name) {
+  for (int i = 0; i < METRICS_INTENTS; i++) {
+    if (compare_token(name, metrics_intent_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Estimate a percentile of the latencies of an intent.
+ *
+ * Input:
+ *   metrics  - the metrics
+ *   intent   - the intent
+ *   fraction - the percentile, e.g. 0.99
+ *
+ * Returns:
+ *   the upper bound of the bucket the percentile is in, in nanoseconds
+ *   (UINT64_MAX if it is in the last bucket, 0 if there are no latencies)
+ */
+uint64_t metrics_percentile(const Metrics *metrics, int intent,
+                            double fraction) {
+  uint64_t total = metrics->requests[intent];
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t wanted = (uint64_t)(total * fraction);
+  uint64_t seen = 0;
+  for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+    seen += metrics->buckets[intent][b];
+    if (seen > wanted) {
+      return (uint64_t)256 << b;
+    }
+  }
+  return UINT64_MAX;
+}
+
+/*
+ * Write the metrics in the Prometheus text format.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the file could not be written
+ */
+int metrics_write(FILE *f) {
+  static const struct {
+    const char *name, *help;
+    int counter;
+    double scale;
+  } counters[] = {
+      {"chatbot_question_hits_total", "Questions answered.", METRIC_HITS, 1},
+      {"chatbot_question_misses_total", "Questions not answered.",
+       METRIC_MISSES, 1},
+      {"chatbot_answers_learned_total", "Answers taught by users.",
+       METRIC_TAUGHT, 1},
+      {"chatbot_entities_loaded_total", "Entities read from files.",
+       METRIC_LOADED, 1},
+      {"chatbot_load_seconds_total", "Time spent reading files.",
+       METRIC_LOAD_NS, 1e-9},
+      {"chatbot_saved_bytes_total", "Bytes saved to files.",
+       METRIC_SAVED_BYTES, 1},
+      {"chatbot_save_seconds_total", "Time spent saving files.",
+       METRIC_SAVE_NS, 1e-9},
+      {"chatbot_prompt_seconds_total", "Time spent waiting for answers.",
+       METRIC_PROMPT_NS, 1e-9},
+      {"chatbot_suggestions_taken_total",
+       "Questions answered for a suggested entity.", METRIC_SUGGESTED, 1},
+      {"chatbot_responses_evicted_total",
+       "Responses moved to the spill file.", METRIC_EVICTED, 1},
+      {"chatbot_spill_reads_total",
+       "Questions answered from the spill file.", METRIC_SPILL_READS, 1},
+      {"chatbot_store_flushes_total",
+       "Runs written to the disk store.", METRIC_STORE_FLUSHES, 1},
+      {"chatbot_store_compactions_total",
+       "Merges of the disk store's runs.", METRIC_STORE_COMPACTIONS, 1},
+      {"chatbot_store_run_probes_total",
+       "Runs of the disk store looked in for an entity.", METRIC_RUN_PROBES,
+       1},
+      {"chatbot_store_bloom_skips_total",
+       "Runs of the disk store skipped by their bloom filter.",
+       METRIC_BLOOM_SKIPS, 1},
+  };
+  Metrics metrics;
+  metrics_read(&metrics);
+
+  for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %.9g\n", counters[c].name,
+            counters[c].help, counters[c].name, counters[c].name,
+            metrics.counters[counters[c].counter] * counters[c].scale);
+  }
+
+  fprintf(f, "# HELP chatbot_request_duration_seconds "
+             "Time to handle a line, by intent.\n"
+             "# TYPE chatbot_request_duration_seconds histogram\n");
+  for (int i = 0; i < METRICS_INTENTS; i++) {
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+      seen += metrics.buckets[i][b];
+      fprintf(f,
+              "chatbot_request_duration_seconds_bucket{intent=\"%s\","
+              "le=\"%.9g\"} %llu\n",
+              metrics_intent_names[i], ((uint64_t)256 << b) * 1e-9,
+              (unsigned long long)seen);
+    }
+    fprintf(f,
+            "chatbot_request_duration_seconds_bucket{intent=\"%s\","
+            "le=\"+Inf\"} %llu\n"
+            "chatbot_request_duration_seconds_sum{intent=\"%s\"} %.9g\n"
+            "chatbot_request_duration_seconds_count{intent=\"%s\"} %llu\n",
+            metrics_intent_names[i], (unsigned long long)metrics.requests[i],
+            metrics_intent_names[i], metrics.latency_ns[i] * 1e-9,
+            metrics_intent_names[i], (unsigned long long)metrics.requests[i]);
+  }
+  return fflush(f) == 0 && !ferror(f) ? KB_OK : KB_IOERROR;
+}
+
+/*
+ * Helper function to write the metrics to the dump file, replacing it.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM or KB_IOERROR, if the file could not be written
+ */
+
+static int metrics_dump_once() {
+  SaveFile file;
+  int result = savefile_open(&file, metrics_dump.path);
+  if (result != KB_OK) {
+    return result;
+  }
+  result = metrics_write(file.f);
+  if (result == KB_OK) {
+    return savefile_commit(&file);
+  }
+  savefile_abort(&file);
+  return result;
+}
+
+/*
+ * Helper function run by the thread that writes the metrics to a file every
+ * few seconds, and once more when it is stopped.
+ *
+ * Input:
+ *   arg - not used
+ */
+
+static void *metrics_dump_thread(void *arg) {
+  (void)arg;
+  int warned = 0;
+  pthread_mutex_lock(&metrics_dump.lock);
+  for (;;) {
+    int stop = metrics_dump.stop;
+    pthread_mutex_unlock(&metrics_dump.lock);
+    if (metrics_dump_once() != KB_OK && !warned) {
+      fprintf(stderr, "metrics: can't write %s\n", metrics_dump.path);
+      warned = 1;
+    }
+    pthread_mutex_lock(&metrics_dump.lock);
+    if (stop) {
+      break;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += metrics_dump.seconds;
+    while (!metrics_dump.stop &&
+           pthread_cond_timedwait(&metrics_dump.wake, &metrics_dump.lock,
+                                  &until) == 0)
+      ;
+  }
+  pthread_mutex_unlock(&metrics_dump.lock);
+  return NULL;
+}
+
+/*
+ * Start writing the metrics to a file in the Prometheus text format, now and
+ * every few seconds until metrics_dump_stop().
+ *
+ * Input:
+ *   path    - the file
+ *   seconds - how often to write it
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if seconds is not positive
+ *   KB_NOMEM, if the thread could not be started
+ */
+int metrics_dump_start(const char *path, int seconds) {
+  if (seconds <= 0) {
+    return KB_INVALID;
+  }
+  metrics_dump.path = path;
+  metrics_dump.seconds = seconds;
+  metrics_dump.stop = 0;
+  if (pthread_create(&metrics_dump.thread, NULL, metrics_dump_thread, NULL) !=
+      0) {
+    return KB_NOMEM;
+  }
+  metrics_dump.running = 1;
+  return KB_OK;
+}
+
+/*
+ * Stop writing the metrics to a file, writing them one last time first. It
+ * does nothing if metrics_dump_start() was not called.
+ */
+void metrics_dump_stop() {
+  if (!metrics_dump.running) {
+    return;
+  }
+  pthread_mutex_lock(&metrics_dump.lock);
+  metrics_dump.stop = 1;
+  pthread_cond_signal(&metrics_dump.wake);
+  pthread_mutex_unlock(&metrics_dump.lock);
+  pthread_join(metrics_dump.thread, NULL);
+  metrics_dump.running = 0;
+}
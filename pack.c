@@ -0,0 +1,787 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements packs, the compact form of a knowledge base that is
+ * mostly read (e.g. "chatbot -k faq.ini -P 16"), which takes a fraction of the
+ * memory of the nodes, hash indexes and files it replaces (see kb_pack() in
+ * knowledge.c).
+ *
+ * A pack holds the entries of one section, sorted by their case-folded
+ * entities (in the order of the radix tree), in blocks of a few entries each.
+ * The entities in a block are front coded: each is stored as the length of the
+ * prefix it shares with the one before it and the characters after that, so
+ * only the first entity of a block is stored whole. A lookup binary searches
+ * the first entities of the blocks, then reads the entities of one block.
+ *
+ * Responses are compressed with a table of up to 255 symbols of 1 to 8
+ * characters, each written as a one-byte code, as in FSST ("Fast Static
+ * Symbol Table" compression); a character that starts no symbol is escaped.
+ * The table is trained on a sample of the responses of every section, so its
+ * symbols are the strings they have in common, and any one response is
+ * decompressed a symbol at a time without reading any other.
+ *
+ * A pack is never changed once it is built, so lookups read it without
+ * locking. Answers learned afterwards go in the section's nodes as usual,
+ * shadowing the pack's entries.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the most symbols in a table, and the code that escapes a character */
+#define PACK_SYMBOLS 255
+#define PACK_ESCAPE 255
+
+/* the longest symbol */
+#define PACK_SYMBOL_MAX 8
+
+/* the codes a training round counts: the symbols, then each character
+ * escaped */
+#define PACK_CODES (PACK_SYMBOLS + 256)
+
+/* the bytes of responses a table is trained on, and the rounds of training */
+#define PACK_SAMPLE_BYTES (256 * 1024)
+#define PACK_ROUNDS 5
+
+/* Type definition for a table of symbols */
+struct kb_pack_table {
+  uint64_t symbols[PACK_SYMBOLS]; /* the characters of each symbol, padded
+                                     with 0 */
+  uint8_t lens[PACK_SYMBOLS];     /* the length of each symbol */
+  size_t count;                   /* the number of symbols */
+  uint8_t order[PACK_SYMBOLS];    /* the codes by first character, the
+                                     longest symbols first */
+  uint16_t first[257];            /* where the codes of each first character
+                                     start in 'order' */
+};
+
+/* Type definition for a pack: the entries of a section. Each block starts at
+ * blocks[b] in data; each entry in it is the length of the prefix its entity
+ * shares with the one before (0 for the first), the length and characters of
+ * the rest of the entity, and the length (1 or 2 bytes) and codes of its
+ * compressed response. */
+struct kb_pack {
+  uint64_t symbols[256];      /* the characters of each code's symbol */
+  uint8_t lens[256];          /* the length of each code's symbol */
+  size_t count;               /* the number of entries */
+  size_t block;               /* the number of entries in a block */
+  size_t block_count;         /* the number of blocks */
+  uint64_t *blocks;           /* where each block starts */
+  unsigned char *data;        /* the blocks */
+  size_t size;                /* the bytes of data */
+  uint64_t entity_bytes;      /* the bytes of the entities before packing */
+  uint64_t response_bytes;    /* the bytes of the responses before packing */
+};
+
+/* Type definition for a symbol that might be added to a table, while it is
+ * being trained */
+typedef struct pack_candidate {
+  uint64_t value; /* the characters, padded with 0 */
+  uint64_t gain;  /* the characters it would have covered in the sample */
+  uint8_t len;    /* the length */
+} PackCandidate;
+
+/*
+ * Helper function to index the symbols of a table by their first character,
+ * longest first, so that pack_match() finds the longest symbol that matches.
+ *
+ * Input:
+ *   table - the table
+ */
+
+static void pack_index(KBPackTable *table) {
+  size_t counts[257] = {0};
+  for (size_t c = 0; c < table->count; c++) {
+    counts[*(const unsigned char *)&table->symbols[c] + 1]++;
+  }
+  for (int f = 0; f < 256; f++) {
+    counts[f + 1] += counts[f];
+  }
+  for (int f = 0; f <= 256; f++) {
+    table->first[f] = (uint16_t)counts[f];
+  }
+  for (int len = PACK_SYMBOL_MAX; len > 0; len--) {
+    for (size_t c = 0; c < table->count; c++) {
+      if (table->lens[c] == len) {
+        table->order[counts[*(const unsigned char *)&table->symbols[c]]++] =
+            (uint8_t)c;
+      }
+    }
+  }
+}
+
+/*
+ * Helper function to find the longest symbol of a table at the start of some
+ * text.
+ *
+ * Input:
+ *   table - the table
+ *   text  - the text
+ *   len   - the length of the text, at least 1
+ *
+ * Returns:
+ *   the symbol's code, or PACK_ESCAPE if no symbol matches
+ */
+
+static int pack_match(const KBPackTable *table, const unsigned char *text,
+                      size_t len) {
+  for (size_t k = table->first[text[0]]; k < table->first[text[0] + 1]; k++) {
+    int code = table->order[k];
+    if (table->lens[code] <= len &&
+        memcmp(text, &table->symbols[code], table->lens[code]) == 0) {
+      return code;
+    }
+  }
+  return PACK_ESCAPE;
+}
+
+/*
+ * Helper function to compress a response with a table.
+ *
+ * Input:
+ *   table - the table
+ *   text  - the response
+ *   len   - the length of the response
+ *   out   - a buffer to receive the codes, of at least 2 * len bytes
+ *
+ * Returns:
+ *   the number of bytes of codes
+ */
+
+static size_t pack_encode(const KBPackTable *table, const char *text,
+                          size_t len, unsigned char *out) {
+  const unsigned char *p = (const unsigned char *)text;
+  size_t used = 0;
+  for (size_t i = 0; i < len;) {
+    int code = pack_match(table, p + i, len - i);
+    out[used++] = (unsigned char)code;
+    if (code == PACK_ESCAPE) {
+      out[used++] = p[i++];
+    } else {
+      i += table->lens[code];
+    }
+  }
+  return used;
+}
+
+/*
+ * Helper function to decompress a response.
+ *
+ * Input:
+ *   pack  - the pack
+ *   codes - the codes of the response
+ *   len   - the number of bytes of codes
+ *   out   - a buffer to receive the response, of at least
+ *           MAX_RESPONSE + PACK_SYMBOL_MAX bytes
+ *
+ * Returns:
+ *   the length of the response
+ */
+
+static size_t pack_decode(const KBPack *pack, const unsigned char *codes,
+                          size_t len, char *out) {
+  const unsigned char *end = codes + len;
+  size_t used = 0;
+  while (codes < end) {
+    int code = *codes++;
+    if (code == PACK_ESCAPE) {
+      out[used++] = (char)*codes++;
+    } else {
+      // A whole word is copied, and the symbol's length counted
+      memcpy(out + used, &pack->symbols[code], PACK_SYMBOL_MAX);
+      used += pack->lens[code];
+    }
+  }
+  return used;
+}
+
+/*
+ * Helper function to get the characters of a code counted in training: a
+ * symbol of the table, or an escaped character.
+ *
+ * Input:
+ *   table - the table
+ *   id    - the code, or PACK_SYMBOLS plus an escaped character
+ *   len   - receives the length of the characters
+ *
+ * Returns:
+ *   the characters, padded with 0
+ */
+
+static uint64_t pack_symbol(const KBPackTable *table, int id, size_t *len) {
+  if (id < PACK_SYMBOLS) {
+    *len = table->lens[id];
+    return table->symbols[id];
+  }
+  unsigned char c = (unsigned char)(id - PACK_SYMBOLS);
+  uint64_t value = 0;
+  memcpy(&value, &c, 1);
+  *len = 1;
+  return value;
+}
+
+/*
+ * Helper function to add a candidate symbol, growing the array as needed.
+ *
+ * Input:
+ *   candidates - the array of candidates, which may be moved
+ *   count      - the number of candidates, which is incremented
+ *   capacity   - the room in the array, which may be increased
+ *   value      - the characters of the symbol
+ *   len        - its length
+ *   gain       - the characters it would have covered
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int add_candidate(PackCandidate **candidates, size_t *count,
+                         size_t *capacity, uint64_t value, size_t len,
+                         uint64_t gain) {
+  if (*count == *capacity) {
+    size_t grown = *capacity == 0 ? 1024 : *capacity * 2;
+    PackCandidate *moved = realloc(*candidates, grown * sizeof(PackCandidate));
+    if (moved == NULL) {
+      return KB_NOMEM;
+    }
+    *candidates = moved;
+    *capacity = grown;
+  }
+  PackCandidate *candidate = &(*candidates)[(*count)++];
+  candidate->value = value;
+  candidate->len = (uint8_t)len;
+  candidate->gain = gain;
+  return KB_OK;
+}
+
+/*
+ * Helper function (called by qsort()) to order candidates by their
+ * characters, so that the same symbol found twice is counted once.
+ *
+ * Input:
+ *   a - the one candidate
+ *   b - the other
+ *
+ * Returns:
+ *   as strcmp()
+ */
+
+static int compare_candidate_strings(const void *a, const void *b) {
+  const PackCandidate *x = a, *y = b;
+  if (x->len != y->len) {
+    return x->len < y->len ? -1 : 1;
+  }
+  return memcmp(&x->value, &y->value, sizeof(uint64_t));
+}
+
+/*
+ * Helper function (called by qsort()) to order candidates by how much they
+ * would gain, the most first.
+ *
+ * Input:
+ *   a - the one candidate
+ *   b - the other
+ *
+ * Returns:
+ *   as strcmp()
+ */
+
+static int compare_candidate_gains(const void *a, const void *b) {
+  const PackCandidate *x = a, *y = b;
+  if (x->gain != y->gain) {
+    return x->gain > y->gain ? -1 : 1;
+  }
+  return compare_candidate_strings(a, b);
+}
+
+/*
+ * Helper function to run one round of training: compress the sample with the
+ * table so far, counting each code and each pair of codes in a row, then make
+ * the table the symbols (and pairs of symbols, joined) that covered the most
+ * characters.
+ *
+ * Input:
+ *   table  - the table, which is replaced
+ *   items  - the entries
+ *   count  - the number of entries
+ *   stride - the sample is every stride-th entry's response
+ *   counts - PACK_CODES counters for the codes
+ *   pairs  - PACK_CODES * PACK_CODES counters for the pairs of codes
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int pack_round(KBPackTable *table, const KBPackItem *items,
+                      size_t count, size_t stride, uint32_t *counts,
+                      uint32_t *pairs) {
+  memset(counts, 0, PACK_CODES * sizeof(uint32_t));
+  memset(pairs, 0, (size_t)PACK_CODES * PACK_CODES * sizeof(uint32_t));
+  for (size_t i = 0; i < count; i += stride) {
+    const unsigned char *p = (const unsigned char *)items[i].response;
+    size_t len = items[i].response_len;
+    int prev = -1;
+    for (size_t k = 0; k < len;) {
+      int code = pack_match(table, p + k, len - k);
+      int id = code == PACK_ESCAPE ? PACK_SYMBOLS + p[k] : code;
+      k += code == PACK_ESCAPE ? 1 : table->lens[code];
+      counts[id]++;
+      if (prev >= 0) {
+        pairs[(size_t)prev * PACK_CODES + id]++;
+      }
+      prev = id;
+    }
+  }
+
+  PackCandidate *candidates = NULL;
+  size_t candidate_count = 0, capacity = 0;
+  int result = KB_OK;
+  for (int a = 0; a < PACK_CODES && result == KB_OK; a++) {
+    if (counts[a] == 0) {
+      continue;
+    }
+    size_t a_len;
+    uint64_t a_value = pack_symbol(table, a, &a_len);
+    result = add_candidate(&candidates, &candidate_count, &capacity, a_value,
+                           a_len, (uint64_t)counts[a] * a_len);
+    for (int b = 0; b < PACK_CODES && result == KB_OK; b++) {
+      uint32_t n = pairs[(size_t)a * PACK_CODES + b];
+      size_t b_len;
+      uint64_t b_value = pack_symbol(table, b, &b_len);
+      if (n == 0 || a_len + b_len > PACK_SYMBOL_MAX) {
+        continue;
+      }
+      unsigned char joined[2 * PACK_SYMBOL_MAX] = {0};
+      memcpy(joined, &a_value, a_len);
+      memcpy(joined + a_len, &b_value, b_len);
+      uint64_t value;
+      memcpy(&value, joined, sizeof(uint64_t));
+      result = add_candidate(&candidates, &candidate_count, &capacity, value,
+                             a_len + b_len, (uint64_t)n * (a_len + b_len));
+    }
+  }
+  if (result != KB_OK) {
+    free(candidates);
+    return result;
+  }
+
+  // The same symbol may be a code and a pair, or several pairs
+  qsort(candidates, candidate_count, sizeof(PackCandidate),
+        compare_candidate_strings);
+  size_t unique = 0;
+  for (size_t c = 0; c < candidate_count; c++) {
+    if (unique > 0 &&
+        compare_candidate_strings(&candidates[unique - 1], &candidates[c]) ==
+            0) {
+      candidates[unique - 1].gain += candidates[c].gain;
+    } else {
+      candidates[unique++] = candidates[c];
+    }
+  }
+  qsort(candidates, unique, sizeof(PackCandidate), compare_candidate_gains);
+
+  table->count = unique < PACK_SYMBOLS ? unique : PACK_SYMBOLS;
+  for (size_t c = 0; c < table->count; c++) {
+    table->symbols[c] = candidates[c].value;
+    table->lens[c] = candidates[c].len;
+  }
+  pack_index(table);
+  free(candidates);
+  return KB_OK;
+}
+
+/*
+ * Train a table of symbols on the responses of some entries, to compress them
+ * with (see pack_create()). A sample of about PACK_SAMPLE_BYTES of them is
+ * read PACK_ROUNDS times, each time from the table the last round made.
+ *
+ * Input:
+ *   items - the entries
+ *   count - the number of entries
+ *
+ * Returns:
+ *   NULL, if there was a memory allocation failure
+ *   A pointer to the table, to be freed with free()
+ */
+KBPackTable *pack_train(const KBPackItem *items, size_t count) {
+  KBPackTable *table = calloc(1, sizeof(KBPackTable));
+  uint32_t *counts = malloc(PACK_CODES * sizeof(uint32_t));
+  uint32_t *pairs = malloc((size_t)PACK_CODES * PACK_CODES * sizeof(uint32_t));
+  int result = table == NULL || counts == NULL || pairs == NULL ? KB_NOMEM
+                                                                : KB_OK;
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += items[i].response_len;
+  }
+  size_t stride = (size_t)(total / PACK_SAMPLE_BYTES) + 1;
+  for (int round = 0; round < PACK_ROUNDS && result == KB_OK; round++) {
+    result = pack_round(table, items, count, stride, counts, pairs);
+  }
+  free(counts);
+  free(pairs);
+  if (result != KB_OK) {
+    free(table);
+    return NULL;
+  }
+  return table;
+}
+
+/*
+ * Helper function to fold the first characters of an entity, for sorting
+ * entries: 8 of them, padded with 0, in one word.
+ *
+ * Input:
+ *   entity - the entity
+ *   len    - its length
+ *
+ * Returns:
+ *   the folded characters
+ */
+
+static uint64_t pack_prefix(const char *entity, size_t len) {
+  uint64_t prefix = 0;
+  for (size_t k = 0; k < 8; k++) {
+    prefix = prefix << 8 | (k < len ? (unsigned char)FOLD_CHAR(entity[k]) : 0);
+  }
+  return prefix;
+}
+
+/*
+ * Helper function (called by qsort()) to order entries as the radix tree
+ * does: by their case-folded entities, a prefix before the entities that
+ * extend it.
+ *
+ * Input:
+ *   a - the one entry
+ *   b - the other
+ *
+ * Returns:
+ *   as strcmp()
+ */
+
+static int compare_pack_items(const void *a, const void *b) {
+  const KBPackItem *x = a, *y = b;
+  uint64_t x_prefix = pack_prefix(x->entity, x->entity_len);
+  uint64_t y_prefix = pack_prefix(y->entity, y->entity_len);
+  if (x_prefix != y_prefix) {
+    return x_prefix < y_prefix ? -1 : 1;
+  }
+  size_t len = x->entity_len < y->entity_len ? x->entity_len : y->entity_len;
+  for (size_t k = 8; k < len; k++) {
+    int cx = (unsigned char)FOLD_CHAR(x->entity[k]);
+    int cy = (unsigned char)FOLD_CHAR(y->entity[k]);
+    if (cx != cy) {
+      return cx - cy;
+    }
+  }
+  return (x->entity_len > y->entity_len) - (x->entity_len < y->entity_len);
+}
+
+/*
+ * Pack the entries of a section. The entries are sorted in place; their
+ * strings are copied, so they need only live until this returns.
+ *
+ * Input:
+ *   table - the table to compress the responses with (see pack_train())
+ *   items - the entries, each with a different entity (ignoring case)
+ *   count - the number of entries
+ *   block - the number of entries in a block, at least 1
+ *
+ * Returns:
+ *   NULL, if there was a memory allocation failure
+ *   A pointer to the pack, to be freed with pack_destroy()
+ */
+KBPack *pack_create(const KBPackTable *table, KBPackItem *items, size_t count,
+                    size_t block) {
+  qsort(items, count, sizeof(KBPackItem), compare_pack_items);
+  KBPack *pack = calloc(1, sizeof(KBPack));
+  if (pack == NULL) {
+    return NULL;
+  }
+  memcpy(pack->symbols, table->symbols, sizeof(table->symbols));
+  memcpy(pack->lens, table->lens, sizeof(table->lens));
+  pack->count = count;
+  pack->block = block;
+  pack->block_count = (count + block - 1) / block;
+  pack->blocks = malloc((pack->block_count + 1) * sizeof(uint64_t));
+
+  size_t capacity = 4096;
+  unsigned char *data = malloc(capacity);
+  if (pack->blocks == NULL || data == NULL) {
+    free(data);
+    pack_destroy(pack);
+    return NULL;
+  }
+
+  // An entry takes at most its lengths, its entity and twice its response
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    const KBPackItem *item = &items[i];
+    size_t most = 4 + item->entity_len + 2 * item->response_len;
+    if (used + most > capacity) {
+      while (used + most > capacity) {
+        capacity *= 2;
+      }
+      unsigned char *moved = realloc(data, capacity);
+      if (moved == NULL) {
+        free(data);
+        pack_destroy(pack);
+        return NULL;
+      }
+      data = moved;
+    }
+
+    size_t shared = 0;
+    if (i % block == 0) {
+      pack->blocks[i / block] = used;
+    } else {
+      const KBPackItem *prev = &items[i - 1];
+      while (shared < prev->entity_len && shared < item->entity_len &&
+             prev->entity[shared] == item->entity[shared]) {
+        shared++;
+      }
+    }
+    data[used++] = (unsigned char)shared;
+    data[used++] = (unsigned char)(item->entity_len - shared);
+    memcpy(data + used, item->entity + shared, item->entity_len - shared);
+    used += item->entity_len - shared;
+
+    unsigned char codes[2 * MAX_RESPONSE];
+    size_t len = pack_encode(table, item->response, item->response_len, codes);
+    if (len < 128) {
+      data[used++] = (unsigned char)len;
+    } else {
+      data[used++] = (unsigned char)(len & 127) | 128;
+      data[used++] = (unsigned char)(len >> 7);
+    }
+    memcpy(data + used, codes, len);
+    used += len;
+    pack->entity_bytes += item->entity_len;
+    pack->response_bytes += item->response_len;
+  }
+  pack->blocks[pack->block_count] = used;
+
+  // Give back the room the responses did not need
+  unsigned char *fitted = realloc(data, used > 0 ? used : 1);
+  pack->data = fitted != NULL ? fitted : data;
+  pack->size = used;
+  return pack;
+}
+
+/*
+ * Helper function to read the entity of an entry, after the one before it.
+ *
+ * Input:
+ *   p      - the entry
+ *   entity - the entity before it, which is replaced by this one
+ *   len    - the length of the entity before, which is replaced too
+ *
+ * Returns:
+ *   a pointer to the entry's response
+ */
+
+static const unsigned char *read_entity(const unsigned char *p, char *entity,
+                                        size_t *len) {
+  size_t shared = p[0], rest = p[1];
+  memcpy(entity + shared, p + 2, rest);
+  *len = shared + rest;
+  return p + 2 + rest;
+}
+
+/*
+ * Helper function to read where the codes of an entry's response are.
+ *
+ * Input:
+ *   p   - the response
+ *   len - receives the number of bytes of codes
+ *
+ * Returns:
+ *   a pointer to the codes
+ */
+
+static const unsigned char *read_codes(const unsigned char *p, size_t *len) {
+  if (p[0] < 128) {
+    *len = p[0];
+    return p + 1;
+  }
+  *len = (size_t)(p[0] & 127) | (size_t)p[1] << 7;
+  return p + 2;
+}
+
+/*
+ * Helper function to compare an entity with a case-folded one, in the order
+ * entries are sorted.
+ *
+ * Input:
+ *   entity     - the entity
+ *   entity_len - its length
+ *   folded     - the folded entity
+ *   len        - its length
+ *
+ * Returns:
+ *   as strcmp()
+ */
+
+static int compare_folded(const char *entity, size_t entity_len,
+                          const char *folded, size_t len) {
+  size_t n = entity_len < len ? entity_len : len;
+  for (size_t k = 0; k < n; k++) {
+    int c = (unsigned char)FOLD_CHAR(entity[k]) - (unsigned char)folded[k];
+    if (c != 0) {
+      return c;
+    }
+  }
+  return (entity_len > len) - (entity_len < len);
+}
+
+/*
+ * Look up the response to an entity in a pack: the block it would be in is
+ * found by binary search on the blocks' first entities, then the block is
+ * read up to the entity, and only its response is decompressed.
+ *
+ * Input:
+ *   pack     - the pack, or NULL
+ *   folded   - the entity, case-folded (see make_key() in knowledge.c)
+ *   len      - the length of the entity
+ *   response - a buffer to receive the response, or NULL
+ *   n        - the maximum number of characters to write to the buffer,
+ *              including the terminating null
+ *
+ * Returns:
+ *   the length of the response, if the entity is in the pack
+ *   KB_NOTFOUND, if it is not
+ */
+int pack_find(const KBPack *pack, const char *folded, size_t len,
+              char *response, int n) {
+  if (pack == NULL || pack->block_count == 0) {
+    return KB_NOTFOUND;
+  }
+
+  // The last block whose first entity is not after the one looked up
+  size_t lo = 0, hi = pack->block_count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    const unsigned char *p = pack->data + pack->blocks[mid];
+    if (compare_folded((const char *)p + 2, p[1], folded, len) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  const unsigned char *p = pack->data + pack->blocks[lo];
+  const unsigned char *end = pack->data + pack->blocks[lo + 1];
+  char entity[MAX_ENTITY];
+  size_t entity_len = 0;
+  while (p < end) {
+    size_t codes_len;
+    p = read_entity(p, entity, &entity_len);
+    const unsigned char *codes = read_codes(p, &codes_len);
+    p = codes + codes_len;
+    int c = compare_folded(entity, entity_len, folded, len);
+    if (c > 0) {
+      break;
+    } else if (c == 0) {
+      char text[MAX_RESPONSE + PACK_SYMBOL_MAX];
+      size_t text_len = pack_decode(pack, codes, codes_len, text);
+      if (response != NULL && n > 0) {
+        size_t copied = text_len < (size_t)n - 1 ? text_len : (size_t)n - 1;
+        memcpy(response, text, copied);
+        response[copied] = '\0';
+      }
+      return (int)text_len;
+    }
+  }
+  return KB_NOTFOUND;
+}
+
+/*
+ * Pass each entry of a pack to a function, in order.
+ *
+ * Input:
+ *   pack - the pack
+ *   fn   - the function, which is passed each entity and its response (not
+ *          null-terminated, and only valid until it returns), their lengths
+ *          and 'arg'
+ *   arg  - an argument to pass on to fn
+ */
+void pack_walk(const KBPack *pack,
+               void (*fn)(const char *entity, size_t entity_len,
+                          const char *response, size_t response_len,
+                          void *arg),
+               void *arg) {
+  const unsigned char *p = pack->data;
+  const unsigned char *end = pack->data + pack->size;
+  char entity[MAX_ENTITY];
+  char text[MAX_RESPONSE + PACK_SYMBOL_MAX];
+  size_t entity_len = 0;
+  while (p < end) {
+    size_t codes_len;
+    p = read_entity(p, entity, &entity_len);
+    const unsigned char *codes = read_codes(p, &codes_len);
+    p = codes + codes_len;
+    fn(entity, entity_len, text, pack_decode(pack, codes, codes_len, text),
+       arg);
+  }
+}
+
+/*
+ * Write out the entities of a pack one after another, in order, without
+ * decompressing their responses.
+ *
+ * Input:
+ *   pack   - the pack
+ *   buffer - a buffer to receive the entities, of the size given by
+ *            pack_stats()
+ */
+void pack_entities(const KBPack *pack, char *buffer) {
+  const unsigned char *p = pack->data;
+  const unsigned char *end = pack->data + pack->size;
+  char entity[MAX_ENTITY];
+  size_t entity_len = 0;
+  while (p < end) {
+    size_t codes_len;
+    p = read_entity(p, entity, &entity_len);
+    p = read_codes(p, &codes_len) + codes_len;
+    memcpy(buffer, entity, entity_len);
+    buffer += entity_len;
+  }
+}
+
+/*
+ * Find out how large a pack is, and how large its entries were before they
+ * were packed.
+ *
+ * Input:
+ *   pack  - the pack
+ *   stats - a structure to receive the figures
+ */
+void pack_stats(const KBPack *pack, KBPackStats *stats) {
+  stats->entries = pack->count;
+  stats->entity_bytes = pack->entity_bytes;
+  stats->raw_bytes = pack->entity_bytes + pack->response_bytes;
+  stats->bytes = sizeof(KBPack) +
+                 (pack->block_count + 1) * sizeof(uint64_t) + pack->size;
+}
+
+/*
+ * Free a pack (e.g. through epoch_retire(), once no lookup can be reading
+ * it).
+ *
+ * Input:
+ *   arg - the pack
+ */
+void pack_destroy(void *arg) {
+  KBPack *pack = arg;
+  if (pack == NULL) {
+    return;
+  }
+  free(pack->blocks);
+  free(pack->data);
+  free(pack);
+}
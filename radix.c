@@ -0,0 +1,403 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the radix tree of a section: its entities in order,
+ * case-folded as the index compares them, so that the chatbot can list the
+ * entities it knows a page at a time ("list what ICT10 10 2"), answer prefix
+ * questions ("what is ICT10*"), and save them in the same order every time.
+ *
+ * Each node of the tree is labelled with the characters that follow its
+ * parent's, and an entity is the path from the root to the node it ends at.
+ * A label is not stored: it is read from an entity that passes through the
+ * node, which any entity below it does. Children are kept sorted by the first
+ * character of their labels, and each node counts the entities below it, so
+ * finding the entities with a prefix, and skipping to a page of them, costs
+ * time in proportion to the length of the prefix and the size of the page,
+ * however many entities there are.
+ *
+ * A radix tree is built the first time it is needed (see kb_list() in
+ * knowledge.c), kept up to date as entities are added and removed, and
+ * dropped when its entities might move. Its nodes come from an arena of its
+ * own. It is only used with the knowledge base's lock held, so it takes no
+ * locks of its own.
+ */
+
+#include "chat1002.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Type definition for a node of a radix tree */
+typedef struct radix_node {
+  const char *entity;        /* an entity that passes through the node, or
+                                ends at it if 'is_entity' */
+  uint32_t count;            /* the number of entities in the subtree */
+  uint8_t depth;             /* the length of the path to the end of the node */
+  uint8_t label;             /* the length of the node's label */
+  uint8_t is_entity;         /* 1 if an entity ends at the node */
+  uint16_t children;         /* the number of children */
+  uint16_t capacity;         /* the room in 'child' */
+  struct radix_node **child; /* the children, by the first character of their
+                                labels, which follow the array (see
+                                radix_keys()) */
+} RadixNode;
+
+/* Type definition for a radix tree */
+struct kb_radix {
+  RadixNode root; /* the empty path */
+  Arena arena;    /* holds every node and array of children */
+};
+
+/*
+ * Helper function to get the first characters of the labels of a node's
+ * children, case-folded, which are kept after the array of children so that
+ * finding a child reads only the parent's memory.
+ *
+ * Input:
+ *   node - the node
+ *
+ * Returns:
+ *   the characters, one for each child
+ */
+
+static unsigned char *radix_keys(const RadixNode *node) {
+  return (unsigned char *)(node->child + node->capacity);
+}
+
+/*
+ * Helper function to find the child of a node whose label starts with a
+ * character.
+ *
+ * Input:
+ *   node - the node
+ *   c    - the character, case-folded
+ *   at   - receives the position of the child, or where it would go
+ *
+ * Returns:
+ *   NULL, if the node has no such child
+ *   A pointer to the child
+ */
+
+static RadixNode *radix_child(const RadixNode *node, unsigned char c,
+                              size_t *at) {
+  const unsigned char *keys = radix_keys(node);
+  size_t lo = 0, hi = node->children;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (keys[mid] < c) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *at = lo;
+  if (lo < node->children && keys[lo] == c) {
+    return node->child[lo];
+  }
+  return NULL;
+}
+
+/*
+ * Helper function to count how many characters of a node's label a string
+ * matches, given that the first one does.
+ *
+ * Input:
+ *   node - the node
+ *   s    - the rest of the string, after the node's parent's path
+ *   len  - the length of the rest of the string, at least 1
+ *
+ * Returns:
+ *   the number of characters matched, from 1 to the length of the label
+ */
+
+static size_t radix_match(const RadixNode *node, const char *s, size_t len) {
+  const char *label = node->entity + node->depth - node->label;
+  size_t k = 1;
+  while (k < node->label && k < len && FOLD_CHAR(label[k]) == FOLD_CHAR(s[k])) {
+    k++;
+  }
+  return k;
+}
+
+/*
+ * Helper function to create a node.
+ *
+ * Input:
+ *   radix  - the radix tree
+ *   entity - an entity that passes through the node
+ *   depth  - the length of the path to the end of the node
+ *   label  - the length of the node's label
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the node, with no children
+ */
+
+static RadixNode *radix_node(KBRadix *radix, const char *entity, size_t depth,
+                             size_t label) {
+  RadixNode *node = arena_alloc(&radix->arena, sizeof(RadixNode),
+                                sizeof(void *));
+  if (node == NULL) {
+    return NULL;
+  }
+  memset(node, 0, sizeof(RadixNode));
+  node->entity = entity;
+  node->depth = (uint8_t)depth;
+  node->label = (uint8_t)label;
+  return node;
+}
+
+/*
+ * Helper function to give a node another child. Arrays of children come from
+ * the arena, so a full one is left there when it is replaced by one twice
+ * the size.
+ *
+ * Input:
+ *   radix - the radix tree
+ *   node  - the node
+ *   at    - the position of the new child
+ *   child - the new child
+ *   key   - the first character of the child's label, case-folded
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int radix_attach(KBRadix *radix, RadixNode *node, size_t at,
+                        RadixNode *child, unsigned char key) {
+  if (node->children == node->capacity) {
+    size_t capacity = node->capacity == 0 ? 2 : node->capacity * 2;
+    RadixNode **array = arena_alloc(
+        &radix->arena, capacity * (sizeof(RadixNode *) + 1), sizeof(void *));
+    if (array == NULL) {
+      return KB_NOMEM;
+    }
+    if (node->children > 0) {
+      memcpy(array, node->child, node->children * sizeof(RadixNode *));
+      memcpy(array + capacity, radix_keys(node), node->children);
+    }
+    node->child = array;
+    node->capacity = (uint16_t)capacity;
+  }
+  unsigned char *keys = radix_keys(node);
+  size_t after = node->children - at;
+  memmove(node->child + at + 1, node->child + at, after * sizeof(RadixNode *));
+  memmove(keys + at + 1, keys + at, after);
+  node->child[at] = child;
+  keys[at] = key;
+  node->children++;
+  return KB_OK;
+}
+
+/*
+ * Create an empty radix tree.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the radix tree, to be freed with radix_destroy()
+ */
+KBRadix *radix_create() { return calloc(1, sizeof(KBRadix)); }
+
+/*
+ * Free a radix tree. The entities themselves belong to the knowledge base.
+ *
+ * Input:
+ *   radix - the radix tree, or NULL
+ */
+void radix_destroy(KBRadix *radix) {
+  if (radix == NULL) {
+    return;
+  }
+  arena_reset(&radix->arena);
+  free(radix);
+}
+
+/*
+ * Add an entity to a radix tree, if no entity that is the same but for case
+ * is in it already. The entity is not copied, so it must stay where it is for
+ * as long as the tree is used.
+ *
+ * Input:
+ *   radix  - the radix tree
+ *   entity - the entity (need not be null-terminated)
+ *   len    - the length of the entity, less than MAX_ENTITY
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the tree may then
+ *             have a node for the entity without counting it, and should be
+ *             dropped)
+ */
+int radix_insert(KBRadix *radix, const char *entity, size_t len) {
+  RadixNode *path[MAX_ENTITY + 2];
+  size_t depth = 0;
+  RadixNode *node = &radix->root;
+  size_t pos = 0;
+
+  for (;;) {
+    path[depth++] = node;
+    if (pos == len) {
+      if (node->is_entity) {
+        return KB_OK;
+      }
+      node->is_entity = 1;
+      node->entity = entity; // it has the same path as the node's entity
+      break;
+    }
+
+    size_t at;
+    unsigned char c = (unsigned char)FOLD_CHAR(entity[pos]);
+    RadixNode *child = radix_child(node, c, &at);
+    if (child == NULL) {
+      RadixNode *leaf = radix_node(radix, entity, len, len - pos);
+      if (leaf == NULL || radix_attach(radix, node, at, leaf, c) != KB_OK) {
+        return KB_NOMEM;
+      }
+      leaf->is_entity = 1;
+      path[depth++] = leaf;
+      break;
+    }
+
+    size_t k = radix_match(child, entity + pos, len - pos);
+    if (k < child->label) {
+      // The entity leaves the child's label part way: split the label there
+      RadixNode *split = radix_node(radix, child->entity, pos + k, k);
+      unsigned char rest = (unsigned char)FOLD_CHAR(
+          child->entity[child->depth - child->label + k]);
+      if (split == NULL ||
+          radix_attach(radix, split, 0, child, rest) != KB_OK) {
+        return KB_NOMEM;
+      }
+      split->count = child->count;
+      child->label -= k;
+      node->child[at] = split;
+      child = split;
+    }
+    node = child;
+    pos += k;
+  }
+
+  for (size_t i = 0; i < depth; i++) {
+    path[i]->count++;
+  }
+  return KB_OK;
+}
+
+/*
+ * Remove an entity from a radix tree. Its nodes are kept, so that the entities
+ * below them can still be found, but no longer count it.
+ *
+ * Input:
+ *   radix  - the radix tree
+ *   entity - the entity (need not be null-terminated)
+ *   len    - the length of the entity, less than MAX_ENTITY
+ *
+ * Returns:
+ *   KB_OK, if the entity was removed
+ *   KB_NOTFOUND, if the entity is not in the tree
+ */
+int radix_remove(KBRadix *radix, const char *entity, size_t len) {
+  RadixNode *path[MAX_ENTITY + 2];
+  size_t depth = 0;
+  RadixNode *node = &radix->root;
+  size_t pos = 0;
+  path[depth++] = node;
+  while (pos < len) {
+    size_t at;
+    node = radix_child(node, (unsigned char)FOLD_CHAR(entity[pos]), &at);
+    if (node == NULL) {
+      return KB_NOTFOUND;
+    }
+    size_t k = radix_match(node, entity + pos, len - pos);
+    if (k < node->label) {
+      return KB_NOTFOUND; // the entity ends, or leaves the label, part way
+    }
+    path[depth++] = node;
+    pos += k;
+  }
+  if (!node->is_entity) {
+    return KB_NOTFOUND;
+  }
+
+  node->is_entity = 0;
+  for (size_t i = 0; i < depth; i++) {
+    path[i]->count--;
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to visit the entities of a subtree in order, skipping the
+ * first few and stopping after a number of them. Whole subtrees are skipped
+ * by their counts, without visiting them.
+ *
+ * Input:
+ *   node  - the root of the subtree
+ *   skip  - the number of entities still to skip, which is updated
+ *   limit - the number of entities still to visit, which is updated
+ *   fn    - the function, which is passed each entity, its length and 'arg'
+ *   arg   - an argument to pass on to fn
+ */
+
+static void radix_visit(const RadixNode *node, size_t *skip, size_t *limit,
+                        void (*fn)(const char *entity, size_t len, void *arg),
+                        void *arg) {
+  if (*skip >= node->count) {
+    *skip -= node->count;
+    return;
+  }
+  // An entity comes before the longer ones it is a prefix of
+  if (node->is_entity) {
+    if (*skip > 0) {
+      (*skip)--;
+    } else {
+      fn(node->entity, node->depth, arg);
+      (*limit)--;
+    }
+  }
+  for (size_t i = 0; i < node->children && *limit > 0; i++) {
+    radix_visit(node->child[i], skip, limit, fn, arg);
+  }
+}
+
+/*
+ * Call a function for entities that start with a prefix (ignoring case), in
+ * order of their case-folded characters, skipping the first few.
+ *
+ * Input:
+ *   radix  - the radix tree
+ *   prefix - the prefix (need not be null-terminated)
+ *   len    - the length of the prefix (0 for every entity)
+ *   skip   - the number of entities to skip
+ *   limit  - the most entities to pass to fn
+ *   fn     - the function, which is passed each entity (not null-terminated),
+ *            its length and 'arg'
+ *   arg    - an argument to pass on to fn
+ *
+ * Returns:
+ *   the number of entities that start with the prefix
+ */
+size_t radix_list(const KBRadix *radix, const char *prefix, size_t len,
+                  size_t skip, size_t limit,
+                  void (*fn)(const char *entity, size_t len, void *arg),
+                  void *arg) {
+  const RadixNode *node = &radix->root;
+  size_t pos = 0;
+  while (pos < len) {
+    size_t at;
+    node = radix_child(node, (unsigned char)FOLD_CHAR(prefix[pos]), &at);
+    if (node == NULL) {
+      return 0;
+    }
+    size_t k = radix_match(node, prefix + pos, len - pos);
+    if (k < node->label && pos + k < len) {
+      return 0; // the prefix leaves the label part way
+    }
+    pos += k;
+  }
+
+  if (limit > 0) {
+    radix_visit(node, &skip, &limit, fn, arg);
+  }
+  return node->count;
+}
@@ -0,0 +1,234 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements transcript replay, which measures how long the chatbot
+ * takes to answer each line a user types, along the whole path the terminal
+ * takes: splitting the line into words, chatbot_main()'s dispatch, the
+ * intent's work, and printing the reply.
+ *
+ * A transcript is what the user would type, one line at a time, e.g. one
+ * recorded with "tee", or one written by "chatbot -G ... -T" (see bench.c).
+ * The lines are answered in a session over the default knowledge base (so
+ * -k and -j apply) that reads the user's answers from the transcript too, so
+ * a question the chatbot can't answer takes the next line as the answer to
+ * learn, just as on the terminal. The chatbot's output is thrown away.
+ *
+ * Each line is timed and counted under its intent: the question word (with
+ * "+teach" if the chatbot asked for the answer, which is only noticed when
+ * the transcript is a file), the command, or "other". At the end of the
+ * transcript, or at EXIT, the number of lines, the rate at which they were
+ * answered (over the time spent answering them, not reading them) and the
+ * latency percentiles are printed on stdout as JSON, one line for each intent
+ * and one for them all, e.g.
+ *
+ *   {"intent":"what","requests":80210,"p50_ns":2816,"p99_ns":9472,
+ *    "p999_ns":31744,"max_ns":180224}
+ *
+ * (on one line), so that a change can be held back if it makes the tail
+ * worse.
+ */
+
+#include "chat1002.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* room for more intents than replay_name() can give */
+#define REPLAY_INTENTS 16
+
+/* Type definition for the latencies of one intent */
+typedef struct replay_intent {
+  char name[MAX_INTENT + 8]; /* the intent, e.g. "what" or "what+teach" */
+  long requests;             /* the number of lines */
+  uint64_t max_ns;           /* the longest latency */
+  long *histogram;           /* LATENCY_BUCKETS counts */
+} ReplayIntent;
+
+/*
+ * Helper function to get the time in nanoseconds.
+ */
+
+static uint64_t replay_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * Helper function to name the intent of a line, as chatbot_session_main()
+ * would dispatch it.
+ *
+ * Input:
+ *   inc    - the number of words in the line
+ *   inv    - the words
+ *   taught - 1 if the chatbot asked the user for an answer
+ *   name   - a buffer for the name, with room for MAX_INTENT + 8 characters
+ */
+
+static void replay_name(int inc, char *inv[], int taught, char *name) {
+  const char *intent = "empty";
+  if (inc >= 1) {
+    const Intent *found = intent_find(inv[0]);
+    if (intent_question(knowledge_default(), inv[0]) >= 0) {
+      intent = inv[0];
+    } else if (found == NULL) {
+      intent = "other";
+    } else {
+      intent = metrics_intent_name(found->metric);
+    }
+  }
+
+  int len = 0;
+  while (intent[len] != '\0' && len < MAX_INTENT - 1) {
+    name[len] = tolower((unsigned char)intent[len]);
+    len++;
+  }
+  strcpy(name + len, taught ? "+teach" : "");
+}
+
+/*
+ * Helper function to find the latencies of an intent, adding it if it is new.
+ *
+ * Input:
+ *   intents - the intents seen so far
+ *   count   - the number of them, which is updated
+ *   name    - the intent
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the intent's latencies
+ */
+
+static ReplayIntent *replay_intent(ReplayIntent *intents, int *count,
+                                   const char *name) {
+  for (int i = 0; i < *count; i++) {
+    if (strcmp(intents[i].name, name) == 0) {
+      return &intents[i];
+    }
+  }
+  ReplayIntent *intent = &intents[*count];
+  memset(intent, 0, sizeof(ReplayIntent));
+  intent->histogram = calloc(LATENCY_BUCKETS, sizeof(long));
+  if (intent->histogram == NULL) {
+    return NULL;
+  }
+  snprintf(intent->name, sizeof(intent->name), "%s", name);
+  (*count)++;
+  return intent;
+}
+
+/*
+ * Helper function to print the latencies of an intent.
+ *
+ * Input:
+ *   intent - the intent's latencies
+ */
+
+static void replay_report(const ReplayIntent *intent) {
+  const long *h = intent->histogram;
+  long total = intent->requests;
+  printf("{\"intent\":\"%s\",\"requests\":%ld,\"p50_ns\":%llu,"
+         "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+         intent->name, total,
+         (unsigned long long)latency_percentile(h, total, 0.5),
+         (unsigned long long)latency_percentile(h, total, 0.99),
+         (unsigned long long)latency_percentile(h, total, 0.999),
+         (unsigned long long)intent->max_ns);
+}
+
+/*
+ * Replay a transcript.
+ *
+ * Input:
+ *   filename - the transcript ("-" for standard input)
+ *
+ * Returns:
+ *   the exit status for the program (0 if the transcript was replayed)
+ */
+int replay_main(const char *filename) {
+  FILE *in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+  if (in == NULL) {
+    fprintf(stderr, "replay: can't open %s\n", filename);
+    return 1;
+  }
+#ifdef _WIN32
+  FILE *out = fopen("NUL", "w");
+#else
+  FILE *out = fopen("/dev/null", "w");
+#endif
+  session_t *session = session_create(knowledge_default(), in, out);
+  ReplayIntent intents[REPLAY_INTENTS];
+  ReplayIntent all;
+  int count = 0;
+  memset(&all, 0, sizeof(all));
+  strcpy(all.name, "all");
+  all.histogram = calloc(LATENCY_BUCKETS, sizeof(long));
+  if (out == NULL || session == NULL || all.histogram == NULL) {
+    fprintf(stderr, "replay: Memory allocation error.\n");
+    return 1;
+  }
+
+  char input[MAX_INPUT];
+  char *inv[MAX_INPUT];
+  char output[MAX_RESPONSE];
+  int done = 0, status = 0;
+  uint64_t busy = 0;
+  long skipped = 0;
+  while (!done && fgets(input, MAX_INPUT, in) != NULL) {
+    if (strchr(input, '\n') == NULL && !feof(in)) {
+      // Too long for the terminal as well; it would not be answered
+      int c;
+      while ((c = fgetc(in)) != '\n' && c != EOF)
+        ;
+      skipped++;
+      continue;
+    }
+
+    // Time the line as the terminal would handle it; a teach flow reads the
+    // answer from the transcript as part of the line
+    long before = ftell(in);
+    uint64_t started = replay_clock();
+    int inc = split_words(input, inv);
+    done = chatbot_session_main(session, inc, inv, output, MAX_RESPONSE);
+    fprintf(out, "%s: %s\n", chatbot_botname(), output);
+    uint64_t elapsed = replay_clock() - started;
+    busy += elapsed;
+
+    char name[MAX_INTENT + 8];
+    replay_name(inc, inv, ftell(in) != before, name);
+    ReplayIntent *intent = replay_intent(intents, &count, name);
+    if (intent == NULL) {
+      fprintf(stderr, "replay: Memory allocation error.\n");
+      status = 1;
+      break;
+    }
+    int bucket = latency_bucket(elapsed);
+    ReplayIntent *both[2] = {intent, &all};
+    for (int i = 0; i < 2; i++) {
+      both[i]->histogram[bucket]++;
+      both[i]->requests++;
+      if (elapsed > both[i]->max_ns) {
+        both[i]->max_ns = elapsed;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    replay_report(&intents[i]);
+    free(intents[i].histogram);
+  }
+  replay_report(&all);
+  printf("{\"intent\":\"throughput\",\"requests\":%ld,\"skipped\":%ld,"
+         "\"requests_per_s\":%.0f}\n",
+         all.requests, skipped, busy > 0 ? all.requests * 1e9 / busy : 0.0);
+  free(all.histogram);
+
+  session_destroy(session);
+  fclose(out);
+  if (in != stdin) {
+    fclose(in);
+  }
+  return status;
+}
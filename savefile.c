@@ -0,0 +1,155 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements replacing a file all at once, so that saving the
+ * knowledge base never leaves a file half written.
+ *
+ * savefile_open() creates a temporary file beside the one to be replaced, and
+ * everything is written to that. savefile_commit() makes the temporary file
+ * durable and renames it over the original, which readers (and a knowledge
+ * base that has the original mapped, see kb_read()) go on seeing until the
+ * rename; after a crash there is either the whole old file or the whole new
+ * one. savefile_abort() throws the temporary file away instead.
+ *
+ * Where rename() cannot replace a file (Windows), the file is simply
+ * overwritten.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Start replacing a file.
+ *
+ * Input:
+ *   file - a structure to receive the temporary file
+ *   path - the name of the file to replace (which need not exist yet)
+ *
+ * Returns:
+ *   KB_OK, if file->f is ready to be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the temporary file could not be created
+ */
+int savefile_open(SaveFile *file, const char *path) {
+  memset(file, 0, sizeof(SaveFile));
+  file->path = path;
+#ifdef _WIN32
+  file->f = fopen(path, "wb");
+  return file->f == NULL ? KB_IOERROR : KB_OK;
+#else
+  size_t len = strlen(path) + sizeof(".XXXXXX");
+  file->temp = malloc(len);
+  if (file->temp == NULL) {
+    return KB_NOMEM;
+  }
+  snprintf(file->temp, len, "%s.XXXXXX", path);
+
+  int fd = mkstemp(file->temp);
+  if (fd < 0) {
+    free(file->temp);
+    file->temp = NULL;
+    return KB_IOERROR;
+  }
+  // mkstemp() makes files only their owner can read; keep the original's mode
+  struct stat st;
+  fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : 0644);
+  file->f = fdopen(fd, "wb");
+  if (file->f == NULL) {
+    close(fd);
+    remove(file->temp);
+    free(file->temp);
+    file->temp = NULL;
+    return KB_IOERROR;
+  }
+  return KB_OK;
+#endif
+}
+
+/*
+ * Helper function to make a rename in a file's directory durable.
+ *
+ * Input:
+ *   path - the name of the file
+ */
+
+static void savefile_sync_directory(const char *path) {
+#ifndef _WIN32
+  const char *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".") : strndup(path, slash - path + 1);
+  if (dir == NULL) {
+    return;
+  }
+  int fd = open(dir, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+#endif
+}
+
+/*
+ * Finish replacing a file: make the temporary file durable and rename it over
+ * the original. If that fails, the original is left as it was.
+ *
+ * Input:
+ *   file - the file, from savefile_open()
+ *
+ * Returns:
+ *   KB_OK, if the file has been replaced
+ *   KB_IOERROR, if it could not be
+ */
+int savefile_commit(SaveFile *file) {
+  TRACE_SPAN("savefile_commit");
+  int result = KB_OK;
+  if (fflush(file->f) != 0) {
+    result = KB_IOERROR;
+  }
+#ifndef _WIN32
+  if (result == KB_OK && fsync(fileno(file->f)) != 0) {
+    result = KB_IOERROR;
+  }
+#endif
+  if (fclose(file->f) != 0) {
+    result = KB_IOERROR;
+  }
+  file->f = NULL;
+  if (file->temp == NULL) {
+    return result;
+  }
+
+  if (result == KB_OK && rename(file->temp, file->path) != 0) {
+    result = KB_IOERROR;
+  }
+  if (result == KB_OK) {
+    savefile_sync_directory(file->path);
+  } else {
+    remove(file->temp);
+  }
+  free(file->temp);
+  file->temp = NULL;
+  return result;
+}
+
+/*
+ * Give up replacing a file, leaving the original as it was.
+ *
+ * Input:
+ *   file - the file, from savefile_open()
+ */
+void savefile_abort(SaveFile *file) {
+  fclose(file->f);
+  file->f = NULL;
+  if (file->temp != NULL) {
+    remove(file->temp);
+    free(file->temp);
+    file->temp = NULL;
+  }
+}
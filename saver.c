@@ -0,0 +1,220 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements saving a knowledge base in the background, so that
+ * SAVE answers at once however large the knowledge base is, and the chatbot
+ * goes on answering (and learning) while the file is written.
+ *
+ * saver_start() takes a point-in-time view of the knowledge base (see
+ * kb_view() in knowledge.c), which costs a copy of each section's hash index
+ * made under the lock, and hands it to a thread that writes it out as
+ * kb_write() would. Answers learned after the view was taken are not in the
+ * file, and the view stays valid even if the knowledge base is reset, since
+ * the thread stays in an epoch (see epoch.c) until it is done with it. So
+ * nothing retired meanwhile is freed until the save is done: a knowledge base
+ * with a budget (see kb_set_budget()) goes over it by the responses moved to
+ * the spill file during the save. The file is replaced only once it is
+ * complete (see savefile.c).
+ *
+ * A knowledge base runs one save at a time. saver_status() reports on the
+ * last one (the STATUS intent), and saver_wait() waits for it to finish, as
+ * the program exits or the knowledge base is closed.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Type definition for a save in the background */
+struct kb_saver {
+  kb_t *kb;               /* the knowledge base */
+  char *path;             /* the file being replaced */
+  SaveFile file;          /* the file being written */
+  int state;              /* KB_SAVE_RUNNING or KB_SAVE_DONE */
+  int viewed;             /* 1 once the view has been taken */
+  int result;             /* once done, KB_OK or the error */
+  uint64_t started;       /* when the save started, from metrics_clock() */
+  uint64_t elapsed_ns;    /* once done, the time it took */
+  uint64_t bytes;         /* once done, the bytes written */
+  pthread_t thread;       /* the thread writing the file */
+  pthread_mutex_t lock;   /* protects state, viewed and the results */
+  pthread_cond_t changed; /* signalled when viewed is set */
+};
+
+/* held to start, report on or wait for a save of any knowledge base */
+static pthread_mutex_t saver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper function to free a save that has finished, once its thread has
+ * ended.
+ *
+ * Input:
+ *   saver - the save
+ */
+
+static void saver_free(KBSaver *saver) {
+  pthread_join(saver->thread, NULL);
+  pthread_mutex_destroy(&saver->lock);
+  pthread_cond_destroy(&saver->changed);
+  free(saver->path);
+  free(saver);
+}
+
+/*
+ * Helper function run by the thread that takes the view of the knowledge
+ * base and writes it to the file.
+ *
+ * Input:
+ *   arg - the save
+ */
+
+static void *saver_thread(void *arg) {
+  KBSaver *saver = arg;
+  KBView *view = kb_view(saver->kb);
+  pthread_mutex_lock(&saver->lock);
+  saver->viewed = 1;
+  pthread_cond_signal(&saver->changed);
+  pthread_mutex_unlock(&saver->lock);
+
+  int result = KB_NOMEM;
+  uint64_t bytes = 0;
+  if (view != NULL) {
+    result = kb_view_write(view, saver->file.f, &bytes);
+    kb_view_close(view);
+  }
+  if (result == KB_OK) {
+    result = savefile_commit(&saver->file);
+  } else {
+    savefile_abort(&saver->file);
+  }
+
+  pthread_mutex_lock(&saver->lock);
+  saver->result = result;
+  saver->bytes = bytes;
+  saver->elapsed_ns = metrics_clock() - saver->started;
+  saver->state = KB_SAVE_DONE;
+  pthread_mutex_unlock(&saver->lock);
+  return NULL;
+}
+
+/*
+ * Start saving a knowledge base to a file in the background. It returns once
+ * the view to be saved has been taken, so the file holds what the knowledge
+ * base knew when this was called, not what it learns while it is written.
+ *
+ * Input:
+ *   kb   - the knowledge base
+ *   path - the file
+ *
+ * Returns:
+ *   KB_OK, if the save has started
+ *   KB_INVALID, if a save of the knowledge base is still running
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be created
+ */
+int saver_start(kb_t *kb, const char *path) {
+  pthread_mutex_lock(&saver_lock);
+  KBSaver *last = kb->saver;
+  if (last != NULL) {
+    pthread_mutex_lock(&last->lock);
+    int running = last->state == KB_SAVE_RUNNING;
+    pthread_mutex_unlock(&last->lock);
+    if (running) {
+      pthread_mutex_unlock(&saver_lock);
+      return KB_INVALID;
+    }
+  }
+
+  KBSaver *saver = calloc(1, sizeof(KBSaver));
+  if (saver == NULL || (saver->path = strdup(path)) == NULL) {
+    free(saver);
+    pthread_mutex_unlock(&saver_lock);
+    return KB_NOMEM;
+  }
+  int result = savefile_open(&saver->file, saver->path);
+  if (result != KB_OK) {
+    free(saver->path);
+    free(saver);
+    pthread_mutex_unlock(&saver_lock);
+    return result;
+  }
+  saver->kb = kb;
+  saver->state = KB_SAVE_RUNNING;
+  saver->started = metrics_clock();
+  pthread_mutex_init(&saver->lock, NULL);
+  pthread_cond_init(&saver->changed, NULL);
+  if (pthread_create(&saver->thread, NULL, saver_thread, saver) != 0) {
+    savefile_abort(&saver->file);
+    pthread_mutex_destroy(&saver->lock);
+    pthread_cond_destroy(&saver->changed);
+    free(saver->path);
+    free(saver);
+    pthread_mutex_unlock(&saver_lock);
+    return KB_NOMEM;
+  }
+
+  // Answer only once later changes can't reach the file
+  pthread_mutex_lock(&saver->lock);
+  while (!saver->viewed) {
+    pthread_cond_wait(&saver->changed, &saver->lock);
+  }
+  pthread_mutex_unlock(&saver->lock);
+
+  if (last != NULL) {
+    saver_free(last);
+  }
+  kb->saver = saver;
+  pthread_mutex_unlock(&saver_lock);
+  return KB_OK;
+}
+
+/*
+ * Find out how the last save of a knowledge base started by saver_start() is
+ * going.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   status - a structure to receive the state of the save
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if no save has been started
+ */
+int saver_status(kb_t *kb, KBSaveStatus *status) {
+  pthread_mutex_lock(&saver_lock);
+  KBSaver *saver = kb->saver;
+  if (saver == NULL) {
+    pthread_mutex_unlock(&saver_lock);
+    return KB_NOTFOUND;
+  }
+  pthread_mutex_lock(&saver->lock);
+  status->state = saver->state;
+  status->result = saver->result;
+  snprintf(status->path, sizeof(status->path), "%s", saver->path);
+  status->elapsed_ns = saver->state == KB_SAVE_DONE
+                           ? saver->elapsed_ns
+                           : metrics_clock() - saver->started;
+  status->bytes = saver->bytes;
+  pthread_mutex_unlock(&saver->lock);
+  pthread_mutex_unlock(&saver_lock);
+  return KB_OK;
+}
+
+/*
+ * Wait for the last save of a knowledge base to finish, and forget it. It
+ * does nothing if no save has been started.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void saver_wait(kb_t *kb) {
+  pthread_mutex_lock(&saver_lock);
+  KBSaver *saver = kb->saver;
+  kb->saver = NULL;
+  pthread_mutex_unlock(&saver_lock);
+  if (saver != NULL) {
+    saver_free(saver);
+  }
+}
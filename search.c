@@ -0,0 +1,834 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the search index of a knowledge base: its answers by
+ * the words in their responses, so that the chatbot can find an answer from
+ * part of it ("search teaches Python") when the user does not know the
+ * entity it is filed under.
+ *
+ * Each answer is a document, numbered in the order it was added. A response
+ * is split into words (runs of letters and digits, and of bytes that are not
+ * ASCII, so that UTF-8 text stays whole), which are case-folded as entities
+ * are and cut to SEARCH_MAX_TERM - 1 characters. Each word has a posting list
+ * of the documents it is in: for each, the difference from the previous
+ * document's number and the number of times the word is in it, both as
+ * variable-length integers (seven bits to a byte), so that most postings take
+ * two bytes.
+ *
+ * Overwriting a response adds a document for the new one and marks the old
+ * one dead, as removing the answer does; dead documents are skipped when
+ * postings are read, and stay in their lists until the index is next built.
+ *
+ * Documents are ranked by BM25: a word counts for more the rarer it is and the
+ * more often it is in a response, and for less the longer the response is.
+ * The words of a query are read rarest first, and once SEARCH_ACCUMULATORS
+ * documents have matched, the rest only add to the scores of those, so a
+ * search of millions of responses costs the decoding of its words' lists and
+ * little more.
+ *
+ * A search index is built the first time it is needed (see kb_search() in
+ * knowledge.c), kept up to date as answers change, and dropped when its
+ * responses might move. A document need not keep its response (e.g. one
+ * that is packed, see pack.c); its hits then have an empty response, for the
+ * caller to look up. It is only used with the knowledge base's lock held,
+ * so it takes no locks of its own.
+ */
+
+#include "chat1002.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the most characters of a word that are indexed, and the null */
+#define SEARCH_MAX_TERM 32
+
+/* the most words of a query that are looked up */
+#define SEARCH_MAX_QUERY 16
+
+/* the number of documents a search scores before it only adds to the scores
+ * of the ones found so far */
+#define SEARCH_ACCUMULATORS (1 << 16)
+
+/* the most answers a search gives */
+#define SEARCH_MAX_HITS 16
+
+/* the BM25 parameters: how quickly repeating a word stops counting, and how
+ * much the length of a response counts */
+#define SEARCH_K1 1.2
+#define SEARCH_B 0.75
+
+/* Type definition for a document: an answer in the knowledge base */
+typedef struct search_doc {
+  const char *entity;    /* the entity (not null-terminated) */
+  const char *response;  /* the response (not null-terminated), or NULL if
+                            it is not kept */
+  uint64_t hash;         /* hash of the case-folded entity */
+  uint16_t response_len; /* the length of the response */
+  uint8_t entity_len;    /* the length of the entity */
+  uint8_t section;       /* the section number of the question word */
+} SearchDoc;
+
+/* Type definition for the posting list of a word. The word follows the
+ * header, and the postings follow the word. */
+typedef struct search_list {
+  uint32_t used;         /* the number of bytes of postings */
+  uint32_t capacity;     /* the room for postings */
+  uint8_t len;           /* the length of the word */
+  unsigned char bytes[]; /* the word, then the postings */
+} SearchList;
+
+/* Type definition for a slot in the table of words */
+typedef struct search_term {
+  uint64_t hash;    /* the hash of the word */
+  uint32_t df;      /* the number of documents in the list, dead or not */
+  uint32_t last;    /* the last document in the list */
+  SearchList *list; /* the posting list, or NULL for an empty slot */
+} SearchTerm;
+
+/* Type definition for a word of a response or query, as it is indexed */
+typedef struct search_word {
+  char term[SEARCH_MAX_TERM]; /* the case-folded word (not null-terminated) */
+  size_t len;                 /* the length of the word */
+  uint64_t hash;              /* the hash of the word */
+  uint32_t tf;                /* the number of times it was found */
+  const SearchTerm *slot;     /* its slot, when looking up a query */
+} SearchWord;
+
+/* Type definition for a search index */
+struct kb_search {
+  SearchDoc *docs;     /* the documents, by number */
+  uint16_t *lengths;   /* the number of words in each, or 0 if it is dead */
+  float *scores;       /* the scores of a search, 0 outside one */
+  uint32_t *touched;   /* the documents a search has scored */
+  size_t count;        /* the number of documents */
+  size_t capacity;     /* the room in each of the arrays above */
+  size_t live;         /* the number of documents that are not dead */
+  uint64_t words;      /* the number of words in them */
+  uint32_t *owners;    /* the latest document of each answer (dead if it
+                          was removed), plus 1, by the hash of its entity;
+                          0 for an empty slot */
+  size_t owner_count;  /* the number of answers in 'owners' */
+  size_t owner_slots;  /* the number of slots in 'owners' */
+  SearchTerm *terms;   /* the words, by hash */
+  size_t term_count;   /* the number of words */
+  size_t term_slots;   /* the number of slots in 'terms' */
+};
+
+/*
+ * Helper function to determine whether a character is part of a word.
+ *
+ * Input:
+ *   c - the character
+ *
+ * Returns:
+ *   1, for a letter, a digit or a byte that is not ASCII
+ *   0, otherwise
+ */
+
+static int search_is_word(unsigned char c) {
+  return (unsigned)((c | 32) - 'a') < 26 || (unsigned)(c - '0') < 10 ||
+         c >= 0x80;
+}
+
+/*
+ * Helper function to read the next word of a text, case-folded and hashed.
+ *
+ * Input:
+ *   s    - the text (need not be null-terminated)
+ *   len  - the length of the text
+ *   pos  - the position to read from, which is moved past the word
+ *   word - receives the word
+ *
+ * Returns:
+ *   1, if a word was read
+ *   0, if the text has no more words
+ */
+
+static int search_next_word(const char *s, size_t len, size_t *pos,
+                            SearchWord *word) {
+  size_t i = *pos;
+  while (i < len && !search_is_word((unsigned char)s[i])) {
+    i++;
+  }
+  if (i == len) {
+    *pos = i;
+    return 0;
+  }
+
+  uint64_t hash = 14695981039346656037ULL;
+  size_t k = 0;
+  for (; i < len && search_is_word((unsigned char)s[i]); i++) {
+    if (k < SEARCH_MAX_TERM - 1) {
+      word->term[k] = FOLD_CHAR(s[i]);
+      hash ^= (unsigned char)word->term[k];
+      hash *= 1099511628211ULL;
+      k++;
+    }
+  }
+  word->len = k;
+  word->hash = hash;
+  *pos = i;
+  return 1;
+}
+
+/*
+ * Helper function to split a text into its distinct words, counting how many
+ * times each is found.
+ *
+ * Input:
+ *   s     - the text (need not be null-terminated)
+ *   len   - the length of the text
+ *   words - receives the words
+ *   max   - the most distinct words to keep
+ *   total - receives the number of words, distinct or not
+ *
+ * Returns:
+ *   the number of distinct words
+ */
+
+static size_t search_split(const char *s, size_t len, SearchWord *words,
+                           size_t max, size_t *total) {
+  size_t count = 0, pos = 0;
+  SearchWord word;
+  *total = 0;
+  while (search_next_word(s, len, &pos, &word)) {
+    (*total)++;
+    size_t w = 0;
+    while (w < count &&
+           (words[w].hash != word.hash || words[w].len != word.len ||
+            memcmp(words[w].term, word.term, word.len) != 0)) {
+      w++;
+    }
+    if (w < count) {
+      words[w].tf++;
+    } else if (count < max) {
+      word.tf = 1;
+      words[count++] = word;
+    }
+  }
+  return count;
+}
+
+/*
+ * Helper function to find a word in the table of words.
+ *
+ * Input:
+ *   search - the search index
+ *   word   - the word
+ *
+ * Returns:
+ *   the slot of the word, or the empty slot where it would go
+ */
+
+static SearchTerm *search_term(const KBSearch *search, const SearchWord *word) {
+  size_t mask = search->term_slots - 1;
+  size_t i = (size_t)word->hash & mask;
+  SearchTerm *slot;
+  while ((slot = &search->terms[i])->list != NULL) {
+    if (slot->hash == word->hash && slot->list->len == word->len &&
+        memcmp(slot->list->bytes, word->term, word->len) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return slot;
+}
+
+/*
+ * Helper function to double the size of the table of words (or make the first
+ * one).
+ *
+ * Input:
+ *   search - the search index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int search_grow_terms(KBSearch *search) {
+  size_t slots = search->term_slots == 0 ? 1024 : search->term_slots * 2;
+  SearchTerm *terms = calloc(slots, sizeof(SearchTerm));
+  if (terms == NULL) {
+    return KB_NOMEM;
+  }
+  SearchTerm *old = search->terms;
+  size_t old_slots = search->term_slots;
+  search->terms = terms;
+  search->term_slots = slots;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].list != NULL) {
+      size_t j = (size_t)old[i].hash & (slots - 1);
+      while (terms[j].list != NULL) {
+        j = (j + 1) & (slots - 1);
+      }
+      terms[j] = old[i];
+    }
+  }
+  free(old);
+  return KB_OK;
+}
+
+/*
+ * Helper function to find the slot of an answer's live document in the table
+ * of owners.
+ *
+ * Input:
+ *   search  - the search index
+ *   section - the section number of the question word
+ *   entity  - the entity (need not be null-terminated)
+ *   len     - the length of the entity
+ *   hash    - the hash of the case-folded entity
+ *
+ * Returns:
+ *   the slot of the answer, or the empty slot where it would go
+ */
+
+static size_t search_owner(const KBSearch *search, int section,
+                           const char *entity, size_t len, uint64_t hash) {
+  size_t mask = search->owner_slots - 1;
+  size_t i = (size_t)(hash ^ (uint64_t)section * 0x9E3779B97F4A7C15ULL) & mask;
+  uint32_t owner;
+  while ((owner = search->owners[i]) != 0) {
+    const SearchDoc *doc = &search->docs[owner - 1];
+    if (doc->hash == hash && doc->section == section &&
+        doc->entity_len == len) {
+      size_t k = 0;
+      while (k < len && FOLD_CHAR(doc->entity[k]) == FOLD_CHAR(entity[k])) {
+        k++;
+      }
+      if (k == len) {
+        break;
+      }
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/*
+ * Helper function to double the size of the table of owners (or make the
+ * first one).
+ *
+ * Input:
+ *   search - the search index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int search_grow_owners(KBSearch *search) {
+  size_t slots = search->owner_slots == 0 ? 1024 : search->owner_slots * 2;
+  uint32_t *owners = calloc(slots, sizeof(uint32_t));
+  if (owners == NULL) {
+    return KB_NOMEM;
+  }
+  uint32_t *old = search->owners;
+  size_t old_slots = search->owner_slots;
+  search->owners = owners;
+  search->owner_slots = slots;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i] != 0) {
+      const SearchDoc *doc = &search->docs[old[i] - 1];
+      owners[search_owner(search, doc->section, doc->entity, doc->entity_len,
+                          doc->hash)] = old[i];
+    }
+  }
+  free(old);
+  return KB_OK;
+}
+
+/*
+ * Helper function to double the room for documents (or make the first).
+ *
+ * Input:
+ *   search - the search index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int search_grow_docs(KBSearch *search) {
+  size_t capacity = search->capacity == 0 ? 1024 : search->capacity * 2;
+  if (capacity > UINT32_MAX) {
+    return KB_NOMEM;
+  }
+  SearchDoc *docs = realloc(search->docs, capacity * sizeof(SearchDoc));
+  if (docs == NULL) {
+    return KB_NOMEM;
+  }
+  search->docs = docs;
+  uint16_t *lengths = realloc(search->lengths, capacity * sizeof(uint16_t));
+  if (lengths == NULL) {
+    return KB_NOMEM;
+  }
+  search->lengths = lengths;
+  float *scores = realloc(search->scores, capacity * sizeof(float));
+  if (scores == NULL) {
+    return KB_NOMEM;
+  }
+  memset(scores + search->capacity, 0,
+         (capacity - search->capacity) * sizeof(float));
+  search->scores = scores;
+  uint32_t *touched = realloc(search->touched, capacity * sizeof(uint32_t));
+  if (touched == NULL) {
+    return KB_NOMEM;
+  }
+  search->touched = touched;
+  search->capacity = capacity;
+  return KB_OK;
+}
+
+/*
+ * Helper function to append a number to a posting list, seven bits to a byte,
+ * lowest first, with the top bit of each byte but the last set.
+ *
+ * Input:
+ *   list  - the posting list, with room for five more bytes
+ *   value - the number
+ */
+
+static void search_put_varint(SearchList *list, uint32_t value) {
+  unsigned char *p = list->bytes + list->len + list->used;
+  while (value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  list->used = (uint32_t)(p - (list->bytes + list->len));
+}
+
+/*
+ * Helper function to read a number written by search_put_varint().
+ *
+ * Input:
+ *   p - the position to read from, which is moved past the number
+ *
+ * Returns:
+ *   the number
+ */
+
+static uint32_t search_get_varint(const unsigned char **p) {
+  const unsigned char *q = *p;
+  uint32_t value = *q & 0x7F;
+  for (int shift = 7; *q++ & 0x80; shift += 7) {
+    value |= (uint32_t)(*q & 0x7F) << shift;
+  }
+  *p = q;
+  return value;
+}
+
+/*
+ * Helper function to add a posting to the list of a word, creating the list
+ * if the word is new.
+ *
+ * Input:
+ *   search - the search index, with room in the table of words for one more
+ *   word   - the word
+ *   doc    - the document, later than any in the list
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int search_post(KBSearch *search, const SearchWord *word,
+                       uint32_t doc) {
+  SearchTerm *slot = search_term(search, word);
+  SearchList *list = slot->list;
+  if (list == NULL) {
+    list = malloc(sizeof(SearchList) + word->len + 8);
+    if (list == NULL) {
+      return KB_NOMEM;
+    }
+    list->used = 0;
+    list->capacity = 8;
+    list->len = (uint8_t)word->len;
+    memcpy(list->bytes, word->term, word->len);
+    slot->hash = word->hash;
+    slot->df = 0;
+    slot->last = 0;
+    slot->list = list;
+    search->term_count++;
+  } else if (list->capacity - list->used < 10) {
+    uint32_t capacity = list->capacity * 2;
+    list = realloc(list, sizeof(SearchList) + list->len + capacity);
+    if (list == NULL) {
+      return KB_NOMEM;
+    }
+    list->capacity = capacity;
+    slot->list = list;
+  }
+
+  search_put_varint(list, doc - slot->last);
+  search_put_varint(list, word->tf);
+  slot->last = doc;
+  slot->df++;
+  return KB_OK;
+}
+
+/*
+ * Create an empty search index.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the search index, to be freed with search_destroy()
+ */
+KBSearch *search_create() {
+  KBSearch *search = calloc(1, sizeof(KBSearch));
+  if (search == NULL) {
+    return NULL;
+  }
+  if (search_grow_terms(search) != KB_OK ||
+      search_grow_owners(search) != KB_OK) {
+    search_destroy(search);
+    return NULL;
+  }
+  return search;
+}
+
+/*
+ * Free a search index. The entities and responses themselves belong to the
+ * knowledge base.
+ *
+ * Input:
+ *   search - the search index, or NULL
+ */
+void search_destroy(KBSearch *search) {
+  if (search == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < search->term_slots; i++) {
+    free(search->terms[i].list);
+  }
+  free(search->terms);
+  free(search->owners);
+  free(search->docs);
+  free(search->lengths);
+  free(search->scores);
+  free(search->touched);
+  free(search);
+}
+
+/*
+ * Add an answer to a search index, in place of the answer to the same
+ * question (the same section, and the same entity but for case) if there was
+ * one. The strings are not copied, so they must stay where they are for as
+ * long as the index is used.
+ *
+ * Input:
+ *   search       - the search index
+ *   section      - the section number of the question word
+ *   entity       - the entity (need not be null-terminated)
+ *   entity_len   - the length of the entity, less than MAX_ENTITY
+ *   hash         - the hash of the case-folded entity (see make_key())
+ *   response     - the response (need not be null-terminated)
+ *   response_len - the length of the response, less than MAX_RESPONSE
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the index may then be
+ *             missing some of the answer's words, and should be dropped)
+ */
+int search_add(KBSearch *search, int section, const char *entity,
+               size_t entity_len, uint64_t hash, const char *response,
+               size_t response_len) {
+  SearchWord words[MAX_RESPONSE / 2];
+  size_t total;
+  size_t count = search_split(response, response_len, words,
+                              MAX_RESPONSE / 2, &total);
+
+  if (search->count == search->capacity && search_grow_docs(search) != KB_OK) {
+    return KB_NOMEM;
+  }
+  if ((search->owner_count + 1) * 2 > search->owner_slots &&
+      search_grow_owners(search) != KB_OK) {
+    return KB_NOMEM;
+  }
+  while ((search->term_count + count) * 2 > search->term_slots) {
+    if (search_grow_terms(search) != KB_OK) {
+      return KB_NOMEM;
+    }
+  }
+
+  uint32_t id = (uint32_t)search->count++;
+  SearchDoc *doc = &search->docs[id];
+  doc->entity = entity;
+  doc->response = response;
+  doc->hash = hash;
+  doc->response_len = (uint16_t)response_len;
+  doc->entity_len = (uint8_t)entity_len;
+  doc->section = (uint8_t)section;
+  // Every live document counts at least one word, so 0 can mark dead ones
+  uint16_t length = total == 0 ? 1 : total > UINT16_MAX ? UINT16_MAX
+                                                        : (uint16_t)total;
+  search->lengths[id] = length;
+
+  size_t i = search_owner(search, section, entity, entity_len, hash);
+  uint32_t old = search->owners[i];
+  if (old == 0) {
+    search->owner_count++;
+  } else if (search->lengths[old - 1] != 0) {
+    search->words -= search->lengths[old - 1];
+    search->lengths[old - 1] = 0;
+    search->live--;
+  }
+  search->owners[i] = id + 1;
+  search->live++;
+  search->words += length;
+
+  for (size_t w = 0; w < count; w++) {
+    if (search_post(search, &words[w], id) != KB_OK) {
+      return KB_NOMEM;
+    }
+  }
+  return KB_OK;
+}
+
+/*
+ * Remove an answer from a search index, if it is in it, by marking its
+ * document dead.
+ *
+ * Input:
+ *   search     - the search index
+ *   section    - the section number of the question word
+ *   entity     - the entity (need not be null-terminated)
+ *   entity_len - the length of the entity, less than MAX_ENTITY
+ *   hash       - the hash of the case-folded entity (see make_key())
+ */
+void search_remove(KBSearch *search, int section, const char *entity,
+                   size_t entity_len, uint64_t hash) {
+  uint32_t owner = search->owners[search_owner(search, section, entity,
+                                               entity_len, hash)];
+  if (owner != 0 && search->lengths[owner - 1] != 0) {
+    search->words -= search->lengths[owner - 1];
+    search->lengths[owner - 1] = 0;
+    search->live--;
+  }
+}
+
+/*
+ * Point the document of an answer at the same response in a new place, e.g.
+ * once it has been moved to the spill file (see spill.c), or at nowhere, if
+ * it is not to be kept. The words indexed stay as they are.
+ *
+ * Input:
+ *   search     - the search index
+ *   section    - the section number of the question word
+ *   entity     - the entity (need not be null-terminated)
+ *   entity_len - the length of the entity, less than MAX_ENTITY
+ *   hash       - the hash of the case-folded entity (see make_key())
+ *   response   - the response, where it now is, or NULL
+ */
+void search_move(KBSearch *search, int section, const char *entity,
+                 size_t entity_len, uint64_t hash, const char *response) {
+  uint32_t owner = search->owners[search_owner(search, section, entity,
+                                               entity_len, hash)];
+  if (owner != 0 && search->lengths[owner - 1] != 0) {
+    search->docs[owner - 1].response = response;
+  }
+}
+
+/*
+ * Helper function to work out a natural logarithm, to weigh a word by its
+ * rarity, without needing the maths library: the number is halved into
+ * [1, 2), where a short series is exact enough for ranking.
+ *
+ * Input:
+ *   x - the number, at least 1
+ *
+ * Returns:
+ *   the logarithm of x
+ */
+
+static double search_log(double x) {
+  int halvings = 0;
+  while (x >= 2) {
+    x /= 2;
+    halvings++;
+  }
+  double y = (x - 1) / (x + 1), y2 = y * y, term = y, sum = 0;
+  for (int i = 1; i < 20; i += 2) {
+    sum += term / i;
+    term *= y2;
+  }
+  return halvings * 0.69314718055994531 + 2 * sum;
+}
+
+/*
+ * Helper function to determine whether one document ranks above another: it
+ * has the higher score, or the same score and was added first.
+ *
+ * Input:
+ *   search - the search index
+ *   a      - the one document
+ *   b      - the other
+ *
+ * Returns:
+ *   1, if a ranks above b
+ *   0, otherwise
+ */
+
+static int search_above(const KBSearch *search, uint32_t a, uint32_t b) {
+  float sa = search->scores[a], sb = search->scores[b];
+  return sa > sb || (sa == sb && a < b);
+}
+
+/*
+ * Helper function to restore the order of a heap of documents (the lowest
+ * ranked first) after its first document has been replaced.
+ *
+ * Input:
+ *   search - the search index
+ *   heap   - the documents
+ *   count  - the number of them
+ */
+
+static void search_sift(const KBSearch *search, uint32_t *heap, size_t count) {
+  size_t i = 0;
+  for (;;) {
+    size_t low = i, l = 2 * i + 1, r = l + 1;
+    if (l < count && search_above(search, heap[low], heap[l])) {
+      low = l;
+    }
+    if (r < count && search_above(search, heap[low], heap[r])) {
+      low = r;
+    }
+    if (low == i) {
+      return;
+    }
+    uint32_t t = heap[i];
+    heap[i] = heap[low];
+    heap[low] = t;
+    i = low;
+  }
+}
+
+/*
+ * Search for the answers whose responses best match a query, best first.
+ *
+ * Input:
+ *   search  - the search index
+ *   query   - the query (need not be null-terminated)
+ *   len     - the length of the query
+ *   hits    - receives the answers
+ *   max     - the most answers to give (at most SEARCH_MAX_HITS are)
+ *   matches - receives the number of answers that have any word of the query
+ *             (once more than SEARCH_ACCUMULATORS have, at least as many as
+ *             have its commonest word)
+ *
+ * Returns:
+ *   the number of answers given
+ */
+int search_find(KBSearch *search, const char *query, size_t len,
+                KBSearchHit *hits, int max, size_t *matches) {
+  SearchWord words[SEARCH_MAX_QUERY];
+  size_t total;
+  size_t count = search_split(query, len, words, SEARCH_MAX_QUERY, &total);
+  *matches = 0;
+  if (search->live == 0 || max <= 0) {
+    return 0;
+  }
+
+  // Read the rarest words first, so that the documents they match are
+  // scored before the common words' stop adding new ones
+  size_t found = 0;
+  for (size_t w = 0; w < count; w++) {
+    const SearchTerm *slot = search_term(search, &words[w]);
+    if (slot->list == NULL) {
+      continue;
+    }
+    SearchWord word = words[w];
+    word.slot = slot;
+    size_t at = found++;
+    while (at > 0 && words[at - 1].slot->df > slot->df) {
+      words[at] = words[at - 1];
+      at--;
+    }
+    words[at] = word;
+  }
+
+  double n = (double)search->live;
+  double average = (double)search->words / n;
+  float k = (float)(SEARCH_K1 * (1.0 - SEARCH_B));
+  float per_word = (float)(SEARCH_K1 * SEARCH_B / average);
+  size_t touched = 0;
+  for (size_t w = 0; w < found; w++) {
+    const SearchTerm *slot = words[w].slot;
+    double df = slot->df < n ? slot->df : n;
+    float weight = (float)((SEARCH_K1 + 1) *
+                           search_log(1.0 + (n - df + 0.5) / (df + 0.5)));
+
+    const unsigned char *p = slot->list->bytes + slot->list->len;
+    const unsigned char *end = p + slot->list->used;
+    uint32_t doc = 0;
+    size_t live = 0;
+    while (p < end) {
+      doc += search_get_varint(&p);
+      float tf = (float)search_get_varint(&p);
+      uint16_t length = search->lengths[doc];
+      if (length == 0) {
+        continue; // dead
+      }
+      live++;
+      if (search->scores[doc] == 0) {
+        if (touched == SEARCH_ACCUMULATORS) {
+          continue;
+        }
+        search->touched[touched++] = doc;
+      }
+      search->scores[doc] += weight * tf / (tf + k + per_word * length);
+    }
+    if (live > *matches) {
+      *matches = live;
+    }
+  }
+  if (touched > *matches) {
+    *matches = touched;
+  }
+
+  // Keep the best documents in a heap, the lowest ranked at the top
+  uint32_t heap[SEARCH_MAX_HITS];
+  size_t kept = 0;
+  if (max > SEARCH_MAX_HITS) {
+    max = SEARCH_MAX_HITS;
+  }
+  for (size_t t = 0; t < touched; t++) {
+    uint32_t doc = search->touched[t];
+    if (kept < (size_t)max) {
+      size_t at = kept++;
+      while (at > 0 && search_above(search, heap[(at - 1) / 2], doc)) {
+        heap[at] = heap[(at - 1) / 2];
+        at = (at - 1) / 2;
+      }
+      heap[at] = doc;
+    } else if (search_above(search, doc, heap[0])) {
+      heap[0] = doc;
+      search_sift(search, heap, kept);
+    }
+  }
+
+  // Take the lowest ranked off the heap, filling the hits from the end
+  for (size_t h = kept; h-- > 0;) {
+    const SearchDoc *doc = &search->docs[heap[0]];
+    KBSearchHit *hit = &hits[h];
+    hit->section = doc->section;
+    memcpy(hit->entity, doc->entity, doc->entity_len);
+    hit->entity[doc->entity_len] = '\0';
+    if (doc->response != NULL) {
+      memcpy(hit->response, doc->response, doc->response_len);
+      hit->response[doc->response_len] = '\0';
+    } else {
+      hit->response[0] = '\0';
+    }
+    hit->score = search->scores[heap[0]];
+    heap[0] = heap[h];
+    search_sift(search, heap, h);
+  }
+
+  for (size_t t = 0; t < touched; t++) {
+    search->scores[search->touched[t]] = 0;
+  }
+  return (int)kept;
+}
@@ -0,0 +1,458 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements server mode, in which one chatbot chats with many
+ * users at once, and the load generator used to measure it.
+ *
+ * The server listens on a Unix domain socket ("unix:/path/to/socket") or a
+ * TCP port ("port" or "host:port", on 127.0.0.1 by default) and gives each
+ * connection a thread of its own, up to a maximum number of connections. A
+ * connection is chatted with exactly as the terminal is: each line the
+ * client sends is split into words and passed to chatbot_main(), and the
+ * reply is sent back on one line starting with the chatbot's name and ":".
+ * When the chatbot needs an answer from the user (see prompt_user()), it
+ * sends its question on a line starting with the chatbot's name and "?", and
+ * the next line from the client is the answer.
+ *
+ * Each connection is a session of its own, but they all share the default
+ * knowledge base, whose lock lets any number of them look up answers at once
+ * while changes are made one at a time. EXIT only ends the connection; it
+ * does not reset the shared knowledge base.
+ *
+ * The load generator opens a number of connections to a server, sends each
+ * of them a number of questions (the lines of a file, or "what is SIT"), and
+ * reports the rate at which connections were set up and questions answered.
+ * If the server asks for an answer, it is given one.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int server_main(const ServerOptions *options) {
+  fprintf(stderr, "server: not supported on this platform\n");
+  return 1;
+}
+
+int loadgen_main(const ServerOptions *options) {
+  fprintf(stderr, "loadgen: not supported on this platform\n");
+  return 1;
+}
+
+#else
+
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the default maximum number of connections served at once */
+#define SERVER_CONNECTIONS 1024
+
+/* the number of pending connections the listening socket queues */
+#define SERVER_BACKLOG 512
+
+/* Type definition for the load generator's per-connection state */
+typedef struct load_client {
+  const ServerOptions *options; /* the address and number of requests */
+  char **questions;             /* the questions to ask, in turn */
+  int question_count;           /* the number of questions */
+  int id;                       /* which connection this is */
+  double connected;             /* when the greeting was received */
+  double finished;              /* when the last reply was received */
+  long requests;                /* the number of questions answered */
+  int failed;                   /* 1 if the connection failed */
+} LoadClient;
+
+/* the number of connections being served, and its lock */
+static int server_active;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper function to turn an address given on the command line into a socket
+ * address.
+ *
+ * Input:
+ *   address - "unix:path", "host:port" or "port"
+ *   addr    - receives the socket address
+ *   len     - receives the length of the socket address
+ *
+ * Returns:
+ *   0, if successful
+ *   -1, if the address is not valid
+ */
+
+static int resolve(const char *address, struct sockaddr_storage *addr,
+                   socklen_t *len) {
+  memset(addr, 0, sizeof(*addr));
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    if (strlen(address + 5) >= sizeof(un->sun_path)) {
+      return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address + 5);
+    *len = sizeof(*un);
+    return 0;
+  }
+
+  char host[256] = "127.0.0.1";
+  const char *port = strrchr(address, ':');
+  if (port != NULL) {
+    if (port - address >= (long)sizeof(host)) {
+      return -1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    port++;
+  } else {
+    port = address;
+  }
+
+  struct addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &found) != 0) {
+    return -1;
+  }
+  memcpy(addr, found->ai_addr, found->ai_addrlen);
+  *len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 0;
+}
+
+/*
+ * Helper function to get the time in seconds, for measuring rates.
+ */
+
+static double server_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Helper function run by the thread serving a connection.
+ *
+ * Input:
+ *   arg - the socket of the connection
+ */
+
+static void *serve_connection(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char input[MAX_INPUT];
+  char *inv[MAX_INPUT];
+  char output[MAX_RESPONSE];
+
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  session_t *session = NULL;
+  if (in != NULL && out != NULL &&
+      (session = session_create(knowledge_default(), in, out)) != NULL) {
+    fprintf(out, "%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
+    fflush(out);
+
+    while (fgets(input, MAX_INPUT, in) != NULL) {
+      if (strchr(input, '\n') == NULL && !feof(in)) {
+        snprintf(output, MAX_RESPONSE, "Too many characters. Try again.");
+        int c;
+        while ((c = fgetc(in)) != '\n' && c != EOF)
+          ;
+      } else {
+        int inc = split_words(input, inv);
+        if (inc < 1) {
+          continue;
+        }
+        if (chatbot_session_main(session, inc, inv, output, MAX_RESPONSE)) {
+          fprintf(out, "%s: %s\n", chatbot_botname(), output);
+          break;
+        }
+      }
+      fprintf(out, "%s: %s\n", chatbot_botname(), output);
+      if (fflush(out) != 0) {
+        break;
+      }
+    }
+  }
+
+  if (session != NULL) {
+    session_destroy(session);
+  }
+
+  if (in != NULL) {
+    fclose(in);
+  } else {
+    close(fd);
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+  pthread_mutex_lock(&server_lock);
+  server_active--;
+  pthread_mutex_unlock(&server_lock);
+  return NULL;
+}
+
+/*
+ * Run server mode. This only returns if the server can't be started.
+ *
+ * Input:
+ *   options - the address to listen on and the maximum number of connections
+ *
+ * Returns:
+ *   1 (the exit status for the program)
+ */
+int server_main(const ServerOptions *options) {
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int limit =
+      options->connections > 0 ? options->connections : SERVER_CONNECTIONS;
+
+  if (resolve(options->address, &addr, &len) != 0) {
+    fprintf(stderr, "server: bad address %s\n", options->address);
+    return 1;
+  }
+  if (addr.ss_family == AF_UNIX) {
+    unlink(((struct sockaddr_un *)&addr)->sun_path);
+  }
+
+  int on = 1;
+  int listener = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(listener, (struct sockaddr *)&addr, len) != 0 ||
+      listen(listener, SERVER_BACKLOG) != 0) {
+    perror("server");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "server: %s is listening on %s\n", chatbot_botname(),
+          options->address);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+
+    pthread_mutex_lock(&server_lock);
+    int busy = server_active >= limit;
+    if (!busy) {
+      server_active++;
+    }
+    pthread_mutex_unlock(&server_lock);
+
+    pthread_t thread;
+    if (busy || pthread_create(&thread, &attr, serve_connection,
+                               (void *)(intptr_t)fd) != 0) {
+      char reply[MAX_RESPONSE];
+      int n = snprintf(reply, sizeof(reply),
+                       "%s: I'm too busy. Try again later.\n",
+                       chatbot_botname());
+      if (write(fd, reply, n) < 0) {
+        /* the client has gone anyway */
+      }
+      close(fd);
+      if (!busy) {
+        pthread_mutex_lock(&server_lock);
+        server_active--;
+        pthread_mutex_unlock(&server_lock);
+      }
+    }
+  }
+}
+
+/*
+ * Helper function to read the reply to a question from the server, answering
+ * any question the server asks in the meantime.
+ *
+ * Input:
+ *   in   - the stream from the server
+ *   out  - the stream to the server
+ *   line - a buffer of MAX_INPUT characters to receive the reply
+ *
+ * Returns:
+ *   0, if a reply was read
+ *   -1, if the connection ended
+ */
+
+static int read_reply(FILE *in, FILE *out, char *line) {
+  size_t name_len = strlen(chatbot_botname());
+  for (;;) {
+    if (fgets(line, MAX_INPUT, in) == NULL) {
+      return -1;
+    }
+    if (strncmp(line, chatbot_botname(), name_len) == 0 &&
+        line[name_len] == '?') {
+      fputs("Taught by the load generator.\n", out);
+      fflush(out);
+    } else {
+      return 0;
+    }
+  }
+}
+
+/*
+ * Helper function run by each of the load generator's connections.
+ *
+ * Input:
+ *   arg - the connection's LoadClient
+ */
+
+static void *load_client(void *arg) {
+  LoadClient *client = arg;
+  struct sockaddr_storage addr;
+  socklen_t len;
+  char line[MAX_INPUT];
+
+  client->failed = 1;
+  if (resolve(client->options->address, &addr, &len) != 0) {
+    return NULL;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, len) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  if (in == NULL || out == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  int requests = client->options->requests;
+  if (fgets(line, MAX_INPUT, in) == NULL) {
+    requests = 0;
+  }
+  client->connected = server_clock();
+  for (int i = 0; i < requests; i++) {
+    fputs(client->questions[(client->id + i) % client->question_count], out);
+    fputc('\n', out);
+    fflush(out);
+    if (read_reply(in, out, line) != 0) {
+      break;
+    }
+    client->requests++;
+  }
+  fputs("exit\n", out);
+  fflush(out);
+  client->finished = server_clock();
+  client->failed = client->requests < client->options->requests;
+
+  fclose(in);
+  fclose(out);
+  return NULL;
+}
+
+/*
+ * Run the load generator.
+ *
+ * Input:
+ *   options - the address of the server, the number of connections, the
+ *             number of questions per connection and the file of questions
+ *
+ * Returns:
+ *   the exit status for the program (0 if every question was answered)
+ */
+int loadgen_main(const ServerOptions *options) {
+  static char default_question[] = "what is SIT";
+  char *default_questions[] = {default_question};
+  char **questions = default_questions;
+  int question_count = 1;
+  int connections = options->connections > 0 ? options->connections : 1;
+
+  /* read the questions, one per line */
+  if (options->questions != NULL) {
+    FILE *f = fopen(options->questions, "r");
+    char line[MAX_INPUT];
+    int capacity = 0;
+    if (f == NULL) {
+      fprintf(stderr, "loadgen: can't read %s\n", options->questions);
+      return 1;
+    }
+    questions = NULL;
+    question_count = 0;
+    while (fgets(line, MAX_INPUT, f) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0') {
+        continue;
+      }
+      if (question_count == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        questions = realloc(questions, capacity * sizeof(char *));
+      }
+      questions[question_count++] = strdup(line);
+    }
+    fclose(f);
+    if (question_count == 0) {
+      fprintf(stderr, "loadgen: %s has no questions\n", options->questions);
+      return 1;
+    }
+  }
+
+  LoadClient *clients = calloc(connections, sizeof(LoadClient));
+  pthread_t *threads = calloc(connections, sizeof(pthread_t));
+  signal(SIGPIPE, SIG_IGN);
+
+  double started = server_clock();
+  for (int i = 0; i < connections; i++) {
+    clients[i].options = options;
+    clients[i].questions = questions;
+    clients[i].question_count = question_count;
+    clients[i].id = i;
+    pthread_create(&threads[i], NULL, load_client, &clients[i]);
+  }
+
+  long requests = 0;
+  int failed = 0;
+  double all_connected = started, all_finished = started;
+  for (int i = 0; i < connections; i++) {
+    pthread_join(threads[i], NULL);
+    requests += clients[i].requests;
+    failed += clients[i].failed;
+    if (clients[i].connected > all_connected) {
+      all_connected = clients[i].connected;
+    }
+    if (clients[i].finished > all_finished) {
+      all_finished = clients[i].finished;
+    }
+  }
+
+  double connect_time = all_connected - started;
+  double elapsed = all_finished - started;
+  fprintf(stderr,
+          "loadgen: %d connections (%d failed) set up in %.3f s, "
+          "%.0f connections/s\n",
+          connections, failed, connect_time,
+          connect_time > 0 ? connections / connect_time : 0.0);
+  fprintf(stderr,
+          "loadgen: %ld requests in %.3f s, %.0f requests/s\n", requests,
+          elapsed, elapsed > 0 ? requests / elapsed : 0.0);
+
+  if (questions != default_questions) {
+    for (int i = 0; i < question_count; i++) {
+      free(questions[i]);
+    }
+    free(questions);
+  }
+  free(clients);
+  free(threads);
+  return failed > 0;
+}
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the compiled knowledge base format written by the
+ * compile intent.
+ *
+ * A compiled knowledge base is an image of the knowledge base that can be
+ * mapped and used as it is, with no parsing and no allocation per entry:
+ *
+ *   header | strings | entries | slots | section table
+ *
+ * The header (KBSnapshotHeader) identifies the format and locates the section
+ * table. Each section (KBSnapshotSection) has an array of entries, which
+ * point into the strings, and a linear-probing hash index of the entries
+ * using the same hash as the in-memory index in knowledge.c. Everything after
+ * the header is covered by a checksum, which is checked when the file is
+ * loaded. Numbers are stored in the byte order of the writing machine.
+ */
+
+#include "chat1002.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the constants used by the checksum (those of xxHash64) */
+#define CHECKSUM_PRIME1 0x9E3779B185EBCA87ULL
+#define CHECKSUM_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define CHECKSUM_PRIME3 0x165667B19E3779F9ULL
+
+/* Type definition for the state of snapshot_write() */
+typedef struct snapshot_writer {
+  FILE *f;                   /* the file being written */
+  Checksum sum;              /* checksum of everything after the header */
+  uint64_t offset;           /* the current offset in the file */
+  int error;                 /* KB_OK, or the first error encountered */
+  KBSnapshotEntry *entries;  /* the entries of the current section */
+  size_t count;              /* the number of entries */
+  size_t capacity;           /* the number of entries allocated */
+} SnapshotWriter;
+
+/*
+ * Helper function to fold one 8-byte word into a lane of the checksum.
+ */
+
+static uint64_t checksum_round(uint64_t lane, uint64_t word) {
+  lane += word * CHECKSUM_PRIME2;
+  lane = (lane << 31) | (lane >> 33);
+  return lane * CHECKSUM_PRIME1;
+}
+
+/*
+ * Helper function to fold a 32-byte block into the four lanes.
+ */
+
+static void checksum_block(Checksum *sum, const unsigned char *block) {
+  for (int i = 0; i < 4; i++) {
+    uint64_t word;
+    memcpy(&word, block + i * 8, 8);
+    sum->lanes[i] = checksum_round(sum->lanes[i], word);
+  }
+}
+
+/*
+ * Start a checksum.
+ *
+ * Input:
+ *   sum - the checksum
+ */
+void checksum_init(Checksum *sum) {
+  memset(sum, 0, sizeof(Checksum));
+  sum->lanes[0] = CHECKSUM_PRIME1 + CHECKSUM_PRIME2;
+  sum->lanes[1] = CHECKSUM_PRIME2;
+  sum->lanes[2] = 0;
+  sum->lanes[3] = -CHECKSUM_PRIME1;
+}
+
+/*
+ * Add bytes to a checksum. The four lanes are independent, so the loop runs
+ * at close to memory speed.
+ *
+ * Input:
+ *   sum  - the checksum
+ *   data - the bytes
+ *   len  - the number of bytes
+ */
+void checksum_update(Checksum *sum, const void *data, size_t len) {
+  if (len == 0) {
+    return; // data may be NULL, which memcpy() must not be given
+  }
+  const unsigned char *p = data;
+  sum->total += len;
+
+  if (sum->pending_len > 0) {
+    size_t take = 32 - sum->pending_len;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(sum->pending + sum->pending_len, p, take);
+    sum->pending_len += take;
+    p += take;
+    len -= take;
+    if (sum->pending_len < 32) {
+      return;
+    }
+    checksum_block(sum, sum->pending);
+    sum->pending_len = 0;
+  }
+
+  while (len >= 32) {
+    checksum_block(sum, p);
+    p += 32;
+    len -= 32;
+  }
+  memcpy(sum->pending, p, len);
+  sum->pending_len = len;
+}
+
+/*
+ * Finish a checksum.
+ *
+ * Input:
+ *   sum - the checksum
+ *
+ * Returns:
+ *   the checksum of all of the bytes added
+ */
+uint64_t checksum_final(Checksum *sum) {
+  uint64_t hash = 0;
+  for (int i = 0; i < 4; i++) {
+    hash ^= checksum_round(0, sum->lanes[i]);
+    hash = hash * CHECKSUM_PRIME1 + CHECKSUM_PRIME3;
+  }
+  hash += sum->total;
+  for (size_t i = 0; i < sum->pending_len; i++) {
+    hash ^= sum->pending[i] * CHECKSUM_PRIME3;
+    hash = ((hash << 11) | (hash >> 53)) * CHECKSUM_PRIME1;
+  }
+  hash ^= hash >> 33;
+  hash *= CHECKSUM_PRIME2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+/*
+ * Check that a buffer is laid out as a compiled knowledge base that this
+ * program can use: the magic, version, byte order and size match and every
+ * section's arrays are within the buffer. The checksum is not checked, so
+ * only the pages of the header and section table are read (see store.c).
+ *
+ * Input:
+ *   data - the contents of the file (aligned to 8 bytes)
+ *   size - the size of the file
+ *
+ * Returns:
+ *   NULL, if the buffer is not laid out as a compiled knowledge base
+ *   A pointer to the header
+ */
+const KBSnapshotHeader *snapshot_layout(const char *data, size_t size) {
+  const KBSnapshotHeader *header = (const KBSnapshotHeader *)data;
+  if (size < sizeof(KBSnapshotHeader) ||
+      memcmp(header->magic, KB_SNAPSHOT_MAGIC, 8) != 0 ||
+      header->version != KB_SNAPSHOT_VERSION ||
+      header->byte_order != 0x01020304 || header->file_size != size ||
+      header->sections_offset % 8 != 0 || header->sections_offset > size ||
+      header->section_count > (size - header->sections_offset) /
+                                  sizeof(KBSnapshotSection)) {
+    return NULL;
+  }
+
+  const KBSnapshotSection *table =
+      (const KBSnapshotSection *)(data + header->sections_offset);
+  for (uint64_t i = 0; i < header->section_count; i++) {
+    const KBSnapshotSection *section = &table[i];
+    if (memchr(section->name, '\0', MAX_INTENT) == NULL ||
+        section->entries_offset % 8 != 0 || section->slots_offset % 4 != 0 ||
+        section->entries_offset > size || section->slots_offset > size ||
+        section->entry_count > (size - section->entries_offset) /
+                                   sizeof(KBSnapshotEntry) ||
+        section->slot_count > (size - section->slots_offset) /
+                                  sizeof(uint32_t) ||
+        section->slot_count == 0 ||
+        (section->slot_count & (section->slot_count - 1)) != 0 ||
+        section->entry_count >= section->slot_count) {
+      return NULL;
+    }
+  }
+  return header;
+}
+
+/*
+ * Check that a buffer holds a compiled knowledge base that this program can
+ * use: it is laid out as one (see snapshot_layout()) and the checksum is
+ * correct. The string offsets of individual entries are trusted once the
+ * checksum matches.
+ *
+ * Input:
+ *   data - the contents of the file (aligned to 8 bytes)
+ *   size - the size of the file
+ *
+ * Returns:
+ *   NULL, if the buffer is not a usable compiled knowledge base
+ *   A pointer to the header
+ */
+const KBSnapshotHeader *snapshot_validate(const char *data, size_t size) {
+  const KBSnapshotHeader *header = snapshot_layout(data, size);
+  if (header == NULL) {
+    return NULL;
+  }
+
+  Checksum sum;
+  checksum_init(&sum);
+  checksum_update(&sum, data + sizeof(KBSnapshotHeader),
+                  size - sizeof(KBSnapshotHeader));
+  if (checksum_final(&sum) != header->checksum) {
+    return NULL;
+  }
+  return header;
+}
+
+/*
+ * Helper function to write bytes to the file, adding them to the checksum.
+ */
+
+static void emit(SnapshotWriter *w, const void *data, size_t len) {
+  if (len > 0 && fwrite(data, 1, len, w->f) != len) {
+    w->error = KB_IOERROR;
+  }
+  checksum_update(&w->sum, data, len);
+  w->offset += len;
+}
+
+/*
+ * Helper function to pad the file with zeroes to a multiple of 8 bytes.
+ */
+
+static void emit_padding(SnapshotWriter *w) {
+  static const char zeroes[8];
+  emit(w, zeroes, -w->offset & 7);
+}
+
+/*
+ * Helper function (called by section_walk()) to write the strings of a node
+ * and remember where they are.
+ */
+
+static void add_entry(const Node *node, void *arg) {
+  SnapshotWriter *w = arg;
+  if (w->error != KB_OK) {
+    return;
+  }
+  if (w->count == w->capacity) {
+    size_t capacity = w->capacity == 0 ? 1024 : w->capacity * 2;
+    KBSnapshotEntry *entries =
+        realloc(w->entries, capacity * sizeof(KBSnapshotEntry));
+    if (entries == NULL) {
+      w->error = KB_NOMEM;
+      return;
+    }
+    w->entries = entries;
+    w->capacity = capacity;
+  }
+
+  KBSnapshotEntry *entry = &w->entries[w->count++];
+  memset(entry, 0, sizeof(KBSnapshotEntry));
+  entry->hash = node->hash;
+  entry->entity_offset = w->offset;
+  entry->entity_len = node->entity_len;
+  emit(w, node->entity, node->entity_len);
+  entry->response_offset = w->offset;
+  entry->response_len = node->response_len;
+  emit(w, node->response, node->response_len);
+}
+
+/*
+ * Helper function to build the hash index of a section's entries.
+ *
+ * Input:
+ *   entries  - the entries
+ *   count    - the number of entries
+ *   capacity - receives the number of slots
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the slots, which the caller must free
+ */
+
+static uint32_t *build_slots(const KBSnapshotEntry *entries, size_t count,
+                             size_t *capacity) {
+  size_t slot_count = KB_INITIAL_SLOTS;
+  while (count * 100 > slot_count * KB_MAX_LOAD) {
+    slot_count *= 2;
+  }
+
+  uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+  if (slots == NULL) {
+    return NULL;
+  }
+  for (size_t e = 0; e < count; e++) {
+    size_t i = (size_t)entries[e].hash & (slot_count - 1);
+    while (slots[i] != 0) {
+      i = (i + 1) & (slot_count - 1);
+    }
+    slots[i] = e + 1;
+  }
+  *capacity = slot_count;
+  return slots;
+}
+
+/*
+ * Write the knowledge base to a file in the compiled format.
+ *
+ * Every section is written, under its question word (see intent.c).
+ *
+ * Input:
+ *   f  - the file (opened for writing in binary mode, and seekable)
+ *   kb - the knowledge base (which the caller has locked)
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written
+ */
+int snapshot_write(FILE *f, kb_t *kb) {
+  int count = intent_sections(kb);
+  SnapshotWriter w;
+  KBSnapshotHeader header;
+  KBSnapshotSection *table = calloc(count, sizeof(KBSnapshotSection));
+  KBSnapshotEntry **entries = calloc(count, sizeof(KBSnapshotEntry *));
+
+  memset(&w, 0, sizeof(w));
+  memset(&header, 0, sizeof(header));
+  w.f = f;
+  w.error = table == NULL || entries == NULL ? KB_NOMEM : KB_OK;
+
+  // Leave room for the header, which is written last
+  if (w.error == KB_OK && fwrite(&header, sizeof(header), 1, f) != 1) {
+    w.error = KB_IOERROR;
+  }
+  w.offset = sizeof(header);
+  checksum_init(&w.sum);
+
+  // The strings, section by section
+  for (int s = 0; s < count && w.error == KB_OK; s++) {
+    w.entries = NULL;
+    w.count = w.capacity = 0;
+    section_walk(&kb->sections[s], add_entry, &w);
+    entries[s] = w.entries;
+    snprintf(table[s].name, MAX_INTENT, "%s", intent_section_name(kb, s));
+    table[s].entry_count = w.count;
+  }
+  emit_padding(&w);
+
+  // The entries, then the hash indexes
+  for (int s = 0; s < count && w.error == KB_OK; s++) {
+    table[s].entries_offset = w.offset;
+    emit(&w, entries[s], table[s].entry_count * sizeof(KBSnapshotEntry));
+  }
+  for (int s = 0; s < count && w.error == KB_OK; s++) {
+    size_t slot_count;
+    uint32_t *slots = build_slots(entries[s], table[s].entry_count,
+                                  &slot_count);
+    if (slots == NULL) {
+      w.error = KB_NOMEM;
+      break;
+    }
+    table[s].slots_offset = w.offset;
+    table[s].slot_count = slot_count;
+    emit(&w, slots, slot_count * sizeof(uint32_t));
+    free(slots);
+  }
+  emit_padding(&w);
+
+  // The section table, and finally the header
+  header.sections_offset = w.offset;
+  header.section_count = count;
+  if (w.error == KB_OK) {
+    emit(&w, table, count * sizeof(KBSnapshotSection));
+  }
+  memcpy(header.magic, KB_SNAPSHOT_MAGIC, 8);
+  header.version = KB_SNAPSHOT_VERSION;
+  header.byte_order = 0x01020304;
+  header.file_size = w.offset;
+  header.checksum = checksum_final(&w.sum);
+  if (w.error == KB_OK && (fseek(f, 0, SEEK_SET) != 0 ||
+                           fwrite(&header, sizeof(header), 1, f) != 1 ||
+                           fflush(f) != 0)) {
+    w.error = KB_IOERROR;
+  }
+
+  for (int s = 0; entries != NULL && s < count; s++) {
+    free(entries[s]);
+  }
+  free(entries);
+  free(table);
+  return w.error;
+}
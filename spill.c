@@ -0,0 +1,233 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the spill file of a knowledge base with a memory
+ * budget (see kb_set_budget() in knowledge.c): the file that responses are
+ * moved to when the responses learned would otherwise take more memory than
+ * the budget allows.
+ *
+ * A spill file is only ever appended to, and it is mapped as it grows, a
+ * segment at a time, so a response moved to it is read through the mapping
+ * like a response in a loaded file: lookups take no locks and make no system
+ * calls, and the kernel reads a response back in from disk when it is next
+ * looked up, and drops it again when memory is short. Segments are never
+ * unmapped until the whole file is (see spill_destroy()), so a response
+ * stays where it was put.
+ *
+ * The file is created in a directory of the user's choice and unlinked at
+ * once, so it goes away with the program, however that ends.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+KBSpill *spill_create(const char *dir) { return NULL; }
+
+const char *spill_append(KBSpill *spill, const char *data, size_t len,
+                         size_t align) {
+  return NULL;
+}
+
+uint64_t spill_size(const KBSpill *spill) { return 0; }
+
+void spill_destroy(void *arg) {}
+
+#else
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* the size of a segment of a spill file (a larger append gets a segment of
+ * its own, rounded up to SPILL_ALIGN) */
+#define SPILL_SEGMENT (64 * 1024 * 1024)
+
+/* the alignment of the segments in the file, a multiple of any page size */
+#define SPILL_ALIGN (64 * 1024)
+
+/* Type definition for a mapped segment of a spill file */
+typedef struct spill_segment {
+  char *data;      /* the mapping */
+  size_t size;     /* the length of the mapping */
+  uint64_t offset; /* where the segment starts in the file */
+} SpillSegment;
+
+/* Type definition for a spill file */
+struct kb_spill {
+  int fd;                  /* the file, which has been unlinked */
+  uint64_t size;           /* the length of the file */
+  uint64_t appended;       /* the bytes appended to it */
+  size_t used;             /* the bytes used in the last segment */
+  SpillSegment *segments;  /* the segments, in the order they were added */
+  size_t segment_count;    /* the number of segments */
+  size_t segment_capacity; /* the room in 'segments' */
+};
+
+/*
+ * Create a spill file.
+ *
+ * Input:
+ *   dir - the directory to create it in, or NULL for $TMPDIR (or /var/tmp)
+ *
+ * Returns:
+ *   NULL, if the file could not be created, or there is memory allocation
+ *   error
+ *   A pointer to the spill file, to be freed with spill_destroy()
+ */
+KBSpill *spill_create(const char *dir) {
+  if (dir == NULL) {
+    dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/var/tmp";
+  }
+  KBSpill *spill = calloc(1, sizeof(KBSpill));
+  size_t len = strlen(dir) + sizeof("/chatbot-spill.XXXXXX");
+  char *path = malloc(len);
+  if (spill == NULL || path == NULL) {
+    free(spill);
+    free(path);
+    return NULL;
+  }
+  snprintf(path, len, "%s/chatbot-spill.XXXXXX", dir);
+  spill->fd = mkstemp(path);
+  if (spill->fd >= 0) {
+    unlink(path);
+  }
+  free(path);
+  if (spill->fd < 0) {
+    free(spill);
+    return NULL;
+  }
+  return spill;
+}
+
+/*
+ * Helper function to add a segment to a spill file, and map it.
+ *
+ * Input:
+ *   spill - the spill file
+ *   len   - the most the segment has to hold
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be grown or mapped
+ */
+
+static int spill_grow(KBSpill *spill, size_t len) {
+  if (spill->segment_count == spill->segment_capacity) {
+    size_t capacity =
+        spill->segment_capacity == 0 ? 16 : spill->segment_capacity * 2;
+    SpillSegment *segments =
+        realloc(spill->segments, capacity * sizeof(SpillSegment));
+    if (segments == NULL) {
+      return KB_NOMEM;
+    }
+    spill->segments = segments;
+    spill->segment_capacity = capacity;
+  }
+
+  size_t size = SPILL_SEGMENT;
+  if (len > size) {
+    size = (len + SPILL_ALIGN - 1) / SPILL_ALIGN * SPILL_ALIGN;
+  }
+  if (ftruncate(spill->fd, spill->size + size) != 0) {
+    return KB_IOERROR;
+  }
+  void *data =
+      mmap(NULL, size, PROT_READ, MAP_SHARED, spill->fd, spill->size);
+  if (data == MAP_FAILED) {
+    return KB_IOERROR;
+  }
+  SpillSegment *segment = &spill->segments[spill->segment_count++];
+  segment->data = data;
+  segment->size = size;
+  segment->offset = spill->size;
+  spill->size += size;
+  spill->used = 0;
+  return KB_OK;
+}
+
+/*
+ * Append bytes to a spill file. The bytes are written with pwrite(), and
+ * read back through the mapping, which sees them at once.
+ *
+ * Input:
+ *   spill - the spill file
+ *   data  - the bytes
+ *   len   - the number of bytes
+ *   align - the alignment they need, a power of two no more than SPILL_ALIGN
+ *           (1 for a response)
+ *
+ * Returns:
+ *   NULL, if the bytes could not be written (e.g. the disk is full)
+ *   A pointer to the bytes in the spill file, which stays valid until
+ *   spill_destroy()
+ */
+const char *spill_append(KBSpill *spill, const char *data, size_t len,
+                         size_t align) {
+  TRACE_SPAN("spill_append");
+  spill->used = (spill->used + align - 1) & ~(align - 1);
+  if (spill->segment_count == 0 ||
+      spill->segments[spill->segment_count - 1].size < spill->used ||
+      spill->segments[spill->segment_count - 1].size - spill->used < len) {
+    if (spill_grow(spill, len) != KB_OK) {
+      return NULL;
+    }
+  }
+
+  SpillSegment *segment = &spill->segments[spill->segment_count - 1];
+  const char *p = data;
+  size_t left = len;
+  uint64_t at = segment->offset + spill->used;
+  while (left > 0) {
+    ssize_t written = pwrite(spill->fd, p, left, at);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return NULL;
+    }
+    p += written;
+    left -= written;
+    at += written;
+  }
+  const char *stored = segment->data + spill->used;
+  spill->used += len;
+  spill->appended += len;
+  return stored;
+}
+
+/*
+ * Get the number of bytes appended to a spill file.
+ *
+ * Input:
+ *   spill - the spill file, or NULL
+ *
+ * Returns:
+ *   the number of bytes (0 if spill is NULL)
+ */
+uint64_t spill_size(const KBSpill *spill) {
+  return spill == NULL ? 0 : spill->appended;
+}
+
+/*
+ * Unmap and close a spill file (called through epoch_retire(), once no
+ * lookup can be reading it).
+ *
+ * Input:
+ *   arg - the spill file
+ */
+void spill_destroy(void *arg) {
+  KBSpill *spill = arg;
+  for (size_t s = 0; s < spill->segment_count; s++) {
+    munmap(spill->segments[s].data, spill->segments[s].size);
+  }
+  free(spill->segments);
+  close(spill->fd);
+  free(spill);
+}
+
+#endif
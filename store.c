@@ -0,0 +1,1479 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the disk store, which keeps a knowledge base on disk
+ * rather than in memory, so that it can be far larger than the memory of the
+ * machine answering from it (e.g. "chatbot -D faq.store").
+ *
+ * The store is a log-structured merge tree. Answers are learned into the
+ * knowledge base's sections in memory as usual (the memtable), and recorded
+ * in the store's journal, "<dir>/wal" (see journal.c). Once the memtable
+ * takes KB_STORE_MEMTABLE_BYTES, it is written out as a run, an immutable
+ * compiled knowledge base (see snapshot.c) in the store's directory, and
+ * emptied. A question the memtable can't answer is looked up in the runs,
+ * newest first. Each run has a bloom filter over its entities, kept beside it
+ * in "<run>.bloom" and mapped, so a run without the entity is almost always
+ * skipped without being read, and the run with it costs one hash probe: a
+ * lookup reads a few pages, however large the store.
+ *
+ * A background thread merges runs of similar size into one (size-tiered
+ * compaction), keeping the newest response to each entity, so there are only
+ * ever a few runs. The runs are listed, newest first, in "<dir>/MANIFEST",
+ * which is replaced (see savefile.c) whenever a run is added or merged; files
+ * it does not list were left behind by a crash, and are removed when the
+ * store is opened. Lookups take no locks: the list of runs is replaced, never
+ * changed, and runs are retired (see epoch.c) once they have been merged.
+ *
+ * LOAD imports a file into the store (a large file is written out a run at a
+ * time as it is read), SAVE exports all of it, and RESET removes every run.
+ * LIST, SEARCH and the suggestions for near misses are not available, since
+ * they would need indexes of the whole store in memory: LIST and SEARCH say
+ * so, and a near miss is simply not answered with a suggestion.
+ */
+
+#include "chat1002.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int store_open(kb_t *kb, const char *dir) { return KB_IOERROR; }
+
+void store_close(kb_t *kb) {}
+
+int store_get(KBStore *store, int section, const char *folded, size_t len,
+              uint64_t hash, char *response, int n) {
+  return KB_NOTFOUND;
+}
+
+int store_flush(KBStore *store, kb_t *kb, size_t bytes) { return 0; }
+
+void store_reset(KBStore *store) {}
+
+const KBStoreRuns *store_runs(KBStore *store) { return NULL; }
+
+void store_walk(const KBStoreRuns *runs, int section,
+                void (*fn)(const char *entity, size_t entity_len,
+                           const char *response, size_t response_len,
+                           void *arg),
+                void *arg) {}
+
+uint64_t store_entries(const KBStoreRuns *runs, int section) { return 0; }
+
+void store_stats(KBStore *store, KBStoreStats *stats) {
+  memset(stats, 0, sizeof(KBStoreStats));
+}
+
+#else
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the first line of a store's manifest */
+#define STORE_MANIFEST_MAGIC "CHATSTORE 1"
+
+/* the first bytes of a run's bloom filter file */
+#define STORE_BLOOM_MAGIC "CHATBLM\n"
+
+/* the bits of bloom filter per entity, and the bits set for each; a filter
+ * is made of 512-bit blocks, and an entity's bits are all in one block */
+#define STORE_BLOOM_BITS 10
+#define STORE_BLOOM_PROBES 6
+
+/* the number of runs at which runs of similar size are merged */
+#define STORE_COMPACT_RUNS 4
+
+/* the longest name of a file in a store, e.g. "run-0000000000000001.kb" */
+#define STORE_MAX_NAME 32
+
+/* Type definition for the header of a bloom filter file */
+typedef struct store_bloom_header {
+  char magic[8];         /* STORE_BLOOM_MAGIC */
+  uint64_t run_size;     /* the size of the run it is for */
+  uint64_t run_checksum; /* the checksum in the run's header */
+  uint64_t blocks;       /* the number of 64-byte blocks that follow */
+} StoreBloomHeader;
+
+/* Type definition for a run of a store */
+typedef struct store_run {
+  uint64_t id;                   /* the run's number, in its file's name */
+  char *path;                    /* the run's file */
+  char *data;                    /* the run, mapped */
+  size_t size;                   /* the size of the run */
+  uint64_t entries;              /* the number of entries in it */
+  KBBase bases[KB_MAX_SECTIONS]; /* its entries by section number (capacity
+                                    0 if it has none for the section) */
+  int tables[KB_MAX_SECTIONS];   /* where each section is in its section
+                                    table, or -1 */
+  const uint64_t *bloom;         /* the bloom filter, 8 words per block */
+  uint64_t blocks;               /* the number of blocks */
+  void *bloom_map;               /* the mapped bloom filter file, or NULL if
+                                    the filter was built in memory */
+  size_t bloom_map_size;         /* the size of the mapping */
+  int obsolete;                  /* 1 to remove its files when released */
+} StoreRun;
+
+/* Type definition for the runs of a store, newest first. A list is never
+ * changed once it is published; a new one replaces it (see publish()). */
+struct kb_store_runs {
+  size_t count;      /* the number of runs */
+  StoreRun *runs[];  /* the runs */
+};
+
+/* Type definition for a disk store */
+struct kb_store {
+  kb_t *kb;                    /* the knowledge base kept in the store */
+  char *dir;                   /* the store's directory */
+  KBStoreRuns *_Atomic runs;   /* the runs, changed with kb->lock held */
+  _Atomic uint64_t next_id;    /* the number of the next run */
+  size_t flush_at;             /* the memtable size to write a run at */
+  KBStoreRuns *merging;        /* the runs being merged, or NULL */
+  int pending;                 /* 1 if the runs may need merging */
+  atomic_int stop;             /* 1 to stop the background thread */
+  pthread_t thread;            /* the thread that merges runs */
+  pthread_mutex_t lock;        /* protects merging and pending */
+  pthread_cond_t changed;      /* signalled when pending or stop is set */
+};
+
+/* Type definition for the state of writing a merged run */
+typedef struct store_writer {
+  KBStore *store;  /* the store (the merge stops once it is being closed) */
+  FILE *f;         /* the file being written */
+  Checksum sum;    /* checksum of everything after the header */
+  uint64_t offset; /* the current offset in the file */
+  int error;       /* KB_OK, or the first error encountered */
+} StoreWriter;
+
+/*
+ * Helper function to make the name of a file in a store's directory.
+ *
+ * Input:
+ *   store - the store
+ *   name  - the name of the file in the directory
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   The path, which the caller must free
+ */
+
+static char *store_path(const KBStore *store, const char *name) {
+  size_t len = strlen(store->dir) + strlen(name) + 2;
+  char *path = malloc(len);
+  if (path != NULL) {
+    snprintf(path, len, "%s/%s", store->dir, name);
+  }
+  return path;
+}
+
+/*
+ * Helper function to work out the name of a run's file.
+ *
+ * Input:
+ *   id   - the run's number
+ *   name - a buffer of STORE_MAX_NAME characters to receive the name
+ */
+
+static void run_name(uint64_t id, char *name) {
+  snprintf(name, STORE_MAX_NAME, "run-%016llx.kb", (unsigned long long)id);
+}
+
+/*
+ * Helper function to find the number of the run a file in a store's
+ * directory belongs to.
+ *
+ * Input:
+ *   name - the name of the file, e.g. "run-0000000000000001.kb.bloom"
+ *   id   - receives the run's number
+ *
+ * Returns:
+ *   the length of the run's own name, or 0 if the file is not a run's
+ */
+
+static size_t parse_run_name(const char *name, uint64_t *id) {
+  if (strncmp(name, "run-", 4) != 0 || strlen(name) < 23 ||
+      strncmp(name + 20, ".kb", 3) != 0) {
+    return 0;
+  }
+  *id = 0;
+  for (int k = 4; k < 20; k++) {
+    char c = name[k];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                       : -1;
+    if (digit < 0) {
+      return 0;
+    }
+    *id = *id << 4 | digit;
+  }
+  return 23;
+}
+
+/*
+ * Helper function to mix an entity's hash into the bits a bloom filter keeps
+ * for it. The hash indexes use the hash's low bits, so it is mixed first
+ * (with the finaliser of SplitMix64), and the number of the entity's section
+ * in its run is mixed in too.
+ *
+ * Input:
+ *   hash  - the hash of the case-folded entity
+ *   table - where the section is in the run's section table
+ *
+ * Returns:
+ *   the mixed hash
+ */
+
+static uint64_t bloom_mix(uint64_t hash, int table) {
+  uint64_t h = hash ^ ((uint64_t)table + 1) * 0x9E3779B97F4A7C15ULL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  return h ^ (h >> 31);
+}
+
+/*
+ * Helper function to find the block of a bloom filter an entity's bits are
+ * in, and the bits (STORE_BLOOM_PROBES of them, each 9 bits long) within it.
+ *
+ * Input:
+ *   h      - the mixed hash, from bloom_mix()
+ *   blocks - the number of blocks in the filter
+ *   bits   - receives the bits
+ *
+ * Returns:
+ *   the number of the block
+ */
+
+static uint64_t bloom_block(uint64_t h, uint64_t blocks, uint64_t *bits) {
+  *bits = h * 0xD6E8FEB86659FD93ULL;
+  return ((h >> 32) * blocks) >> 32;
+}
+
+/*
+ * Helper function to add an entity to a bloom filter.
+ *
+ * Input:
+ *   bloom  - the filter
+ *   blocks - the number of blocks in it
+ *   hash   - the hash of the case-folded entity
+ *   table  - where its section is in the run's section table
+ */
+
+static void bloom_add(uint64_t *bloom, uint64_t blocks, uint64_t hash,
+                      int table) {
+  uint64_t bits;
+  uint64_t *block = bloom + 8 * bloom_block(bloom_mix(hash, table), blocks,
+                                            &bits);
+  for (int p = 0; p < STORE_BLOOM_PROBES; p++, bits >>= 9) {
+    block[(bits & 511) >> 6] |= 1ULL << (bits & 63);
+  }
+}
+
+/*
+ * Helper function to check whether a run may have an entity, according to
+ * its bloom filter.
+ *
+ * Input:
+ *   run   - the run
+ *   hash  - the hash of the case-folded entity
+ *   table - where its section is in the run's section table
+ *
+ * Returns:
+ *   1, if the run may have the entity
+ *   0, if it certainly doesn't
+ */
+
+static int bloom_test(const StoreRun *run, uint64_t hash, int table) {
+  uint64_t bits;
+  const uint64_t *block =
+      run->bloom + 8 * bloom_block(bloom_mix(hash, table), run->blocks, &bits);
+  for (int p = 0; p < STORE_BLOOM_PROBES; p++, bits >>= 9) {
+    if (!(block[(bits & 511) >> 6] & (1ULL << (bits & 63)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Helper function to look an entity up in one section of a run.
+ *
+ * Input:
+ *   run     - the run
+ *   section - the section number
+ *   folded  - the case-folded entity (see make_key() in knowledge.c)
+ *   len     - the length of the entity
+ *   hash    - the hash of the case-folded entity
+ *
+ * Returns:
+ *   NULL, if the run doesn't have the entity
+ *   A pointer to the entity's entry in the run
+ */
+
+static const KBSnapshotEntry *run_find(const StoreRun *run, int section,
+                                       const char *folded, size_t len,
+                                       uint64_t hash) {
+  const KBBase *base = &run->bases[section];
+  if (base->capacity == 0) {
+    return NULL;
+  }
+  size_t mask = base->capacity - 1;
+  for (size_t i = (size_t)hash & mask; base->slots[i] != 0;
+       i = (i + 1) & mask) {
+    const KBSnapshotEntry *entry = &base->entries[base->slots[i] - 1];
+    if (entry->hash != hash || entry->entity_len != len) {
+      continue;
+    }
+    const char *entity = base->data + entry->entity_offset;
+    size_t k = 0;
+    while (k < len && FOLD_CHAR(entity[k]) == folded[k]) {
+      k++;
+    }
+    if (k == len) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Helper function to check whether any of the runs newer than one has an
+ * entity in one of its sections, so that the older run's entry for it is
+ * out of date.
+ *
+ * Input:
+ *   runs    - the runs, newest first
+ *   newer   - the number of runs newer than the one in question
+ *   section - the section number
+ *   entity  - the entity (not case-folded)
+ *   len     - its length, less than MAX_ENTITY
+ *   hash    - the hash of the case-folded entity
+ *
+ * Returns:
+ *   1, if a newer run has the entity
+ *   0, otherwise
+ */
+
+static int shadowed(StoreRun *const *runs, size_t newer, int section,
+                    const char *entity, size_t len, uint64_t hash) {
+  char folded[MAX_ENTITY];
+  for (size_t k = 0; k < len; k++) {
+    folded[k] = FOLD_CHAR(entity[k]);
+  }
+  for (size_t r = 0; r < newer; r++) {
+    int table = runs[r]->tables[section];
+    if (table >= 0 && bloom_test(runs[r], hash, table) &&
+        run_find(runs[r], section, folded, len, hash) != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Helper function to load the bloom filter of a run from its file, if the
+ * file is there and is for this version of the run.
+ *
+ * Input:
+ *   run    - the run
+ *   header - the run's header
+ *
+ * Returns:
+ *   KB_OK, if the filter was loaded
+ *   KB_NOTFOUND, if it has to be built
+ */
+
+static int load_bloom(StoreRun *run, const KBSnapshotHeader *header) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.bloom", run->path);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(StoreBloomHeader)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return KB_NOTFOUND;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return KB_NOTFOUND;
+  }
+
+  const StoreBloomHeader *bloom = map;
+  if (memcmp(bloom->magic, STORE_BLOOM_MAGIC, 8) != 0 ||
+      bloom->run_size != run->size ||
+      bloom->run_checksum != header->checksum || bloom->blocks == 0 ||
+      bloom->blocks > ((size_t)st.st_size - sizeof(StoreBloomHeader)) / 64 ||
+      (size_t)st.st_size != sizeof(StoreBloomHeader) + bloom->blocks * 64) {
+    munmap(map, st.st_size);
+    return KB_NOTFOUND;
+  }
+  run->bloom_map = map;
+  run->bloom_map_size = st.st_size;
+  run->bloom = (const uint64_t *)(bloom + 1);
+  run->blocks = bloom->blocks;
+  return KB_OK;
+}
+
+/*
+ * Helper function to build the bloom filter of a run from its entries, and
+ * save it beside the run for next time (if it can't be saved, it is built
+ * again then).
+ *
+ * Input:
+ *   run    - the run
+ *   header - the run's header
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int build_bloom(StoreRun *run, const KBSnapshotHeader *header) {
+  TRACE_SPAN("build_bloom");
+  uint64_t blocks = (run->entries * STORE_BLOOM_BITS + 511) / 512;
+  blocks = blocks == 0 ? 1 : blocks;
+  uint64_t *bloom = calloc(blocks, 64);
+  if (bloom == NULL) {
+    return KB_NOMEM;
+  }
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    const KBBase *base = &run->bases[s];
+    for (size_t e = 0; run->tables[s] >= 0 && e < base->count; e++) {
+      bloom_add(bloom, blocks, base->entries[e].hash, run->tables[s]);
+    }
+  }
+  run->bloom = bloom;
+  run->blocks = blocks;
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.bloom", run->path);
+  StoreBloomHeader file_header;
+  memset(&file_header, 0, sizeof(file_header));
+  memcpy(file_header.magic, STORE_BLOOM_MAGIC, 8);
+  file_header.run_size = run->size;
+  file_header.run_checksum = header->checksum;
+  file_header.blocks = blocks;
+  SaveFile file;
+  if (savefile_open(&file, path) == KB_OK) {
+    if (fwrite(&file_header, sizeof(file_header), 1, file.f) == 1 &&
+        fwrite(bloom, 64, blocks, file.f) == blocks) {
+      savefile_commit(&file);
+    } else {
+      savefile_abort(&file);
+    }
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function to unmap a run and free it (called through epoch_retire()
+ * once no lookup can be reading it). The files of an obsolete run are
+ * removed.
+ *
+ * Input:
+ *   arg - the run
+ */
+
+static void run_release(void *arg) {
+  StoreRun *run = arg;
+  if (run->data != NULL) {
+    munmap(run->data, run->size);
+  }
+  if (run->bloom_map != NULL) {
+    munmap(run->bloom_map, run->bloom_map_size);
+  } else {
+    free((void *)run->bloom);
+  }
+  if (run->obsolete) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.bloom", run->path);
+    unlink(run->path);
+    unlink(path);
+  }
+  free(run->path);
+  free(run);
+}
+
+/*
+ * Helper function to open a run of a store: map it, check that it is a
+ * compiled knowledge base, and load (or build) its bloom filter. Its
+ * sections' names are made question words of the store's knowledge base, as
+ * loading it would, if asked; otherwise sections whose names are not
+ * question words of the knowledge base are left out. The checksum of the
+ * whole run is not checked, since that would read all of it; it was checked
+ * when the run was written.
+ *
+ * Input:
+ *   store - the store
+ *   id    - the run's number
+ *   add   - 1 to make the names of its sections question words (the
+ *           knowledge base's lock must be held), 0 to only look them up
+ *
+ * Returns:
+ *   NULL, if the run could not be opened or is damaged, or there is memory
+ *   allocation error
+ *   A pointer to the run
+ */
+
+static StoreRun *run_open(KBStore *store, uint64_t id, int add) {
+  char name[STORE_MAX_NAME];
+  run_name(id, name);
+  StoreRun *run = calloc(1, sizeof(StoreRun));
+  if (run == NULL || (run->path = store_path(store, name)) == NULL) {
+    free(run);
+    return NULL;
+  }
+  run->id = id;
+
+  int fd = open(run->path, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      run->data = data;
+      run->size = st.st_size;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  const KBSnapshotHeader *header =
+      run->data == NULL ? NULL : snapshot_layout(run->data, run->size);
+  if (header == NULL) {
+    run_release(run);
+    return NULL;
+  }
+  // Lookups go straight to the pages they need
+  madvise(run->data, run->size, MADV_RANDOM);
+
+  const KBSnapshotSection *table =
+      (const KBSnapshotSection *)(run->data + header->sections_offset);
+  for (int s = 0; s < KB_MAX_SECTIONS; s++) {
+    run->tables[s] = -1;
+  }
+  for (uint64_t t = 0; t < header->section_count; t++) {
+    size_t len = strnlen(table[t].name, MAX_INTENT);
+    int s = add ? intent_add_question(store->kb, table[t].name, len)
+                : intent_question(store->kb, table[t].name);
+    if (s < 0 || run->tables[s] >= 0) {
+      continue;
+    }
+    KBBase *base = &run->bases[s];
+    base->data = run->data;
+    base->entries =
+        (const KBSnapshotEntry *)(run->data + table[t].entries_offset);
+    base->slots = (const uint32_t *)(run->data + table[t].slots_offset);
+    base->count = table[t].entry_count;
+    base->capacity = table[t].slot_count;
+    run->tables[s] = (int)t;
+    run->entries += base->count;
+  }
+
+  if (load_bloom(run, header) != KB_OK && build_bloom(run, header) != KB_OK) {
+    run_release(run);
+    return NULL;
+  }
+  return run;
+}
+
+/*
+ * Helper function to make a list of runs.
+ *
+ * Input:
+ *   count - the number of runs it will hold
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error
+ *   A pointer to the list, with its count set
+ */
+
+static KBStoreRuns *runs_create(size_t count) {
+  KBStoreRuns *runs =
+      malloc(sizeof(KBStoreRuns) + (count + 1) * sizeof(StoreRun *));
+  if (runs != NULL) {
+    runs->count = count;
+  }
+  return runs;
+}
+
+/*
+ * Helper function to replace a store's manifest with a list of its runs.
+ *
+ * Input:
+ *   store - the store
+ *   runs  - the runs, newest first
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the manifest could not be written
+ */
+
+static int write_manifest(KBStore *store, const KBStoreRuns *runs) {
+  char *path = store_path(store, "MANIFEST");
+  if (path == NULL) {
+    return KB_NOMEM;
+  }
+  SaveFile file;
+  int result = savefile_open(&file, path);
+  if (result == KB_OK) {
+    fprintf(file.f, "%s\n", STORE_MANIFEST_MAGIC);
+    for (size_t r = 0; r < runs->count; r++) {
+      char name[STORE_MAX_NAME];
+      run_name(runs->runs[r]->id, name);
+      fprintf(file.f, "%s\n", name);
+    }
+    result = ferror(file.f) ? KB_IOERROR : savefile_commit(&file);
+    if (result != KB_OK && file.f != NULL) {
+      savefile_abort(&file);
+    }
+  }
+  free(path);
+  return result;
+}
+
+/*
+ * Helper function to make a list of runs the store's, once the manifest
+ * lists them. The knowledge base's lock must be held. The caller retires the
+ * list it replaces (see epoch.c) once it is done with it.
+ *
+ * Input:
+ *   store - the store
+ *   runs  - the new list
+ *
+ * Returns:
+ *   KB_OK, if successful (the list is the store's)
+ *   KB_NOMEM or KB_IOERROR, if the manifest could not be written (the list
+ *   is still the caller's)
+ */
+
+static int publish(KBStore *store, KBStoreRuns *runs) {
+  int result = write_manifest(store, runs);
+  if (result == KB_OK) {
+    atomic_store_explicit(&store->runs, runs, memory_order_release);
+  }
+  return result;
+}
+
+/*
+ * Helper function to let the background thread know that the runs may need
+ * merging.
+ *
+ * Input:
+ *   store - the store
+ */
+
+static void wake(KBStore *store) {
+  pthread_mutex_lock(&store->lock);
+  store->pending = 1;
+  pthread_cond_signal(&store->changed);
+  pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ * Helper function to choose the runs to merge: the newest run, and each run
+ * after it that is no more than twice the size of the newer runs together.
+ * Runs that are much larger than everything newer are left alone, so each
+ * entry is merged only a few times as the store grows.
+ *
+ * Input:
+ *   runs - the runs, newest first
+ *
+ * Returns:
+ *   the number of runs to merge (the newest ones), or 0 if none
+ */
+
+static size_t choose_merge(const KBStoreRuns *runs) {
+  if (runs->count < STORE_COMPACT_RUNS) {
+    return 0;
+  }
+  uint64_t total = runs->runs[0]->size;
+  size_t count = 1;
+  while (count < runs->count && runs->runs[count]->size <= 2 * total) {
+    total += runs->runs[count++]->size;
+  }
+  return count > 1 ? count : 0;
+}
+
+/*
+ * Helper function to write bytes to a merged run, adding them to the
+ * checksum.
+ */
+
+static void merge_emit(StoreWriter *w, const void *data, size_t len) {
+  if (len > 0 && w->error == KB_OK && fwrite(data, 1, len, w->f) != len) {
+    w->error = KB_IOERROR;
+  }
+  checksum_update(&w->sum, data, len);
+  w->offset += len;
+}
+
+/*
+ * Helper function to pad a merged run with zeroes to a multiple of 8 bytes.
+ */
+
+static void merge_pad(StoreWriter *w) {
+  static const char zeroes[8];
+  merge_emit(w, zeroes, -w->offset & 7);
+}
+
+/*
+ * Helper function to write one section of a merged run: the strings of the
+ * entries that are not out of date, then (going over the same entries again,
+ * so that no entry is kept in memory) the entries, then their hash index.
+ *
+ * Input:
+ *   w       - the writer
+ *   inputs  - the runs being merged, newest first
+ *   count   - the number of them
+ *   section - the section number
+ *   table   - receives the section's place in the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written, or the store is being
+ *   closed
+ */
+
+static int merge_section(StoreWriter *w, StoreRun *const *inputs,
+                         size_t count, int section,
+                         KBSnapshotSection *table) {
+  uint64_t strings = w->offset;
+  uint64_t entry_count = 0;
+  for (size_t r = 0; r < count; r++) {
+    const KBBase *base = &inputs[r]->bases[section];
+    for (size_t e = 0; e < base->count && w->error == KB_OK; e++) {
+      const KBSnapshotEntry *entry = &base->entries[e];
+      const char *entity = base->data + entry->entity_offset;
+      if (e % 4096 == 0 && atomic_load(&w->store->stop)) {
+        w->error = KB_IOERROR;
+      } else if (!shadowed(inputs, r, section, entity, entry->entity_len,
+                           entry->hash)) {
+        merge_emit(w, entity, entry->entity_len);
+        merge_emit(w, base->data + entry->response_offset,
+                   entry->response_len);
+        entry_count++;
+      }
+    }
+  }
+  merge_pad(w);
+  if (w->error != KB_OK) {
+    return w->error;
+  }
+
+  size_t slot_count = KB_INITIAL_SLOTS;
+  while (entry_count * 100 > slot_count * KB_MAX_LOAD) {
+    slot_count *= 2;
+  }
+  uint32_t *slots = entry_count >= UINT32_MAX
+                        ? NULL
+                        : calloc(slot_count, sizeof(uint32_t));
+  if (slots == NULL) {
+    return KB_NOMEM;
+  }
+  table->entries_offset = w->offset;
+  table->entry_count = entry_count;
+  uint64_t at = strings, e_out = 0;
+  for (size_t r = 0; r < count; r++) {
+    const KBBase *base = &inputs[r]->bases[section];
+    for (size_t e = 0; e < base->count; e++) {
+      const KBSnapshotEntry *entry = &base->entries[e];
+      const char *entity = base->data + entry->entity_offset;
+      if (shadowed(inputs, r, section, entity, entry->entity_len,
+                   entry->hash)) {
+        continue;
+      }
+      KBSnapshotEntry copy;
+      memset(&copy, 0, sizeof(copy));
+      copy.hash = entry->hash;
+      copy.entity_offset = at;
+      copy.entity_len = entry->entity_len;
+      copy.response_offset = at + entry->entity_len;
+      copy.response_len = entry->response_len;
+      at += entry->entity_len + entry->response_len;
+      merge_emit(w, &copy, sizeof(copy));
+
+      size_t i = (size_t)copy.hash & (slot_count - 1);
+      while (slots[i] != 0) {
+        i = (i + 1) & (slot_count - 1);
+      }
+      slots[i] = ++e_out;
+    }
+  }
+
+  table->slots_offset = w->offset;
+  table->slot_count = slot_count;
+  merge_emit(w, slots, slot_count * sizeof(uint32_t));
+  merge_pad(w);
+  free(slots);
+  return w->error;
+}
+
+/*
+ * Helper function to write runs merged into one, in the compiled format. An
+ * entity in more than one of them keeps its response from the newest.
+ *
+ * Input:
+ *   store  - the store (the merge stops early if the store is closed)
+ *   f      - the file (opened for writing in binary mode, and seekable)
+ *   inputs - the runs, newest first
+ *   count  - the number of them
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the file could not be written, or the store was closed
+ */
+
+static int merge_runs(KBStore *store, FILE *f, StoreRun *const *inputs,
+                      size_t count) {
+  TRACE_SPAN("merge_runs");
+  StoreWriter w;
+  KBSnapshotHeader header;
+  KBSnapshotSection table[KB_MAX_SECTIONS];
+  memset(&w, 0, sizeof(w));
+  memset(&header, 0, sizeof(header));
+  memset(table, 0, sizeof(table));
+  w.store = store;
+  w.f = f;
+  if (fwrite(&header, sizeof(header), 1, f) != 1) {
+    return KB_IOERROR;
+  }
+  w.offset = sizeof(header);
+  checksum_init(&w.sum);
+
+  // Every section any of the runs has
+  int section_count = 0;
+  for (int s = 0; s < KB_MAX_SECTIONS && w.error == KB_OK; s++) {
+    size_t r = 0;
+    while (r < count && inputs[r]->tables[s] < 0) {
+      r++;
+    }
+    if (r == count) {
+      continue;
+    }
+    KBSnapshotSection *section = &table[section_count++];
+    const KBSnapshotSection *names = (const KBSnapshotSection *)(
+        inputs[r]->data +
+        ((const KBSnapshotHeader *)inputs[r]->data)->sections_offset);
+    memcpy(section->name, names[inputs[r]->tables[s]].name, MAX_INTENT);
+    w.error = merge_section(&w, inputs, count, s, section);
+  }
+
+  header.sections_offset = w.offset;
+  header.section_count = section_count;
+  merge_emit(&w, table, section_count * sizeof(KBSnapshotSection));
+  memcpy(header.magic, KB_SNAPSHOT_MAGIC, 8);
+  header.version = KB_SNAPSHOT_VERSION;
+  header.byte_order = 0x01020304;
+  header.file_size = w.offset;
+  header.checksum = checksum_final(&w.sum);
+  if (w.error == KB_OK && (fseek(f, 0, SEEK_SET) != 0 ||
+                           fwrite(&header, sizeof(header), 1, f) != 1 ||
+                           fflush(f) != 0)) {
+    w.error = KB_IOERROR;
+  }
+  return w.error;
+}
+
+/*
+ * Helper function to check whether a run is being merged, so that
+ * store_reset() leaves it to the merge to release. The store's lock must be
+ * held.
+ *
+ * Input:
+ *   store - the store
+ *   run   - the run
+ *
+ * Returns:
+ *   1, if the run is being merged
+ *   0, otherwise
+ */
+
+static int is_merging(const KBStore *store, const StoreRun *run) {
+  for (size_t r = 0; store->merging != NULL && r < store->merging->count;
+       r++) {
+    if (store->merging->runs[r] == run) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Helper function to merge the runs choose_merge() picks into one, and put
+ * it in their place. The runs are read without any lock, so runs can be
+ * added meanwhile, and without staying in a read-side critical section,
+ * which would hold up the freeing of everything retired meanwhile; they are
+ * marked as being merged instead, so that they are not released. If the
+ * store is reset meanwhile, the merge is thrown away, and the runs released.
+ *
+ * Input:
+ *   store - the store
+ *
+ * Returns:
+ *   1, if runs were merged
+ *   0, if there was nothing to merge, or the merge failed
+ */
+
+static int compact_runs(KBStore *store) {
+  TRACE_SPAN("store_compact");
+  kb_t *kb = store->kb;
+  KBStoreRuns *inputs = NULL;
+  if (epoch_enter() != 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&store->lock);
+  KBStoreRuns *runs = atomic_load_explicit(&store->runs, memory_order_acquire);
+  size_t count = choose_merge(runs);
+  if (count > 0 && (inputs = runs_create(count)) != NULL) {
+    memcpy(inputs->runs, runs->runs, count * sizeof(StoreRun *));
+    store->merging = inputs;
+  }
+  pthread_mutex_unlock(&store->lock);
+  epoch_leave();
+  if (inputs == NULL) {
+    return 0;
+  }
+
+  uint64_t id = atomic_fetch_add(&store->next_id, 1);
+  char name[STORE_MAX_NAME];
+  run_name(id, name);
+  char *path = store_path(store, name);
+  SaveFile file;
+  int result = path == NULL ? KB_NOMEM : savefile_open(&file, path);
+  if (result == KB_OK) {
+    result = merge_runs(store, file.f, inputs->runs, count);
+    if (result == KB_OK) {
+      result = savefile_commit(&file);
+    } else {
+      savefile_abort(&file);
+    }
+  }
+  // The merged run's sections are all question words already, unless the
+  // store has been reset meanwhile, in which case the run is thrown away
+  StoreRun *merged = result == KB_OK ? run_open(store, id, 0) : NULL;
+  if (result == KB_OK && merged == NULL) {
+    unlink(path);
+    result = KB_IOERROR;
+  }
+  free(path);
+
+  // Put the merged run in place of the runs, if they are still there (runs
+  // are only ever added in front of them, or all removed)
+  int merged_ok = 0;
+  pthread_mutex_lock(&kb->lock);
+  KBStoreRuns *current =
+      atomic_load_explicit(&store->runs, memory_order_acquire);
+  size_t first = 0;
+  while (first < current->count && current->runs[first] != inputs->runs[0]) {
+    first++;
+  }
+  int present = first < current->count;
+  KBStoreRuns *replaced =
+      present && merged != NULL ? runs_create(current->count - count + 1)
+                                : NULL;
+  if (replaced != NULL) {
+    memcpy(replaced->runs, current->runs, first * sizeof(StoreRun *));
+    replaced->runs[first] = merged;
+    memcpy(&replaced->runs[first + 1], &current->runs[first + count],
+           (current->count - first - count) * sizeof(StoreRun *));
+    if (publish(store, replaced) == KB_OK) {
+      epoch_retire(free, current);
+      merged_ok = 1;
+    } else {
+      free(replaced);
+    }
+  }
+  for (size_t r = 0; r < count && (merged_ok || !present); r++) {
+    inputs->runs[r]->obsolete = 1;
+    epoch_retire(run_release, inputs->runs[r]);
+  }
+  pthread_mutex_lock(&store->lock);
+  store->merging = NULL;
+  pthread_mutex_unlock(&store->lock);
+  pthread_mutex_unlock(&kb->lock);
+
+  if (merged != NULL && !merged_ok) {
+    merged->obsolete = 1;
+    run_release(merged);
+  }
+  if (result != KB_OK && !atomic_load(&store->stop)) {
+    fprintf(stderr, "store: can't merge runs in %s\n", store->dir);
+  }
+  if (merged_ok) {
+    metrics_add(METRIC_STORE_COMPACTIONS, 1);
+  }
+  free(inputs);
+  return merged_ok;
+}
+
+/*
+ * Helper function run by the thread that merges a store's runs, whenever a
+ * run is added, until the store is closed.
+ *
+ * Input:
+ *   arg - the store
+ */
+
+static void *store_thread(void *arg) {
+  KBStore *store = arg;
+  pthread_mutex_lock(&store->lock);
+  while (!atomic_load(&store->stop)) {
+    if (!store->pending) {
+      pthread_cond_wait(&store->changed, &store->lock);
+      continue;
+    }
+    store->pending = 0;
+    pthread_mutex_unlock(&store->lock);
+    while (!atomic_load(&store->stop) && compact_runs(store)) {
+    }
+    pthread_mutex_lock(&store->lock);
+  }
+  pthread_mutex_unlock(&store->lock);
+  return NULL;
+}
+
+/*
+ * Helper function to read a store's manifest and open the runs it lists.
+ *
+ * Input:
+ *   store - the store
+ *   runs  - receives the runs, newest first
+ *
+ * Returns:
+ *   KB_OK, if successful (a store with no manifest yet has no runs)
+ *   KB_INVALID, if the manifest or a run is damaged
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int read_manifest(KBStore *store, KBStoreRuns **runs) {
+  char *path = store_path(store, "MANIFEST");
+  if (path == NULL || (*runs = runs_create(0)) == NULL) {
+    free(path);
+    return KB_NOMEM;
+  }
+  FILE *f = fopen(path, "r");
+  free(path);
+  if (f == NULL) {
+    return errno == ENOENT ? KB_OK : KB_INVALID;
+  }
+
+  char line[MAX_INPUT];
+  int result = KB_OK;
+  if (fgets(line, sizeof(line), f) == NULL ||
+      strncmp(line, STORE_MANIFEST_MAGIC "\n", sizeof(line)) != 0) {
+    result = KB_INVALID;
+  }
+  while (result == KB_OK && fgets(line, sizeof(line), f) != NULL) {
+    uint64_t id;
+    line[strcspn(line, "\n")] = '\0';
+    if (parse_run_name(line, &id) != strlen(line) || strlen(line) == 0) {
+      result = KB_INVALID;
+      break;
+    }
+    KBStoreRuns *grown = realloc(*runs, sizeof(KBStoreRuns) +
+                                            ((*runs)->count + 2) *
+                                                sizeof(StoreRun *));
+    if (grown == NULL) {
+      result = KB_NOMEM;
+      break;
+    }
+    *runs = grown;
+    StoreRun *run = run_open(store, id, 1);
+    if (run == NULL) {
+      fprintf(stderr, "store: can't open %s in %s\n", line, store->dir);
+      result = KB_INVALID;
+      break;
+    }
+    (*runs)->runs[(*runs)->count++] = run;
+    if (id >= store->next_id) {
+      store->next_id = id + 1;
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+/*
+ * Helper function to remove the files in a store's directory that its
+ * manifest does not list: runs (and their bloom filters) whose writing or
+ * merging a crash interrupted, and temporary files.
+ *
+ * Input:
+ *   store - the store
+ *   runs  - the runs listed
+ */
+
+static void remove_leftovers(KBStore *store, const KBStoreRuns *runs) {
+  DIR *dir = opendir(store->dir);
+  struct dirent *entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    uint64_t id;
+    size_t len = parse_run_name(name, &id);
+    int listed = 0;
+    for (size_t r = 0; len > 0 && r < runs->count; r++) {
+      listed |= runs->runs[r]->id == id;
+    }
+    if ((len > 0 && !listed) ||
+        (len > 0 && strcmp(name + len, "") != 0 &&
+         strcmp(name + len, ".bloom") != 0) ||
+        strncmp(name, "MANIFEST.", 9) == 0) {
+      char *path = store_path(store, name);
+      if (path != NULL) {
+        unlink(path);
+        free(path);
+      }
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+}
+
+/*
+ * Keep a knowledge base in a disk store from now on: open the store in a
+ * directory (which is created if need be), and answer from its runs as well
+ * as from memory. Its journal is not opened here (see main.c). This is best
+ * done while the knowledge base is still empty.
+ *
+ * Input:
+ *   kb  - the knowledge base (which must not already have a store)
+ *   dir - the directory
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the store is damaged
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERROR, if the directory could not be created
+ */
+int store_open(kb_t *kb, const char *dir) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return KB_IOERROR;
+  }
+  KBStore *store = calloc(1, sizeof(KBStore));
+  if (store == NULL || (store->dir = strdup(dir)) == NULL) {
+    free(store);
+    return KB_NOMEM;
+  }
+  store->kb = kb;
+  store->flush_at = KB_STORE_MEMTABLE_BYTES;
+  store->next_id = 1;
+
+  KBStoreRuns *runs = NULL;
+  pthread_mutex_lock(&kb->lock);
+  int result = read_manifest(store, &runs);
+  pthread_mutex_unlock(&kb->lock);
+  if (result == KB_OK) {
+    remove_leftovers(store, runs);
+    atomic_init(&store->runs, runs);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->changed, NULL);
+    if (pthread_create(&store->thread, NULL, store_thread, store) != 0) {
+      pthread_mutex_destroy(&store->lock);
+      pthread_cond_destroy(&store->changed);
+      result = KB_NOMEM;
+    }
+  }
+  if (result != KB_OK) {
+    for (size_t r = 0; runs != NULL && r < runs->count; r++) {
+      run_release(runs->runs[r]);
+    }
+    free(runs);
+    free(store->dir);
+    free(store);
+    return result;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  kb->store = store;
+  pthread_mutex_unlock(&kb->lock);
+  wake(store); // a crash may have come between a run and its merge
+  return KB_OK;
+}
+
+/*
+ * Stop keeping a knowledge base in its store, e.g. as the knowledge base is
+ * closed. A merge in progress is abandoned. The store's files stay as they
+ * are, and what is in memory is not written to a run: the journal has it.
+ * No other thread may be using the knowledge base.
+ *
+ * Input:
+ *   kb - the knowledge base (which need not have a store)
+ */
+void store_close(kb_t *kb) {
+  pthread_mutex_lock(&kb->lock);
+  KBStore *store = kb->store;
+  kb->store = NULL;
+  pthread_mutex_unlock(&kb->lock);
+  if (store == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  atomic_store(&store->stop, 1);
+  pthread_cond_signal(&store->changed);
+  pthread_mutex_unlock(&store->lock);
+  pthread_join(store->thread, NULL);
+
+  KBStoreRuns *runs = atomic_load(&store->runs);
+  for (size_t r = 0; r < runs->count; r++) {
+    epoch_retire(run_release, runs->runs[r]);
+  }
+  epoch_retire(free, runs);
+  pthread_mutex_destroy(&store->lock);
+  pthread_cond_destroy(&store->changed);
+  free(store->dir);
+  free(store);
+}
+
+/*
+ * Look an entity up in a store's runs, newest first. The caller must have
+ * entered a read-side critical section (see epoch.c).
+ *
+ * Input:
+ *   store    - the store
+ *   section  - the section number of the question word
+ *   folded   - the case-folded entity (see make_key() in knowledge.c)
+ *   len      - the length of the entity, less than MAX_ENTITY
+ *   hash     - the hash of the case-folded entity
+ *   response - a buffer to receive the response
+ *   n        - the size of the buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found (and copied to the response buffer)
+ *   KB_NOTFOUND, if no run has the entity
+ */
+int store_get(KBStore *store, int section, const char *folded, size_t len,
+              uint64_t hash, char *response, int n) {
+  TRACE_SPAN("store_get");
+  const KBStoreRuns *runs =
+      atomic_load_explicit(&store->runs, memory_order_acquire);
+  uint64_t skipped = 0, probed = 0;
+  const StoreRun *found = NULL;
+  const KBSnapshotEntry *entry = NULL;
+  for (size_t r = 0; r < runs->count && entry == NULL; r++) {
+    const StoreRun *run = runs->runs[r];
+    int table = run->tables[section];
+    if (table < 0) {
+      continue;
+    } else if (!bloom_test(run, hash, table)) {
+      skipped++;
+      continue;
+    }
+    probed++;
+    entry = run_find(run, section, folded, len, hash);
+    found = run;
+  }
+  if (skipped > 0) {
+    metrics_add(METRIC_BLOOM_SKIPS, skipped);
+  }
+  if (probed > 0) {
+    metrics_add(METRIC_RUN_PROBES, probed);
+  }
+  if (entry == NULL) {
+    return KB_NOTFOUND;
+  }
+  snprintf(response, n, "%.*s", (int)entry->response_len,
+           found->data + entry->response_offset);
+  return KB_OK;
+}
+
+/*
+ * Write a knowledge base's memtable (everything in its sections) to its
+ * store as a new run, once the memtable takes at least
+ * KB_STORE_MEMTABLE_BYTES, and put the run in front of the store's runs. The
+ * caller then empties the memtable (see kb_put() in knowledge.c). The
+ * knowledge base's lock must be held. If the run can't be written, the
+ * memtable is kept, and written again once it has grown by as much again.
+ *
+ * Input:
+ *   store - the store
+ *   kb    - the knowledge base
+ *   bytes - the memory the memtable takes
+ *
+ * Returns:
+ *   1, if the memtable was written
+ *   0, if it is not yet large enough
+ *   KB_NOMEM or KB_IOERROR, if it could not be written
+ */
+int store_flush(KBStore *store, kb_t *kb, size_t bytes) {
+  if (bytes < store->flush_at) {
+    return 0;
+  }
+  TRACE_SPAN("store_flush");
+  uint64_t id = atomic_fetch_add(&store->next_id, 1);
+  char name[STORE_MAX_NAME];
+  run_name(id, name);
+  char *path = store_path(store, name);
+  SaveFile file;
+  int result = path == NULL ? KB_NOMEM : savefile_open(&file, path);
+  if (result == KB_OK) {
+    result = snapshot_write(file.f, kb);
+    if (result == KB_OK) {
+      result = savefile_commit(&file);
+    } else {
+      savefile_abort(&file);
+    }
+  }
+  StoreRun *run = NULL;
+  if (result == KB_OK && (run = run_open(store, id, 1)) == NULL) {
+    unlink(path);
+    result = KB_IOERROR;
+  }
+  free(path);
+
+  KBStoreRuns *current =
+      atomic_load_explicit(&store->runs, memory_order_acquire);
+  KBStoreRuns *runs = run == NULL ? NULL : runs_create(current->count + 1);
+  if (run != NULL && runs == NULL) {
+    result = KB_NOMEM;
+  } else if (runs != NULL) {
+    runs->runs[0] = run;
+    memcpy(&runs->runs[1], current->runs, current->count * sizeof(StoreRun *));
+    result = publish(store, runs);
+    if (result == KB_OK) {
+      epoch_retire(free, current);
+    } else {
+      free(runs);
+    }
+  }
+  if (result != KB_OK) {
+    if (run != NULL) {
+      run->obsolete = 1;
+      run_release(run);
+    }
+    store->flush_at = bytes + KB_STORE_MEMTABLE_BYTES;
+    fprintf(stderr, "store: can't write a run to %s\n", store->dir);
+    return result;
+  }
+  store->flush_at = KB_STORE_MEMTABLE_BYTES;
+  metrics_add(METRIC_STORE_FLUSHES, 1);
+  wake(store);
+  return 1;
+}
+
+/*
+ * Remove every run of a store, as its knowledge base is reset. The runs'
+ * files are removed once no lookup (or merge) can be reading them. The
+ * knowledge base's lock must be held.
+ *
+ * Input:
+ *   store - the store
+ */
+void store_reset(KBStore *store) {
+  KBStoreRuns *current =
+      atomic_load_explicit(&store->runs, memory_order_acquire);
+  KBStoreRuns *runs = runs_create(0);
+  if (runs == NULL || publish(store, runs) != KB_OK) {
+    free(runs);
+    fprintf(stderr, "store: can't reset %s\n", store->dir);
+    return;
+  }
+  pthread_mutex_lock(&store->lock);
+  for (size_t r = 0; r < current->count; r++) {
+    current->runs[r]->obsolete = 1;
+    if (!is_merging(store, current->runs[r])) {
+      epoch_retire(run_release, current->runs[r]);
+    }
+  }
+  pthread_mutex_unlock(&store->lock);
+  epoch_retire(free, current);
+  store->flush_at = KB_STORE_MEMTABLE_BYTES;
+}
+
+/*
+ * Get the runs of a store as they are now, e.g. to export them with
+ * store_walk() later. They stay valid while the caller holds the knowledge
+ * base's lock, or stays in the read-side critical section (see epoch.c) it
+ * was in when it called this.
+ *
+ * Input:
+ *   store - the store
+ *
+ * Returns:
+ *   the runs
+ */
+const KBStoreRuns *store_runs(KBStore *store) {
+  return atomic_load_explicit(&store->runs, memory_order_acquire);
+}
+
+/*
+ * Go through the entries of one section of a store's runs, newest first,
+ * leaving out those that a newer run has a response for.
+ *
+ * Input:
+ *   runs    - the runs, from store_runs()
+ *   section - the section number
+ *   fn      - the function to call with each entry
+ *   arg     - passed on to fn
+ */
+void store_walk(const KBStoreRuns *runs, int section,
+                void (*fn)(const char *entity, size_t entity_len,
+                           const char *response, size_t response_len,
+                           void *arg),
+                void *arg) {
+  for (size_t r = 0; r < runs->count; r++) {
+    const KBBase *base = &runs->runs[r]->bases[section];
+    for (size_t e = 0; e < base->count; e++) {
+      const KBSnapshotEntry *entry = &base->entries[e];
+      const char *entity = base->data + entry->entity_offset;
+      if (!shadowed(runs->runs, r, section, entity, entry->entity_len,
+                    entry->hash)) {
+        fn(entity, entry->entity_len, base->data + entry->response_offset,
+           entry->response_len, arg);
+      }
+    }
+  }
+}
+
+/*
+ * Count the entries of one section of a store's runs, including those that
+ * are out of date.
+ *
+ * Input:
+ *   runs    - the runs, from store_runs()
+ *   section - the section number
+ *
+ * Returns:
+ *   the number of entries
+ */
+uint64_t store_entries(const KBStoreRuns *runs, int section) {
+  uint64_t count = 0;
+  for (size_t r = 0; r < runs->count; r++) {
+    count += runs->runs[r]->bases[section].count;
+  }
+  return count;
+}
+
+/*
+ * Find out how large a store is.
+ *
+ * Input:
+ *   store - the store
+ *   stats - a structure to receive the figures
+ */
+void store_stats(KBStore *store, KBStoreStats *stats) {
+  memset(stats, 0, sizeof(KBStoreStats));
+  if (epoch_enter() != 0) {
+    return;
+  }
+  const KBStoreRuns *runs = store_runs(store);
+  stats->runs = runs->count;
+  for (size_t r = 0; r < runs->count; r++) {
+    stats->entries += runs->runs[r]->entries;
+    stats->bytes += runs->runs[r]->size + runs->runs[r]->blocks * 64;
+  }
+  epoch_leave();
+}
+
+#endif
@@ -0,0 +1,374 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the knowledge base stress test, which measures how
+ * long lookups take while other threads are teaching the chatbot.
+ *
+ * The test fills a knowledge base of its own with STRESS_ENTITIES answers,
+ * then runs two phases of the same length. In the first, the reader threads
+ * look up random entities as fast as they can; in the second, the writer
+ * threads run alongside them, overwriting answers, teaching new ones, and
+ * every STRESS_RESET_PUTS answers resetting the knowledge base and filling it
+ * again. Every lookup is timed, and for each phase the number of lookups and
+ * the percentiles of their latency are printed on stderr. Since lookups take
+ * no locks, they should be about as fast with the writers as without them.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* the number of entities in the knowledge base at the start of each phase */
+#define STRESS_ENTITIES 100000
+
+/* the number of answers taught between resets of the knowledge base */
+#define STRESS_RESET_PUTS 1000000
+
+/* Type definition for the state shared by the stress test's threads */
+typedef struct stress {
+  kb_t *kb;                 /* the knowledge base under test */
+  char (*entities)[32];     /* the names of the entities */
+  atomic_int stop;          /* set to 1 to end the phase */
+  atomic_long puts;         /* the answers taught in this phase */
+  atomic_long resets;       /* the resets in this phase */
+  atomic_long since_reset;  /* the answers taught since the last reset */
+} Stress;
+
+/* Type definition for the state of one stress test thread */
+typedef struct stress_thread {
+  Stress *stress;         /* the shared state */
+  uint64_t seed;          /* the state of the random number generator */
+  long lookups;           /* the number of lookups made */
+  long found;             /* the number of lookups that found an answer */
+  long *histogram;        /* the number of lookups in each latency bucket */
+} StressThread;
+
+/*
+ * Helper function to get the time in nanoseconds.
+ */
+
+static uint64_t stress_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * Helper function to get a random number (xorshift64).
+ *
+ * Input:
+ *   seed - the state of the generator, which is updated
+ *
+ * Returns:
+ *   the random number
+ */
+
+static uint64_t stress_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+/*
+ * Find the bucket of a latency histogram that a number of nanoseconds falls
+ * in. Latencies below LATENCY_LINEAR nanoseconds have a bucket each; above
+ * that, each power of two is split into LATENCY_SUB_BUCKETS buckets, so the
+ * error is at most about 3%.
+ *
+ * Input:
+ *   ns - the latency
+ *
+ * Returns:
+ *   the index of the bucket, less than LATENCY_BUCKETS
+ */
+int latency_bucket(uint64_t ns) {
+  if (ns < LATENCY_LINEAR) {
+    return (int)ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int bucket = LATENCY_LINEAR + (msb - 8) * LATENCY_SUB_BUCKETS +
+               (int)((ns >> (msb - 5)) & (LATENCY_SUB_BUCKETS - 1));
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Find the smallest latency in a bucket of a latency histogram.
+ *
+ * Input:
+ *   bucket - the index of the bucket
+ *
+ * Returns:
+ *   the latency in nanoseconds
+ */
+uint64_t latency_bucket_ns(int bucket) {
+  if (bucket < LATENCY_LINEAR) {
+    return bucket;
+  }
+  int msb = 8 + (bucket - LATENCY_LINEAR) / LATENCY_SUB_BUCKETS;
+  uint64_t sub = (bucket - LATENCY_LINEAR) % LATENCY_SUB_BUCKETS;
+  return ((uint64_t)1 << msb) + (sub << (msb - 5));
+}
+
+/*
+ * Find a percentile of the latencies in a histogram.
+ *
+ * Input:
+ *   histogram - the number of latencies in each of LATENCY_BUCKETS buckets
+ *   total     - the number of latencies
+ *   fraction  - the percentile, e.g. 0.99
+ *
+ * Returns:
+ *   the latency in nanoseconds
+ */
+uint64_t latency_percentile(const long *histogram, long total,
+                            double fraction) {
+  long wanted = (long)(total * fraction);
+  long seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += histogram[b];
+    if (seen > wanted) {
+      return latency_bucket_ns(b);
+    }
+  }
+  return latency_bucket_ns(LATENCY_BUCKETS - 1);
+}
+
+/*
+ * Helper function to fill the knowledge base with its initial answers.
+ *
+ * Input:
+ *   stress - the stress test
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+
+static int stress_fill(Stress *stress) {
+  char response[MAX_RESPONSE];
+  for (int e = 0; e < STRESS_ENTITIES; e++) {
+    snprintf(response, sizeof(response), "the answer to %s",
+             stress->entities[e]);
+    if (kb_put(stress->kb, "what", stress->entities[e], response) != KB_OK) {
+      return KB_NOMEM;
+    }
+  }
+  return KB_OK;
+}
+
+/*
+ * Helper function run by each reader thread: look up random entities until
+ * the phase ends, timing each lookup.
+ *
+ * Input:
+ *   arg - the thread's StressThread
+ */
+
+static void *stress_reader(void *arg) {
+  StressThread *thread = arg;
+  Stress *stress = thread->stress;
+  char response[MAX_RESPONSE];
+  long lookups = 0, found = 0;
+  uint64_t seed = thread->seed; // kept local, as the threads' state is shared
+
+  while (!atomic_load_explicit(&stress->stop, memory_order_relaxed)) {
+    const char *entity =
+        stress->entities[stress_random(&seed) % STRESS_ENTITIES];
+    uint64_t started = stress_clock();
+    int result = kb_get(stress->kb, "what", entity, response, MAX_RESPONSE);
+    uint64_t elapsed = stress_clock() - started;
+    thread->histogram[latency_bucket(elapsed)]++;
+    lookups++;
+    found += result == KB_OK;
+  }
+  thread->lookups = lookups;
+  thread->found = found;
+  return NULL;
+}
+
+/*
+ * Helper function run by each writer thread: teach answers until the phase
+ * ends. Most overwrite an existing answer and the rest teach a new entity;
+ * every STRESS_RESET_PUTS answers, the knowledge base is reset and filled
+ * again so that it does not grow without limit.
+ *
+ * Input:
+ *   arg - the thread's StressThread
+ */
+
+static void *stress_writer(void *arg) {
+  StressThread *thread = arg;
+  Stress *stress = thread->stress;
+  char entity[MAX_ENTITY];
+  char response[MAX_RESPONSE];
+
+  while (!atomic_load_explicit(&stress->stop, memory_order_relaxed)) {
+    uint64_t r = stress_random(&thread->seed);
+    if (r % 10 == 0) {
+      snprintf(entity, sizeof(entity), "new entity %llu",
+               (unsigned long long)(r >> 8));
+    } else {
+      snprintf(entity, sizeof(entity), "%s",
+               stress->entities[(r >> 8) % STRESS_ENTITIES]);
+    }
+    snprintf(response, sizeof(response), "answer %llu",
+             (unsigned long long)r);
+    if (kb_put(stress->kb, "what", entity, response) != KB_OK) {
+      break;
+    }
+    atomic_fetch_add_explicit(&stress->puts, 1, memory_order_relaxed);
+
+    // Whichever writer swaps the count back to 0 does the reset, so there is
+    // exactly one per STRESS_RESET_PUTS, however many writers pass it
+    long since = atomic_fetch_add(&stress->since_reset, 1) + 1;
+    if (since >= STRESS_RESET_PUTS &&
+        atomic_compare_exchange_strong(&stress->since_reset, &since, 0)) {
+      kb_reset(stress->kb);
+      if (stress_fill(stress) != KB_OK) {
+        break;
+      }
+      atomic_fetch_add(&stress->resets, 1);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Helper function to run one phase of the stress test and report on it.
+ *
+ * Input:
+ *   stress  - the stress test
+ *   options - the length of the phase and the number of readers
+ *   writers - the number of writers for this phase
+ *
+ * Returns:
+ *   0, if the phase ran
+ *   1, if there was a memory allocation failure
+ */
+
+static int stress_phase(Stress *stress, const StressOptions *options,
+                        int writers) {
+  int readers = options->readers;
+  int count = readers + writers;
+  StressThread *threads = calloc(count, sizeof(StressThread));
+  pthread_t *ids = calloc(count, sizeof(pthread_t));
+  long *histograms = calloc((size_t)readers * LATENCY_BUCKETS, sizeof(long));
+  if (threads == NULL || ids == NULL || histograms == NULL) {
+    free(threads);
+    free(ids);
+    free(histograms);
+    return 1;
+  }
+
+  atomic_store(&stress->stop, 0);
+  atomic_store(&stress->puts, 0);
+  atomic_store(&stress->resets, 0);
+  for (int t = 0; t < count; t++) {
+    threads[t].stress = stress;
+    threads[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1) + writers;
+    if (t < readers) {
+      threads[t].histogram = histograms + (size_t)t * LATENCY_BUCKETS;
+    }
+    pthread_create(&ids[t], NULL, t < readers ? stress_reader : stress_writer,
+                   &threads[t]);
+  }
+  struct timespec length;
+  length.tv_sec = (time_t)options->seconds;
+  length.tv_nsec = (long)((options->seconds - length.tv_sec) * 1e9);
+  nanosleep(&length, NULL);
+  atomic_store(&stress->stop, 1);
+
+  long lookups = 0, found = 0;
+  for (int t = 0; t < count; t++) {
+    pthread_join(ids[t], NULL);
+  }
+  for (int t = 0; t < readers; t++) {
+    lookups += threads[t].lookups;
+    found += threads[t].found;
+    if (t > 0) {
+      for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        histograms[b] += threads[t].histogram[b];
+      }
+    }
+  }
+
+  fprintf(stderr,
+          "stress: %d readers, %d writers: %ld lookups (%ld found), "
+          "%.0f lookups/s\n",
+          readers, writers, lookups, found, lookups / options->seconds);
+  fprintf(stderr,
+          "stress:   latency p50 %llu ns, p99 %llu ns, p99.9 %llu ns, "
+          "p99.99 %llu ns\n",
+          (unsigned long long)latency_percentile(histograms, lookups, 0.5),
+          (unsigned long long)latency_percentile(histograms, lookups, 0.99),
+          (unsigned long long)latency_percentile(histograms, lookups, 0.999),
+          (unsigned long long)latency_percentile(histograms, lookups, 0.9999));
+  if (writers > 0) {
+    long puts = atomic_load(&stress->puts);
+    fprintf(stderr, "stress:   %ld answers taught, %.0f/s, %ld resets\n",
+            puts, puts / options->seconds, atomic_load(&stress->resets));
+  }
+
+  free(threads);
+  free(ids);
+  free(histograms);
+  return 0;
+}
+
+/*
+ * Run the stress test.
+ *
+ * Input:
+ *   options - the length of each phase and the numbers of threads
+ *
+ * Returns:
+ *   the exit status for the program (0 if the test ran)
+ */
+int stress_main(const StressOptions *options) {
+  StressOptions phase = *options;
+  Stress stress;
+
+  if (phase.seconds <= 0) {
+    fprintf(stderr, "stress: the test must run for some time\n");
+    return 1;
+  }
+  if (phase.readers <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    phase.readers = (int)sysconf(_SC_NPROCESSORS_ONLN) - phase.writers;
+#endif
+    if (phase.readers <= 0) {
+      phase.readers = 1;
+    }
+  }
+
+  memset(&stress, 0, sizeof(stress));
+  stress.kb = kb_create();
+  stress.entities = malloc(STRESS_ENTITIES * sizeof(*stress.entities));
+  if (stress.kb == NULL || stress.entities == NULL) {
+    fprintf(stderr, "stress: Memory allocation error.\n");
+    return 1;
+  }
+  for (int e = 0; e < STRESS_ENTITIES; e++) {
+    snprintf(stress.entities[e], sizeof(*stress.entities), "entity %d", e);
+  }
+
+  int status = stress_fill(&stress) != KB_OK ||
+               stress_phase(&stress, &phase, 0) != 0 ||
+               (phase.writers > 0 &&
+                stress_phase(&stress, &phase, phase.writers) != 0);
+  if (status != 0) {
+    fprintf(stderr, "stress: Memory allocation error.\n");
+  }
+
+  kb_destroy(stress.kb);
+  free(stress.entities);
+  return status;
+}
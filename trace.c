@@ -0,0 +1,227 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements tracing: recording when the chatbot's work started and
+ * how long it took, span by span, so that a slow LOAD or SAVE can be seen on a
+ * timeline, e.g. reading the file in kb_read() inside chatbot_do_load() inside
+ * chatbot_session_main().
+ *
+ * Tracing is built in only with -DCHATBOT_TRACE:
+ *
+ *   gcc -O2 -pthread -DCHATBOT_TRACE -o chatbot main.c
+ *
+ * Otherwise TRACE_SPAN() (see chat1002.h) compiles to nothing, and tracing
+ * costs nothing at all.
+ *
+ * Each thread records its spans in a ring of its own, of the latest
+ * TRACE_RING_SIZE spans, so recording a span is two reads of the clock and a
+ * store to memory no other thread writes. Rings are never freed: when a
+ * thread ends, its ring is kept (with its spans) for the next thread to carry
+ * on in, like the blocks of the runtime metrics (see metrics.c).
+ *
+ * trace_export() writes the spans as a Chrome trace (JSON), which
+ * chrome://tracing and https://ui.perfetto.dev can show. It should be called
+ * once the threads being traced have stopped, since a ring may otherwise be
+ * overwritten as it is read.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CHATBOT_TRACE
+
+/* Type definition for a span that has ended */
+typedef struct trace_event {
+  const char *name; /* the name of the span */
+  uint64_t start;   /* when it started, in nanoseconds */
+  uint64_t ns;      /* how long it took */
+} TraceEvent;
+
+/* Type definition for the spans of one thread */
+typedef struct trace_ring {
+  TraceEvent events[TRACE_RING_SIZE]; /* the latest spans */
+  _Atomic uint64_t count;  /* the number of spans ever recorded in the ring */
+  int tid;                 /* the thread's number in the trace */
+  atomic_int in_use;       /* 1 while a thread owns the ring */
+  struct trace_ring *next; /* the next ring in trace_rings */
+} TraceRing;
+
+/* every ring made so far */
+static TraceRing *_Atomic trace_rings;
+
+/* the number of rings made so far */
+static atomic_int trace_ring_count;
+
+/* the current thread's ring */
+static _Thread_local TraceRing *trace_self;
+
+/* the key whose destructor gives up a thread's ring when it ends */
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Helper function (the destructor of trace_key) to give up the ring of a
+ * thread that has ended, so that another thread can record in it.
+ *
+ * Input:
+ *   arg - the ring
+ */
+
+static void trace_release(void *arg) {
+  TraceRing *ring = arg;
+  atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+/*
+ * Helper function to create trace_key, once.
+ */
+
+static void trace_make_key() { pthread_key_create(&trace_key, trace_release); }
+
+/*
+ * Helper function to find the current thread's ring: one given up by a thread
+ * that has ended, or else a new one.
+ *
+ * Returns:
+ *   NULL, if there is memory allocation error (nothing is then recorded)
+ *   A pointer to the ring
+ */
+
+static TraceRing *trace_ring() {
+  if (trace_self != NULL) {
+    return trace_self;
+  }
+  pthread_once(&trace_key_once, trace_make_key);
+
+  TraceRing *ring;
+  for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+    int unused = 0;
+    if (atomic_load_explicit(&ring->in_use, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_strong(&ring->in_use, &unused, 1)) {
+      break;
+    }
+  }
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL) {
+      return NULL;
+    }
+    atomic_init(&ring->in_use, 1);
+    ring->tid = atomic_fetch_add(&trace_ring_count, 1) + 1;
+    TraceRing *head = atomic_load(&trace_rings);
+    do {
+      ring->next = head;
+    } while (!atomic_compare_exchange_weak(&trace_rings, &head, ring));
+  }
+  pthread_setspecific(trace_key, ring);
+  trace_self = ring;
+  return ring;
+}
+
+/*
+ * Start a span. This is used by TRACE_SPAN(), which ends the span with
+ * trace_end() when the block it is in ends.
+ *
+ * Input:
+ *   name - the name of the span, a string constant
+ *
+ * Returns:
+ *   the span
+ */
+TraceSpan trace_begin(const char *name) {
+  TraceSpan span = {name, metrics_clock()};
+  return span;
+}
+
+/*
+ * End a span, recording it in the current thread's ring.
+ *
+ * Input:
+ *   span - the span, from trace_begin()
+ */
+void trace_end(TraceSpan *span) {
+  uint64_t now = metrics_clock();
+  TraceRing *ring = trace_ring();
+  if (ring == NULL) {
+    return;
+  }
+  uint64_t count = atomic_load_explicit(&ring->count, memory_order_relaxed);
+  TraceEvent *event = &ring->events[count % TRACE_RING_SIZE];
+  event->name = span->name;
+  event->start = span->start;
+  event->ns = now - span->start;
+  atomic_store_explicit(&ring->count, count + 1, memory_order_release);
+}
+
+#endif
+
+/*
+ * Write the spans recorded so far as a Chrome trace (JSON). Spans are
+ * "complete" events, with times in microseconds, and each thread that
+ * recorded spans is a thread of the trace.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_IOERROR, if the file could not be written
+ */
+int trace_write(FILE *f) {
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+             "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+             "\"args\":{\"name\":\"chatbot\"}}");
+#ifdef CHATBOT_TRACE
+  for (TraceRing *ring = atomic_load(&trace_rings); ring != NULL;
+       ring = ring->next) {
+    uint64_t count = atomic_load_explicit(&ring->count, memory_order_acquire);
+    uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < count; i++) {
+      const TraceEvent *event = &ring->events[i % TRACE_RING_SIZE];
+      fprintf(f,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              event->name, ring->tid, event->start / 1e3, event->ns / 1e3);
+    }
+  }
+#endif
+  fprintf(f, "\n]}\n");
+  return fflush(f) == 0 && !ferror(f) ? KB_OK : KB_IOERROR;
+}
+
+/*
+ * Write the spans recorded so far to a file as a Chrome trace, replacing the
+ * file.
+ *
+ * Input:
+ *   path - the name of the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the chatbot was built without tracing (the file is not
+ *               written)
+ *   KB_NOMEM or KB_IOERROR, if the file could not be written
+ */
+int trace_export(const char *path) {
+#ifndef CHATBOT_TRACE
+  (void)path;
+  return KB_INVALID;
+#else
+  SaveFile file;
+  int result = savefile_open(&file, path);
+  if (result != KB_OK) {
+    return result;
+  }
+  result = trace_write(file.f);
+  if (result == KB_OK) {
+    return savefile_commit(&file);
+  }
+  savefile_abort(&file);
+  return result;
+#endif
+}
@@ -0,0 +1,327 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements watch mode, in which knowledge files (and compiled
+ * knowledge bases) that have been loaded are loaded again whenever they
+ * change on disk, e.g. "chatbot -W faq.ini" while the file is edited.
+ *
+ * Each file is loaded with kb_reload() (see knowledge.c), which compares it
+ * with the version loaded before and applies only the entities that were
+ * added, changed or removed, so a small edit to a large file costs little and
+ * the chatbot goes on answering from the rest of the knowledge base while it
+ * is applied. What changed is reported on stderr, e.g.
+ *
+ *   watch: faq.ini: 1 added, 2 changed, 0 removed
+ *
+ * On Linux, one thread waits for inotify to report that a file in the
+ * directory of a watched file was written and closed, or moved into place (as
+ * editors and savefile.c do), then waits a moment more for the writes to
+ * settle before loading it. Elsewhere, files are loaded but not watched.
+ */
+
+#include "chat1002.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/* the most files that may be watched */
+#define WATCH_MAX 32
+
+/* how long to wait, in milliseconds, for the writes to a file to settle */
+#define WATCH_SETTLE_MS 50
+
+/* Type definition for a watched file */
+typedef struct watch_entry {
+  kb_t *kb;         /* the knowledge base it is loaded into */
+  char *path;       /* the file, as it was named */
+  const char *name; /* the last component of the path */
+  int wd;           /* the inotify watch of its directory */
+  int pending;      /* 1 if it has changed since it was last loaded */
+} WatchEntry;
+
+/* the state of the thread that watches the files */
+static struct {
+  WatchEntry entries[WATCH_MAX]; /* the watched files */
+  int count;                     /* the number of them */
+  int running;                   /* 1 while the thread runs */
+  int fd;                        /* the inotify instance */
+  int wake[2];                   /* a pipe written to stop the thread */
+  pthread_t thread;              /* the thread */
+  pthread_mutex_t lock;          /* protects the entries */
+} watch = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#ifdef __linux__
+
+/*
+ * Helper function to load a watched file and report what changed. The watch
+ * lock must be held.
+ *
+ * Input:
+ *   entry - the file
+ */
+
+static void watch_reload(WatchEntry *entry) {
+  KBDelta delta;
+  int result = kb_reload(entry->kb, entry->path, &delta);
+  if (result == KB_NOTFOUND) {
+    return; // e.g. removed, to be moved into place again
+  } else if (result < 0) {
+    fprintf(stderr, "watch: can't load %s\n", entry->path);
+  } else if (result > 0) {
+    fprintf(stderr, "watch: %s: %zu added, %zu changed, %zu removed\n",
+            entry->path, delta.added, delta.changed, delta.removed);
+  }
+}
+
+/*
+ * Helper function to read the events inotify has for the watched files, and
+ * mark the files they are about as pending.
+ *
+ * Returns:
+ *   the number of files marked
+ */
+
+static int watch_read_events() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(watch.fd, buf, sizeof(buf));
+  int marked = 0;
+  pthread_mutex_lock(&watch.lock);
+  for (ssize_t i = 0; i < len;) {
+    const struct inotify_event *event =
+        (const struct inotify_event *)(buf + i);
+    for (int e = 0; e < watch.count; e++) {
+      WatchEntry *entry = &watch.entries[e];
+      if (entry->wd == event->wd && event->len > 0 &&
+          strcmp(entry->name, event->name) == 0) {
+        entry->pending = 1;
+        marked++;
+      }
+    }
+    i += sizeof(struct inotify_event) + event->len;
+  }
+  pthread_mutex_unlock(&watch.lock);
+  return marked;
+}
+
+/*
+ * Helper function run by the thread that watches the files, until
+ * watch_stop() writes to the pipe.
+ *
+ * Input:
+ *   arg - not used
+ */
+
+static void *watch_thread(void *arg) {
+  (void)arg;
+  struct pollfd fds[2] = {{.fd = watch.fd, .events = POLLIN},
+                          {.fd = watch.wake[0], .events = POLLIN}};
+  int pending = 0;
+  for (;;) {
+    // Wait for a change, then for the changes to stop
+    int ready = poll(fds, 2, pending ? WATCH_SETTLE_MS : -1);
+    if (ready < 0 || (fds[1].revents & POLLIN)) {
+      break;
+    } else if (ready > 0) {
+      pending += watch_read_events();
+      continue;
+    } else if (!pending) {
+      continue;
+    }
+
+    pthread_mutex_lock(&watch.lock);
+    for (int e = 0; e < watch.count; e++) {
+      if (watch.entries[e].pending) {
+        watch.entries[e].pending = 0;
+        watch_reload(&watch.entries[e]);
+      }
+    }
+    pthread_mutex_unlock(&watch.lock);
+    pending = 0;
+  }
+  return NULL;
+}
+
+/*
+ * Helper function to start watching, if it has not been started. The watch
+ * lock must be held.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if inotify or the thread could not be started
+ */
+
+static int watch_start() {
+  if (watch.running) {
+    return KB_OK;
+  }
+  watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (watch.fd < 0) {
+    return KB_NOMEM;
+  }
+  if (pipe(watch.wake) != 0) {
+    close(watch.fd);
+    return KB_NOMEM;
+  }
+  if (pthread_create(&watch.thread, NULL, watch_thread, NULL) != 0) {
+    close(watch.fd);
+    close(watch.wake[0]);
+    close(watch.wake[1]);
+    return KB_NOMEM;
+  }
+  watch.running = 1;
+  return KB_OK;
+}
+
+/*
+ * Helper function to watch the directory of a file. The watch lock must be
+ * held.
+ *
+ * Input:
+ *   entry - the file, whose name is set
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the directory can't be watched
+ */
+
+static int watch_directory(WatchEntry *entry) {
+  const char *slash = strrchr(entry->path, '/');
+  entry->name = slash == NULL ? entry->path : slash + 1;
+  char dir[4096];
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == entry->path) {
+    strcpy(dir, "/");
+  } else if ((size_t)(slash - entry->path) < sizeof(dir)) {
+    memcpy(dir, entry->path, slash - entry->path);
+    dir[slash - entry->path] = '\0';
+  } else {
+    return KB_NOTFOUND;
+  }
+  entry->wd = inotify_add_watch(watch.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  return entry->wd < 0 ? KB_NOTFOUND : KB_OK;
+}
+
+#else
+
+static int watch_start() { return KB_OK; }
+
+static int watch_directory(WatchEntry *entry) {
+  entry->name = entry->path;
+  entry->wd = -1;
+  return KB_OK;
+}
+
+#endif
+
+/*
+ * Load a file into a knowledge base, as kb_reload() does, and load it again
+ * whenever it changes until watch_forget() or watch_stop().
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   path  - the file
+ *   delta - receives the changes made by loading it now
+ *
+ * Returns:
+ *   as kb_reload(); or KB_NOMEM if the file could not be watched
+ */
+int watch_file(kb_t *kb, const char *path, KBDelta *delta) {
+  pthread_mutex_lock(&watch.lock);
+  int result = watch_start();
+  if (result == KB_OK) {
+    result = kb_reload(kb, path, delta);
+  }
+
+  // A file loaded again is already watched
+  int e = 0;
+  while (e < watch.count &&
+         (watch.entries[e].kb != kb || strcmp(watch.entries[e].path, path))) {
+    e++;
+  }
+  if (result >= 0 && e == watch.count && watch.count == WATCH_MAX) {
+    result = KB_NOMEM;
+  } else if (result >= 0 && e == watch.count) {
+    WatchEntry *entry = &watch.entries[watch.count];
+    memset(entry, 0, sizeof(WatchEntry));
+    entry->kb = kb;
+    entry->path = strdup(path);
+    if (entry->path == NULL || watch_directory(entry) != KB_OK) {
+      free(entry->path);
+      result = KB_NOMEM;
+    } else {
+      watch.count++;
+    }
+  }
+  pthread_mutex_unlock(&watch.lock);
+  return result;
+}
+
+/*
+ * Determine whether watch mode is on, i.e. whether any file has been watched.
+ *
+ * Returns:
+ *   1, if watch_file() has been called and watch_stop() has not
+ *   0, otherwise
+ */
+int watch_active() {
+  pthread_mutex_lock(&watch.lock);
+  int active = watch.count > 0;
+  pthread_mutex_unlock(&watch.lock);
+  return active;
+}
+
+/*
+ * Stop watching the files loaded into a knowledge base, e.g. as it is closed.
+ * A reload in progress finishes first.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void watch_forget(kb_t *kb) {
+  pthread_mutex_lock(&watch.lock);
+  int kept = 0;
+  for (int e = 0; e < watch.count; e++) {
+    if (watch.entries[e].kb == kb) {
+      // The directory stays watched; its events no longer match a file
+      free(watch.entries[e].path);
+    } else {
+      watch.entries[kept++] = watch.entries[e];
+    }
+  }
+  watch.count = kept;
+  pthread_mutex_unlock(&watch.lock);
+}
+
+/*
+ * Stop watching every file. It does nothing if no file was watched.
+ */
+void watch_stop() {
+  pthread_mutex_lock(&watch.lock);
+  int running = watch.running;
+  watch.running = 0;
+  pthread_mutex_unlock(&watch.lock);
+  if (running) {
+#ifdef __linux__
+    ssize_t written = write(watch.wake[1], "", 1);
+    (void)written;
+    pthread_join(watch.thread, NULL);
+    close(watch.fd);
+    close(watch.wake[0]);
+    close(watch.wake[1]);
+#endif
+  }
+
+  pthread_mutex_lock(&watch.lock);
+  for (int e = 0; e < watch.count; e++) {
+    free(watch.entries[e].path);
+  }
+  watch.count = 0;
+  pthread_mutex_unlock(&watch.lock);
+}